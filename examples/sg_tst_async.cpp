@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2014-2015 Douglas Gilbert.
+ * Copyright (c) 2014-2016 Douglas Gilbert.
  * All rights reserved.
  *
  * Redistribution and use in source and binary forms, with or without
@@ -56,9 +56,10 @@
 #include <sys/stat.h>
 #include "sg_lib.h"
 #include "sg_io_linux.h"
+#include "sg_pt.h"
 #include "sg_unaligned.h"
 
-static const char * version_str = "1.11 20150227";
+static const char * version_str = "1.12 20160629";
 static const char * util_name = "sg_tst_async";
 
 /* This is a test program for checking the async usage of the Linux sg
@@ -68,6 +69,12 @@ static const char * util_name = "sg_tst_async";
  * ioctl(SG_GET_NUM_WAITING) ) for the completion of those commands. Each
  * command has a unique "pack_id" which is a sequence starting at 1.
  * Either TEST UNIT UNIT, READ(16) or WRITE(16) commands are issued.
+ * With the '-u' option the commands are sent with the sg_pt async
+ * functions (start_scsi_pt() and reap_scsi_pt()) with each thread's
+ * io_uring engine turned on. Then writes and reads of sg headers are
+ * batched, typically one system call per batch; compare the IOPS with
+ * and without '-u'. If io_uring is not available the sg_pt functions
+ * fall back to write() and read().
  *
  * This is C++ code with some things from C++11 (e.g. threads) and was
  * only just able to compile (when some things were reverted) with gcc/g++
@@ -80,10 +87,11 @@ static const char * util_name = "sg_tst_async";
  * object files in the lib directory can be built with:
  *   cd <sg3_utils_package_root> ; ./configure ; cd lib; make
  *   cd ../examples
- * Then to build sg_tst_async concatenate the next 3 lines:
+ * Then to build sg_tst_async concatenate the next 4 lines:
  *   g++ -Wall -std=c++11 -pthread -I ../include ../lib/sg_lib.o
- *     ../lib/sg_lib_data.o ../lib/sg_io_linux.o -o sg_tst_async
- *     sg_tst_async.cpp
+ *     ../lib/sg_lib_data.o ../lib/sg_io_linux.o ../lib/sg_pt_common.o
+ *     ../lib/sg_pt_linux.o ../lib/sg_pt_emul.o ../lib/sg_io_uring.o
+ *     -o sg_tst_async sg_tst_async.cpp
  * or use the C++ Makefile in that directory:
  *   make -f Makefile.cplus sg_tst_async
  *
@@ -159,6 +167,7 @@ struct opts_t {
     int stats;
     int verbose;
     int wait_ms;
+    bool uring;
     command2execute c2e;
     blkLQDiscipline blqd;
     myQDiscipline myqd;
@@ -219,6 +228,7 @@ static struct option long_options[] = {
         {"stats", no_argument, 0, 'S'},
         {"tnum", required_argument, 0, 't'},
         {"tur", no_argument, 0, 'T'},
+        {"uring", no_argument, 0, 'u'},
         {"verbose", no_argument, 0, 'v'},
         {"version", no_argument, 0, 'V'},
         {"wait", required_argument, 0, 'w'},
@@ -236,8 +246,9 @@ usage(void)
            "[-qfav=FAV]\n"
            "                    [--read] [--szlb=LB] [--stats] [--tnum=NT] "
            "[--tur]\n"
-           "                    [--verbose] [--version] [--wait=MS] "
-           "[--write]\n"
+           "                    [--uring] [--verbose] [--version] "
+           "[--wait=MS]\n"
+           "                    [--write]\n"
            "                    <sg_disk_device>*\n",
            util_name);
     printf("  where\n");
@@ -269,6 +280,9 @@ usage(void)
     printf("    --tnum=NT|-t NT    number of threads (def: %d)\n",
            DEF_NUM_THREADS);
     printf("    --tur|-T        do TEST UNIT READYs (default is TURs)\n");
+    printf("    --uring|-u      use sg_pt async functions with io_uring "
+           "engine\n"
+           "                    (ignores --direct and --noxfer)\n");
     printf("    --verbose|-v    increase verbosity\n");
     printf("    --version|-V    print version number then exit\n");
     printf("    --wait=MS|-w MS    >0: poll(<wait_ms>); =0: poll(0); (def: "
@@ -475,6 +489,163 @@ finish_sg3_cmd(int sg_fd, command2execute cmd2exe, int & pack_id, int wait_ms,
     return ok ? 0 : -1;
 }
 
+/* Per command state when the sg_pt async functions are used (-u). The
+ * cdb and sense buffers must stay valid until the response is reaped
+ * since the io_uring engine may write the sg header some time after
+ * start_scsi_pt() returns. */
+struct pt_cmd_t {
+    struct sg_pt_base * ptp;
+    int pack_id;
+    unsigned char cdb[16];
+    unsigned char sense[64];
+};
+
+/* Returns 0 if command started (or queued) okay, else -1 */
+static int
+start_pt_cmd(int sg_fd, command2execute cmd2exe, struct pt_cmd_t * pcp,
+             uint64_t lba, unsigned char * lbp, int xfer_bytes,
+             blkLQDiscipline blqd, unsigned int & eagains)
+{
+    int res;
+    struct sg_pt_base * ptp = pcp->ptp;
+    const char * np = NULL;
+
+    clear_scsi_pt_obj(ptp);
+    memset(pcp->cdb, 0, sizeof(pcp->cdb));
+    switch (cmd2exe) {
+    case SCSI_TUR:
+        np = "TEST UNIT READY";
+        set_scsi_pt_cdb(ptp, pcp->cdb, TUR_CMD_LEN);
+        break;
+    case SCSI_READ16:
+        np = "READ(16)";
+        pcp->cdb[0] = 0x88;
+        sg_put_unaligned_be64(lba, pcp->cdb + 2);
+        pcp->cdb[13] = 1;
+        set_scsi_pt_cdb(ptp, pcp->cdb, READ16_CMD_LEN);
+        set_scsi_pt_data_in(ptp, lbp, xfer_bytes);
+        break;
+    case SCSI_WRITE16:
+        np = "WRITE(16)";
+        pcp->cdb[0] = 0x8a;
+        sg_put_unaligned_be64(lba, pcp->cdb + 2);
+        pcp->cdb[13] = 1;
+        set_scsi_pt_cdb(ptp, pcp->cdb, WRITE16_CMD_LEN);
+        set_scsi_pt_data_out(ptp, lbp, xfer_bytes);
+        break;
+    }
+    set_scsi_pt_sense(ptp, pcp->sense, sizeof(pcp->sense));
+    set_scsi_pt_packet_id(ptp, pcp->pack_id);
+    if (BLQ_AT_HEAD == blqd)
+        set_scsi_pt_flags(ptp, SCSI_PT_FLAGS_QUEUE_AT_HEAD);
+    else if (BLQ_AT_TAIL == blqd)
+        set_scsi_pt_flags(ptp, SCSI_PT_FLAGS_QUEUE_AT_TAIL);
+
+    for (int k = 0; (res = start_scsi_pt(ptp, sg_fd, DEF_TIMEOUT_MS / 1000,
+                                         0)); ++k) {
+        if ((-ENOMEM == res) && (k < MAX_CONSEC_NOMEMS)) {
+            this_thread::yield();
+            continue;
+        }
+        if (-EAGAIN == res) {
+            ++eagains;
+            this_thread::yield();
+            continue;
+        }
+        if (res < 0)
+            pr_errno_lk(-res, "%s: %s, pack_id=%d", __func__, np,
+                        pcp->pack_id);
+        else
+            pr2serr_lk("%s: %s, pack_id=%d, bad parameters\n", __func__, np,
+                       pcp->pack_id);
+        return -1;
+    }
+    return 0;
+}
+
+/* Fetches one response. Returns 0 if command completed okay, 1 if its
+ * queued write failed with EAGAIN and it has been started again, else
+ * -1 . The pt_cmd_t the response belongs to is written to pcpp. */
+static int
+finish_pt_cmd(int sg_fd, command2execute cmd2exe, struct pt_cmd_t ** pcpp,
+              map<struct sg_pt_base *, struct pt_cmd_t *> & ptp_2_cmd,
+              int wait_ms, unsigned int & eagains,
+              unsigned int & start_eagains)
+{
+    int ok, res, slen;
+    struct sg_pt_base * ptp = NULL;
+    struct pt_cmd_t * pcp;
+    const char * np = NULL;
+
+    switch (cmd2exe) {
+    case SCSI_TUR:
+        np = "TEST UNIT READY";
+        break;
+    case SCSI_READ16:
+        np = "READ(16)";
+        break;
+    case SCSI_WRITE16:
+        np = "WRITE(16)";
+        break;
+    }
+    while (-EAGAIN == (res = reap_scsi_pt(sg_fd, ((wait_ms > 0) ?
+                                                  wait_ms : 0), &ptp, 0))) {
+        ++eagains;
+        if (0 == wait_ms)
+            this_thread::yield();
+        else if (-2 == wait_ms)
+            sleep(0);                   // process yield ??
+    }
+    if (res < 0) {
+        pr_errno_lk(-res, "%s: %s", __func__, np);
+        return -1;
+    }
+    auto p = ptp_2_cmd.find(ptp);
+
+    if (p == ptp_2_cmd.end()) {
+        pr2serr_lk("%s: %s, response for unknown object\n", __func__, np);
+        return -1;
+    }
+    pcp = p->second;
+    *pcpp = pcp;
+    if (EAGAIN == get_scsi_pt_os_err(ptp)) {   /* sg driver queue full */
+        ++start_eagains;
+        return start_scsi_pt(ptp, sg_fd, DEF_TIMEOUT_MS / 1000, 0) ? -1 : 1;
+    }
+    /* now for the error processing */
+    ok = 0;
+    slen = get_scsi_pt_sense_len(ptp);
+    switch (get_scsi_pt_result_category(ptp)) {
+    case SCSI_PT_RESULT_GOOD:
+        ok = 1;
+        break;
+    case SCSI_PT_RESULT_SENSE:
+        if (SG_LIB_CAT_RECOVERED == sg_err_category_sense(pcp->sense,
+                                                          slen)) {
+            pr2serr_lk("%s: Recovered error on %s, continuing\n", __func__,
+                       np);
+            ok = 1;
+            break;
+        }
+        {
+            lock_guard<mutex> lg(console_mutex);
+            sg_print_sense(np, pcp->sense, slen, 1);
+        }
+        break;
+    case SCSI_PT_RESULT_OS_ERR:
+        pr_errno_lk(get_scsi_pt_os_err(ptp), "%s: %s, pack_id=%d", __func__,
+                    np, pcp->pack_id);
+        break;
+    default: /* won't bother decoding other categories */
+        pr2serr_lk("%s: %s, pack_id=%d, status=0x%x, transport error=%d\n",
+                   __func__, np, pcp->pack_id,
+                   get_scsi_pt_status_response(ptp),
+                   get_scsi_pt_transport_err(ptp));
+        break;
+    }
+    return ok ? 0 : -1;
+}
+
 /* Should have page alignment if direct_io chosen */
 static unsigned char *
 get_aligned_heap(int bytes_at_least)
@@ -528,9 +699,12 @@ work_thread(int id, struct opts_t * op)
     const char * err = NULL;
     Rand_uint * ruip = NULL;
     struct pollfd  pfd[1];
+    struct pt_cmd_t * pcp = NULL;
     list<unsigned char *> free_lst;         /* of aligned lb buffers */
+    list<struct pt_cmd_t *> free_pt_lst;    /* when op->uring */
     map<int, unsigned char *> pi_2_buff;    /* pack_id -> lb buffer */
     map<int, uint64_t> pi_2_lba;            /* pack_id -> LBA */
+    map<struct sg_pt_base *, struct pt_cmd_t *> ptp_2_cmd;
 
     /* device name and hi_lba may depend on id */
     n = op->dev_names.size();
@@ -559,6 +733,19 @@ work_thread(int id, struct opts_t * op)
     }
     pfd[0].fd = sg_fd;
     pfd[0].events = POLLIN;
+    if (op->uring) {
+        res = scsi_pt_uring_enable(op->maxq_per_thread, op->verbose);
+        if (-ENOSYS == res) {
+            if (0 == id)
+                pr2serr_lk("io_uring not available, sg_pt functions will "
+                           "use write() and read()\n");
+        } else if (res) {
+            pr_errno_lk(-res, "%s: id=%d, scsi_pt_uring_enable", __func__,
+                        id);
+            close(sg_fd);
+            return;
+        }
+    }
     if (is_rw && hi_lba) {
         seed = get_urandom_uint();
         if (op->verbose > 1)
@@ -612,8 +799,30 @@ work_thread(int id, struct opts_t * op)
                     lba = op->lba;
             } else
                 lba = 0;
-            if (start_sg3_cmd(sg_fd, op->c2e, pack_id, lba, lbp, op->lb_sz,
-                              sg_flags, thr_start_eagain_count)) {
+            if (op->uring) {
+                if (free_pt_lst.empty()) {
+                    pcp = new pt_cmd_t;
+                    pcp->ptp = construct_scsi_pt_obj();
+                    if (NULL == pcp->ptp) {
+                        delete pcp;
+                        err = "out of memory";
+                        break;
+                    }
+                    ptp_2_cmd[pcp->ptp] = pcp;
+                } else {
+                    pcp = free_pt_lst.back();
+                    free_pt_lst.pop_back();
+                }
+                pcp->pack_id = pack_id;
+                if (start_pt_cmd(sg_fd, op->c2e, pcp, lba, lbp, op->lb_sz,
+                                 op->blqd, thr_start_eagain_count)) {
+                    free_pt_lst.push_back(pcp);
+                    err = "start_pt_cmd()";
+                    break;
+                }
+            } else if (start_sg3_cmd(sg_fd, op->c2e, pack_id, lba, lbp,
+                                     op->lb_sz, sg_flags,
+                                     thr_start_eagain_count)) {
                 err = "start_sg3_cmd()";
                 break;
             }
@@ -627,7 +836,14 @@ work_thread(int id, struct opts_t * op)
         if ((num_outstanding >= op->maxq_per_thread) || (k >= npt)) {
             /* full queue or finished injecting */
             num_waiting_read = 0;
-            if (ioctl(sg_fd, SG_GET_NUM_WAITING, &num_waiting_read) < 0) {
+            if (op->uring) {
+                num_waiting_read = poll_scsi_pt(sg_fd, 0, op->verbose);
+                if (num_waiting_read < 0) {
+                    err = "poll_scsi_pt() failed";
+                    break;
+                }
+            } else if (ioctl(sg_fd, SG_GET_NUM_WAITING,
+                             &num_waiting_read) < 0) {
                 err = "ioctl(SG_GET_NUM_WAITING) failed";
                 break;
             }
@@ -652,7 +868,9 @@ work_thread(int id, struct opts_t * op)
                 }
             } else {    /* nothing waiting to be read */
                 n = (op->wait_ms > 0) ? op->wait_ms : 0;
-                while (0 == (res = poll(pfd, 1, n))) {
+                while (0 == (res = (op->uring ?
+                                    poll_scsi_pt(sg_fd, n, op->verbose) :
+                                    poll(pfd, 1, n)))) {
                     if (res < 0) {
                         err = "poll(wait_ms) failed";
                         break;
@@ -666,7 +884,14 @@ work_thread(int id, struct opts_t * op)
                 num_to_read = 0;
             else {
                 num_waiting_read = 0;
-                if (ioctl(sg_fd, SG_GET_NUM_WAITING, &num_waiting_read) < 0) {
+                if (op->uring) {
+                    num_waiting_read = poll_scsi_pt(sg_fd, 0, op->verbose);
+                    if (num_waiting_read < 0) {
+                        err = "poll_scsi_pt() failed";
+                        break;
+                    }
+                } else if (ioctl(sg_fd, SG_GET_NUM_WAITING,
+                                 &num_waiting_read) < 0) {
                     err = "ioctl(SG_GET_NUM_WAITING) failed";
                     break;
                 }
@@ -679,9 +904,23 @@ work_thread(int id, struct opts_t * op)
         }
 
         while (num_to_read-- > 0) {
-            if (finish_sg3_cmd(sg_fd, op->c2e, pack_id, op->wait_ms,
-                               thr_fin_eagain_count)) {
-                err = "finish_sg3_cmd()";
+            if (op->uring) {
+                pcp = NULL;
+                res = finish_pt_cmd(sg_fd, op->c2e, &pcp, ptp_2_cmd,
+                                    op->wait_ms, thr_fin_eagain_count,
+                                    thr_start_eagain_count);
+                if (1 == res)
+                    continue;   /* started again */
+                if (pcp) {
+                    pack_id = pcp->pack_id;
+                    free_pt_lst.push_back(pcp);
+                } else
+                    pack_id = 0;
+            } else
+                res = finish_sg3_cmd(sg_fd, op->c2e, pack_id, op->wait_ms,
+                                     thr_fin_eagain_count);
+            if (res) {
+                err = op->uring ? "finish_pt_cmd()" : "finish_sg3_cmd()";
                 if (ruip && (pack_id > 0)) {
                     auto q = pi_2_lba.find(pack_id);
 
@@ -724,6 +963,15 @@ work_thread(int id, struct opts_t * op)
         if (err)
             break;
     }
+    if (op->uring) {
+        /* objects still in flight are left alone (and the ring open) */
+        if (0 == scsi_pt_uring_enable(0, op->verbose) && ! err) {
+            for (auto p = ptp_2_cmd.begin(); p != ptp_2_cmd.end(); ++p) {
+                destruct_scsi_pt_obj(p->first);
+                delete p->second;
+            }
+        }
+    }
     close(sg_fd);       // sg driver will handle any commands "in flight"
     if (ruip)
         delete ruip;
@@ -926,7 +1174,7 @@ main(int argc, char * argv[])
     while (1) {
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "dfhl:M:n:Nq:Q:Rs:St:TvVw:W",
+        c = getopt_long(argc, argv, "dfhl:M:n:Nq:Q:Rs:St:TuvVw:W",
                         long_options, &option_index);
         if (c == -1)
             break;
@@ -1049,6 +1297,9 @@ main(int argc, char * argv[])
         case 'T':
             op->c2e = SCSI_TUR;
             break;
+        case 'u':
+            op->uring = true;
+            break;
         case 'v':
             ++op->verbose;
             break;
@@ -0,0 +1,1061 @@
+/*
+ * Copyright (c) 2016 Douglas Gilbert.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <poll.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <getopt.h>
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/bsg.h>
+#include "sg_lib.h"
+#include "sg_io_linux.h"
+#include "sg_pt.h"
+
+static const char * version_str = "1.00 20160707";
+static const char * util_name = "sg_tst_overhead";
+
+/* This is a benchmark of the software overhead of sending a SCSI command
+ * and fetching its response. Commands that move no data (TEST UNIT READY
+ * or READ(16) with a transfer length of zero) are sent, so with a fast
+ * target like the scsi_debug driver (e.g. 'modprobe scsi_debug delay=0')
+ * the time measured is mainly spent in the kernel and this library. The
+ * same commands are sent by each of these back ends:
+ *    sgio      blocking SG_IO ioctl via do_scsi_pt()
+ *    sg3       sg v3 headers with write() and read() on a sg device node
+ *    bsg       sg v4 headers on a bsg device node; ioctl(SG_IO) when the
+ *              queue depth is 1, else write() and read() (which recent
+ *              kernels no longer support)
+ *    pt        start_scsi_pt() and reap_scsi_pt() with objects taken
+ *              from, and returned to, the per thread pool
+ *    uring     as for pt but with the thread's io_uring engine turned on
+ *    reactor   as for pt but driven by a sg_pt reactor with callbacks
+ * For each back end, each number of threads and each queue depth (per
+ * thread) given, the threads send commands for a fixed time. Then the
+ * rate (IOPS) and the latencies (from the command being started until
+ * its response is fetched) are reported. The latency histograms are
+ * those of the sg_pt library (see scsi_pt_lat_record()).
+ *
+ * The sg3 and bsg back ends need the sg or bsg device node of the given
+ * device; they are found via sysfs so any of the sg, bsg or block device
+ * nodes of a SCSI device can be given. The other back ends use whatever
+ * is given, including emulated disks (e.g. emul:/tmp/disk.img).
+ *
+ * The build uses various object files from the <sg3_utils>/lib directory
+ * which is assumed to be a sibling of this examples directory. Those
+ * object files in the lib directory can be built with:
+ *   cd <sg3_utils_package_root> ; ./configure ; cd lib; make
+ *   cd ../examples
+ * Then use the C++ Makefile in that directory:
+ *   make -f Makefile.cplus sg_tst_overhead
+ *
+ * This utility is Linux only.
+ */
+
+using namespace std;
+using namespace std::chrono;
+
+#define DEF_TIME_SECS 2
+#define DEF_TIMEOUT_MS 20000    /* 20 seconds */
+#define DEF_THREADS_LIST "1,2,4"
+#define DEF_QD_LIST "1,4,16"
+#define MAX_QD 128
+#define MAX_THREADS 256
+#define REAP_WAIT_MS 1000
+#define SENSE_BUFF_LEN 32
+
+#define TUR_CMD_LEN 6
+#define READ16_CMD_LEN 16
+
+enum back_end_t {BE_SGIO, BE_SG3, BE_BSG, BE_PT, BE_URING, BE_REACTOR,
+                 BE_NUM};
+
+struct back_end_info_t {
+    const char * name;
+    bool queued;        /* false: queue depth is always 1 */
+};
+
+static struct back_end_info_t be_arr[BE_NUM] = {
+    {"sgio", false},
+    {"sg3", true},
+    {"bsg", true},
+    {"pt", true},
+    {"uring", true},
+    {"reactor", true},
+};
+
+struct opts_t {
+    vector<const char *> dev_names;
+    vector<int> back_ends;
+    vector<int> thread_nums;
+    vector<int> qds;
+    bool do_read;
+    int time_secs;
+    int verbose;
+    int cdb_len;
+    unsigned char cdb[READ16_CMD_LEN];
+};
+
+/* Filled by each thread, then merged by main() */
+struct thr_res_t {
+    uint64_t cmds;
+    uint64_t errs;
+    uint64_t eagains;
+    const char * err;
+    struct sg_pt_lat_hist hist;
+};
+
+static mutex console_mutex;
+static atomic<int> ready_count(0);
+static atomic<bool> go_flag(false);
+static atomic<bool> stop_flag(false);
+static atomic<bool> uring_warned(false);
+
+static struct option long_options[] = {
+        {"engine", required_argument, 0, 'e'},
+        {"help", no_argument, 0, 'h'},
+        {"qd", required_argument, 0, 'q'},
+        {"read", no_argument, 0, 'R'},
+        {"threads", required_argument, 0, 't'},
+        {"time", required_argument, 0, 'T'},
+        {"verbose", no_argument, 0, 'v'},
+        {"version", no_argument, 0, 'V'},
+        {0, 0, 0, 0},
+};
+
+
+static void
+usage(void)
+{
+    printf("Usage: %s [--engine=BE[,BE...]] [--help] [--qd=QD[,QD...]]\n"
+           "                       [--read] [--threads=NT[,NT...]] "
+           "[--time=SECS]\n"
+           "                       [--verbose] [--version] <device>+\n",
+           util_name);
+    printf("  where\n");
+    printf("    --engine=BE,...|-e BE,...    back ends to measure, from: "
+           "sgio, sg3,\n"
+           "                                 bsg, pt, uring and reactor "
+           "(def: all)\n");
+    printf("    --help|-h       print this usage message then exit\n");
+    printf("    --qd=QD,...|-q QD,...    commands queued per thread (def: "
+           "%s)\n", DEF_QD_LIST);
+    printf("    --read|-R       send READ(16) with transfer length 0 (def: "
+           "TEST UNIT\n"
+           "                    READY)\n");
+    printf("    --threads=NT,...|-t NT,...    number of threads (def: %s)\n",
+           DEF_THREADS_LIST);
+    printf("    --time=SECS|-T SECS    seconds each combination runs for "
+           "(def: %d)\n", DEF_TIME_SECS);
+    printf("    --verbose|-v    increase verbosity\n");
+    printf("    --version|-V    print version number then exit\n\n");
+    printf("Measures the per command overhead of several pass-through back "
+           "ends by\nsending commands that transfer no data. For each "
+           "combination of back end,\nthread count and queue depth the IOPS "
+           "and latency percentiles (in\nmicroseconds) are shown. Each "
+           "thread opens the next <device> in a round\nrobin fashion. The "
+           "sgio back end ignores the queue depth.\n");
+}
+
+#ifdef __GNUC__
+static int pr2serr_lk(const char * fmt, ...)
+        __attribute__ ((format (printf, 1, 2)));
+#else
+static int pr2serr_lk(const char * fmt, ...);
+#endif
+
+
+static int
+pr2serr_lk(const char * fmt, ...)
+{
+    int n;
+    va_list args;
+    lock_guard<mutex> lg(console_mutex);
+
+    va_start(args, fmt);
+    n = vfprintf(stderr, fmt, args);
+    va_end(args);
+    return n;
+}
+
+/* Decodes a comma separated list of numbers in the range 1 to max into
+ * v. Returns 0 if okay, else -1 . */
+static int
+num_list_decode(const char * arg, int max, vector<int> & v)
+{
+    int n;
+    const char * cp;
+
+    v.clear();
+    for (cp = arg; cp && *cp; cp = strchr(cp, ',')) {
+        if (',' == *cp)
+            ++cp;
+        if (! isdigit(*cp))
+            return -1;
+        n = sg_get_num_nomult(cp);
+        if ((n < 1) || (n > max))
+            return -1;
+        v.push_back(n);
+    }
+    return v.empty() ? -1 : 0;
+}
+
+/* Decodes a comma separated list of back end names into v. Returns 0 if
+ * okay, else -1 . */
+static int
+back_end_list_decode(const char * arg, vector<int> & v)
+{
+    int k, len;
+    const char * cp;
+    const char * ep;
+
+    v.clear();
+    for (cp = arg; *cp; cp = *ep ? ep + 1 : ep) {
+        ep = strchr(cp, ',');
+        if (NULL == ep)
+            ep = cp + strlen(cp);
+        len = ep - cp;
+        for (k = 0; k < BE_NUM; ++k) {
+            if ((len == (int)strlen(be_arr[k].name)) &&
+                (0 == strncmp(cp, be_arr[k].name, len)))
+                break;
+        }
+        if (k >= BE_NUM) {
+            pr2serr_lk("unknown back end: %.*s\n", len, cp);
+            return -1;
+        }
+        v.push_back(k);
+    }
+    return v.empty() ? -1 : 0;
+}
+
+/* Finds the device node named in the sysfs 'sub' directory (e.g.
+ * "scsi_generic" or "bsg") of the SCSI device that dev_name belongs to.
+ * Works for sg, bsg and block device nodes. Places "<pref><name>" in b
+ * and returns true if found. */
+static bool
+find_sibling_node(const char * dev_name, const char * sub, const char * pref,
+                  char * b, int b_len)
+{
+    bool found = false;
+    char dir_name[256];
+    struct stat a_stat;
+    DIR * dirp;
+    struct dirent * dep;
+
+    if (stat(dev_name, &a_stat) < 0)
+        return false;
+    if (! (S_ISCHR(a_stat.st_mode) || S_ISBLK(a_stat.st_mode)))
+        return false;
+    snprintf(dir_name, sizeof(dir_name), "/sys/dev/%s/%u:%u/device/%s",
+             (S_ISCHR(a_stat.st_mode) ? "char" : "block"),
+             major(a_stat.st_rdev), minor(a_stat.st_rdev), sub);
+    dirp = opendir(dir_name);
+    if (NULL == dirp)
+        return false;
+    while ((dep = readdir(dirp))) {
+        if ('.' == dep->d_name[0])
+            continue;
+        snprintf(b, b_len, "%s%s", pref, dep->d_name);
+        found = true;
+        break;
+    }
+    closedir(dirp);
+    return found;
+}
+
+/* Waits until main() says go. */
+static void
+wait_for_go(void)
+{
+    ++ready_count;
+    while (! go_flag.load())
+        this_thread::yield();
+}
+
+static inline void
+record_lat(const struct opts_t * op, uint64_t start_ns)
+{
+    scsi_pt_lat_record(op->cdb[0], scsi_pt_lat_now_ns() - start_ns);
+}
+
+/* Returns true if the command held in ptp completed without error (a
+ * recovered error or a unit attention is not counted as an error). */
+static bool
+pt_cmd_ok(const struct sg_pt_base * ptp, const unsigned char * sbp)
+{
+    int cat;
+
+    switch (get_scsi_pt_result_category(ptp)) {
+    case SCSI_PT_RESULT_GOOD:
+        return true;
+    case SCSI_PT_RESULT_SENSE:
+        cat = sg_err_category_sense(sbp, get_scsi_pt_sense_len(ptp));
+        return (SG_LIB_CAT_RECOVERED == cat) ||
+               (SG_LIB_CAT_UNIT_ATTENTION == cat);
+    default:
+        return false;
+    }
+}
+
+static bool
+cat_ok(int cat)
+{
+    return (SG_LIB_CAT_CLEAN == cat) || (SG_LIB_CAT_RECOVERED == cat) ||
+           (SG_LIB_CAT_UNIT_ATTENTION == cat);
+}
+
+static void
+prep_pt_obj(const struct opts_t * op, struct sg_pt_base * ptp,
+            unsigned char * sbp)
+{
+    set_scsi_pt_cdb(ptp, op->cdb, op->cdb_len);
+    set_scsi_pt_sense(ptp, sbp, SENSE_BUFF_LEN);
+}
+
+/* sgio back end: one object, do_scsi_pt() for each command */
+static void
+sgio_worker(const struct opts_t * op, int fd, struct thr_res_t * rp)
+{
+    int res;
+    uint64_t t;
+    unsigned char sense_b[SENSE_BUFF_LEN];
+    struct sg_pt_base * ptp;
+
+    ptp = construct_scsi_pt_obj();
+    wait_for_go();
+    if (NULL == ptp) {
+        rp->err = "out of memory";
+        return;
+    }
+    while (! stop_flag.load()) {
+        clear_scsi_pt_obj(ptp);
+        prep_pt_obj(op, ptp, sense_b);
+        t = scsi_pt_lat_now_ns();
+        res = do_scsi_pt(ptp, fd, DEF_TIMEOUT_MS / 1000, 0);
+        if (res) {
+            rp->err = (res < 0) ? safe_strerror(-res) : "do_scsi_pt() "
+                      "failed";
+            break;
+        }
+        record_lat(op, t);
+        ++rp->cmds;
+        if (! pt_cmd_ok(ptp, sense_b))
+            ++rp->errs;
+    }
+    destruct_scsi_pt_obj(ptp);
+}
+
+/* Per command slot of the sg3 and bsg back ends */
+struct hdr_slot_t {
+    uint64_t start_ns;
+    unsigned char sense[SENSE_BUFF_LEN];
+};
+
+/* sg3 back end: sg v3 headers written to and read from a non-blocking sg
+ * file descriptor. The pack_id is the slot index. */
+static void
+sg3_worker(const struct opts_t * op, int fd, int qd, struct thr_res_t * rp)
+{
+    int k, outstanding;
+    vector<int> free_slots;
+    vector<struct hdr_slot_t> slots(qd);
+    struct sg_io_hdr hdr;
+    struct pollfd pfd;
+
+    for (k = qd - 1; k >= 0; --k)
+        free_slots.push_back(k);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    wait_for_go();
+    for (outstanding = 0; ; ) {
+        while ((! stop_flag.load()) && (outstanding < qd)) {
+            k = free_slots.back();
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.interface_id = 'S';
+            hdr.dxfer_direction = SG_DXFER_NONE;
+            hdr.cmd_len = op->cdb_len;
+            hdr.cmdp = (unsigned char *)op->cdb;
+            hdr.mx_sb_len = SENSE_BUFF_LEN;
+            hdr.sbp = slots[k].sense;
+            hdr.timeout = DEF_TIMEOUT_MS;
+            hdr.pack_id = k;
+            slots[k].start_ns = scsi_pt_lat_now_ns();
+            if (write(fd, &hdr, sizeof(hdr)) < 0) {
+                if ((EAGAIN == errno) || (ENOMEM == errno)) {
+                    ++rp->eagains;      /* sg driver's queue is full */
+                    break;
+                }
+                rp->err = safe_strerror(errno);
+                return;
+            }
+            free_slots.pop_back();
+            ++outstanding;
+        }
+        if (0 == outstanding) {
+            if (stop_flag.load())
+                break;
+            this_thread::yield();
+            continue;
+        }
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.interface_id = 'S';
+        hdr.pack_id = -1;
+        while (read(fd, &hdr, sizeof(hdr)) < 0) {
+            if (EAGAIN != errno) {
+                rp->err = safe_strerror(errno);
+                return;
+            }
+            if (poll(&pfd, 1, REAP_WAIT_MS) < 0) {
+                rp->err = safe_strerror(errno);
+                return;
+            }
+        }
+        k = hdr.pack_id;
+        if ((k < 0) || (k >= qd)) {
+            rp->err = "unexpected pack_id";
+            return;
+        }
+        record_lat(op, slots[k].start_ns);
+        ++rp->cmds;
+        if (! cat_ok(sg_err_category3(&hdr)))
+            ++rp->errs;
+        free_slots.push_back(k);
+        --outstanding;
+    }
+}
+
+static void
+prep_v4_hdr(const struct opts_t * op, struct sg_io_v4 * h4p,
+            unsigned char * sbp, int slot)
+{
+    memset(h4p, 0, sizeof(*h4p));
+    h4p->guard = 'Q';
+    h4p->protocol = BSG_PROTOCOL_SCSI;
+    h4p->subprotocol = BSG_SUB_PROTOCOL_SCSI_CMD;
+    h4p->request_len = op->cdb_len;
+    h4p->request = (uint64_t)(uintptr_t)op->cdb;
+    h4p->max_response_len = SENSE_BUFF_LEN;
+    h4p->response = (uint64_t)(uintptr_t)sbp;
+    h4p->timeout = DEF_TIMEOUT_MS;
+    h4p->usr_ptr = (uint64_t)slot;
+}
+
+static int
+v4_hdr_cat(const struct sg_io_v4 * h4p, const unsigned char * sbp)
+{
+    return sg_err_category_new(h4p->device_status, h4p->transport_status,
+                               h4p->driver_status, sbp,
+                               h4p->response_len);
+}
+
+/* bsg back end: sg v4 headers on a non-blocking bsg file descriptor. The
+ * usr_ptr is the slot index. */
+static void
+bsg_worker(const struct opts_t * op, int fd, int qd, struct thr_res_t * rp)
+{
+    int k, outstanding;
+    uint64_t t;
+    vector<int> free_slots;
+    vector<struct hdr_slot_t> slots(qd);
+    struct sg_io_v4 h4;
+    struct pollfd pfd;
+
+    wait_for_go();
+    if (1 == qd) {      /* no queue, so use the SG_IO ioctl */
+        while (! stop_flag.load()) {
+            prep_v4_hdr(op, &h4, slots[0].sense, 0);
+            t = scsi_pt_lat_now_ns();
+            if (ioctl(fd, SG_IO, &h4) < 0) {
+                rp->err = safe_strerror(errno);
+                return;
+            }
+            record_lat(op, t);
+            ++rp->cmds;
+            if (! cat_ok(v4_hdr_cat(&h4, slots[0].sense)))
+                ++rp->errs;
+        }
+        return;
+    }
+    for (k = qd - 1; k >= 0; --k)
+        free_slots.push_back(k);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (outstanding = 0; ; ) {
+        while ((! stop_flag.load()) && (outstanding < qd)) {
+            k = free_slots.back();
+            prep_v4_hdr(op, &h4, slots[k].sense, k);
+            slots[k].start_ns = scsi_pt_lat_now_ns();
+            if (write(fd, &h4, sizeof(h4)) < 0) {
+                if ((EAGAIN == errno) || (ENOMEM == errno)) {
+                    ++rp->eagains;
+                    break;
+                }
+                rp->err = (EINVAL == errno) ? "write() not supported by "
+                          "this bsg driver" : safe_strerror(errno);
+                return;
+            }
+            free_slots.pop_back();
+            ++outstanding;
+        }
+        if (0 == outstanding) {
+            if (stop_flag.load())
+                break;
+            this_thread::yield();
+            continue;
+        }
+        memset(&h4, 0, sizeof(h4));
+        h4.guard = 'Q';
+        while (read(fd, &h4, sizeof(h4)) < 0) {
+            if (EAGAIN != errno) {
+                rp->err = safe_strerror(errno);
+                return;
+            }
+            if (poll(&pfd, 1, REAP_WAIT_MS) < 0) {
+                rp->err = safe_strerror(errno);
+                return;
+            }
+        }
+        k = (int)h4.usr_ptr;
+        if ((k < 0) || (k >= qd)) {
+            rp->err = "unexpected usr_ptr";
+            return;
+        }
+        record_lat(op, slots[k].start_ns);
+        ++rp->cmds;
+        if (! cat_ok(v4_hdr_cat(&h4, slots[k].sense)))
+            ++rp->errs;
+        free_slots.push_back(k);
+        --outstanding;
+    }
+}
+
+/* Per command slot of the pt, uring and reactor back ends */
+struct pt_slot_t {
+    struct sg_pt_base * ptp;
+    uint64_t start_ns;
+    const struct opts_t * op;
+    struct thr_res_t * rp;
+    unsigned char sense[SENSE_BUFF_LEN];
+};
+
+/* Takes an object from the pool for slot sp and starts its command.
+ * Returns the value from start_scsi_pt() (or -ENOMEM). */
+static int
+pt_slot_start(struct pt_slot_t * sp, int fd)
+{
+    int res;
+
+    sp->ptp = acquire_scsi_pt_obj();
+    if (NULL == sp->ptp)
+        return -ENOMEM;
+    prep_pt_obj(sp->op, sp->ptp, sp->sense);
+    sp->start_ns = scsi_pt_lat_now_ns();
+    res = start_scsi_pt(sp->ptp, fd, DEF_TIMEOUT_MS / 1000, 0);
+    if (res) {
+        release_scsi_pt_obj(sp->ptp);
+        sp->ptp = NULL;
+    }
+    return res;
+}
+
+/* Accounts for the response in slot sp and returns its object to the
+ * pool. */
+static void
+pt_slot_done(struct pt_slot_t * sp)
+{
+    record_lat(sp->op, sp->start_ns);
+    ++sp->rp->cmds;
+    if (! pt_cmd_ok(sp->ptp, sp->sense))
+        ++sp->rp->errs;
+    release_scsi_pt_obj(sp->ptp);
+    sp->ptp = NULL;
+}
+
+static const char *
+start_err_str(int res)
+{
+    return (res < 0) ? safe_strerror(-res) : "start_scsi_pt() failed";
+}
+
+/* pt and uring back ends: start_scsi_pt() and reap_scsi_pt() with objects
+ * from the pool. */
+static void
+pt_worker(const struct opts_t * op, int fd, int qd, bool uring,
+          struct thr_res_t * rp)
+{
+    int k, res, outstanding;
+    vector<int> free_slots;
+    vector<struct pt_slot_t> slots(qd);
+    struct sg_pt_base * ptp;
+
+    for (k = qd - 1; k >= 0; --k) {
+        slots[k].ptp = NULL;
+        slots[k].op = op;
+        slots[k].rp = rp;
+        free_slots.push_back(k);
+    }
+    if (uring) {
+        res = scsi_pt_uring_enable(qd, op->verbose);
+        if (-ENOSYS == res) {
+            if (! uring_warned.exchange(true))
+                pr2serr_lk("io_uring not available, uring back end uses "
+                           "write() and read()\n");
+        } else if (res) {
+            wait_for_go();
+            rp->err = safe_strerror(-res);
+            return;
+        }
+    }
+    wait_for_go();
+    for (outstanding = 0; ; ) {
+        while ((! stop_flag.load()) && (outstanding < qd)) {
+            k = free_slots.back();
+            res = pt_slot_start(&slots[k], fd);
+            if (-EAGAIN == res) {
+                ++rp->eagains;
+                break;
+            } else if (res) {
+                rp->err = start_err_str(res);
+                goto fini;
+            }
+            free_slots.pop_back();
+            ++outstanding;
+        }
+        if (0 == outstanding) {
+            if (stop_flag.load())
+                break;
+            this_thread::yield();
+            continue;
+        }
+        ptp = NULL;
+        res = reap_scsi_pt(fd, REAP_WAIT_MS, &ptp, 0);
+        if (-EAGAIN == res)
+            continue;
+        else if (res) {
+            rp->err = safe_strerror(-res);
+            goto fini;
+        }
+        for (k = 0; k < qd; ++k) {
+            if (slots[k].ptp == ptp)
+                break;
+        }
+        if (k >= qd) {
+            rp->err = "response for unknown object";
+            goto fini;
+        }
+        if (EAGAIN == get_scsi_pt_os_err(ptp)) {  /* queued write failed */
+            ++rp->eagains;
+            res = start_scsi_pt(ptp, fd, DEF_TIMEOUT_MS / 1000, 0);
+            if (res) {
+                rp->err = start_err_str(res);
+                goto fini;
+            }
+            continue;
+        }
+        pt_slot_done(&slots[k]);
+        free_slots.push_back(k);
+        --outstanding;
+    }
+fini:
+    if (uring && (0 == outstanding))
+        scsi_pt_uring_enable(0, op->verbose);
+}
+
+/* State of the reactor back end in a thread */
+struct reactor_ctx_t {
+    struct sg_pt_reactor * rctp;
+    int fd;
+    vector<int> pending;    /* slots to (re)start */
+    vector<struct pt_slot_t> slots;
+};
+
+static void reactor_done(struct sg_pt_base * ptp, int fd, int res,
+                         void * priv);
+
+/* Returns 0 if the command in slot k was submitted, 1 if the queue was
+ * full (k is put on the pending list), else a negated errno. */
+static int
+reactor_start(struct reactor_ctx_t * cp, int k)
+{
+    int res;
+    struct pt_slot_t * sp = &cp->slots[k];
+
+    sp->ptp = acquire_scsi_pt_obj();
+    if (NULL == sp->ptp)
+        return -ENOMEM;
+    prep_pt_obj(sp->op, sp->ptp, sp->sense);
+    sp->start_ns = scsi_pt_lat_now_ns();
+    res = scsi_pt_reactor_submit(cp->rctp, sp->ptp, cp->fd,
+                                 DEF_TIMEOUT_MS / 1000, reactor_done, cp);
+    if (0 == res)
+        return 0;
+    release_scsi_pt_obj(sp->ptp);
+    sp->ptp = NULL;
+    if (-EAGAIN == res) {
+        ++sp->rp->eagains;
+        cp->pending.push_back(k);
+        return 1;
+    }
+    return (res < 0) ? res : -EINVAL;
+}
+
+static void
+reactor_done(struct sg_pt_base * ptp, int fd, int res, void * priv)
+{
+    int k;
+    struct reactor_ctx_t * cp = (struct reactor_ctx_t *)priv;
+    struct pt_slot_t * sp = NULL;
+
+    if (fd) { ; }       /* suppress warning */
+    for (k = 0; k < (int)cp->slots.size(); ++k) {
+        if (cp->slots[k].ptp == ptp) {
+            sp = &cp->slots[k];
+            break;
+        }
+    }
+    if (NULL == sp)
+        return;
+    if (res) {
+        sp->rp->err = safe_strerror(-res);
+        release_scsi_pt_obj(ptp);
+        sp->ptp = NULL;
+        return;
+    }
+    pt_slot_done(sp);
+    if (! stop_flag.load())
+        cp->pending.push_back(k);
+}
+
+/* reactor back end: commands are restarted from their callbacks (via the
+ * pending list) until told to stop. */
+static void
+reactor_worker(const struct opts_t * op, int fd, int qd,
+               struct thr_res_t * rp)
+{
+    int k, res;
+    struct reactor_ctx_t ctx;
+
+    ctx.fd = fd;
+    ctx.slots.resize(qd);
+    for (k = 0; k < qd; ++k) {
+        ctx.slots[k].ptp = NULL;
+        ctx.slots[k].op = op;
+        ctx.slots[k].rp = rp;
+        ctx.pending.push_back(k);
+    }
+    ctx.rctp = construct_scsi_pt_reactor(op->verbose);
+    wait_for_go();
+    if (NULL == ctx.rctp) {
+        rp->err = "out of memory";
+        return;
+    }
+    res = scsi_pt_reactor_add_fd(ctx.rctp, fd);
+    if (res) {
+        rp->err = safe_strerror(-res);
+        goto fini;
+    }
+    while (true) {
+        vector<int> to_start;
+
+        if (! stop_flag.load())
+            to_start.swap(ctx.pending);
+        for (k = 0; k < (int)to_start.size(); ++k) {
+            res = reactor_start(&ctx, to_start[k]);
+            if (1 == res) {     /* queue full, keep the rest pending */
+                ctx.pending.insert(ctx.pending.end(), to_start.begin() + k + 1,
+                                   to_start.end());
+                break;
+            } else if (res < 0) {
+                rp->err = safe_strerror(-res);
+                goto fini;
+            }
+        }
+        if (rp->err)
+            break;
+        if (0 == scsi_pt_reactor_outstanding(ctx.rctp)) {
+            if (stop_flag.load())
+                break;
+            this_thread::yield();
+            continue;
+        }
+        res = scsi_pt_reactor_run(ctx.rctp, REAP_WAIT_MS);
+        if ((res < 0) && (-EINTR != res)) {
+            rp->err = safe_strerror(-res);
+            break;
+        }
+    }
+fini:
+    destruct_scsi_pt_reactor(ctx.rctp);
+}
+
+static void
+work_thread(int id, int be, int qd, const struct opts_t * op,
+            struct thr_res_t * rp)
+{
+    int fd;
+    char b[320];
+    const char * dev_name = op->dev_names[id % op->dev_names.size()];
+
+    scsi_pt_lat_reset();
+    if ((BE_SG3 == be) || (BE_BSG == be)) {
+        if (! find_sibling_node(dev_name, ((BE_SG3 == be) ? "scsi_generic" :
+                                           "bsg"),
+                                ((BE_SG3 == be) ? "/dev/" : "/dev/bsg/"),
+                                b, sizeof(b))) {
+            rp->err = "no such device node";
+            wait_for_go();
+            return;
+        }
+        if (op->verbose && (0 == id))
+            pr2serr_lk("%s back end using %s\n", be_arr[be].name, b);
+        fd = open(b, O_RDWR | O_NONBLOCK);
+        if (fd < 0)
+            fd = -errno;
+    } else
+        fd = scsi_pt_open_flags(dev_name, O_RDWR | O_NONBLOCK, op->verbose);
+    if (fd < 0) {
+        rp->err = safe_strerror(-fd);
+        wait_for_go();
+        return;
+    }
+    switch (be) {
+    case BE_SGIO:
+        sgio_worker(op, fd, rp);
+        break;
+    case BE_SG3:
+        sg3_worker(op, fd, qd, rp);
+        break;
+    case BE_BSG:
+        bsg_worker(op, fd, qd, rp);
+        break;
+    case BE_PT:
+    case BE_URING:
+        pt_worker(op, fd, qd, (BE_URING == be), rp);
+        break;
+    case BE_REACTOR:
+        reactor_worker(op, fd, qd, rp);
+        break;
+    }
+    scsi_pt_lat_snapshot(op->cdb[0], &rp->hist);
+    if ((BE_SG3 == be) || (BE_BSG == be))
+        close(fd);
+    else
+        scsi_pt_close_device(fd);
+}
+
+/* Runs one combination and prints its line. */
+static void
+run_combination(int be, int num_threads, int qd, const struct opts_t * op)
+{
+    int k;
+    uint64_t cmds = 0;
+    uint64_t errs = 0;
+    uint64_t eagains = 0;
+    double secs;
+    const char * err = NULL;
+    vector<thread> thr_v;
+    vector<struct thr_res_t> res_v(num_threads);
+    struct sg_pt_lat_hist hist;
+    steady_clock::time_point t_start, t_end;
+
+    memset(&hist, 0, sizeof(hist));
+    memset(res_v.data(), 0, num_threads * sizeof(struct thr_res_t));
+    ready_count = 0;
+    go_flag = false;
+    stop_flag = false;
+    for (k = 0; k < num_threads; ++k)
+        thr_v.push_back(thread(work_thread, k, be, qd, op, &res_v[k]));
+    while (ready_count.load() < num_threads)
+        this_thread::yield();
+    t_start = steady_clock::now();
+    go_flag = true;
+    this_thread::sleep_for(seconds(op->time_secs));
+    stop_flag = true;
+    for (k = 0; k < num_threads; ++k)
+        thr_v[k].join();
+    t_end = steady_clock::now();
+    secs = duration_cast<duration<double> >(t_end - t_start).count();
+
+    for (k = 0; k < num_threads; ++k) {
+        cmds += res_v[k].cmds;
+        errs += res_v[k].errs;
+        eagains += res_v[k].eagains;
+        if (res_v[k].err && (NULL == err))
+            err = res_v[k].err;
+        scsi_pt_lat_merge(&hist, &res_v[k].hist);
+    }
+    if (be_arr[be].queued)
+        printf("%-8s %7d %4d ", be_arr[be].name, num_threads, qd);
+    else
+        printf("%-8s %7d %4s ", be_arr[be].name, num_threads, "-");
+    if (err && (0 == cmds)) {
+        printf("  failed: %s\n", err);
+        return;
+    }
+    printf("%10.0f %8.1f %8.1f %8.1f %9.1f %9.1f %6" PRIu64,
+           (secs > 0.0) ? (cmds / secs) : 0.0,
+           hist.count ? (hist.sum_ns / 1000.0 / hist.count) : 0.0,
+           scsi_pt_lat_percentile(&hist, 50.0) / 1000.0,
+           scsi_pt_lat_percentile(&hist, 99.0) / 1000.0,
+           scsi_pt_lat_percentile(&hist, 99.9) / 1000.0,
+           hist.max_ns / 1000.0, errs);
+    if (op->verbose)
+        printf("  eagains=%" PRIu64, eagains);
+    if (err)
+        printf("  [%s]", err);
+    printf("\n");
+    fflush(stdout);
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    int c, k, j, n;
+    struct opts_t opts;
+    struct opts_t * op;
+
+    op = &opts;
+    op->do_read = false;
+    op->time_secs = DEF_TIME_SECS;
+    op->verbose = 0;
+    num_list_decode(DEF_THREADS_LIST, MAX_THREADS, op->thread_nums);
+    num_list_decode(DEF_QD_LIST, MAX_QD, op->qds);
+
+    while (1) {
+        int option_index = 0;
+
+        c = getopt_long(argc, argv, "e:hq:Rt:T:vV", long_options,
+                        &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'e':
+            if (back_end_list_decode(optarg, op->back_ends))
+                return 1;
+            break;
+        case 'h':
+        case '?':
+            usage();
+            return 0;
+        case 'q':
+            if (num_list_decode(optarg, MAX_QD, op->qds)) {
+                pr2serr_lk("--qd= expects a list of numbers from 1 to %d\n",
+                           MAX_QD);
+                return 1;
+            }
+            break;
+        case 'R':
+            op->do_read = true;
+            break;
+        case 't':
+            if (num_list_decode(optarg, MAX_THREADS, op->thread_nums)) {
+                pr2serr_lk("--threads= expects a list of numbers from 1 to "
+                           "%d\n", MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 'T':
+            n = sg_get_num_nomult(optarg);
+            if (n < 1) {
+                pr2serr_lk("--time= expects a positive number\n");
+                return 1;
+            }
+            op->time_secs = n;
+            break;
+        case 'v':
+            ++op->verbose;
+            break;
+        case 'V':
+            pr2serr_lk("%s version: %s\n", util_name, version_str);
+            return 0;
+        default:
+            pr2serr_lk("unrecognised option code 0x%x ??\n", c);
+            usage();
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        for (; optind < argc; ++optind)
+            op->dev_names.push_back(argv[optind]);
+    }
+    if (op->dev_names.empty()) {
+        pr2serr_lk("No device name given\n\n");
+        usage();
+        return 1;
+    }
+    if (op->back_ends.empty()) {
+        for (k = 0; k < BE_NUM; ++k)
+            op->back_ends.push_back(k);
+    }
+    memset(op->cdb, 0, sizeof(op->cdb));
+    if (op->do_read) {  /* READ(16) of LBA 0, transfer length 0 */
+        op->cdb[0] = 0x88;
+        op->cdb_len = READ16_CMD_LEN;
+    } else              /* TEST UNIT READY */
+        op->cdb_len = TUR_CMD_LEN;
+
+    printf("%s: %s, %d second(s) per line, latencies in microseconds\n",
+           util_name, (op->do_read ? "READ(16), no data" :
+                       "TEST UNIT READY"), op->time_secs);
+    printf("back end threads   qd       IOPS      avg      p50      p99     "
+           "p99.9       max   errs\n");
+    for (k = 0; k < (int)op->back_ends.size(); ++k) {
+        int be = op->back_ends[k];
+
+        for (j = 0; j < (int)op->thread_nums.size(); ++j) {
+            if (be_arr[be].queued) {
+                for (n = 0; n < (int)op->qds.size(); ++n)
+                    run_combination(be, op->thread_nums[j], op->qds[n], op);
+            } else
+                run_combination(be, op->thread_nums[j], 1, op);
+        }
+    }
+    return 0;
+}
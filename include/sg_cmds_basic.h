@@ -254,6 +254,56 @@ int sg_cmds_process_resp(struct sg_pt_base * ptvp, const char * leadin,
                          const unsigned char * sense_b, int noisy,
                          int verbose, int * o_sense_cat);
 
+/* The following variants of the sg_ll_* functions of the same name
+ * (without the "_pt" suffix) use the caller's pass-through object rather
+ * than constructing (and destructing) one per command. The object is
+ * cleared at the start of each call so it may be reused for any number of
+ * commands; afterwards it can be queried with the get_scsi_pt_*()
+ * functions. Return values are the same as the non "_pt" variants. */
+int sg_ll_inquiry_pt(struct sg_pt_base * ptvp, int sg_fd, int cmddt,
+                     int evpd, int pg_op, void * resp, int mx_resp_len,
+                     int noisy, int verbose);
+int sg_ll_log_sense_pt(struct sg_pt_base * ptvp, int sg_fd, int ppc, int sp,
+                       int pc, int pg_code, int subpg_code, int paramp,
+                       unsigned char * resp, int mx_resp_len, int noisy,
+                       int verbose);
+int sg_ll_request_sense_pt(struct sg_pt_base * ptvp, int sg_fd, int desc,
+                           void * resp, int mx_resp_len, int noisy,
+                           int verbose);
+int sg_ll_test_unit_ready_pt(struct sg_pt_base * ptvp, int sg_fd,
+                             int pack_id, int noisy, int verbose);
+int sg_ll_test_unit_ready_progress_pt(struct sg_pt_base * ptvp, int sg_fd,
+                                      int pack_id, int * progress,
+                                      int noisy, int verbose);
+
+/* "Probe then fetch" helpers for pages that start with a 4 byte header
+ * holding a 16 bit page length at offset 2 (VPD, log and diagnostic
+ * pages). Rather than asking for the header first and then the whole
+ * page, the command is sent with an allocation length remembered as
+ * adequate for that page of that device (or a generous default the first
+ * time), and only sent again (with the length the header asks for) if the
+ * response was truncated. Page lengths are remembered, keyed by device,
+ * opcode, page and subpage, for the lifetime of the process and shared by
+ * all its threads. mx_resp_len is the size of resp and caps any allocation
+ * length. Return values are the same as the function named without
+ * "_fetch". When 0 is returned and resp_lenp is non-NULL, *resp_lenp is
+ * set to the page length from the response header or the number of bytes
+ * actually received, whichever is less. */
+int sg_ll_vpd_fetch(int sg_fd, int pg_code, void * resp, int mx_resp_len,
+                    int * resp_lenp, int noisy, int verbose);
+int sg_ll_log_sense_fetch(int sg_fd, int ppc, int sp, int pc, int pg_code,
+                          int subpg_code, int paramp, unsigned char * resp,
+                          int mx_resp_len, int * resp_lenp, int noisy,
+                          int verbose);
+int sg_ll_receive_diag_fetch(int sg_fd, int pcv, int pg_code, void * resp,
+                             int mx_resp_len, int * resp_lenp, int noisy,
+                             int verbose);
+
+/* Forgets the page lengths remembered by the *_fetch() functions for the
+ * device open on sg_fd, or for all devices if sg_fd is negative. Useful
+ * after a microcode download or a device node is reused. */
+void sg_page_len_cache_clear(int sg_fd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -154,6 +154,14 @@ int sg_ll_reassign_blocks(int sg_fd, int longlba, int longlist, void * paramp,
 int sg_ll_receive_diag(int sg_fd, int pcv, int pg_code, void * resp,
                        int mx_resp_len, int noisy, int verbose);
 
+struct sg_pt_base;
+
+/* As sg_ll_receive_diag() but uses the caller's pass-through object (see
+ * the "_pt" variants in sg_cmds_basic.h). */
+int sg_ll_receive_diag_pt(struct sg_pt_base * ptvp, int sg_fd, int pcv,
+                          int pg_code, void * resp, int mx_resp_len,
+                          int noisy, int verbose);
+
 /* Invokes a SCSI REPORT IDENTIFYING INFORMATION command. This command was
  * called REPORT DEVICE IDENTIFIER prior to spc4r07. Return of 0 -> success,
  * SG_LIB_CAT_INVALID_OP -> Report identifying information not supported,
@@ -227,7 +235,9 @@ int sg_ll_unmap_v2(int sg_fd, int anchor, int group_num, int timeout_secs,
  * SG_LIB_CAT_MEDIUM_HARD -> medium or hardware error, no valid info,
  * SG_LIB_CAT_MEDIUM_HARD_WITH_INFO -> as previous, with valid info,
  * SG_LIB_CAT_NOT_READY -> device not ready, SG_LIB_CAT_ABORTED_COMMAND,
- * SG_LIB_CAT_MISCOMPARE, -1 -> other failure */
+ * SG_LIB_CAT_MISCOMPARE, -1 -> other failure. When info is valid it is
+ * written to *infop: the LBA of a medium error, or with a MISCOMPARE
+ * (BYTCHK set) the offset of the first byte that miscompared. */
 int sg_ll_verify10(int sg_fd, int vrprotect, int dpo, int bytechk,
                    unsigned int lba, int veri_len, void * data_out,
                    int data_out_len, unsigned int * infop, int noisy,
@@ -241,7 +251,9 @@ int sg_ll_verify10(int sg_fd, int vrprotect, int dpo, int bytechk,
  * SG_LIB_CAT_MEDIUM_HARD -> medium or hardware error, no valid info,
  * SG_LIB_CAT_MEDIUM_HARD_WITH_INFO -> as previous, with valid info,
  * SG_LIB_CAT_NOT_READY -> device not ready, SG_LIB_CAT_ABORTED_COMMAND,
- * SG_LIB_CAT_MISCOMPARE, -1 -> other failure */
+ * SG_LIB_CAT_MISCOMPARE, -1 -> other failure. When info is valid it is
+ * written to *infop: the LBA of a medium error, or with a MISCOMPARE
+ * (BYTCHK set) the offset of the first byte that miscompared. */
 int sg_ll_verify16(int sg_fd, int vrprotect, int dpo, int bytechk,
                    uint64_t llba, int veri_len, int group_num,
                    void * data_out, int data_out_len, uint64_t * infop,
@@ -2,14 +2,14 @@
 #define SG_IO_LINUX_H
 
 /*
- * Copyright (c) 2004-2015 Douglas Gilbert.
+ * Copyright (c) 2004-2016 Douglas Gilbert.
  * All rights reserved.
  * Use of this source code is governed by a BSD-style
  * license that can be found in the BSD_LICENSE file.
  */
 
 /*
- * Version 1.04 [20151217]
+ * Version 1.07 [20160702]
  */
 
 /*
@@ -172,6 +172,32 @@ int sg_err_category_new(int scsi_status, int host_status, int driver_status,
 /* The following function declaration is for the sg version 3 driver. */
 int sg_err_category3(struct sg_io_hdr * hp);
 
+/* As sg_err_category3() but also decodes sense data (if any) into the
+ * structure pointed to by sip, in one pass without string formatting. */
+int sg_err_category3_si(const struct sg_io_hdr * hp,
+                        struct sg_sense_info * sip);
+
+/* Emulation of a SCSI disk whose medium is a regular file, see
+ * sg_pt_emul.c . A device name starting with SG_EMUL_PREFIX is emulated
+ * as is, when the SG_EMUL_ENV environment variable is set, the name of a
+ * regular file. The value of that variable holds options (e.g. "bs=4096,
+ * mmap"). The functions that follow sg_emul_is_emul_name() act like the
+ * open(), close(), ioctl(SG_IO), write(), read() and SG_GET_NUM_WAITING
+ * calls on a sg device node: they return -1 and set errno on failure.
+ * The scsi_pt_* functions use these so most utilities need do nothing
+ * more. */
+#define SG_EMUL_PREFIX "emul:"
+#define SG_EMUL_ENV "SG3_UTILS_EMUL"
+
+int sg_emul_is_emul_name(const char * device_name);
+int sg_emul_open(const char * device_name, int flags, int verbose);
+int sg_emul_fd(int fd);         /* returns 1 if fd is emulated, else 0 */
+int sg_emul_close(int fd);
+int sg_emul_sg_io(int fd, struct sg_io_hdr * hp);
+int sg_emul_write(int fd, const struct sg_io_hdr * hp);
+int sg_emul_read(int fd, struct sg_io_hdr * hp);
+int sg_emul_num_waiting(int fd);
+
 
 /* Note about SCSI status codes found in older versions of Linux.
    Linux has traditionally used a 1 bit right shifted and masked
@@ -202,6 +202,45 @@ int sg_get_sense_filemark_eom_ili(const unsigned char * sensep, int sb_len,
 int sg_get_sense_progress_fld(const unsigned char * sensep, int sb_len,
                               int * progress_outp);
 
+/* Everything a caller is likely to act on in a sense buffer, decoded in
+ * one pass by sg_get_sense_info() without any string formatting. Fields
+ * that are absent from the sense data are zero. Both fixed and descriptor
+ * formats are handled; desc_off[] holds the byte offset (from the start
+ * of the sense buffer) of the first descriptor of each type 0 to 15 (0
+ * if there is none) so descriptor format callers need not search. */
+#define SG_SENSE_INFO_MAX_DESC_TYPE 15
+
+struct sg_sense_info {
+    unsigned char response_code; /* 0x70 to 0x73 (or 0 if none) */
+    unsigned char sense_key;
+    unsigned char asc;
+    unsigned char ascq;
+    unsigned char info_valid;   /* VALID bit (set with information) */
+    unsigned char cmd_info_valid; /* command-specific information given */
+    unsigned char sksv;         /* sense key specific bytes valid */
+    unsigned char progress_valid; /* progress indication given */
+    unsigned char filemark;
+    unsigned char eom;
+    unsigned char ili;
+    unsigned char fru_code;
+    unsigned char sks[3];       /* sense key specific bytes, byte 0 has SKSV */
+    unsigned char desc_off[SG_SENSE_INFO_MAX_DESC_TYPE + 1];
+    int sb_len;                 /* bytes of sense data decoded */
+    int progress;               /* 0 to 65535 meaning 0% to 100% */
+    uint64_t info;              /* information field */
+    uint64_t cmd_info;          /* command-specific information field */
+};
+
+/* Decodes sense buffer 'sbp' of 'sb_len' bytes into the structure pointed
+ * to by 'sip', which is cleared first. Returns 1 if the response code is
+ * recognized (same rule as sg_scsi_normalize_sense()), else returns 0. */
+int sg_get_sense_info(const unsigned char * sbp, int sb_len,
+                      struct sg_sense_info * sip);
+
+/* Returns the SG_LIB_CAT_* value that sg_err_category_sense() would yield
+ * for the sense buffer that was decoded into 'sip'. */
+int sg_sense_info_category(const struct sg_sense_info * sip);
+
 /* Closely related to sg_print_sense(). Puts decoded sense data in 'buff'.
  * Usually multiline with multiple '\n' including one trailing. If
  * 'raw_sinfo' set appends sense buffer in hex. 'leadin' is string prepended
@@ -268,8 +307,21 @@ extern FILE * sg_warnings_strm;
 
 void sg_set_warnings_strm(FILE * warnings_strm);
 
-/* The following "print" functions send ACSII to 'sg_warnings_strm' file
- * descriptor (default value is stderr). 'leadin' is string prepended to
+/* Each thread may have its own warnings stream which, when set, is used
+ * instead of sg_warnings_strm for diagnostics from library functions that
+ * thread calls. So threads can, for example, log to separate files
+ * without contending for one FILE lock or serializing their output.
+ * Setting NULL reverts the calling thread to sg_warnings_strm. Returns 0,
+ * or -ENOSYS if the library was built without thread local storage. */
+int sg_set_thread_warnings_strm(FILE * warnings_strm);
+
+/* Returns the stream library diagnostics from the calling thread go to:
+ * its own warnings stream if set, otherwise sg_warnings_strm if set,
+ * otherwise stderr. */
+FILE * sg_get_warnings_strm(void);
+
+/* The following "print" functions send ACSII to sg_get_warnings_strm()
+ * (default value is stderr). 'leadin' is string prepended to
  * each line printed out, NULL treated as "". */
 void sg_print_command(const unsigned char * command);
 void sg_print_scsi_status(int scsi_status);
@@ -374,6 +426,17 @@ int sg_vpd_dev_id_iter(const unsigned char * initial_desig_desc, int page_len,
  * If errnum is negative, flip its sign. */
 char * safe_strerror(int errnum);
 
+/* Like snprintf() but returns the number of chars actually placed in cp
+ * (excluding the trailing null), so the 'n += sg_scnpr(b + n, blen - n,
+ * ...)' idiom is safe. For cp_max_len <= 1 nothing is written and 0 is
+ * returned. The Linux kernel has a similar function called scnprintf(). */
+#if defined(__GNUC__) || defined(__clang__)
+int sg_scnpr(char * cp, int cp_max_len, const char * fmt, ...)
+             __attribute__ ((format (printf, 3, 4)));
+#else
+int sg_scnpr(char * cp, int cp_max_len, const char * fmt, ...);
+#endif
+
 
 /* Print (to stdout) 'str' of bytes in hex, 16 bytes per line optionally
  * followed at the right hand side of the line with an ASCII interpretation.
@@ -452,6 +515,24 @@ int sg_get_num_nomult(const char * buf);
  * terminator. */
 int64_t sg_get_llnum(const char * buf);
 
+/* Returns 1 if all b_len bytes at bp are zero, else 0 (also when bp is
+ * NULL or b_len <= 0). Used to find runs of zeroed blocks. */
+int sg_all_zeros(const unsigned char * bp, int b_len);
+
+
+/* CRC32C (Castagnoli) of len bytes at buf, continuing from crc which
+ * should be 0 for the first (or only) call. Uses the SSE4.2 or ARMv8
+ * CRC32 instructions when available. */
+uint32_t sg_crc32c(uint32_t crc, const void * buf, size_t len);
+
+/* Given crc1 of a first block of data and crc2 of a second block of len2
+ * bytes, returns the CRC32C of both blocks concatenated. */
+uint32_t sg_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+/* Returns name of the implementation sg_crc32c() uses: "sse4.2", "armv8"
+ * or "table". */
+const char * sg_crc32c_impl(void);
+
 
 /* <<< Architectural support functions [is there a better place?] >>> */
 
@@ -54,6 +54,17 @@ struct sg_lib_value_name_t {
     const char * name;
 };
 
+/* Maps an operation code to the array of its service action names. If
+ * 'pdt_match' is -1 then applies to all peripheral device types, otherwise
+ * the decayed PDT (see sg_lib_pdt_decay()) must equal 'pdt_match'. */
+struct sg_lib_opcode_sa_t {
+    int op_code;
+    int pdt_match;
+    struct sg_lib_value_name_t * arr;
+    int num;            /* entries in 'arr', excluding terminator */
+    const char * prefix;        /* if non-NULL, prepended to SA name */
+};
+
 struct sg_lib_asc_ascq_t {
     unsigned char asc;          /* additional sense code */
     unsigned char ascq;         /* additional sense code qualifier */
@@ -90,8 +101,13 @@ extern struct sg_lib_value_name_t sg_lib_zoning_out_arr[];
 extern struct sg_lib_value_name_t sg_lib_zoning_in_arr[];
 extern struct sg_lib_value_name_t sg_lib_read_attr_arr[];
 extern struct sg_lib_value_name_t sg_lib_read_pos_arr[];
+extern const int sg_lib_normal_opcodes_num;  /* excluding terminator */
+extern struct sg_lib_opcode_sa_t sg_lib_opcode_sa_arr[];
+extern const int sg_lib_opcode_sa_num;       /* excluding terminator */
 extern struct sg_lib_asc_ascq_range_t sg_lib_asc_ascq_range[];
 extern struct sg_lib_asc_ascq_t sg_lib_asc_ascq[];
+extern const int sg_lib_asc_ascq_range_num;   /* excluding terminator */
+extern const int sg_lib_asc_ascq_num;         /* excluding terminator */
 extern const char * sg_lib_sense_key_desc[];
 extern const char * sg_lib_pdt_strs[];
 extern const char * sg_lib_transport_proto_strs[];
@@ -0,0 +1,22 @@
+#ifndef SG_LIB_THREAD_H
+#define SG_LIB_THREAD_H
+
+/*
+ * Copyright (c) 2016 Douglas Gilbert.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the BSD_LICENSE file.
+ */
+
+/* Internal to libsgutils2, not installed. */
+
+/* SG_LIB_THREAD_LOCAL is defined when the compiler offers thread local
+ * storage. Library state that each thread keeps for itself (warnings
+ * stream, object pool, io_uring engine, ...) is declared with it. Where
+ * it is not defined such state is either shared by all threads or the
+ * feature is not offered; each user says which. */
+#if defined(__GNUC__) || defined(__clang__)
+#define SG_LIB_THREAD_LOCAL __thread
+#endif
+
+#endif
@@ -2,13 +2,14 @@
 #define SG_PT_H
 
 /*
- * Copyright (c) 2005-2014 Douglas Gilbert.
+ * Copyright (c) 2005-2016 Douglas Gilbert.
  * All rights reserved.
  * Use of this source code is governed by a BSD-style
  * license that can be found in the BSD_LICENSE file.
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -51,6 +52,23 @@ struct sg_pt_base * construct_scsi_pt_obj(void);
  * used to issue more than one SCSI command. */
 void clear_scsi_pt_obj(struct sg_pt_base * objp);
 
+/* Following is a guard which is defined when acquire_scsi_pt_obj() and
+ * release_scsi_pt_obj() are present. */
+#define SCSI_PT_POOL_FUNCTIONS 1
+/* Like construct_scsi_pt_obj() but first tries to take a (cleared) object
+ * from a small per-thread cache that is filled by release_scsi_pt_obj().
+ * So in the steady state no heap allocation is needed. Returns NULL if
+ * out of memory. */
+struct sg_pt_base * acquire_scsi_pt_obj(void);
+
+/* Clears *objp and keeps it in the calling thread's cache for reuse by
+ * acquire_scsi_pt_obj(). If that cache is full then objp is destructed.
+ * objp may come from construct_scsi_pt_obj() or acquire_scsi_pt_obj().
+ * Where threads are pthreads the objects still cached when a thread exits
+ * (with pthread_exit() or by returning from its start routine) are
+ * destructed then; those of the main thread go when the process exits. */
+void release_scsi_pt_obj(struct sg_pt_base * objp);
+
 /* Set the CDB (command descriptor block) */
 void set_scsi_pt_cdb(struct sg_pt_base * objp, const unsigned char * cdb,
                      int cdb_len);
@@ -63,6 +81,27 @@ void set_scsi_pt_data_in(struct sg_pt_base * objp,   /* from device */
 /* Set a pointer and length to be used for data transferred to device */
 void set_scsi_pt_data_out(struct sg_pt_base * objp,    /* to device */
                           const unsigned char * dxferp, int dxfer_len);
+
+/* Following is a guard which is defined when set_scsi_pt_data_in_iov()
+ * and set_scsi_pt_data_out_iov() are present. */
+#define SCSI_PT_IOV_FUNCTIONS 1
+/* One element of a scatter gather list. Same layout as the POSIX struct
+ * iovec (and sg_iovec_t in the Linux sg driver). */
+struct sg_pt_iovec {
+    void * iov_base;
+    size_t iov_len;
+};
+/* Like set_scsi_pt_data_in() and set_scsi_pt_data_out() but the data is
+ * transferred to or from the iov_count buffers described by iovp. The
+ * array at iovp must stay valid until the command completes. In Linux
+ * the sg driver and bsg gather and scatter the buffers; elsewhere only
+ * iov_count of 1 is supported, more will cause do_scsi_pt() to return
+ * SCSI_PT_DO_BAD_PARAMS. */
+void set_scsi_pt_data_in_iov(struct sg_pt_base * objp,
+                             const struct sg_pt_iovec * iovp, int iov_count);
+void set_scsi_pt_data_out_iov(struct sg_pt_base * objp,
+                              const struct sg_pt_iovec * iovp,
+                              int iov_count);
 /* The following "set_"s implementations may be dummies */
 void set_scsi_pt_packet_id(struct sg_pt_base * objp, int pack_id);
 void set_scsi_pt_tag(struct sg_pt_base * objp, uint64_t tag);
@@ -93,6 +132,292 @@ void set_scsi_pt_flags(struct sg_pt_base * objp, int flags);
 int do_scsi_pt(struct sg_pt_base * objp, int fd, int timeout_secs,
                int verbose);
 
+/* Following is a guard which is defined when start_scsi_pt(),
+ * poll_scsi_pt(), reap_scsi_pt() and finish_scsi_pt() are present. Older
+ * versions of this library may not have these functions. */
+#define SCSI_PT_ASYNC_FUNCTIONS 1
+/* Submits the SCSI command held in *objp but does not wait for it to
+ * complete. Several commands, each with its own objp, may be outstanding
+ * on the same fd. The objp, and the buffers given to it, must stay valid
+ * until its response has been fetched by reap_scsi_pt() or
+ * finish_scsi_pt(). In Linux uses write() on sg (v3) and bsg (v4) device
+ * nodes; -EAGAIN is returned (on fds opened O_NONBLOCK) when the driver's
+ * queue is full. Other implementations execute the command before
+ * returning (so finish_scsi_pt() is not called; it would yield
+ * SCSI_PT_DO_BAD_PARAMS). Return values are the same as for do_scsi_pt(). */
+int start_scsi_pt(struct sg_pt_base * objp, int fd, int timeout_secs,
+                  int verbose);
+
+/* Waits up to wait_ms milliseconds (0 for no wait, negative to wait
+ * indefinitely) for a response to arrive on fd. Returns the number of
+ * responses ready to be fetched (1 if at least one but the count is not
+ * known), 0 if none, or a negated errno. */
+int poll_scsi_pt(int fd, int wait_ms, int verbose);
+
+/* Fetches the response of any command started on fd, waiting up to
+ * wait_ms milliseconds (as for poll_scsi_pt()). The response is placed in
+ * the object it was started with and, if objpp is non-NULL, the address
+ * of that object is written to *objpp. Returns 0 if okay, -EAGAIN if no
+ * response arrived in time, -EINVAL if the response fetched was not to a
+ * command started with start_scsi_pt() on fd (it is discarded), otherwise
+ * a negated errno. */
+int reap_scsi_pt(int fd, int wait_ms, struct sg_pt_base ** objpp,
+                 int verbose);
+
+/* Waits for the command started on objp to complete. Responses for other
+ * objects fetched meanwhile are placed in those objects (so a later
+ * finish_scsi_pt() on them returns at once). If SG_SET_FORCE_PACK_ID is
+ * active on a Linux sg fd, the value given to set_scsi_pt_packet_id()
+ * selects the response. Afterwards the get_scsi_pt_*() functions can be
+ * used on objp. Return values are the same as for do_scsi_pt(). */
+int finish_scsi_pt(struct sg_pt_base * objp, int fd, int verbose);
+
+/* Following is a guard which is defined when scsi_pt_uring_enable() and
+ * scsi_pt_uring_submit() are present. In Linux, when io_uring is
+ * available (kernel 5.6 or later), each thread can have start_scsi_pt()
+ * queue the write() of a sg v3 header, and the read() of a response, in
+ * a ring rather than doing system calls. Queued commands are passed to
+ * the kernel together when poll_scsi_pt(), reap_scsi_pt(),
+ * finish_scsi_pt() or scsi_pt_uring_submit() is called, or the ring is
+ * full. Emulated disks and bsg (v4) device nodes are not affected. When
+ * a queued write fails, reap_scsi_pt() returns the object (i.e. returns
+ * 0) and get_scsi_pt_os_err() yields the errno (e.g. EAGAIN when the sg
+ * driver's queue was full). */
+#define SCSI_PT_URING_FUNCTIONS 1
+/* Turns the io_uring engine of the calling thread on with room for up to
+ * num_cmds outstanding commands (beyond that start_scsi_pt() returns
+ * -EAGAIN), or off if num_cmds is 0. Should be called when this thread
+ * has no commands outstanding and turned off before the thread exits.
+ * Returns 0 if okay, -ENOSYS if io_uring is not available (write() and
+ * read() continue to be used), -EBUSY if commands are outstanding, else a
+ * negated errno. */
+int scsi_pt_uring_enable(int num_cmds, int verbose);
+/* Passes the commands queued by this thread to the kernel. Returns the
+ * number passed (0 if the engine is off), else a negated errno. */
+int scsi_pt_uring_submit(int verbose);
+
+/* Following is a guard which is defined when scsi_pt_mmap_buffer() and
+ * scsi_pt_mmap_release() are present. In Linux the sg driver can map its
+ * reserved buffer into the process so the data of a command need not be
+ * copied between kernel and user space ("mmap-ed IO"). Once a fd has a
+ * mapped buffer, any command on that fd whose data buffer (set by
+ * set_scsi_pt_data_in() or set_scsi_pt_data_out()) starts at the mapped
+ * address uses mmap-ed IO; other commands are not affected. The sg driver
+ * has one reserved buffer per fd so only one such command should be
+ * outstanding at a time. For an emulated disk a heap buffer is returned
+ * and used like any other. Elsewhere these functions yield -ENOSYS. These
+ * functions are not thread safe; call them before sharing fd. */
+#define SCSI_PT_MMAP_FUNCTIONS 1
+/* Sizes the reserved buffer of fd (a sg device) to at least len bytes
+ * (rounded up to a page size multiple) and maps it once; later calls on
+ * fd return that mapping unless a larger len is asked for. If fd was
+ * opened read-only the mapping is read-only (i.e. only usable for data
+ * in commands). On success
+ * places the buffer address in *bufpp and returns 0, else returns a
+ * negated errno (e.g. -ENOTTY when fd is not a sg device node). */
+int scsi_pt_mmap_buffer(int fd, int len, unsigned char ** bufpp,
+                        int verbose);
+/* Unmaps the buffer of fd, if any. scsi_pt_close_device() calls this. */
+void scsi_pt_mmap_release(int fd);
+
+/* Following is a guard which is defined when the *_scsi_pt_reactor() and
+ * scsi_pt_reactor_*() functions are present. A reactor lets one thread
+ * drive commands on many file descriptors: each fd is registered once
+ * (in Linux they share one epoll set) and each command is submitted with
+ * a callback. A reactor is not thread safe; use one per thread. */
+#define SCSI_PT_REACTOR_FUNCTIONS 1
+struct sg_pt_reactor;
+
+/* Called from scsi_pt_reactor_run() once the response to the command
+ * held in objp has been fetched from fd. If res is 0 then the
+ * get_scsi_pt_*() functions can be used on objp. Otherwise res is a
+ * negated errno: -EIO if fd reported an error or hangup, -ECANCELED if fd
+ * was removed from the reactor. The callback may submit more commands. */
+typedef void (*sg_pt_done_fn)(struct sg_pt_base * objp, int fd, int res,
+                              void * priv);
+
+/* Returns NULL if problem (e.g. out of memory). */
+struct sg_pt_reactor * construct_scsi_pt_reactor(int verbose);
+/* Outstanding commands are forgotten, their callbacks are not called. */
+void destruct_scsi_pt_reactor(struct sg_pt_reactor * rp);
+
+/* Registers fd (from scsi_pt_open_device() or scsi_pt_open_flags()). Fds
+ * that can not be polled (e.g. emulated disks) are checked on each
+ * scsi_pt_reactor_run(). Responses on a fd opened O_NONBLOCK are fetched
+ * with one read() each; on other fds the number waiting is asked for
+ * first. Returns 0 if okay, else a negated errno. */
+int scsi_pt_reactor_add_fd(struct sg_pt_reactor * rp, int fd);
+/* Unregisters fd. The callbacks of commands still outstanding on it are
+ * called with res of -ECANCELED. Returns 0 if okay, else -ENOENT. */
+int scsi_pt_reactor_del_fd(struct sg_pt_reactor * rp, int fd);
+
+/* Starts the command held in objp on fd (which must have been added) as
+ * start_scsi_pt() does. When that returns 0 then done_fn (may be NULL)
+ * will be called with priv, from a later scsi_pt_reactor_run(). Returns
+ * the value from start_scsi_pt() (e.g. -EAGAIN when the driver's queue is
+ * full: run the reactor and try again) or a negated errno. */
+int scsi_pt_reactor_submit(struct sg_pt_reactor * rp,
+                           struct sg_pt_base * objp, int fd,
+                           int timeout_secs, sg_pt_done_fn done_fn,
+                           void * priv);
+
+/* Returns the number of submitted commands whose callbacks have not yet
+ * been called. */
+int scsi_pt_reactor_outstanding(const struct sg_pt_reactor * rp);
+
+/* Waits up to wait_ms milliseconds (0 for no wait, negative to wait
+ * indefinitely) for responses on any registered fd, fetches all those
+ * that are ready and calls their callbacks. Returns the number of
+ * callbacks made (0 at once if nothing is outstanding), else a negated
+ * errno (e.g. -EINTR). */
+int scsi_pt_reactor_run(struct sg_pt_reactor * rp, int wait_ms);
+
+/* Following is a guard which is defined when the scsi_pt_lat_*() functions
+ * are present. When enabled, the time taken by each command sent with
+ * do_scsi_pt(), or from start_scsi_pt() until its response is fetched, is
+ * measured in nanoseconds using a monotonic clock. Each sample goes into a
+ * histogram kept per thread and per opcode (cdb[0]); commands without a
+ * cdb (task management functions) have their own, SCSI_PT_LAT_NO_CDB.
+ * The histograms of all threads can be merged. The histogram is
+ * log-linear: each power of 2 range is split into SCSI_PT_LAT_SUB_BUCKETS
+ * equal sub-ranges, so reported values are within 1/16 (6.25%). Currently
+ * only the Linux implementation takes samples automatically. */
+#define SCSI_PT_LAT_FUNCTIONS 1
+#define SCSI_PT_LAT_NO_CDB 256          /* opcode value for no cdb */
+#define SCSI_PT_LAT_SUB_BITS 4
+#define SCSI_PT_LAT_SUB_BUCKETS (1 << SCSI_PT_LAT_SUB_BITS)
+#define SCSI_PT_LAT_MAX_BITS 40         /* 2**40 ns is about 18 minutes */
+#define SCSI_PT_LAT_NUM_BUCKETS \
+        ((SCSI_PT_LAT_MAX_BITS - SCSI_PT_LAT_SUB_BITS + 1) * \
+         SCSI_PT_LAT_SUB_BUCKETS)
+
+struct sg_pt_lat_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t bucket[SCSI_PT_LAT_NUM_BUCKETS];
+};
+
+/* Turns latency sampling on (enable != 0) or off for all threads. Default
+ * is off. */
+void scsi_pt_lat_enable(int enable);
+/* Returns 1 if latency sampling is enabled, else 0 */
+int scsi_pt_lat_enabled(void);
+
+/* Returns the value of a monotonic clock in nanoseconds, or 0 if that is
+ * not available. For callers that time their own commands. */
+uint64_t scsi_pt_lat_now_ns(void);
+
+/* Adds a sample of 'nanosecs' to the calling thread's histogram for
+ * opcode (0 to 255, or SCSI_PT_LAT_NO_CDB). Other values are ignored.
+ * Samples are accepted even when not enabled. */
+void scsi_pt_lat_record(int opcode, uint64_t nanosecs);
+
+/* Copies the calling thread's histogram for opcode into *hp. If opcode is
+ * -1 then the histograms of all opcodes are merged into *hp. Returns the
+ * number of samples copied. */
+uint64_t scsi_pt_lat_snapshot(int opcode, struct sg_pt_lat_hist * hp);
+
+/* Like scsi_pt_lat_snapshot() but merges the histograms of every thread
+ * that has taken a sample, including threads that have since exited. A
+ * thread still taking samples may have some counted and others not. */
+uint64_t scsi_pt_lat_snapshot_all(int opcode, struct sg_pt_lat_hist * hp);
+
+/* Clears all of the calling thread's histograms */
+void scsi_pt_lat_reset(void);
+
+/* Adds the samples in *src to *dst. Useful for combining snapshots taken
+ * by several threads. dst may be zeroed beforehand. */
+void scsi_pt_lat_merge(struct sg_pt_lat_hist * dst,
+                       const struct sg_pt_lat_hist * src);
+
+/* Returns the (upper bound of the) value, in nanoseconds, below which
+ * 'percent' of the samples in *hp fall (e.g. 99.9 for p99.9). Returns 0
+ * if *hp has no samples. */
+uint64_t scsi_pt_lat_percentile(const struct sg_pt_lat_hist * hp,
+                                double percent);
+
+/* Summarizes *hp as a single line, starting with leadin (if non-NULL),
+ * holding the count, p50, p99, p99.9 and maximum latencies in
+ * microseconds. Returns number of characters written to b (excluding the
+ * trailing null). */
+int scsi_pt_lat_str(const struct sg_pt_lat_hist * hp, const char * leadin,
+                    int b_len, char * b);
+
+/* Following is a guard which is defined when the scsi_pt_trace_*()
+ * functions are present. When enabled, a fixed size record of each command
+ * (sent as for the latency histograms above) is placed in a ring buffer
+ * owned by the calling thread. Only that thread writes to its ring so no
+ * locks are needed; when full the oldest records are overwritten. A ring
+ * is flushed to a compact binary file with scsi_pt_trace_flush(). Records
+ * are in host byte order. */
+#define SCSI_PT_TRACE_FUNCTIONS 1
+
+#define SCSI_PT_TRACE_DIR_NONE 0
+#define SCSI_PT_TRACE_DIR_IN 1          /* data from device */
+#define SCSI_PT_TRACE_DIR_OUT 2         /* data to device */
+#define SCSI_PT_TRACE_DIR_BIDI 3
+
+struct sg_pt_trace_rec {
+    uint64_t start_ns;  /* monotonic clock when command was submitted */
+    uint64_t end_ns;    /* ... when its response was received */
+    uint32_t seq;       /* per thread sequence number, starts at 0 */
+    uint32_t xfer_len;  /* requested data transfer length (bytes) */
+    int32_t resid;      /* residual count of that transfer */
+    int32_t os_err;     /* errno from pass-through, else 0 */
+    uint8_t dir;        /* SCSI_PT_TRACE_DIR_* */
+    uint8_t result_cat; /* SCSI_PT_RESULT_* */
+    uint8_t status;     /* SCSI status */
+    uint8_t sense_key;  /* sense key, asc and ascq are 0 if no sense data */
+    uint8_t asc;
+    uint8_t ascq;
+    uint8_t cdb_len;    /* length of cdb, may exceed 16 */
+    uint8_t reserved;
+    uint8_t cdb[16];    /* (start of) cdb */
+};
+
+#define SCSI_PT_TRACE_MAGIC "SGPTTRC1"
+
+/* Each flush writes this header followed by num_recs records */
+struct sg_pt_trace_hdr {
+    char magic[8];      /* SCSI_PT_TRACE_MAGIC (not null terminated) */
+    uint32_t rec_size;  /* sizeof(struct sg_pt_trace_rec) */
+    uint32_t num_recs;
+    uint64_t ring_id;   /* identifies the thread that owned the ring */
+    uint64_t dropped;   /* records overwritten since previous flush */
+};
+
+/* Turns tracing on with rings holding (at least) num_recs records for
+ * each thread. When num_recs is 0 tracing is turned off. */
+void scsi_pt_trace_enable(int num_recs);
+/* Returns 1 if tracing is enabled, else 0 */
+int scsi_pt_trace_enabled(void);
+
+/* Places a copy of *rp in the calling thread's ring (setting its seq
+ * field). For callers that issue their own commands. Ignored if tracing
+ * is not enabled. */
+void scsi_pt_trace_record(const struct sg_pt_trace_rec * rp);
+
+/* Writes the records held in the calling thread's ring, oldest first, to
+ * fd (after a header) then empties that ring. Returns the number of
+ * records written or a negated errno. */
+int scsi_pt_trace_flush(int fd);
+
+/* Like scsi_pt_trace_flush() but for the rings of every thread, including
+ * threads that have exited, one header per ring. Rings are not locked, so
+ * only call this while no other thread is sending commands (e.g. after
+ * worker threads have been joined). */
+int scsi_pt_trace_flush_all(int fd);
+
+/* Decodes one record into a single line in b (e.g. command name, status
+ * and, if present, sense key with additional sense). When verbose > 0 the
+ * cdb is added in hex and when verbose > 1 the decoded sense data follows
+ * on extra lines. Returns number of characters written to b (excluding
+ * the trailing null). */
+int scsi_pt_trace_rec_str(const struct sg_pt_trace_rec * rp, int verbose,
+                          int b_len, char * b);
+
 #define SCSI_PT_RESULT_GOOD 0
 #define SCSI_PT_RESULT_STATUS 1 /* other than GOOD and CHECK CONDITION */
 #define SCSI_PT_RESULT_SENSE 2
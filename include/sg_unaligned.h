@@ -170,6 +170,73 @@ static inline void sg_nz_put_unaligned_be64(uint64_t val, void *p)
             __put_unaligned_be64(val, (uint8_t *)p);
 }
 
+/* Bulk (array) variants of the above for decoding and building lists of
+ * fixed length descriptors (e.g. LBA status, zone and UNMAP block
+ * descriptors). The "get" variants fetch one big endian field from each of
+ * 'num' descriptors: 'p' points to that field in the first descriptor and
+ * 'stride' is the descriptor length in bytes; host order values are placed
+ * in 'arr'. The "put" variants do the reverse. The loops are simple enough
+ * that compilers can unroll and vectorize them (byte swaps and shuffles)
+ * when 'stride' is a constant. */
+static inline void sg_get_unaligned_be16_arr(const void *p, int stride,
+                                             int num, uint16_t *arr)
+{
+        const uint8_t *xp = (const uint8_t *)p;
+        int k;
+
+        for (k = 0; k < num; ++k, xp += stride)
+                arr[k] = __get_unaligned_be16(xp);
+}
+
+static inline void sg_get_unaligned_be32_arr(const void *p, int stride,
+                                             int num, uint32_t *arr)
+{
+        const uint8_t *xp = (const uint8_t *)p;
+        int k;
+
+        for (k = 0; k < num; ++k, xp += stride)
+                arr[k] = __get_unaligned_be32(xp);
+}
+
+static inline void sg_get_unaligned_be64_arr(const void *p, int stride,
+                                             int num, uint64_t *arr)
+{
+        const uint8_t *xp = (const uint8_t *)p;
+        int k;
+
+        for (k = 0; k < num; ++k, xp += stride)
+                arr[k] = __get_unaligned_be64(xp);
+}
+
+static inline void sg_put_unaligned_be16_arr(const uint16_t *arr, int num,
+                                             void *p, int stride)
+{
+        uint8_t *xp = (uint8_t *)p;
+        int k;
+
+        for (k = 0; k < num; ++k, xp += stride)
+                __put_unaligned_be16(arr[k], xp);
+}
+
+static inline void sg_put_unaligned_be32_arr(const uint32_t *arr, int num,
+                                             void *p, int stride)
+{
+        uint8_t *xp = (uint8_t *)p;
+        int k;
+
+        for (k = 0; k < num; ++k, xp += stride)
+                __put_unaligned_be32(arr[k], xp);
+}
+
+static inline void sg_put_unaligned_be64_arr(const uint64_t *arr, int num,
+                                             void *p, int stride)
+{
+        uint8_t *xp = (uint8_t *)p;
+        int k;
+
+        for (k = 0; k < num; ++k, xp += stride)
+                __put_unaligned_be64(arr[k], xp);
+}
 
 /* Below are the little endian equivalents of the big endian functions
  * above. Little endian is used by ATA, networking and PCI.
@@ -35,7 +35,7 @@
 #endif
 
 
-static const char * const version_str = "1.74 20160528";
+static const char * const version_str = "1.76 20160707";
 
 
 #define SENSE_BUFF_LEN 64       /* Arbitrary, could be larger */
@@ -78,7 +78,7 @@ pr2ws(const char * fmt, ...)
     int n;
 
     va_start(args, fmt);
-    n = vfprintf(sg_warnings_strm ? sg_warnings_strm : stderr, fmt, args);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
     va_end(args);
     return n;
 }
@@ -313,25 +313,45 @@ sg_cmds_process_resp(struct sg_pt_base * ptvp, const char * leadin,
 static struct sg_pt_base *
 create_pt_obj(const char * cname)
 {
-    struct sg_pt_base * ptvp = construct_scsi_pt_obj();
+    struct sg_pt_base * ptvp = acquire_scsi_pt_obj();
     if (NULL == ptvp)
         pr2ws("%s: out of memory\n", cname);
     return ptvp;
 }
 
 static const char * const inquiry_s = "inquiry";
+static const char * const tur_s = "test unit ready";
+static const char * const rq_s = "request sense";
 
 /* Invokes a SCSI INQUIRY command and yields the response. Returns 0 when
  * successful, various SG_LIB_CAT_* positive values or -1 -> other errors */
 int
 sg_ll_inquiry(int sg_fd, int cmddt, int evpd, int pg_op, void * resp,
               int mx_resp_len, int noisy, int verbose)
+{
+    int ret;
+    struct sg_pt_base * ptvp;
+
+    if (NULL == (ptvp = create_pt_obj(inquiry_s)))
+        return -1;
+    ret = sg_ll_inquiry_pt(ptvp, sg_fd, cmddt, evpd, pg_op, resp,
+                           mx_resp_len, noisy, verbose);
+    release_scsi_pt_obj(ptvp);
+    return ret;
+}
+
+/* As sg_ll_inquiry() but uses the caller's object which is cleared
+ * before use. Returns 0 when successful, various SG_LIB_CAT_* positive
+ * values or -1 -> other errors */
+int
+sg_ll_inquiry_pt(struct sg_pt_base * ptvp, int sg_fd, int cmddt, int evpd,
+                 int pg_op, void * resp, int mx_resp_len, int noisy,
+                 int verbose)
 {
     int res, ret, k, sense_cat, resid;
     unsigned char inq_cdb[INQUIRY_CMDLEN] = {INQUIRY_CMD, 0, 0, 0, 0, 0};
     unsigned char sense_b[SENSE_BUFF_LEN];
     unsigned char * up;
-    struct sg_pt_base * ptvp;
 
     if (cmddt)
         inq_cdb[1] |= 2;
@@ -352,8 +372,7 @@ sg_ll_inquiry(int sg_fd, int cmddt, int evpd, int pg_op, void * resp,
         if (mx_resp_len > 4)
             up[4] = 0;
     }
-    if (NULL == (ptvp = create_pt_obj(inquiry_s)))
-        return -1;
+    clear_scsi_pt_obj(ptvp);
     set_scsi_pt_cdb(ptvp, inq_cdb, sizeof(inq_cdb));
     set_scsi_pt_sense(ptvp, sense_b, sizeof(sense_b));
     set_scsi_pt_data_in(ptvp, (unsigned char *)resp, mx_resp_len);
@@ -361,7 +380,6 @@ sg_ll_inquiry(int sg_fd, int cmddt, int evpd, int pg_op, void * resp,
     ret = sg_cmds_process_resp(ptvp, inquiry_s, res, mx_resp_len, sense_b,
                                noisy, verbose, &sense_cat);
     resid = get_scsi_pt_resid(ptvp);
-    destruct_scsi_pt_obj(ptvp);
     if (-1 == ret)
         ;
     else if (-2 == ret) {
@@ -460,7 +478,7 @@ sg_simple_inquiry(int sg_fd, struct sg_simple_inquiry_resp * inq_data,
         memcpy(inq_data->product, inq_resp + 16, 16);
         memcpy(inq_data->revision, inq_resp + 32, 4);
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -474,11 +492,28 @@ int
 sg_ll_test_unit_ready_progress(int sg_fd, int pack_id, int * progress,
                                int noisy, int verbose)
 {
-    static const char * const tur_s = "test unit ready";
+    int ret;
+    struct sg_pt_base * ptvp;
+
+    if (NULL == ((ptvp = create_pt_obj(tur_s))))
+        return -1;
+    ret = sg_ll_test_unit_ready_progress_pt(ptvp, sg_fd, pack_id, progress,
+                                            noisy, verbose);
+    release_scsi_pt_obj(ptvp);
+    return ret;
+}
+
+/* As sg_ll_test_unit_ready_progress() but uses the caller's object which
+ * is cleared before use. Returns 0 when successful, various SG_LIB_CAT_*
+ * positive values or -1 -> other errors */
+int
+sg_ll_test_unit_ready_progress_pt(struct sg_pt_base * ptvp, int sg_fd,
+                                  int pack_id, int * progress, int noisy,
+                                  int verbose)
+{
     int res, ret, k, sense_cat;
     unsigned char tur_cdb[TUR_CMDLEN] = {TUR_CMD, 0, 0, 0, 0, 0};
     unsigned char sense_b[SENSE_BUFF_LEN];
-    struct sg_pt_base * ptvp;
 
     if (verbose) {
         pr2ws("    %s cdb: ", tur_s);
@@ -487,8 +522,7 @@ sg_ll_test_unit_ready_progress(int sg_fd, int pack_id, int * progress,
         pr2ws("\n");
     }
 
-    if (NULL == ((ptvp = create_pt_obj(tur_s))))
-        return -1;
+    clear_scsi_pt_obj(ptvp);
     set_scsi_pt_cdb(ptvp, tur_cdb, sizeof(tur_cdb));
     set_scsi_pt_sense(ptvp, sense_b, sizeof(sense_b));
     set_scsi_pt_packet_id(ptvp, pack_id);
@@ -515,8 +549,6 @@ sg_ll_test_unit_ready_progress(int sg_fd, int pack_id, int * progress,
         }
     } else
         ret = 0;
-
-    destruct_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -531,18 +563,44 @@ sg_ll_test_unit_ready(int sg_fd, int pack_id, int noisy, int verbose)
                                           verbose);
 }
 
+/* As sg_ll_test_unit_ready() but uses the caller's object which is
+ * cleared before use. */
+int
+sg_ll_test_unit_ready_pt(struct sg_pt_base * ptvp, int sg_fd, int pack_id,
+                         int noisy, int verbose)
+{
+    return sg_ll_test_unit_ready_progress_pt(ptvp, sg_fd, pack_id, NULL,
+                                             noisy, verbose);
+}
+
 /* Invokes a SCSI REQUEST SENSE command. Returns 0 when successful, various
  * SG_LIB_CAT_* positive values or -1 -> other errors */
 int
 sg_ll_request_sense(int sg_fd, int desc, void * resp, int mx_resp_len,
                     int noisy, int verbose)
 {
-    static const char * const rq_s = "request sense";
+    int ret;
+    struct sg_pt_base * ptvp;
+
+    if (NULL == ((ptvp = create_pt_obj(rq_s))))
+        return -1;
+    ret = sg_ll_request_sense_pt(ptvp, sg_fd, desc, resp, mx_resp_len,
+                                 noisy, verbose);
+    release_scsi_pt_obj(ptvp);
+    return ret;
+}
+
+/* As sg_ll_request_sense() but uses the caller's object which is cleared
+ * before use. Returns 0 when successful, various SG_LIB_CAT_* positive
+ * values or -1 -> other errors */
+int
+sg_ll_request_sense_pt(struct sg_pt_base * ptvp, int sg_fd, int desc,
+                       void * resp, int mx_resp_len, int noisy, int verbose)
+{
     int k, ret, res, sense_cat;
     unsigned char rs_cdb[REQUEST_SENSE_CMDLEN] =
         {REQUEST_SENSE_CMD, 0, 0, 0, 0, 0};
     unsigned char sense_b[SENSE_BUFF_LEN];
-    struct sg_pt_base * ptvp;
 
     if (desc)
         rs_cdb[1] |= 0x1;
@@ -558,8 +616,7 @@ sg_ll_request_sense(int sg_fd, int desc, void * resp, int mx_resp_len,
         pr2ws("\n");
     }
 
-    if (NULL == ((ptvp = create_pt_obj(rq_s))))
-        return -1;
+    clear_scsi_pt_obj(ptvp);
     set_scsi_pt_cdb(ptvp, rs_cdb, sizeof(rs_cdb));
     set_scsi_pt_sense(ptvp, sense_b, sizeof(sense_b));
     set_scsi_pt_data_in(ptvp, (unsigned char *)resp, mx_resp_len);
@@ -587,7 +644,6 @@ sg_ll_request_sense(int sg_fd, int desc, void * resp, int mx_resp_len,
         } else
             ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -635,6 +691,6 @@ sg_ll_report_luns(int sg_fd, int select_report, void * resp, int mx_resp_len,
         }
     } else
         ret = 0;
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
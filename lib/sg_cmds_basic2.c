@@ -19,8 +19,11 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "sg_lib.h"
 #include "sg_cmds_basic.h"
+#include "sg_cmds_extra.h"
 #include "sg_pt.h"
 #include "sg_unaligned.h"
 
@@ -60,6 +63,8 @@
 #define START_STOP_CMDLEN       6
 #define PREVENT_ALLOW_CMD    0x1e
 #define PREVENT_ALLOW_CMDLEN   6
+#define INQUIRY_CMD     0x12
+#define RECEIVE_DIAGNOSTICS_CMD   0x1c
 
 #define MODE6_RESP_HDR_LEN 4
 #define MODE10_RESP_HDR_LEN 8
@@ -67,6 +72,15 @@
 
 #define INQUIRY_RESP_INITIAL_LEN 36
 
+/* For the *_fetch() functions. VPD pages are first asked for with an
+ * allocation length below 256 as some older devices reject larger ones. */
+#define PAGE_LEN_CACHE_SZ 64
+#define PAGE_FETCH_VPD_LEN 252
+#define PAGE_FETCH_DEF_LEN 4096
+
+/* The page length cache (page_len_cache[] below) is shared by all threads
+ * of the process and guarded by the page_len_lock spin lock. */
+
 
 #if defined(__GNUC__) || defined(__clang__)
 static int pr2ws(const char * fmt, ...)
@@ -83,7 +97,7 @@ pr2ws(const char * fmt, ...)
     int n;
 
     va_start(args, fmt);
-    n = vfprintf(sg_warnings_strm ? sg_warnings_strm : stderr, fmt, args);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
     va_end(args);
     return n;
 }
@@ -91,7 +105,7 @@ pr2ws(const char * fmt, ...)
 static struct sg_pt_base *
 create_pt_obj(const char * cname)
 {
-    struct sg_pt_base * ptvp = construct_scsi_pt_obj();
+    struct sg_pt_base * ptvp = acquire_scsi_pt_obj();
     if (NULL == ptvp)
         pr2ws("%s: out of memory\n", cname);
     return ptvp;
@@ -151,7 +165,7 @@ sg_ll_sync_cache_10(int sg_fd, int sync_nv, int immed, int group,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -204,7 +218,7 @@ sg_ll_readcap_16(int sg_fd, int pmi, uint64_t llba, void * resp,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -254,7 +268,7 @@ sg_ll_readcap_10(int sg_fd, int pmi, unsigned int lba, void * resp,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -294,7 +308,7 @@ sg_ll_mode_sense6(int sg_fd, int dbd, int pc, int pg_code, int sub_pg_code,
     ret = sg_cmds_process_resp(ptvp, cdb_name_s, res, mx_resp_len, sense_b,
                                noisy, verbose, &sense_cat);
     resid = get_scsi_pt_resid(ptvp);
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     if (-1 == ret)
         ;
     else if (-2 == ret) {
@@ -370,7 +384,7 @@ sg_ll_mode_sense10(int sg_fd, int llbaa, int dbd, int pc, int pg_code,
     ret = sg_cmds_process_resp(ptvp, cdb_name_s, res, mx_resp_len, sense_b,
                                noisy, verbose, &sense_cat);
     resid = get_scsi_pt_resid(ptvp);
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     if (-1 == ret)
         ;
     else if (-2 == ret) {
@@ -462,7 +476,7 @@ sg_ll_mode_select6(int sg_fd, int pf, int sp, void * paramp, int param_len,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -519,7 +533,7 @@ sg_ll_mode_select10(int sg_fd, int pf, int sp, void * paramp, int param_len,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -687,13 +701,33 @@ int
 sg_ll_log_sense(int sg_fd, int ppc, int sp, int pc, int pg_code,
                 int subpg_code, int paramp, unsigned char * resp,
                 int mx_resp_len, int noisy, int verbose)
+{
+    static const char * const cdb_name_s = "log sense";
+    int ret;
+    struct sg_pt_base * ptvp;
+
+    if (NULL == ((ptvp = create_pt_obj(cdb_name_s))))
+        return -1;
+    ret = sg_ll_log_sense_pt(ptvp, sg_fd, ppc, sp, pc, pg_code, subpg_code,
+                             paramp, resp, mx_resp_len, noisy, verbose);
+    release_scsi_pt_obj(ptvp);
+    return ret;
+}
+
+/* As sg_ll_log_sense() but uses the caller's object which is cleared
+ * before use. Return of 0 -> success, various SG_LIB_CAT_* positive values
+ * or -1 -> other errors */
+int
+sg_ll_log_sense_pt(struct sg_pt_base * ptvp, int sg_fd, int ppc, int sp,
+                   int pc, int pg_code, int subpg_code, int paramp,
+                   unsigned char * resp, int mx_resp_len, int noisy,
+                   int verbose)
 {
     static const char * const cdb_name_s = "log sense";
     int res, ret, k, sense_cat, resid;
     unsigned char logs_cdb[LOG_SENSE_CMDLEN] =
         {LOG_SENSE_CMD, 0, 0, 0, 0, 0, 0, 0, 0, 0};
     unsigned char sense_b[SENSE_BUFF_LEN];
-    struct sg_pt_base * ptvp;
 
     if (mx_resp_len > 0xffff) {
         pr2ws("mx_resp_len too big\n");
@@ -711,8 +745,7 @@ sg_ll_log_sense(int sg_fd, int ppc, int sp, int pc, int pg_code,
         pr2ws("\n");
     }
 
-    if (NULL == ((ptvp = create_pt_obj(cdb_name_s))))
-        return -1;
+    clear_scsi_pt_obj(ptvp);
     set_scsi_pt_cdb(ptvp, logs_cdb, sizeof(logs_cdb));
     set_scsi_pt_sense(ptvp, sense_b, sizeof(sense_b));
     set_scsi_pt_data_in(ptvp, resp, mx_resp_len);
@@ -720,7 +753,6 @@ sg_ll_log_sense(int sg_fd, int ppc, int sp, int pc, int pg_code,
     ret = sg_cmds_process_resp(ptvp, cdb_name_s, res, mx_resp_len,
                                sense_b, noisy, verbose, &sense_cat);
     resid = get_scsi_pt_resid(ptvp);
-    destruct_scsi_pt_obj(ptvp);
     if (-1 == ret)
         ;
     else if (-2 == ret) {
@@ -810,7 +842,7 @@ sg_ll_log_select(int sg_fd, int pcr, int sp, int pc, int pg_code,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -865,7 +897,7 @@ sg_ll_start_stop_unit(int sg_fd, int immed, int pc_mod__fl_num,
         }
     } else
             ret = 0;
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -917,6 +949,326 @@ sg_ll_prevent_allow(int sg_fd, int prevent, int noisy, int verbose)
         }
     } else
             ret = 0;
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
+
+/* Identifies a device (rather than the file descriptor open on it) for
+ * the page length cache */
+struct page_dev_id {
+    uint64_t a;
+    uint64_t b;
+};
+
+struct page_len_ent {
+    struct page_dev_id dev;
+    uint32_t key;       /* opcode << 16 | pg_code << 8 | subpg_code */
+    int len;            /* 0 -> unused entry */
+};
+
+/* One cache for the whole process, so a length seen by one thread saves
+ * the others a second command. Entries are only touched while holding
+ * page_len_lock, a spin lock since each hold is a short scan of the
+ * cache. Without the GNU atomic builtins there is no lock and the cache
+ * is not safe for concurrent use. */
+static struct page_len_ent page_len_cache[PAGE_LEN_CACHE_SZ];
+static int page_len_next;
+static int page_len_lock;
+
+static void
+page_len_cache_lock(void)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    while (__atomic_exchange_n(&page_len_lock, 1, __ATOMIC_ACQUIRE))
+        ;
+#endif
+}
+
+static void
+page_len_cache_unlock(void)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(&page_len_lock, 0, __ATOMIC_RELEASE);
+#else
+    page_len_lock = 0;
+#endif
+}
+
+/* Device nodes are identified by their type and device number so all
+ * nodes of a device share entries; other files (e.g. emulated disks) by
+ * their file system device and inode. */
+static void
+page_dev_id_get(int sg_fd, struct page_dev_id * idp)
+{
+#ifndef SG_LIB_WIN32
+    struct stat a_stat;
+
+    if (0 == fstat(sg_fd, &a_stat)) {
+        if (S_ISCHR(a_stat.st_mode) || S_ISBLK(a_stat.st_mode)) {
+            idp->a = (uint64_t)a_stat.st_rdev;
+            idp->b = S_ISCHR(a_stat.st_mode) ? 1 : 2;
+        } else {
+            idp->a = (uint64_t)a_stat.st_dev;
+            idp->b = ((uint64_t)a_stat.st_ino << 2) | 3;
+        }
+        return;
+    }
+#endif
+    idp->a = (uint64_t)sg_fd;
+    idp->b = 0;
+}
+
+/* Caller holds page_len_lock */
+static struct page_len_ent *
+page_len_find(const struct page_dev_id * idp, uint32_t key)
+{
+    int k;
+    struct page_len_ent * ep;
+
+    for (k = 0, ep = page_len_cache; k < PAGE_LEN_CACHE_SZ; ++k, ++ep) {
+        if (ep->len && (key == ep->key) && (idp->a == ep->dev.a) &&
+            (idp->b == ep->dev.b))
+            return ep;
+    }
+    return NULL;
+}
+
+/* Returns remembered length for key on device, or 0 if none */
+static int
+page_len_get(const struct page_dev_id * idp, uint32_t key)
+{
+    int len;
+    struct page_len_ent * ep;
+
+    page_len_cache_lock();
+    ep = page_len_find(idp, key);
+    len = ep ? ep->len : 0;
+    page_len_cache_unlock();
+    return len;
+}
+
+static void
+page_len_put(const struct page_dev_id * idp, uint32_t key, int len)
+{
+    struct page_len_ent * ep;
+
+    page_len_cache_lock();
+    ep = page_len_find(idp, key);
+    if (NULL == ep) {   /* replace entries in round robin order */
+        ep = page_len_cache + page_len_next;
+        page_len_next = (page_len_next + 1) % PAGE_LEN_CACHE_SZ;
+        ep->dev = *idp;
+        ep->key = key;
+    }
+    ep->len = len;
+    page_len_cache_unlock();
+}
+
+void
+sg_page_len_cache_clear(int sg_fd)
+{
+    int k;
+    struct page_dev_id id;
+
+    if (sg_fd >= 0)
+        page_dev_id_get(sg_fd, &id);
+    page_len_cache_lock();
+    if (sg_fd < 0) {
+        memset(page_len_cache, 0, sizeof(page_len_cache));
+        page_len_next = 0;
+    } else {
+        for (k = 0; k < PAGE_LEN_CACHE_SZ; ++k) {
+            if ((id.a == page_len_cache[k].dev.a) &&
+                (id.b == page_len_cache[k].dev.b))
+                page_len_cache[k].len = 0;
+        }
+    }
+    page_len_cache_unlock();
+}
+
+/* Describes the command sent by a *_fetch() function */
+struct page_fetch_t {
+    int opcode;
+    int pg_code;
+    int subpg_code;
+    int ppc;            /* ppc, sp, pc and paramp for LOG SENSE */
+    int sp;
+    int pc;
+    int paramp;
+    int pcv;            /* for RECEIVE DIAGNOSTIC RESULTS */
+    int def_len;        /* allocation length when no length remembered */
+};
+
+/* Sends the command described by pfp with allocation length alloc_len.
+ * Places the number of bytes received in *rcvp. */
+static int
+page_fetch_issue(struct sg_pt_base * ptvp, int sg_fd,
+                 const struct page_fetch_t * pfp, unsigned char * resp,
+                 int alloc_len, int * rcvp, int noisy, int verbose)
+{
+    int ret;
+
+    switch (pfp->opcode) {
+    case INQUIRY_CMD:
+        ret = sg_ll_inquiry_pt(ptvp, sg_fd, 0, 1, pfp->pg_code, resp,
+                               alloc_len, noisy, verbose);
+        break;
+    case LOG_SENSE_CMD:
+        ret = sg_ll_log_sense_pt(ptvp, sg_fd, pfp->ppc, pfp->sp, pfp->pc,
+                                 pfp->pg_code, pfp->subpg_code, pfp->paramp,
+                                 resp, alloc_len, noisy, verbose);
+        break;
+    case RECEIVE_DIAGNOSTICS_CMD:
+        ret = sg_ll_receive_diag_pt(ptvp, sg_fd, pfp->pcv, pfp->pg_code,
+                                    resp, alloc_len, noisy, verbose);
+        break;
+    default:
+        return -1;
+    }
+    if (0 == ret) {
+        *rcvp = alloc_len - get_scsi_pt_resid(ptvp);
+        if ((*rcvp < 0) || (*rcvp > alloc_len))
+            *rcvp = alloc_len;
+    }
+    return ret;
+}
+
+/* Returns 1 if resp holds the page (and subpage) asked for, else 0 */
+static int
+page_fetch_match(const struct page_fetch_t * pfp, const unsigned char * resp)
+{
+    switch (pfp->opcode) {
+    case INQUIRY_CMD:
+        return (pfp->pg_code == resp[1]);
+    case LOG_SENSE_CMD:
+        if (pfp->pg_code != (0x3f & resp[0]))
+            return 0;
+        /* SPF bit set when a subpage is returned */
+        return (0x40 & resp[0]) ? (pfp->subpg_code == resp[1]) :
+                                  (0 == pfp->subpg_code);
+    default:
+        return (pfp->pg_code == resp[0]);
+    }
+}
+
+/* Common code of the *_fetch() functions */
+static int
+page_fetch(int sg_fd, const struct page_fetch_t * pfp, unsigned char * resp,
+           int mx_resp_len, int * resp_lenp, int noisy, int verbose)
+{
+    static const char * const cdb_name_s = "page fetch";
+    int ret, alloc_len, rcv, page_len, rem_len;
+    uint32_t key;
+    struct page_dev_id id;
+    struct sg_pt_base * ptvp;
+
+    if (mx_resp_len > 0xffff)
+        mx_resp_len = 0xffff;
+    if (mx_resp_len < 4) {
+        pr2ws("%s: mx_resp_len too small\n", cdb_name_s);
+        return -1;
+    }
+    key = ((pfp->opcode & 0xff) << 16) | ((pfp->pg_code & 0xff) << 8) |
+          (pfp->subpg_code & 0xff);
+    page_dev_id_get(sg_fd, &id);
+    rem_len = page_len_get(&id, key);
+    alloc_len = rem_len ? rem_len : pfp->def_len;
+    if (alloc_len > mx_resp_len)
+        alloc_len = mx_resp_len;
+    if (verbose > 2)
+        pr2ws("    %s: %s allocation length %d\n", cdb_name_s,
+              (rem_len ? "remembered" : "default"), alloc_len);
+
+    if (NULL == ((ptvp = create_pt_obj(cdb_name_s))))
+        return -1;
+    rcv = 0;
+    ret = page_fetch_issue(ptvp, sg_fd, pfp, resp, alloc_len, &rcv, noisy,
+                           verbose);
+    if (ret)
+        goto fini;
+    if (rcv < 4) {
+        page_len = rcv;
+        goto fini;
+    }
+    page_len = sg_get_unaligned_be16(resp + 2) + 4;
+    if (! page_fetch_match(pfp, resp))
+        goto fini;      /* leave the caller to complain */
+    if ((page_len > alloc_len) && (alloc_len < mx_resp_len)) {
+        /* truncated, so ask again for all of it (some HBAs don't like
+         * odd transfer lengths) */
+        alloc_len = page_len + (page_len % 2);
+        if (alloc_len > mx_resp_len)
+            alloc_len = mx_resp_len;
+        if (verbose > 2)
+            pr2ws("    %s: response truncated, ask again with %d\n",
+                  cdb_name_s, alloc_len);
+        ret = page_fetch_issue(ptvp, sg_fd, pfp, resp, alloc_len, &rcv,
+                               noisy, verbose);
+        if (ret)
+            goto fini;
+        page_len = (rcv < 4) ? rcv : (sg_get_unaligned_be16(resp + 2) + 4);
+    }
+    if (page_len >= 4)
+        page_len_put(&id, key, page_len + (page_len % 2));
+fini:
+    release_scsi_pt_obj(ptvp);
+    /* page_len may exceed what was received, report the lesser */
+    if ((0 == ret) && resp_lenp)
+        *resp_lenp = (page_len < rcv) ? page_len : rcv;
+    return ret;
+}
+
+/* Fetches VPD page pg_code with INQUIRY, see sg_cmds_basic.h . */
+int
+sg_ll_vpd_fetch(int sg_fd, int pg_code, void * resp, int mx_resp_len,
+                int * resp_lenp, int noisy, int verbose)
+{
+    struct page_fetch_t pf;
+
+    memset(&pf, 0, sizeof(pf));
+    pf.opcode = INQUIRY_CMD;
+    pf.pg_code = pg_code;
+    pf.def_len = PAGE_FETCH_VPD_LEN;
+    return page_fetch(sg_fd, &pf, (unsigned char *)resp, mx_resp_len,
+                      resp_lenp, noisy, verbose);
+}
+
+/* Fetches a log (sub)page with LOG SENSE, see sg_cmds_basic.h . */
+int
+sg_ll_log_sense_fetch(int sg_fd, int ppc, int sp, int pc, int pg_code,
+                      int subpg_code, int paramp, unsigned char * resp,
+                      int mx_resp_len, int * resp_lenp, int noisy,
+                      int verbose)
+{
+    struct page_fetch_t pf;
+
+    memset(&pf, 0, sizeof(pf));
+    pf.opcode = LOG_SENSE_CMD;
+    pf.pg_code = pg_code;
+    pf.subpg_code = subpg_code;
+    pf.ppc = ppc;
+    pf.sp = sp;
+    pf.pc = pc;
+    pf.paramp = paramp;
+    pf.def_len = PAGE_FETCH_DEF_LEN;
+    return page_fetch(sg_fd, &pf, resp, mx_resp_len, resp_lenp, noisy,
+                      verbose);
+}
+
+/* Fetches a diagnostic page with RECEIVE DIAGNOSTIC RESULTS, see
+ * sg_cmds_basic.h . */
+int
+sg_ll_receive_diag_fetch(int sg_fd, int pcv, int pg_code, void * resp,
+                         int mx_resp_len, int * resp_lenp, int noisy,
+                         int verbose)
+{
+    struct page_fetch_t pf;
+
+    memset(&pf, 0, sizeof(pf));
+    pf.opcode = RECEIVE_DIAGNOSTICS_CMD;
+    pf.pg_code = pg_code;
+    pf.pcv = pcv;
+    pf.def_len = PAGE_FETCH_DEF_LEN;
+    return page_fetch(sg_fd, &pf, (unsigned char *)resp, mx_resp_len,
+                      resp_lenp, noisy, verbose);
+}
@@ -108,7 +108,7 @@ pr2ws(const char * fmt, ...)
     int n;
 
     va_start(args, fmt);
-    n = vfprintf(sg_warnings_strm ? sg_warnings_strm : stderr, fmt, args);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
     va_end(args);
     return n;
 }
@@ -116,7 +116,7 @@ pr2ws(const char * fmt, ...)
 static struct sg_pt_base *
 create_pt_obj(const char * cname)
 {
-    struct sg_pt_base * ptvp = construct_scsi_pt_obj();
+    struct sg_pt_base * ptvp = acquire_scsi_pt_obj();
     if (NULL == ptvp)
         pr2ws("%s: out of memory\n", cname);
     return ptvp;
@@ -181,7 +181,7 @@ sg_ll_get_lba_status(int sg_fd, uint64_t start_llba, void * resp,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -251,7 +251,7 @@ sg_ll_report_tgt_prt_grp2(int sg_fd, void * resp, int mx_resp_len,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -303,7 +303,7 @@ sg_ll_set_tgt_prt_grp(int sg_fd, void * paramp, int param_len, int noisy,
         }
     } else
         ret = 0;
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -365,7 +365,7 @@ sg_ll_report_referrals(int sg_fd, uint64_t start_llba, int one_seg,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -431,7 +431,7 @@ sg_ll_send_diag(int sg_fd, int sf_code, int pf_bit, int sf_bit, int devofl_bit,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -440,13 +440,32 @@ sg_ll_send_diag(int sg_fd, int sf_code, int pf_bit, int sf_bit, int devofl_bit,
 int
 sg_ll_receive_diag(int sg_fd, int pcv, int pg_code, void * resp,
                    int mx_resp_len, int noisy, int verbose)
+{
+    static const char * const cdb_name_s = "receive diagnostic results";
+    int ret;
+    struct sg_pt_base * ptvp;
+
+    if (NULL == ((ptvp = create_pt_obj(cdb_name_s))))
+        return -1;
+    ret = sg_ll_receive_diag_pt(ptvp, sg_fd, pcv, pg_code, resp,
+                                mx_resp_len, noisy, verbose);
+    release_scsi_pt_obj(ptvp);
+    return ret;
+}
+
+/* As sg_ll_receive_diag() but uses the caller's object which is cleared
+ * before use. Return of 0 -> success, various SG_LIB_CAT_* positive values
+ * or -1 -> other errors */
+int
+sg_ll_receive_diag_pt(struct sg_pt_base * ptvp, int sg_fd, int pcv,
+                      int pg_code, void * resp, int mx_resp_len, int noisy,
+                      int verbose)
 {
     static const char * const cdb_name_s = "receive diagnostic results";
     int k, res, ret, sense_cat;
     unsigned char rcvdiag_cdb[RECEIVE_DIAGNOSTICS_CMDLEN] =
         {RECEIVE_DIAGNOSTICS_CMD, 0, 0, 0, 0, 0};
     unsigned char sense_b[SENSE_BUFF_LEN];
-    struct sg_pt_base * ptvp;
 
     rcvdiag_cdb[1] = (unsigned char)(pcv ? 0x1 : 0);
     rcvdiag_cdb[2] = (unsigned char)(pg_code);
@@ -459,8 +478,7 @@ sg_ll_receive_diag(int sg_fd, int pcv, int pg_code, void * resp,
         pr2ws("\n");
     }
 
-    if (NULL == ((ptvp = create_pt_obj(cdb_name_s))))
-        return -1;
+    clear_scsi_pt_obj(ptvp);
     set_scsi_pt_cdb(ptvp, rcvdiag_cdb, sizeof(rcvdiag_cdb));
     set_scsi_pt_sense(ptvp, sense_b, sizeof(sense_b));
     set_scsi_pt_data_in(ptvp, (unsigned char *)resp, mx_resp_len);
@@ -492,7 +510,6 @@ sg_ll_receive_diag(int sg_fd, int pcv, int pg_code, void * resp,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -556,7 +573,7 @@ sg_ll_read_defect10(int sg_fd, int req_plist, int req_glist, int dl_format,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -615,7 +632,7 @@ sg_ll_read_media_serial_num(int sg_fd, void * resp, int mx_resp_len,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -677,7 +694,7 @@ sg_ll_report_id_info(int sg_fd, int itype, void * resp, int max_resp_len,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -732,7 +749,7 @@ sg_ll_set_id_info(int sg_fd, int itype, void * paramp, int param_len,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -813,7 +830,7 @@ sg_ll_format_unit2(int sg_fd, int fmtpinfo, int longlist, int fmtdata,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -866,7 +883,7 @@ sg_ll_reassign_blocks(int sg_fd, int longlba, int longlist, void * paramp,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -928,7 +945,7 @@ sg_ll_persistent_reserve_in(int sg_fd, int rq_servact, void * resp,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -986,7 +1003,7 @@ sg_ll_persistent_reserve_out(int sg_fd, int rq_servact, int rq_scope,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1091,7 +1108,7 @@ sg_ll_read_long10(int sg_fd, int pblock, int correct, unsigned int lba,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1179,7 +1196,7 @@ sg_ll_read_long16(int sg_fd, int pblock, int correct, uint64_t llba,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1258,7 +1275,7 @@ sg_ll_write_long10(int sg_fd, int cor_dis, int wr_uncor, int pblock,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1338,7 +1355,7 @@ sg_ll_write_long16(int sg_fd, int cor_dis, int wr_uncor, int pblock,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1394,17 +1411,19 @@ sg_ll_verify10(int sg_fd, int vrprotect, int dpo, int bytchk,
             ret = 0;
             break;
         case SG_LIB_CAT_MEDIUM_HARD:
+        case SG_LIB_CAT_MISCOMPARE:
             {
-                int valid;
-                uint64_t ull = 0;
+                struct sg_sense_info si;
 
                 slen = get_scsi_pt_sense_len(ptvp);
-                valid = sg_get_sense_info_fld(sense_b, slen, &ull);
-                if (valid) {
-                    if (infop)
-                        *infop = (unsigned int)ull;
+                sg_get_sense_info(sense_b, slen, &si);
+                if (si.info_valid && infop)
+                    *infop = (unsigned int)si.info;
+                if (SG_LIB_CAT_MISCOMPARE == sense_cat)
+                    ret = sense_cat;
+                else if (si.info_valid)
                     ret = SG_LIB_CAT_MEDIUM_HARD_WITH_INFO;
-                } else
+                else
                     ret = SG_LIB_CAT_MEDIUM_HARD;
             }
             break;
@@ -1415,7 +1434,7 @@ sg_ll_verify10(int sg_fd, int vrprotect, int dpo, int bytchk,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1471,17 +1490,19 @@ sg_ll_verify16(int sg_fd, int vrprotect, int dpo, int bytchk, uint64_t llba,
             ret = 0;
             break;
         case SG_LIB_CAT_MEDIUM_HARD:
+        case SG_LIB_CAT_MISCOMPARE:
             {
-                int valid;
-                uint64_t ull = 0;
+                struct sg_sense_info si;
 
                 slen = get_scsi_pt_sense_len(ptvp);
-                valid = sg_get_sense_info_fld(sense_b, slen, &ull);
-                if (valid) {
-                    if (infop)
-                        *infop = ull;
+                sg_get_sense_info(sense_b, slen, &si);
+                if (si.info_valid && infop)
+                    *infop = si.info;
+                if (SG_LIB_CAT_MISCOMPARE == sense_cat)
+                    ret = sense_cat;
+                else if (si.info_valid)
                     ret = SG_LIB_CAT_MEDIUM_HARD_WITH_INFO;
-                } else
+                else
                     ret = SG_LIB_CAT_MEDIUM_HARD;
             }
             break;
@@ -1492,7 +1513,7 @@ sg_ll_verify16(int sg_fd, int vrprotect, int dpo, int bytchk, uint64_t llba,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1666,7 +1687,7 @@ sg_ll_ata_pt(int sg_fd, const unsigned char * cdbp, int cdb_len,
     }
 
 out:
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1727,7 +1748,7 @@ sg_ll_read_buffer(int sg_fd, int mode, int buffer_id, int buffer_offset,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1789,7 +1810,7 @@ sg_ll_write_buffer(int sg_fd, int mode, int buffer_id, int buffer_offset,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1854,7 +1875,7 @@ sg_ll_unmap_v2(int sg_fd, int anchor, int group_num, int timeout_secs,
         }
     } else
         ret = 0;
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1911,7 +1932,7 @@ sg_ll_read_block_limits(int sg_fd, void * resp, int mx_resp_len,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -1966,7 +1987,7 @@ sg_ll_receive_copy_results(int sg_fd, int sa, int list_id, void * resp,
         }
     } else
         ret = 0;
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -2025,7 +2046,7 @@ sg_ll_extended_copy(int sg_fd, void * paramp, int param_len, int noisy,
         }
     } else
         ret = 0;
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -2102,6 +2123,6 @@ sg_ll_3party_copy_out(int sg_fd, int sa, unsigned int list_id, int group_num,
         }
     } else
         ret = 0;
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
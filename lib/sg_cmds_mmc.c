@@ -52,7 +52,7 @@ pr2ws(const char * fmt, ...)
     int n;
 
     va_start(args, fmt);
-    n = vfprintf(sg_warnings_strm ? sg_warnings_strm : stderr, fmt, args);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
     va_end(args);
     return n;
 }
@@ -60,7 +60,7 @@ pr2ws(const char * fmt, ...)
 static struct sg_pt_base *
 create_pt_obj(const char * cname)
 {
-    struct sg_pt_base * ptvp = construct_scsi_pt_obj();
+    struct sg_pt_base * ptvp = acquire_scsi_pt_obj();
     if (NULL == ptvp)
         pr2ws("%s: out of memory\n", cname);
     return ptvp;
@@ -121,7 +121,7 @@ sg_ll_set_cd_speed(int sg_fd, int rot_control, int drv_read_speed,
     } else
         ret = 0;
 
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -210,7 +210,7 @@ sg_ll_get_config(int sg_fd, int rt, int starting, void * resp,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -301,7 +301,7 @@ sg_ll_get_performance(int sg_fd, int data_type, unsigned int starting_lba,
         }
         ret = 0;
     }
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
 
@@ -363,6 +363,6 @@ sg_ll_set_streaming(int sg_fd, int type, void * paramp, int param_len,
         }
     } else
         ret = 0;
-    destruct_scsi_pt_obj(ptvp);
+    release_scsi_pt_obj(ptvp);
     return ret;
 }
@@ -21,7 +21,7 @@
 #include "sg_io_linux.h"
 
 
-/* Version 1.07 20160405 */
+/* Version 1.08 20160702 */
 
 #if defined(__GNUC__) || defined(__clang__)
 static int pr2ws(const char * fmt, ...)
@@ -38,7 +38,7 @@ pr2ws(const char * fmt, ...)
     int n;
 
     va_start(args, fmt);
-    n = vfprintf(sg_warnings_strm ? sg_warnings_strm : stderr, fmt, args);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
     va_end(args);
     return n;
 }
@@ -214,6 +214,23 @@ sg_err_category3(struct sg_io_hdr * hp)
     return sg_err_category_new(hp->status, hp->host_status,
                                hp->driver_status, hp->sbp, hp->sb_len_wr);
 }
+
+/* Like sg_err_category3() but also decodes any sense data into *sip
+ * (which is cleared when there is none). Without sense data the SCSI
+ * status, host and driver status decide, as in sg_err_category_new() */
+int
+sg_err_category3_si(const struct sg_io_hdr * hp, struct sg_sense_info * sip)
+{
+    int res = sg_err_category_new(hp->status, hp->host_status,
+                                  hp->driver_status, NULL, 0);
+
+    if (SG_LIB_CAT_SENSE == res) {
+        sg_get_sense_info(hp->sbp, hp->sb_len_wr, sip);
+        return sg_sense_info_category(sip);
+    }
+    memset(sip, 0, sizeof(*sip));
+    return res;
+}
 #endif
 
 int
@@ -0,0 +1,528 @@
+/*
+ * Copyright (c) 2016 Douglas Gilbert.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the BSD_LICENSE file.
+ */
+
+/* sg_io_uring version 1.00 20160629 */
+
+/*
+ * Queues the write() and read() of sg (v3) or bsg (v4) headers in an
+ * io_uring (Linux 5.6 or later) so a batch of them costs one system call
+ * rather than one each. The rings are set up directly with the
+ * io_uring_setup(2) and io_uring_enter(2) system calls so no extra
+ * library is needed. When the kernel (or its headers when this library
+ * was built) lacks io_uring, sg_uring_probe() returns 0 and
+ * sg_uring_create() fails with ENOSYS; callers then use write() and
+ * read() as before.
+ *
+ * The sg driver has no non-blocking read_iter method, so io_uring runs
+ * each read in a worker thread. To avoid tying up a worker per
+ * outstanding command (and to work on fds opened O_NONBLOCK) each read
+ * is preceded by a linked poll for POLLIN.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sg_io_linux.h"
+#include "sg_io_uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+/* IO_URING_OP_SUPPORTED came with IORING_OP_READ and IORING_OP_WRITE
+ * (which are enumerations) in Linux 5.6 */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && \
+    defined(IO_URING_OP_SUPPORTED)
+#define SG_HAVE_IO_URING 1
+#endif
+
+/* user_data of the poll that precedes each read; its completion is not
+ * passed to the caller */
+#define SG_URING_POLL_UD (~(uint64_t)0)
+
+
+#ifdef SG_HAVE_IO_URING
+
+struct sg_uring {
+    int ring_fd;
+    int verbose;
+    unsigned int sq_entries;
+    unsigned int to_submit;     /* queued but not yet passed to kernel */
+    unsigned int sq_tail;       /* local copy, published by publish_sqes() */
+    unsigned int * sq_headp;
+    unsigned int * sq_tailp;
+    unsigned int * sq_maskp;
+    unsigned int * sq_arr;
+    unsigned int * cq_headp;
+    unsigned int * cq_tailp;
+    unsigned int * cq_maskp;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+    void * sq_ring;
+    size_t sq_ring_sz;
+    void * cq_ring;             /* may be sq_ring (IORING_FEAT_SINGLE_MMAP) */
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+};
+
+static int probe_result = -1;   /* -1: not yet probed */
+
+
+#if defined(__GNUC__) || defined(__clang__)
+static int pr2ws(const char * fmt, ...)
+        __attribute__ ((format (printf, 1, 2)));
+#else
+static int pr2ws(const char * fmt, ...);
+#endif
+
+static int
+pr2ws(const char * fmt, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
+    va_end(args);
+    return n;
+}
+
+static int
+uring_setup(unsigned int entries, struct io_uring_params * pp)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, pp);
+}
+
+static int
+uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete,
+            unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                        min_complete, flags, NULL, 0);
+}
+
+static int
+uring_register(int ring_fd, unsigned int opcode, void * arg,
+               unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg,
+                        nr_args);
+}
+
+/* Returns 1 if this kernel supports the operations used here, else 0 */
+int
+sg_uring_probe(void)
+{
+    int ring_fd, sz;
+    struct io_uring_params params;
+    struct io_uring_probe * prp;
+
+    if (probe_result >= 0)
+        return probe_result;
+    memset(&params, 0, sizeof(params));
+    ring_fd = uring_setup(2, &params);
+    if (ring_fd < 0) {      /* ENOSYS, or EPERM if disabled by sysctl */
+        probe_result = 0;
+        return 0;
+    }
+    sz = sizeof(*prp) + (IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    prp = (struct io_uring_probe *)calloc(1, sz);
+    if (prp && (0 == uring_register(ring_fd, IORING_REGISTER_PROBE, prp,
+                                    IORING_OP_LAST)) &&
+        (prp->last_op >= IORING_OP_READ) &&
+        (prp->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+        (prp->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+        (prp->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED))
+        probe_result = 1;
+    else
+        probe_result = 0;
+    free(prp);
+    close(ring_fd);
+    return probe_result;
+}
+
+void
+sg_uring_destroy(struct sg_uring * up)
+{
+    if (NULL == up)
+        return;
+    if (up->sqes && (MAP_FAILED != (void *)up->sqes))
+        munmap(up->sqes, up->sqes_sz);
+    if (up->cq_ring && (MAP_FAILED != up->cq_ring) &&
+        (up->cq_ring != up->sq_ring))
+        munmap(up->cq_ring, up->cq_ring_sz);
+    if (up->sq_ring && (MAP_FAILED != up->sq_ring))
+        munmap(up->sq_ring, up->sq_ring_sz);
+    if (up->ring_fd >= 0)
+        close(up->ring_fd);
+    free(up);
+}
+
+/* Sets up a ring with at least 'entries' submission queue entries. Returns
+ * NULL (with errno set) on failure: ENOSYS when io_uring can not be
+ * used. */
+struct sg_uring *
+sg_uring_create(int entries, int verbose)
+{
+    int err;
+    struct sg_uring * up;
+    struct io_uring_params params;
+
+    if (! sg_uring_probe()) {
+        errno = ENOSYS;
+        return NULL;
+    }
+    if (entries < 4)
+        entries = 4;
+    up = (struct sg_uring *)calloc(1, sizeof(*up));
+    if (NULL == up) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    up->verbose = verbose;
+    memset(&params, 0, sizeof(params));
+    up->ring_fd = uring_setup(entries, &params);
+    if (up->ring_fd < 0) {
+        err = errno;
+        if (verbose)
+            pr2ws("io_uring_setup(%d) failed: %s\n", entries,
+                  safe_strerror(err));
+        goto fini;
+    }
+    up->sq_entries = params.sq_entries;
+    up->sq_ring_sz = params.sq_off.array +
+                     (params.sq_entries * sizeof(unsigned int));
+    up->cq_ring_sz = params.cq_off.cqes +
+                     (params.cq_entries * sizeof(struct io_uring_cqe));
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (up->cq_ring_sz > up->sq_ring_sz)
+            up->sq_ring_sz = up->cq_ring_sz;
+        up->cq_ring_sz = up->sq_ring_sz;
+    }
+    up->sq_ring = mmap(NULL, up->sq_ring_sz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, up->ring_fd,
+                       IORING_OFF_SQ_RING);
+    if (MAP_FAILED == up->sq_ring)
+        goto map_err;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        up->cq_ring = up->sq_ring;
+    else {
+        up->cq_ring = mmap(NULL, up->cq_ring_sz, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, up->ring_fd,
+                           IORING_OFF_CQ_RING);
+        if (MAP_FAILED == up->cq_ring)
+            goto map_err;
+    }
+    up->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    up->sqes = (struct io_uring_sqe *)mmap(NULL, up->sqes_sz,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE,
+                                           up->ring_fd, IORING_OFF_SQES);
+    if (MAP_FAILED == (void *)up->sqes)
+        goto map_err;
+    up->sq_headp = (unsigned int *)((char *)up->sq_ring +
+                                    params.sq_off.head);
+    up->sq_tailp = (unsigned int *)((char *)up->sq_ring +
+                                    params.sq_off.tail);
+    up->sq_maskp = (unsigned int *)((char *)up->sq_ring +
+                                    params.sq_off.ring_mask);
+    up->sq_arr = (unsigned int *)((char *)up->sq_ring + params.sq_off.array);
+    up->cq_headp = (unsigned int *)((char *)up->cq_ring +
+                                    params.cq_off.head);
+    up->cq_tailp = (unsigned int *)((char *)up->cq_ring +
+                                    params.cq_off.tail);
+    up->cq_maskp = (unsigned int *)((char *)up->cq_ring +
+                                    params.cq_off.ring_mask);
+    up->cqes = (struct io_uring_cqe *)((char *)up->cq_ring +
+                                       params.cq_off.cqes);
+    up->sq_tail = *up->sq_tailp;
+    return up;
+
+map_err:
+    err = errno;
+    if (verbose)
+        pr2ws("mmap of io_uring failed: %s\n", safe_strerror(err));
+fini:
+    sg_uring_destroy(up);
+    errno = err;
+    return NULL;
+}
+
+int
+sg_uring_fd(const struct sg_uring * up)
+{
+    return up ? up->ring_fd : -1;
+}
+
+static unsigned int
+sq_space(const struct sg_uring * up)
+{
+    return up->sq_entries -
+           (up->sq_tail - __atomic_load_n(up->sq_headp, __ATOMIC_ACQUIRE));
+}
+
+/* Passes queued entries to the kernel and, if wait_nr > 0, waits until
+ * at least that many completions are available. Returns the number of
+ * entries passed, else a negated errno. */
+int
+sg_uring_submit(struct sg_uring * up, int wait_nr)
+{
+    int res;
+
+    if (NULL == up)
+        return -EINVAL;
+    if ((0 == up->to_submit) && (wait_nr <= 0))
+        return 0;
+    res = uring_enter(up->ring_fd, up->to_submit,
+                      (wait_nr > 0) ? wait_nr : 0,
+                      (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0);
+    if (res < 0) {
+        res = errno;
+        if ((up->verbose > 1) && (EINTR != res))
+            pr2ws("io_uring_enter failed: %s\n", safe_strerror(res));
+        return -res;
+    }
+    up->to_submit -= (unsigned int)res;
+    return res;
+}
+
+/* Makes room for num entries, submitting what is queued if needed.
+ * Returns the first free sqe (already cleared), NULL if no room. */
+static struct io_uring_sqe *
+get_sqes(struct sg_uring * up, unsigned int num)
+{
+    unsigned int k, idx;
+    unsigned int mask = *up->sq_maskp;
+
+    if (sq_space(up) < num) {
+        sg_uring_submit(up, 0);
+        if (sq_space(up) < num)
+            return NULL;
+    }
+    for (k = 0; k < num; ++k) {
+        idx = (up->sq_tail + k) & mask;
+        memset(up->sqes + idx, 0, sizeof(struct io_uring_sqe));
+        up->sq_arr[idx] = idx;
+    }
+    return up->sqes + (up->sq_tail & mask);
+}
+
+static struct io_uring_sqe *
+nth_sqe(struct sg_uring * up, unsigned int n)
+{
+    return up->sqes + ((up->sq_tail + n) & *up->sq_maskp);
+}
+
+/* Makes the next num entries visible to the kernel (on next submit) */
+static void
+publish_sqes(struct sg_uring * up, unsigned int num)
+{
+    up->sq_tail += num;
+    up->to_submit += num;
+    __atomic_store_n(up->sq_tailp, up->sq_tail, __ATOMIC_RELEASE);
+}
+
+static void
+prep_rw(struct io_uring_sqe * sqep, int op, int fd, const void * buf,
+        unsigned int len, uint64_t user_data)
+{
+    sqep->opcode = op;
+    sqep->fd = fd;
+    sqep->off = (uint64_t)-1;   /* use (and ignore) file position */
+    sqep->addr = (uint64_t)(uintptr_t)buf;
+    sqep->len = len;
+    sqep->user_data = user_data;
+}
+
+static void
+prep_poll(struct io_uring_sqe * sqep, int fd)
+{
+    sqep->opcode = IORING_OP_POLL_ADD;
+    sqep->fd = fd;
+#ifdef IORING_FEAT_POLL_32BITS
+    sqep->poll32_events = POLLIN;
+#else
+    sqep->poll_events = POLLIN;
+#endif
+    sqep->user_data = SG_URING_POLL_UD;
+}
+
+/* Queues a write() of len bytes from buf to fd. Returns 0 if queued, else
+ * -EBUSY (ring full even after submitting) or a negated errno. */
+int
+sg_uring_queue_write(struct sg_uring * up, int fd, const void * buf,
+                     unsigned int len, uint64_t user_data)
+{
+    if ((NULL == up) || (SG_URING_POLL_UD == user_data))
+        return -EINVAL;
+    if (NULL == get_sqes(up, 1))
+        return -EBUSY;
+    prep_rw(nth_sqe(up, 0), IORING_OP_WRITE, fd, buf, len, user_data);
+    publish_sqes(up, 1);
+    return 0;
+}
+
+/* Queues a read() of len bytes from fd into buf, started once fd is
+ * readable. Return values as for sg_uring_queue_write(). */
+int
+sg_uring_queue_read(struct sg_uring * up, int fd, void * buf,
+                    unsigned int len, uint64_t user_data)
+{
+    struct io_uring_sqe * sqep;
+
+    if ((NULL == up) || (SG_URING_POLL_UD == user_data))
+        return -EINVAL;
+    if (NULL == get_sqes(up, 2))
+        return -EBUSY;
+    sqep = nth_sqe(up, 0);
+    prep_poll(sqep, fd);
+    sqep->flags = IOSQE_IO_LINK;
+    prep_rw(nth_sqe(up, 1), IORING_OP_READ, fd, buf, len, user_data);
+    publish_sqes(up, 2);
+    return 0;
+}
+
+/* Queues a write() of wbuf to fd followed by (linked so it is only done
+ * if the write succeeds) a read() into rbuf as sg_uring_queue_read()
+ * does. If the write fails then the read completes with -ECANCELED.
+ * Return values as for sg_uring_queue_write(). */
+int
+sg_uring_queue_write_read(struct sg_uring * up, int fd, const void * wbuf,
+                          void * rbuf, unsigned int len, uint64_t w_ud,
+                          uint64_t r_ud)
+{
+    struct io_uring_sqe * sqep;
+
+    if ((NULL == up) || (SG_URING_POLL_UD == w_ud) ||
+        (SG_URING_POLL_UD == r_ud))
+        return -EINVAL;
+    if (NULL == get_sqes(up, 3))
+        return -EBUSY;
+    sqep = nth_sqe(up, 0);
+    prep_rw(sqep, IORING_OP_WRITE, fd, wbuf, len, w_ud);
+    sqep->flags = IOSQE_IO_LINK;
+    sqep = nth_sqe(up, 1);
+    prep_poll(sqep, fd);
+    sqep->flags = IOSQE_IO_LINK;
+    prep_rw(nth_sqe(up, 2), IORING_OP_READ, fd, rbuf, len, r_ud);
+    publish_sqes(up, 3);
+    return 0;
+}
+
+/* Fetches one completion, if any, without waiting. Returns 1 and places
+ * the user_data given when queued in *user_datap and the result (bytes
+ * transferred or negated errno) in *resp; returns 0 if none. */
+int
+sg_uring_reap(struct sg_uring * up, uint64_t * user_datap, int * resp)
+{
+    unsigned int head, mask;
+    const struct io_uring_cqe * cqep;
+
+    if (NULL == up)
+        return 0;
+    mask = *up->cq_maskp;
+    head = *up->cq_headp;
+    while (head != __atomic_load_n(up->cq_tailp, __ATOMIC_ACQUIRE)) {
+        cqep = up->cqes + (head & mask);
+        ++head;
+        if (SG_URING_POLL_UD == cqep->user_data)
+            continue;
+        if (user_datap)
+            *user_datap = cqep->user_data;
+        if (resp)
+            *resp = cqep->res;
+        __atomic_store_n(up->cq_headp, head, __ATOMIC_RELEASE);
+        return 1;
+    }
+    __atomic_store_n(up->cq_headp, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#else   /* no io_uring: sg_uring_create() fails, callers fall back */
+
+struct sg_uring {
+    int ring_fd;
+};
+
+int
+sg_uring_probe(void)
+{
+    return 0;
+}
+
+struct sg_uring *
+sg_uring_create(int entries, int verbose)
+{
+    if (entries || verbose) { ; }   /* unused, suppress warning */
+    errno = ENOSYS;
+    return NULL;
+}
+
+void
+sg_uring_destroy(struct sg_uring * up)
+{
+    if (up) { ; }       /* unused, suppress warning */
+}
+
+int
+sg_uring_fd(const struct sg_uring * up)
+{
+    if (up) { ; }       /* unused, suppress warning */
+    return -1;
+}
+
+int
+sg_uring_submit(struct sg_uring * up, int wait_nr)
+{
+    if (up || wait_nr) { ; }        /* unused, suppress warning */
+    return -ENOSYS;
+}
+
+int
+sg_uring_queue_write(struct sg_uring * up, int fd, const void * buf,
+                     unsigned int len, uint64_t user_data)
+{
+    if (up || fd || buf || len || user_data) { ; }  /* suppress warning */
+    return -ENOSYS;
+}
+
+int
+sg_uring_queue_read(struct sg_uring * up, int fd, void * buf,
+                    unsigned int len, uint64_t user_data)
+{
+    if (up || fd || buf || len || user_data) { ; }  /* suppress warning */
+    return -ENOSYS;
+}
+
+int
+sg_uring_queue_write_read(struct sg_uring * up, int fd, const void * wbuf,
+                          void * rbuf, unsigned int len, uint64_t w_ud,
+                          uint64_t r_ud)
+{
+    if (up || fd || wbuf || rbuf || len || w_ud || r_ud) { ; }
+    return -ENOSYS;
+}
+
+int
+sg_uring_reap(struct sg_uring * up, uint64_t * user_datap, int * resp)
+{
+    if (up || user_datap || resp) { ; }     /* unused, suppress warning */
+    return 0;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef SG_IO_URING_H
+#define SG_IO_URING_H
+
+/*
+ * Copyright (c) 2016 Douglas Gilbert.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the BSD_LICENSE file.
+ */
+
+/* Internal to libsgutils2, not installed. */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Batched submission through io_uring, see sg_io_uring.c . Writes and
+ * reads of sg (v3) or bsg (v4) headers are queued and passed to the
+ * kernel together by sg_uring_submit(); each completion is fetched by
+ * sg_uring_reap() with the user_data given when it was queued. Functions
+ * returning int give a negated errno on failure, -ENOSYS when io_uring
+ * is not available. sg_uring_fd() can be poll()-ed for POLLIN which means
+ * completions are ready. A ring is not thread safe. */
+struct sg_uring;
+
+int sg_uring_probe(void);       /* returns 1 if io_uring usable, else 0 */
+struct sg_uring * sg_uring_create(int entries, int verbose);
+void sg_uring_destroy(struct sg_uring * up);
+int sg_uring_fd(const struct sg_uring * up);
+int sg_uring_queue_write(struct sg_uring * up, int fd, const void * buf,
+                         unsigned int len, uint64_t user_data);
+int sg_uring_queue_read(struct sg_uring * up, int fd, void * buf,
+                        unsigned int len, uint64_t user_data);
+int sg_uring_queue_write_read(struct sg_uring * up, int fd,
+                              const void * wbuf, void * rbuf,
+                              unsigned int len, uint64_t w_ud,
+                              uint64_t r_ud);
+int sg_uring_submit(struct sg_uring * up, int wait_nr);
+int sg_uring_reap(struct sg_uring * up, uint64_t * user_datap, int * resp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,12 +33,14 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #define __STDC_FORMAT_MACROS 1
 #include <inttypes.h>
 
 #include "sg_lib.h"
 #include "sg_lib_data.h"
 #include "sg_unaligned.h"
+#include "sg_lib_thread.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -50,6 +52,12 @@
 
 FILE * sg_warnings_strm = NULL;        /* would like to default to stderr */
 
+/* Without thread local storage there is no per thread warnings stream and
+ * safe_strerror() shares one buffer between threads. */
+#ifdef SG_LIB_THREAD_LOCAL
+static SG_LIB_THREAD_LOCAL FILE * thread_warnings_strm;
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
 static int pr2ws(const char * fmt, ...)
         __attribute__ ((format (printf, 1, 2)));
@@ -65,17 +73,13 @@ pr2ws(const char * fmt, ...)
     int n;
 
     va_start(args, fmt);
-    n = vfprintf(sg_warnings_strm ? sg_warnings_strm : stderr, fmt, args);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
     va_end(args);
     return n;
 }
 
-#if defined(__GNUC__) || defined(__clang__)
-static int scnpr(char * cp, int cp_max_len, const char * fmt, ...)
-                 __attribute__ ((format (printf, 3, 4)));
-#else
-static int scnpr(char * cp, int cp_max_len, const char * fmt, ...);
-#endif
+/* sg_scnpr() is called by its short name in this file */
+#define scnpr sg_scnpr
 
 /* Want safe, 'n += snprintf(b + n, blen - n, ...)' style sequence of
  * functions. Returns number number of chars placed in cp excluding the
@@ -84,8 +88,8 @@ static int scnpr(char * cp, int cp_max_len, const char * fmt, ...);
  * written to cp. Note this means that when cp_max_len = 1, this function
  * assumes that cp[0] is the null character and does nothing (and returns
  * 0). Linux kernel has a similar function called  scnprintf().  */
-static int
-scnpr(char * cp, int cp_max_len, const char * fmt, ...)
+int
+sg_scnpr(char * cp, int cp_max_len, const char * fmt, ...)
 {
     va_list args;
     int n;
@@ -105,32 +109,35 @@ static inline int my_isprint(int ch)
     return ((ch >= ' ') && (ch < 0x7f));
 }
 
-/* Searches 'arr' for match on 'value' then 'peri_type'. If matches
-   'value' but not 'peri_type' then yields first 'value' match entry.
-   Last element of 'arr' has NULL 'name'. If no match returns NULL. */
+/* Searches 'arr', which has 'num' entries sorted in ascending 'value'
+   order, for match on 'value' then 'peri_type'. If matches 'value' but
+   not 'peri_type' then yields first 'value' match entry. If no match
+   returns NULL. */
 static const struct sg_lib_value_name_t *
-get_value_name(const struct sg_lib_value_name_t * arr, int value,
+get_value_name(const struct sg_lib_value_name_t * arr, int num, int value,
                int peri_type)
 {
-    const struct sg_lib_value_name_t * vp = arr;
+    int lo, hi, mid;
+    const struct sg_lib_value_name_t * vp;
     const struct sg_lib_value_name_t * holdp;
 
     if (peri_type < 0)
         peri_type = 0;
-    for (; vp->name; ++vp) {
-        if (value == vp->value) {
-            if (peri_type == vp->peri_dev_type)
-                return vp;
-            holdp = vp;
-            while ((vp + 1)->name && (value == (vp + 1)->value)) {
-                ++vp;
-                if (peri_type == vp->peri_dev_type)
-                    return vp;
-            }
-            return holdp;
-        }
+    for (lo = 0, hi = num - 1; lo < hi; ) {
+        mid = lo + ((hi - lo) / 2);
+        if (arr[mid].value < value)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    return NULL;
+    if ((num < 1) || (value != arr[lo].value))
+        return NULL;
+    holdp = arr + lo;
+    for (vp = holdp; (vp < (arr + num)) && (value == vp->value); ++vp) {
+        if (peri_type == vp->peri_dev_type)
+            return vp;
+    }
+    return holdp;
 }
 
 /* If this function is not called, sg_warnings_strm will be NULL and all users
@@ -141,6 +148,34 @@ sg_set_warnings_strm(FILE * warnings_strm)
     sg_warnings_strm = warnings_strm;
 }
 
+/* Sets the calling thread's warnings stream, NULL reverts to the process
+ * wide sg_warnings_strm. Returns 0, or -ENOSYS if the library was built
+ * without thread local storage. */
+int
+sg_set_thread_warnings_strm(FILE * warnings_strm)
+{
+#ifdef SG_LIB_THREAD_LOCAL
+    thread_warnings_strm = warnings_strm;
+    return 0;
+#else
+    if (warnings_strm) { ; }    /* suppress warning */
+    return -ENOSYS;
+#endif
+}
+
+/* Library diagnostics go to the stream this function returns: the calling
+ * thread's warnings stream if set, else sg_warnings_strm if set, else
+ * stderr. */
+FILE *
+sg_get_warnings_strm(void)
+{
+#ifdef SG_LIB_THREAD_LOCAL
+    if (thread_warnings_strm)
+        return thread_warnings_strm;
+#endif
+    return sg_warnings_strm ? sg_warnings_strm : stderr;
+}
+
 #define CMD_NAME_LEN 128
 
 void
@@ -241,41 +276,56 @@ sg_get_sense_key_str(int sense_key, int buff_len, char * buff)
     return buff;
 }
 
-/* Yield string associated with ASC/ASCQ values. Returns 'buff'. */
+/* Yield string associated with ASC/ASCQ values. Returns 'buff'. Both
+ * tables in sg_lib_data.c are sorted so are binary searched, keyed on
+ * ASC then ASCQ. */
 char *
 sg_get_asc_ascq_str(int asc, int ascq, int buff_len, char * buff)
 {
-    int k, num, rlen;
+    int lo, hi, mid, num, rlen, key, mkey;
     bool found = false;
-    struct sg_lib_asc_ascq_t * eip;
-    struct sg_lib_asc_ascq_range_t * ei2p;
+    const struct sg_lib_asc_ascq_t * eip;
+    const struct sg_lib_asc_ascq_range_t * ei2p = NULL;
 
     if (1 == buff_len) {
         buff[0] = '\0';
         return buff;
     }
-    for (k = 0; sg_lib_asc_ascq_range[k].text; ++k) {
-        ei2p = &sg_lib_asc_ascq_range[k];
-        if ((ei2p->asc == asc) &&
-            (ascq >= ei2p->ascq_min)  &&
-            (ascq <= ei2p->ascq_max)) {
-            found = true;
-            num = scnpr(buff, buff_len, "Additional sense: ");
-            rlen = buff_len - num;
-            scnpr(buff + num, ((rlen > 0) ? rlen : 0), ei2p->text, ascq);
-        }
+    if ((asc < 0) || (asc > 0xff) || (ascq < 0) || (ascq > 0xff))
+        goto not_found;
+    key = (asc << 8) | ascq;
+    /* find the last range starting at or before asc,ascq */
+    for (lo = 0, hi = sg_lib_asc_ascq_range_num - 1; lo <= hi; ) {
+        mid = (lo + hi) / 2;
+        mkey = (sg_lib_asc_ascq_range[mid].asc << 8) |
+               sg_lib_asc_ascq_range[mid].ascq_min;
+        if (mkey <= key) {
+            ei2p = &sg_lib_asc_ascq_range[mid];
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
     }
-    if (found)
+    if (ei2p && (ei2p->asc == asc) && (ascq <= ei2p->ascq_max)) {
+        num = scnpr(buff, buff_len, "Additional sense: ");
+        rlen = buff_len - num;
+        scnpr(buff + num, ((rlen > 0) ? rlen : 0), ei2p->text, ascq);
         return buff;
+    }
 
-    for (k = 0; sg_lib_asc_ascq[k].text; ++k) {
-        eip = &sg_lib_asc_ascq[k];
-        if (eip->asc == asc &&
-            eip->ascq == ascq) {
+    for (lo = 0, hi = sg_lib_asc_ascq_num - 1; lo <= hi; ) {
+        mid = (lo + hi) / 2;
+        eip = &sg_lib_asc_ascq[mid];
+        mkey = (eip->asc << 8) | eip->ascq;
+        if (mkey == key) {
             found = true;
             scnpr(buff, buff_len, "Additional sense: %s", eip->text);
-        }
+            break;
+        } else if (mkey < key)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
     }
+not_found:
     if (! found) {
         if (asc >= 0x80)
             scnpr(buff, buff_len, "vendor specific ASC=%02x, ASCQ=%02x "
@@ -1838,6 +1888,50 @@ sg_scsi_normalize_sense(const unsigned char * sbp, int sb_len,
     return 1;
 }
 
+/* Maps sense key plus ASC and ASCQ to a SG_LIB_CAT_* value */
+static int
+sense_cat(int sense_key, int asc, int ascq)
+{
+    switch (sense_key) {        /* 0 to 0x1f */
+    case SPC_SK_NO_SENSE:
+        return SG_LIB_CAT_NO_SENSE;
+    case SPC_SK_RECOVERED_ERROR:
+        return SG_LIB_CAT_RECOVERED;
+    case SPC_SK_NOT_READY:
+        return SG_LIB_CAT_NOT_READY;
+    case SPC_SK_MEDIUM_ERROR:
+    case SPC_SK_HARDWARE_ERROR:
+    case SPC_SK_BLANK_CHECK:
+        return SG_LIB_CAT_MEDIUM_HARD;
+    case SPC_SK_UNIT_ATTENTION:
+        return SG_LIB_CAT_UNIT_ATTENTION;
+        /* used to return SG_LIB_CAT_MEDIA_CHANGED when asc==0x28 */
+    case SPC_SK_ILLEGAL_REQUEST:
+        if ((0x20 == asc) && (0x0 == ascq))
+            return SG_LIB_CAT_INVALID_OP;
+        else
+            return SG_LIB_CAT_ILLEGAL_REQ;
+        break;
+    case SPC_SK_ABORTED_COMMAND:
+        if (0x10 == asc)
+            return SG_LIB_CAT_PROTECTION;
+        else
+            return SG_LIB_CAT_ABORTED_COMMAND;
+    case SPC_SK_MISCOMPARE:
+        return SG_LIB_CAT_MISCOMPARE;
+    case SPC_SK_DATA_PROTECT:
+        return SG_LIB_CAT_DATA_PROTECT;
+    case SPC_SK_COPY_ABORTED:
+        return SG_LIB_CAT_COPY_ABORTED;
+    case SPC_SK_COMPLETED:
+    case SPC_SK_VOLUME_OVERFLOW:
+        return SG_LIB_CAT_SENSE;
+    default:
+        ;   /* reserved and vendor specific sense keys fall through */
+    }
+    return SG_LIB_CAT_SENSE;
+}
+
 /* Returns a SG_LIB_CAT_* value. If cannot decode sense buffer (sbp) or a
  * less common sense key then return SG_LIB_CAT_SENSE .*/
 int
@@ -1846,46 +1940,131 @@ sg_err_category_sense(const unsigned char * sbp, int sb_len)
     struct sg_scsi_sense_hdr ssh;
 
     if ((sbp && (sb_len > 2)) &&
-        (sg_scsi_normalize_sense(sbp, sb_len, &ssh))) {
-        switch (ssh.sense_key) {        /* 0 to 0x1f */
-        case SPC_SK_NO_SENSE:
-            return SG_LIB_CAT_NO_SENSE;
-        case SPC_SK_RECOVERED_ERROR:
-            return SG_LIB_CAT_RECOVERED;
-        case SPC_SK_NOT_READY:
-            return SG_LIB_CAT_NOT_READY;
-        case SPC_SK_MEDIUM_ERROR:
-        case SPC_SK_HARDWARE_ERROR:
-        case SPC_SK_BLANK_CHECK:
-            return SG_LIB_CAT_MEDIUM_HARD;
-        case SPC_SK_UNIT_ATTENTION:
-            return SG_LIB_CAT_UNIT_ATTENTION;
-            /* used to return SG_LIB_CAT_MEDIA_CHANGED when ssh.asc==0x28 */
-        case SPC_SK_ILLEGAL_REQUEST:
-            if ((0x20 == ssh.asc) && (0x0 == ssh.ascq))
-                return SG_LIB_CAT_INVALID_OP;
-            else
-                return SG_LIB_CAT_ILLEGAL_REQ;
-            break;
-        case SPC_SK_ABORTED_COMMAND:
-            if (0x10 == ssh.asc)
-                return SG_LIB_CAT_PROTECTION;
-            else
-                return SG_LIB_CAT_ABORTED_COMMAND;
-        case SPC_SK_MISCOMPARE:
-            return SG_LIB_CAT_MISCOMPARE;
-        case SPC_SK_DATA_PROTECT:
-            return SG_LIB_CAT_DATA_PROTECT;
-        case SPC_SK_COPY_ABORTED:
-            return SG_LIB_CAT_COPY_ABORTED;
-        case SPC_SK_COMPLETED:
-        case SPC_SK_VOLUME_OVERFLOW:
-            return SG_LIB_CAT_SENSE;
-        default:
-            ;   /* reserved and vendor specific sense keys fall through */
+        (sg_scsi_normalize_sense(sbp, sb_len, &ssh)))
+        return sense_cat(ssh.sense_key, ssh.asc, ssh.ascq);
+    return SG_LIB_CAT_SENSE;
+}
+
+/* See description in sg_lib.h header file */
+int
+sg_get_sense_info(const unsigned char * sbp, int sb_len,
+                  struct sg_sense_info * sip)
+{
+    int k, len, d_len, d_type;
+    const unsigned char * bp;
+
+    memset(sip, 0, sizeof(*sip));
+    if ((NULL == sbp) || (sb_len < 1) || (0x70 != (0x70 & sbp[0])))
+        return 0;
+    sip->response_code = (0x7f & sbp[0]);
+    if ((sb_len > 7) && (sb_len > (sbp[7] + 8)))
+        sb_len = sbp[7] + 8;    /* ignore bytes beyond additional length */
+    sip->sb_len = sb_len;
+    if (sip->response_code < 0x72) {    /* fixed format */
+        if (sb_len > 2) {
+            sip->sense_key = (0xf & sbp[2]);
+            sip->filemark = !!(0x80 & sbp[2]);
+            sip->eom = !!(0x40 & sbp[2]);
+            sip->ili = !!(0x20 & sbp[2]);
+        }
+        if (sb_len > 6) {
+            sip->info = sg_get_unaligned_be32(sbp + 3);
+            sip->info_valid = !!(0x80 & sbp[0]);
+        }
+        if (sb_len > 11) {
+            sip->cmd_info = sg_get_unaligned_be32(sbp + 8);
+            sip->cmd_info_valid = (sip->cmd_info > 0);
+        }
+        if (sb_len > 12)
+            sip->asc = sbp[12];
+        if (sb_len > 13)
+            sip->ascq = sbp[13];
+        if (sb_len > 14)
+            sip->fru_code = sbp[14];
+        if (sb_len > 17) {
+            memcpy(sip->sks, sbp + 15, 3);
+            sip->sksv = !!(0x80 & sbp[15]);
+        }
+    } else {                            /* descriptor format */
+        if (sb_len > 1)
+            sip->sense_key = (0xf & sbp[1]);
+        if (sb_len > 2)
+            sip->asc = sbp[2];
+        if (sb_len > 3)
+            sip->ascq = sbp[3];
+        /* walk the descriptors once, noting where each type starts */
+        for (k = 8; (k + 1) < sb_len; k += len) {
+            bp = sbp + k;
+            d_type = bp[0];
+            d_len = bp[1];
+            len = d_len + 2;
+            if ((k + len) > sb_len)
+                break;          /* truncated descriptor */
+            if ((d_type > SG_SENSE_INFO_MAX_DESC_TYPE) ||
+                sip->desc_off[d_type])
+                continue;
+            sip->desc_off[d_type] = k;
+            switch (d_type) {
+            case 0:             /* information */
+                if (0xa == d_len) {
+                    sip->info = sg_get_unaligned_be64(bp + 4);
+                    sip->info_valid = !!(0x80 & bp[2]);
+                }
+                break;
+            case 1:             /* command-specific information */
+                if (0xa == d_len) {
+                    sip->cmd_info = sg_get_unaligned_be64(bp + 4);
+                    sip->cmd_info_valid = 1;
+                }
+                break;
+            case 2:             /* sense key specific */
+                if (0x6 == d_len) {
+                    memcpy(sip->sks, bp + 4, 3);
+                    sip->sksv = !!(0x80 & bp[4]);
+                }
+                break;
+            case 3:             /* field replaceable unit */
+                if (d_len >= 2)
+                    sip->fru_code = bp[3];
+                break;
+            case 4:             /* stream commands */
+                if (d_len >= 2) {
+                    sip->filemark = !!(0x80 & bp[3]);
+                    sip->eom = !!(0x40 & bp[3]);
+                    sip->ili = !!(0x20 & bp[3]);
+                }
+                break;
+            case 5:             /* block commands */
+                if (d_len >= 2)
+                    sip->ili = !!(0x20 & bp[3]);
+                break;
+            case 0xa:           /* progress indication */
+                if (0x6 == d_len) {
+                    sip->progress = sg_get_unaligned_be16(bp + 6);
+                    sip->progress_valid = 1;
+                }
+                break;
+            default:
+                break;
+            }
         }
     }
-    return SG_LIB_CAT_SENSE;
+    /* sense key specific progress overrides the progress descriptor */
+    if (sip->sksv && ((SPC_SK_NO_SENSE == sip->sense_key) ||
+                      (SPC_SK_NOT_READY == sip->sense_key))) {
+        sip->progress = sg_get_unaligned_be16(sip->sks + 1);
+        sip->progress_valid = 1;
+    }
+    return 1;
+}
+
+/* See description in sg_lib.h header file */
+int
+sg_sense_info_category(const struct sg_sense_info * sip)
+{
+    if ((0 == sip->response_code) || (sip->sb_len < 3))
+        return SG_LIB_CAT_SENSE;
+    return sense_cat(sip->sense_key, sip->asc, sip->ascq);
 }
 
 /* Beware: gives wrong answer for variable length command (opcode=0x7f) */
@@ -1928,37 +2107,25 @@ sg_get_command_name(const unsigned char * cmdp, int peri_type, int buff_len,
     sg_get_opcode_sa_name(cmdp[0], service_action, peri_type, buff_len, buff);
 }
 
-struct op_code2sa_t {
-    int op_code;
-    int pdt_match;      /* -1->all; 0->disk,ZBC,RCB, 1->tape+adc+smc */
-    struct sg_lib_value_name_t * arr;
-    const char * prefix;
-};
-
-static struct op_code2sa_t op_code2sa_arr[] = {
-    {SG_VARIABLE_LENGTH_CMD, -1, sg_lib_variable_length_arr, NULL},
-    {SG_MAINTENANCE_IN, -1, sg_lib_maint_in_arr, NULL},
-    {SG_MAINTENANCE_OUT, -1, sg_lib_maint_out_arr, NULL},
-    {SG_SERVICE_ACTION_IN_12, -1, sg_lib_serv_in12_arr, NULL},
-    {SG_SERVICE_ACTION_OUT_12, -1, sg_lib_serv_out12_arr, NULL},
-    {SG_SERVICE_ACTION_IN_16, -1, sg_lib_serv_in16_arr, NULL},
-    {SG_SERVICE_ACTION_OUT_16, -1, sg_lib_serv_out16_arr, NULL},
-    {SG_SERVICE_ACTION_BIDI, -1, sg_lib_serv_bidi_arr, NULL},
-    {SG_PERSISTENT_RESERVE_IN, -1, sg_lib_pr_in_arr, "Persistent reserve in"},
-    {SG_PERSISTENT_RESERVE_OUT, -1, sg_lib_pr_out_arr,
-     "Persistent reserve out"},
-    {SG_3PARTY_COPY_OUT, -1, sg_lib_xcopy_sa_arr, NULL},
-    {SG_3PARTY_COPY_IN, -1, sg_lib_rec_copy_sa_arr, NULL},
-    {SG_READ_BUFFER, -1, sg_lib_read_buff_arr, "Read buffer(10)"},
-    {SG_READ_BUFFER_16, -1, sg_lib_read_buff_arr, "Read buffer(16)"},
-    {SG_READ_ATTRIBUTE, -1, sg_lib_read_attr_arr, "Read attribute"},
-    {SG_READ_POSITION, 1, sg_lib_read_pos_arr, "Read position"},
-    {SG_SANITIZE, 0, sg_lib_sanitize_sa_arr, "Sanitize"},
-    {SG_WRITE_BUFFER, -1, sg_lib_write_buff_arr, "Write buffer"},
-    {SG_ZONING_IN, 0, sg_lib_zoning_in_arr, NULL},
-    {SG_ZONING_OUT, 0, sg_lib_zoning_out_arr, NULL},
-    {0xffff, -1, NULL, NULL},
-};
+/* Returns entry in sg_lib_opcode_sa_arr[] for 'op_code' or NULL if that
+ * operation code does not take a service action. */
+static const struct sg_lib_opcode_sa_t *
+get_opcode_sa(int op_code)
+{
+    int lo, hi, mid;
+    const struct sg_lib_opcode_sa_t * osp = sg_lib_opcode_sa_arr;
+
+    for (lo = 0, hi = sg_lib_opcode_sa_num - 1; lo <= hi; ) {
+        mid = lo + ((hi - lo) / 2);
+        if (op_code == osp[mid].op_code)
+            return osp + mid;
+        else if (op_code < osp[mid].op_code)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
 
 void
 sg_get_opcode_sa_name(unsigned char cmd_byte0, int service_action,
@@ -1966,7 +2133,7 @@ sg_get_opcode_sa_name(unsigned char cmd_byte0, int service_action,
 {
     int d_pdt;
     const struct sg_lib_value_name_t * vnp;
-    const struct op_code2sa_t * osp;
+    const struct sg_lib_opcode_sa_t * osp;
     char b[80];
 
     if ((NULL == buff) || (buff_len < 1))
@@ -1979,27 +2146,21 @@ sg_get_opcode_sa_name(unsigned char cmd_byte0, int service_action,
     if (peri_type < 0)
         peri_type = 0;
     d_pdt = sg_lib_pdt_decay(peri_type);
-    for (osp = op_code2sa_arr; osp->arr; ++osp) {
-        if ((int)cmd_byte0 == osp->op_code) {
-            if ((osp->pdt_match < 0) || (d_pdt == osp->pdt_match)) {
-                vnp = get_value_name(osp->arr, service_action, peri_type);
-                if (vnp) {
-                    if (osp->prefix)
-                        scnpr(buff, buff_len, "%s, %s", osp->prefix,
-                              vnp->name);
-                    else
-                        scnpr(buff, buff_len, "%s", vnp->name);
-                } else {
-                    sg_get_opcode_name(cmd_byte0, peri_type, sizeof(b), b);
-                    scnpr(buff, buff_len, "%s service action=0x%x", b,
-                          service_action);
-                }
-            } else
-                sg_get_opcode_name(cmd_byte0, peri_type, buff_len, buff);
-            return;
+    osp = get_opcode_sa(cmd_byte0);
+    if (osp && ((osp->pdt_match < 0) || (d_pdt == osp->pdt_match))) {
+        vnp = get_value_name(osp->arr, osp->num, service_action, peri_type);
+        if (vnp) {
+            if (osp->prefix)
+                scnpr(buff, buff_len, "%s, %s", osp->prefix, vnp->name);
+            else
+                scnpr(buff, buff_len, "%s", vnp->name);
+        } else {
+            sg_get_opcode_name(cmd_byte0, peri_type, sizeof(b), b);
+            scnpr(buff, buff_len, "%s service action=0x%x", b,
+                  service_action);
         }
-    }
-    sg_get_opcode_name(cmd_byte0, peri_type, buff_len, buff);
+    } else
+        sg_get_opcode_name(cmd_byte0, peri_type, buff_len, buff);
 }
 
 void
@@ -2026,7 +2187,9 @@ sg_get_opcode_name(unsigned char cmd_byte0, int peri_type, int buff_len,
     case 2:
     case 4:
     case 5:
-        vnp = get_value_name(sg_lib_normal_opcodes, cmd_byte0, peri_type);
+        vnp = get_value_name(sg_lib_normal_opcodes,
+                             sg_lib_normal_opcodes_num, cmd_byte0,
+                             peri_type);
         if (vnp)
             scnpr(buff, buff_len, "%s", vnp->name);
         else
@@ -2248,133 +2411,104 @@ sg_get_category_sense_str(int sense_cat, int buff_len, char * buff,
 
 /* safe_strerror() contributed by Clayton Weaver <cgweav at email dot com>
  * Allows for situation in which strerror() is given a wild value (or the
- * C library is incomplete) and returns NULL. Still not thread safe.
+ * C library is incomplete) and returns NULL. Each thread has its own
+ * buffer when thread local storage is available (strerror() itself may
+ * still not be thread safe).
  */
 
-static char safe_errbuf[64] = {'u', 'n', 'k', 'n', 'o', 'w', 'n', ' ',
-                               'e', 'r', 'r', 'n', 'o', ':', ' ', 0};
+#ifdef SG_LIB_THREAD_LOCAL
+static SG_LIB_THREAD_LOCAL char safe_errbuf[64];
+#else
+static char safe_errbuf[64];
+#endif
 
 char *
 safe_strerror(int errnum)
 {
-    size_t len;
     char * errstr;
 
     if (errnum < 0)
         errnum = -errnum;
     errstr = strerror(errnum);
     if (NULL == errstr) {
-        len = strlen(safe_errbuf);
-        scnpr(safe_errbuf + len, sizeof(safe_errbuf) - len, "%i", errnum);
+        scnpr(safe_errbuf, sizeof(safe_errbuf), "unknown errno: %i",
+              errnum);
         return safe_errbuf;
     }
     return errstr;
 }
 
-static void
-trimTrailingSpaces(char * b)
+static const char lc_hex_digits[] = "0123456789abcdef";
+
+/* Places 'num' (1 to 16) bytes from 'p' as ASCII-hex into 'b' starting at
+ * offset 'bpos', 3 characters per byte with an extra space between the 8th
+ * and 9th bytes. Only the hex digits are written so 'b' should already be
+ * space filled. Returns the offset following the last hex digit. */
+static int
+hex_line_bytes(const unsigned char * p, int num, char * b, int bpos)
 {
     int k;
+    char * cp = b + bpos;
 
-    for (k = ((int)strlen(b) - 1); k >= 0; --k) {
-        if (' ' != b[k])
-            break;
+    for (k = 0; k < num; ++k, cp += 3) {
+        if (8 == k)
+            ++cp;
+        cp[0] = lc_hex_digits[p[k] >> 4];
+        cp[1] = lc_hex_digits[p[k] & 0xf];
     }
-    if ('\0' != b[k + 1])
-        b[k + 1] = '\0';
+    return (int)(cp - b) - 1;
 }
 
+#define DSHF_LINE_BLEN 80
+#define DSHF_OBUF_LEN 4096
+
 /* Note the ASCII-hex output goes to stdout. [Most other output from functions
  * in this file go to sg_warnings_strm (default stderr).]
  * 'no_ascii' allows for 3 output types:
  *     > 0     each line has address then up to 16 ASCII-hex bytes
  *     = 0     in addition, the bytes are listed in ASCII to the right
- *     < 0     only the ASCII-hex bytes are listed (i.e. without address) */
+ *     < 0     only the ASCII-hex bytes are listed (i.e. without address)
+ * Lines are built in a local buffer which is written to 'fp' when it is
+ * nearly full, rather than formatting each byte and line with stdio. */
 static void
 dStrHexFp(const char* str, int len, int no_ascii, FILE * fp)
 {
-    const char * p = str;
-    const char * formatstr;
-    unsigned char c;
-    char buff[82];
-    int a = 0;
-    int bpstart = 5;
-    const int cpstart = 60;
-    int cpos = cpstart;
-    int bpos = bpstart;
-    int i, k, blen;
+    const unsigned char * p = (const unsigned char *)str;
+    unsigned int u;
+    int a, k, n, lpos, opos;
+    char * lp;
+    char obuf[DSHF_OBUF_LEN];
 
     if (len <= 0)
         return;
-    blen = (int)sizeof(buff);
-    if (0 == no_ascii)  /* address at left and ASCII at right */
-        formatstr = "%.76s\n";
-    else if (no_ascii > 0)
-        formatstr = "%s\n";     /* was: "%.58s\n" */
-    else /* negative: no address at left and no ASCII at right */
-        formatstr = "%s\n";     /* was: "%.48s\n"; */
-    memset(buff, ' ', 80);
-    buff[80] = '\0';
-    if (no_ascii < 0) {
-        bpstart = 0;
-        bpos = bpstart;
-        for (k = 0; k < len; k++) {
-            c = *p++;
-            if (bpos == (bpstart + (8 * 3)))
-                bpos++;
-            scnpr(&buff[bpos], blen - bpos, "%.2x", (int)(unsigned char)c);
-            buff[bpos + 2] = ' ';
-            if ((k > 0) && (0 == ((k + 1) % 16))) {
-                trimTrailingSpaces(buff);
-                fprintf(fp, formatstr, buff);
-                bpos = bpstart;
-                memset(buff, ' ', 80);
-            } else
-                bpos += 3;
-        }
-        if (bpos > bpstart) {
-            buff[bpos + 2] = '\0';
-            trimTrailingSpaces(buff);
-            fprintf(fp, "%s\n", buff);
-        }
-        return;
-    }
-    /* no_ascii>=0, start each line with address (offset) */
-    k = scnpr(buff + 1, blen - 1, "%.2x", a);
-    buff[k + 1] = ' ';
-
-    for (i = 0; i < len; i++) {
-        c = *p++;
-        bpos += 3;
-        if (bpos == (bpstart + (9 * 3)))
-            bpos++;
-        scnpr(&buff[bpos], blen - bpos, "%.2x", (int)(unsigned char)c);
-        buff[bpos + 2] = ' ';
-        if (no_ascii)
-            buff[cpos++] = ' ';
+    for (a = 0, opos = 0; a < len; a += 16, p += 16) {
+        n = ((len - a) < 16) ? (len - a) : 16;
+        lp = obuf + opos;
+        memset(lp, ' ', DSHF_LINE_BLEN);
+        if (no_ascii < 0)
+            lpos = hex_line_bytes(p, n, lp, 0);
         else {
-            if (! my_isprint(c))
-                c = '.';
-            buff[cpos++] = c;
+            /* address (offset) starting in column 1, like "%.2x" */
+            for (k = 2, u = (unsigned int)a >> 8; u; u >>= 4)
+                ++k;
+            for (u = (unsigned int)a; k > 0; --k, u >>= 4)
+                lp[k] = lc_hex_digits[u & 0xf];
+            lpos = hex_line_bytes(p, n, lp, 8);
+            if (0 == no_ascii) {
+                for (k = 0; k < n; ++k)
+                    lp[60 + k] = my_isprint(p[k]) ? p[k] : '.';
+                lpos = 60 + n;
+            }
         }
-        if (cpos > (cpstart + 15)) {
-            if (no_ascii)
-                trimTrailingSpaces(buff);
-            fprintf(fp, formatstr, buff);
-            bpos = bpstart;
-            cpos = cpstart;
-            a += 16;
-            memset(buff, ' ', 80);
-            k = scnpr(buff + 1, blen - 1, "%.2x", a);
-            buff[k + 1] = ' ';
+        lp[lpos] = '\n';
+        opos += lpos + 1;
+        if (opos > (DSHF_OBUF_LEN - (DSHF_LINE_BLEN + 2))) {
+            fwrite(obuf, 1, opos, fp);
+            opos = 0;
         }
     }
-    if (cpos > cpstart) {
-        buff[cpos] = '\0';
-        if (no_ascii)
-            trimTrailingSpaces(buff);
-        fprintf(fp, "%s\n", buff);
-    }
+    if (opos > 0)
+        fwrite(obuf, 1, opos, fp);
 }
 
 void
@@ -2387,7 +2521,7 @@ void
 dStrHexErr(const char* str, int len, int no_ascii)
 {
     dStrHexFp(str, len, no_ascii,
-              (sg_warnings_strm ? sg_warnings_strm : stderr));
+              sg_get_warnings_strm());
 }
 
 #define DSHS_LINE_BLEN 160
@@ -2404,12 +2538,10 @@ int
 dStrHexStr(const char * str, int len, const char * leadin, int format,
            int b_len, char * b)
 {
-    unsigned char c;
-    int bpstart, bpos, k, n, prior_ascii_len;
+    int bpstart, cpstart, j, k, m, n, lpos;
     bool want_ascii;
-    char buff[DSHS_LINE_BLEN + 2];
-    char a[DSHS_BPL + 1];
-    const char * p = str;
+    char line[DSHS_LINE_BLEN + 2];
+    const unsigned char * p = (const unsigned char *)str;
 
     if (len <= 0) {
         if (b_len > 0)
@@ -2419,10 +2551,6 @@ dStrHexStr(const char * str, int len, const char * leadin, int format,
     if (b_len <= 0)
         return 0;
     want_ascii = !format;
-    if (want_ascii) {
-        memset(a, ' ', DSHS_BPL);
-        a[DSHS_BPL] = '\0';
-    }
     if (leadin) {
         bpstart = strlen(leadin);
         /* Cap leadin at (DSHS_LINE_BLEN - 70) characters */
@@ -2430,46 +2558,27 @@ dStrHexStr(const char * str, int len, const char * leadin, int format,
             bpstart = DSHS_LINE_BLEN - 70;
     } else
         bpstart = 0;
-    bpos = bpstart;
-    prior_ascii_len = bpstart + (DSHS_BPL * 3) + 1;
-    n = 0;
-    memset(buff, ' ', DSHS_LINE_BLEN);
-    buff[DSHS_LINE_BLEN] = '\0';
-    if (bpstart > 0)
-        memcpy(buff, leadin, bpstart);
-    for (k = 0; k < len; k++) {
-        c = *p++;
-        if (bpos == (bpstart + ((DSHS_BPL / 2) * 3)))
-            bpos++;     /* for extra space in middle of each line's hex */
-        scnpr(buff + bpos, (int)sizeof(buff) - bpos, "%.2x",
-              (int)(unsigned char)c);
-        buff[bpos + 2] = ' ';
-        if (want_ascii)
-            a[k % DSHS_BPL] = my_isprint(c) ? c : '.';
-        if ((k > 0) && (0 == ((k + 1) % DSHS_BPL))) {
-            trimTrailingSpaces(buff);
-            if (want_ascii) {
-                n += scnpr(b + n, b_len - n, "%-*s   %s\n", prior_ascii_len,
-                           buff, a);
-                memset(a, ' ', DSHS_BPL);
-            } else
-                n += scnpr(b + n, b_len - n, "%s\n", buff);
-            if (n >= (b_len - 1))
-                return n;
-            memset(buff, ' ', DSHS_LINE_BLEN);
-            bpos = bpstart;
-            if (bpstart > 0)
-                memcpy(buff, leadin, bpstart);
-        } else
-            bpos += 3;
-    }
-    if (bpos > bpstart) {
-        trimTrailingSpaces(buff);
-        if (want_ascii)
-            n += scnpr(b + n, b_len - n, "%-*s   %s\n", prior_ascii_len,
-                       buff, a);
-        else
-            n += scnpr(b + n, b_len - n, "%s\n", buff);
+    /* ASCII starts 3 spaces after the widest hex (plus middle space) */
+    cpstart = bpstart + (DSHS_BPL * 3) + 1 + 3;
+    for (k = 0, n = 0; k < len; k += DSHS_BPL, p += DSHS_BPL) {
+        if ((b_len - n) < 2)
+            break;
+        m = ((len - k) < DSHS_BPL) ? (len - k) : DSHS_BPL;
+        memset(line, ' ', DSHS_LINE_BLEN);
+        if (bpstart > 0)
+            memcpy(line, leadin, bpstart);
+        lpos = hex_line_bytes(p, m, line, bpstart);
+        if (want_ascii) {
+            for (j = 0; j < m; ++j)
+                line[cpstart + j] = my_isprint(p[j]) ? p[j] : '.';
+            lpos = cpstart + DSHS_BPL;
+        }
+        line[lpos++] = '\n';
+        if (lpos > (b_len - n - 1))
+            lpos = b_len - n - 1;       /* truncate, as snprintf() would */
+        memcpy(b + n, line, lpos);
+        n += lpos;
+        b[n] = '\0';
     }
     return n;
 }
@@ -2881,6 +2990,29 @@ sg_ata_get_chars(const unsigned short * word_arr, int start_word,
     return op - ochars;
 }
 
+/* Returns 1 if all b_len bytes at bp are zero, else 0 (also 0 if bp is
+ * NULL or b_len <= 0). The main loop ORs together 64 bytes per iteration
+ * without a branch per byte so compilers turn it into vector loads. */
+int
+sg_all_zeros(const unsigned char * bp, int b_len)
+{
+    int k;
+    uint64_t w[8];
+
+    if ((NULL == bp) || (b_len <= 0))
+        return 0;
+    for ( ; b_len >= (int)sizeof(w); bp += sizeof(w), b_len -= sizeof(w)) {
+        memcpy(w, bp, sizeof(w));
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+            return 0;
+    }
+    for (k = 0; k < b_len; ++k) {
+        if (bp[k])
+            return 0;
+    }
+    return 1;
+}
+
 const char *
 sg_lib_version()
 {
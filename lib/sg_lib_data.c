@@ -17,7 +17,7 @@
 #endif
 
 
-const char * sg_lib_version_str = "2.24 20160528";/* spc5r10, sbc4r10 */
+const char * sg_lib_version_str = "2.31 20160710";/* spc5r10, sbc4r10 */
 
 
 /* indexed by pdt; those that map to own index do not decay */
@@ -602,11 +602,74 @@ struct sg_lib_value_name_t sg_lib_read_attr_arr[] = {
     {0xffff, 0, NULL},
 };
 
+struct sg_lib_value_name_t sg_lib_read_pos_arr[] = {
+    {0xffff, 0, NULL},
+};
+
 #endif  /* SG_SCSI_STRINGS */
 
+/* Number of entries in a sg_lib_value_name_t array, excluding terminator */
+#define SG_LIB_VN_NUM(arr) ((int)(sizeof(arr) / sizeof(arr[0])) - 1)
+
+const int sg_lib_normal_opcodes_num = SG_LIB_VN_NUM(sg_lib_normal_opcodes);
+
+/* Operation codes whose command names are qualified by a service action.
+ * N.B. each sg_lib_value_name_t array above must be kept in ascending
+ * value order and this array in ascending op_code order since
+ * sg_get_opcode_name() and sg_get_opcode_sa_name() do binary searches
+ * on them. */
+struct sg_lib_opcode_sa_t sg_lib_opcode_sa_arr[] = {
+    {SG_READ_POSITION, 1, sg_lib_read_pos_arr,
+     SG_LIB_VN_NUM(sg_lib_read_pos_arr), "Read position"},
+    {SG_WRITE_BUFFER, -1, sg_lib_write_buff_arr,
+     SG_LIB_VN_NUM(sg_lib_write_buff_arr), "Write buffer"},
+    {SG_READ_BUFFER, -1, sg_lib_read_buff_arr,
+     SG_LIB_VN_NUM(sg_lib_read_buff_arr), "Read buffer(10)"},
+    {SG_SANITIZE, 0, sg_lib_sanitize_sa_arr,
+     SG_LIB_VN_NUM(sg_lib_sanitize_sa_arr), "Sanitize"},
+    {SG_PERSISTENT_RESERVE_IN, -1, sg_lib_pr_in_arr,
+     SG_LIB_VN_NUM(sg_lib_pr_in_arr), "Persistent reserve in"},
+    {SG_PERSISTENT_RESERVE_OUT, -1, sg_lib_pr_out_arr,
+     SG_LIB_VN_NUM(sg_lib_pr_out_arr), "Persistent reserve out"},
+    {SG_VARIABLE_LENGTH_CMD, -1, sg_lib_variable_length_arr,
+     SG_LIB_VN_NUM(sg_lib_variable_length_arr), NULL},
+    {SG_3PARTY_COPY_OUT, -1, sg_lib_xcopy_sa_arr,
+     SG_LIB_VN_NUM(sg_lib_xcopy_sa_arr), NULL},
+    {SG_3PARTY_COPY_IN, -1, sg_lib_rec_copy_sa_arr,
+     SG_LIB_VN_NUM(sg_lib_rec_copy_sa_arr), NULL},
+    {SG_READ_ATTRIBUTE, -1, sg_lib_read_attr_arr,
+     SG_LIB_VN_NUM(sg_lib_read_attr_arr), "Read attribute"},
+    {SG_ZONING_OUT, 0, sg_lib_zoning_out_arr,
+     SG_LIB_VN_NUM(sg_lib_zoning_out_arr), NULL},
+    {SG_ZONING_IN, 0, sg_lib_zoning_in_arr,
+     SG_LIB_VN_NUM(sg_lib_zoning_in_arr), NULL},
+    {SG_READ_BUFFER_16, -1, sg_lib_read_buff_arr,
+     SG_LIB_VN_NUM(sg_lib_read_buff_arr), "Read buffer(16)"},
+    {SG_SERVICE_ACTION_BIDI, -1, sg_lib_serv_bidi_arr,
+     SG_LIB_VN_NUM(sg_lib_serv_bidi_arr), NULL},
+    {SG_SERVICE_ACTION_IN_16, -1, sg_lib_serv_in16_arr,
+     SG_LIB_VN_NUM(sg_lib_serv_in16_arr), NULL},
+    {SG_SERVICE_ACTION_OUT_16, -1, sg_lib_serv_out16_arr,
+     SG_LIB_VN_NUM(sg_lib_serv_out16_arr), NULL},
+    {SG_MAINTENANCE_IN, -1, sg_lib_maint_in_arr,
+     SG_LIB_VN_NUM(sg_lib_maint_in_arr), NULL},
+    {SG_MAINTENANCE_OUT, -1, sg_lib_maint_out_arr,
+     SG_LIB_VN_NUM(sg_lib_maint_out_arr), NULL},
+    {SG_SERVICE_ACTION_OUT_12, -1, sg_lib_serv_out12_arr,
+     SG_LIB_VN_NUM(sg_lib_serv_out12_arr), NULL},
+    {SG_SERVICE_ACTION_IN_12, -1, sg_lib_serv_in12_arr,
+     SG_LIB_VN_NUM(sg_lib_serv_in12_arr), NULL},
+    {0xffff, -1, NULL, 0, NULL},
+};
+
+const int sg_lib_opcode_sa_num = SG_LIB_VN_NUM(sg_lib_opcode_sa_arr);
+
 /* A conveniently formatted list of SCSI ASC/ASCQ codes and their
  * corresponding text can be found at: www.t10.org/lists/asc-num.txt
- * The following should match asc-num.txt dated 20150423 */
+ * The following should match asc-num.txt dated 20150423
+ * N.B. both of the following arrays must be kept in ascending ASC then
+ * ASCQ (ascq_min for ranges) order, and ranges must not overlap, as
+ * sg_get_asc_ascq_str() does binary searches on them. */
 
 #ifdef SG_SCSI_STRINGS
 struct sg_lib_asc_ascq_range_t sg_lib_asc_ascq_range[] =
@@ -934,14 +997,14 @@ struct sg_lib_asc_ascq_t sg_lib_asc_ascq[] =
     {0x2A,0x07,"Implicit asymmetric access state transition failed"},
     {0x2A,0x08,"Priority changed"},
     {0x2A,0x09,"Capacity data has changed"},
+    {0x2A,0x0a,"Error history i_t nexus cleared"},
+    {0x2A,0x0b,"Error history snapshot released"},
     {0x2A,0x0c, "Error recovery attributes have changed"},
     {0x2A,0x0d, "Data encryption capabilities changed"},
     {0x2A,0x10,"Timestamp changed"},
     {0x2A,0x11,"Data encryption parameters changed by another i_t nexus"},
     {0x2A,0x12,"Data encryption parameters changed by vendor specific event"},
     {0x2A,0x13,"Data encryption key instance counter has changed"},
-    {0x2A,0x0a,"Error history i_t nexus cleared"},
-    {0x2A,0x0b,"Error history snapshot released"},
     {0x2A,0x14,"SA creation capabilities data has changed"},
     {0x2A,0x15,"Medium removal prevention preempted"},
     {0x2A,0x16,"Zone reset write pointer recommended"},
@@ -1396,6 +1459,12 @@ struct sg_lib_asc_ascq_t sg_lib_asc_ascq[] =
     {0, 0, NULL}
 };
 
+/* Number of entries in the above arrays, excluding the terminators */
+const int sg_lib_asc_ascq_range_num = (sizeof(sg_lib_asc_ascq_range) /
+                                       sizeof(sg_lib_asc_ascq_range[0])) - 1;
+const int sg_lib_asc_ascq_num = (sizeof(sg_lib_asc_ascq) /
+                                 sizeof(sg_lib_asc_ascq[0])) - 1;
+
 #else   /* SG_SCSI_STRINGS */
 
 struct sg_lib_asc_ascq_range_t sg_lib_asc_ascq_range[] =
@@ -1407,6 +1476,9 @@ struct sg_lib_asc_ascq_t sg_lib_asc_ascq[] =
 {
     {0, 0, NULL}
 };
+
+const int sg_lib_asc_ascq_range_num = 0;
+const int sg_lib_asc_ascq_num = 0;
 #endif /* SG_SCSI_STRINGS */
 
 const char * sg_lib_sense_key_desc[] = {
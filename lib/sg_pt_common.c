@@ -1,23 +1,733 @@
 /*
- * Copyright (c) 2009-2014 Douglas Gilbert.
+ * Copyright (c) 2009-2016 Douglas Gilbert.
  * All rights reserved.
  * Use of this source code is governed by a BSD-style
  * license that can be found in the BSD_LICENSE file.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
 
 #include "sg_pt.h"
+#include "sg_lib.h"
+#include "sg_lib_thread.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+/* Where threads are pthreads each thread's object pool is emptied when
+ * that thread exits */
+#if defined(SG_LIB_THREAD_LOCAL) && (! defined(SG_LIB_MINGW))
+#define SG_PT_POOL_DRAIN 1
+#include <pthread.h>
+#endif
+
+
+static const char * scsi_pt_version_str = "2.20 20160701";
+
+/* Number of released objects each thread may keep for reuse */
+#define SG_PT_POOL_SZ 4
+
+/* Without thread local storage the cache would need locking, so it is
+ * not used. */
+#ifdef SG_LIB_THREAD_LOCAL
+static SG_LIB_THREAD_LOCAL struct sg_pt_base * pt_pool[SG_PT_POOL_SZ];
+static SG_LIB_THREAD_LOCAL int pt_pool_count;
+#endif
+#ifdef SG_PT_POOL_DRAIN
+static pthread_once_t pt_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pt_pool_key;
+static int pt_pool_key_ok;
+static SG_LIB_THREAD_LOCAL int pt_pool_keyed;  /* key set in this thread */
+#endif
+
+static int lat_enabled = 0;
+
+#define LAT_NUM_HIST (SCSI_PT_LAT_NO_CDB + 1)
+
+/* Each thread's latency histograms, one per opcode (and one for no cdb),
+ * each allocated on first sample. Only the owning thread changes them;
+ * other threads read them for scsi_pt_lat_snapshot_all(), so counts are
+ * stored and loaded atomically (which costs nothing more on common
+ * architectures). Sets are kept on lat_sets, newest first, and never
+ * freed so samples of exited threads still count. Without thread local
+ * storage there is one set shared by all threads (and not thread safe). */
+struct pt_lat_set {
+    struct sg_pt_lat_hist * hist[LAT_NUM_HIST];
+    struct pt_lat_set * next;
+};
+
+#ifdef SG_LIB_THREAD_LOCAL
+static SG_LIB_THREAD_LOCAL struct pt_lat_set * lat_set;
+#define LAT_LOAD(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define LAT_STORE(v, val) __atomic_store_n(&(v), (val), __ATOMIC_RELAXED)
+#define LAT_LOAD_PTR(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define LAT_STORE_PTR(v, val) __atomic_store_n(&(v), (val), __ATOMIC_RELEASE)
+#else
+static struct pt_lat_set * lat_set;
+#define LAT_LOAD(v) (v)
+#define LAT_STORE(v, val) ((v) = (val))
+#define LAT_LOAD_PTR(v) (v)
+#define LAT_STORE_PTR(v, val) ((v) = (val))
+#endif
+static struct pt_lat_set * lat_sets;
+
+struct pt_trace_ring {
+    struct sg_pt_trace_rec * recs;
+    uint32_t num_recs;          /* a power of 2 */
+    uint32_t seq;
+    uint64_t head;              /* number of records placed in ring */
+    uint64_t tail;              /* number flushed or dropped */
+    struct pt_trace_ring * next;    /* on trace_rings list */
+};
+
+static int trace_num_recs = 0;  /* 0 -> tracing off */
+
+/* Trace rings, like the latency histograms, are per thread when thread
+ * local storage is available. Each ring is also placed on the trace_rings
+ * list, and kept when its thread exits, so scsi_pt_trace_flush_all() can
+ * reach every one. */
+#ifdef SG_LIB_THREAD_LOCAL
+static SG_LIB_THREAD_LOCAL struct pt_trace_ring * trace_ring;
+#else
+static struct pt_trace_ring * trace_ring;
+#endif
+static struct pt_trace_ring * trace_rings;
 
-static const char * scsi_pt_version_str = "2.12 20140606";
 
 const char *
 scsi_pt_version()
 {
     return scsi_pt_version_str;
 }
+
+#ifdef SG_PT_POOL_DRAIN
+/* Destructor of pt_pool_key, called as a thread that has put objects in
+ * its pool exits */
+static void
+pt_pool_drain(void * arg)
+{
+    (void)arg;
+    while (pt_pool_count > 0)
+        destruct_scsi_pt_obj(pt_pool[--pt_pool_count]);
+}
+
+static void
+pt_pool_key_init(void)
+{
+    pt_pool_key_ok = (0 == pthread_key_create(&pt_pool_key, pt_pool_drain));
+}
+#endif
+
+struct sg_pt_base *
+acquire_scsi_pt_obj(void)
+{
+#ifdef SG_LIB_THREAD_LOCAL
+    if (pt_pool_count > 0)
+        return pt_pool[--pt_pool_count];    /* cleared when released */
+#endif
+    return construct_scsi_pt_obj();
+}
+
+void
+release_scsi_pt_obj(struct sg_pt_base * objp)
+{
+    if (NULL == objp)
+        return;
+#ifdef SG_LIB_THREAD_LOCAL
+    if (pt_pool_count < SG_PT_POOL_SZ) {
+#ifdef SG_PT_POOL_DRAIN
+        if (! pt_pool_keyed) {
+            /* the key's value only needs to be non-NULL */
+            pthread_once(&pt_pool_once, pt_pool_key_init);
+            if ((! pt_pool_key_ok) ||
+                pthread_setspecific(pt_pool_key, pt_pool)) {
+                destruct_scsi_pt_obj(objp);
+                return;
+            }
+            pt_pool_keyed = 1;
+        }
+#endif
+        clear_scsi_pt_obj(objp);
+        pt_pool[pt_pool_count++] = objp;
+        return;
+    }
+#endif
+    destruct_scsi_pt_obj(objp);
+}
+
+void
+scsi_pt_lat_enable(int enable)
+{
+    lat_enabled = !! enable;
+}
+
+int
+scsi_pt_lat_enabled(void)
+{
+    return lat_enabled;
+}
+
+uint64_t
+scsi_pt_lat_now_ns(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (0 == clock_gettime(CLOCK_MONOTONIC, &ts))
+        return ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec;
+#endif
+    return 0;
+}
+
+/* Returns the bit position of the most significant set bit; n > 0 */
+static int
+msb_pos(uint64_t n)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(n);
+#else
+    int k;
+
+    for (k = 0; n > 1; ++k)
+        n >>= 1;
+    return k;
+#endif
+}
+
+static int
+lat_bucket_index(uint64_t ns)
+{
+    int msb;
+
+    if (ns < SCSI_PT_LAT_SUB_BUCKETS)
+        return (int)ns;
+    msb = msb_pos(ns);
+    if (msb >= SCSI_PT_LAT_MAX_BITS)
+        return SCSI_PT_LAT_NUM_BUCKETS - 1;
+    return ((msb - SCSI_PT_LAT_SUB_BITS + 1) * SCSI_PT_LAT_SUB_BUCKETS) +
+           (int)((ns >> (msb - SCSI_PT_LAT_SUB_BITS)) &
+                 (SCSI_PT_LAT_SUB_BUCKETS - 1));
+}
+
+/* Returns the highest value (in ns) that maps to bucket index k */
+static uint64_t
+lat_bucket_high(int k)
+{
+    int msb, sub;
+    uint64_t low;
+
+    if (k < SCSI_PT_LAT_SUB_BUCKETS)
+        return (uint64_t)k;
+    msb = (k / SCSI_PT_LAT_SUB_BUCKETS) + SCSI_PT_LAT_SUB_BITS - 1;
+    sub = k % SCSI_PT_LAT_SUB_BUCKETS;
+    low = ((uint64_t)1 << msb) +
+          ((uint64_t)sub << (msb - SCSI_PT_LAT_SUB_BITS));
+    return low + ((uint64_t)1 << (msb - SCSI_PT_LAT_SUB_BITS)) - 1;
+}
+
+/* Returns the calling thread's histogram set, creating it (and adding it
+ * to lat_sets) if need be. Returns NULL if out of memory. */
+static struct pt_lat_set *
+lat_get_set(void)
+{
+    struct pt_lat_set * sp = lat_set;
+
+    if (sp)
+        return sp;
+    sp = (struct pt_lat_set *)calloc(1, sizeof(*sp));
+    if (NULL == sp)
+        return NULL;
+#ifdef SG_LIB_THREAD_LOCAL
+    sp->next = __atomic_load_n(&lat_sets, __ATOMIC_RELAXED);
+    while (! __atomic_compare_exchange_n(&lat_sets, &sp->next, sp, 0,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+#else
+    lat_sets = sp;
+#endif
+    lat_set = sp;
+    return sp;
+}
+
+void
+scsi_pt_lat_record(int opcode, uint64_t nanosecs)
+{
+    int k;
+    struct pt_lat_set * sp;
+    struct sg_pt_lat_hist * hp;
+
+    if ((opcode < 0) || (opcode >= LAT_NUM_HIST))
+        return;
+    if (NULL == (sp = lat_get_set()))
+        return;
+    hp = sp->hist[opcode];
+    if (NULL == hp) {
+        hp = (struct sg_pt_lat_hist *)calloc(1, sizeof(*hp));
+        if (NULL == hp)
+            return;
+        LAT_STORE_PTR(sp->hist[opcode], hp);
+    }
+    /* only this thread stores to *hp so plain loads of it are safe */
+    if ((0 == hp->count) || (nanosecs < hp->min_ns))
+        LAT_STORE(hp->min_ns, nanosecs);
+    if (nanosecs > hp->max_ns)
+        LAT_STORE(hp->max_ns, nanosecs);
+    LAT_STORE(hp->count, hp->count + 1);
+    LAT_STORE(hp->sum_ns, hp->sum_ns + nanosecs);
+    k = lat_bucket_index(nanosecs);
+    LAT_STORE(hp->bucket[k], hp->bucket[k] + 1);
+}
+
+/* Adds the samples of src, which another thread may be updating, to dst */
+static void
+lat_merge_live(struct sg_pt_lat_hist * dst, struct sg_pt_lat_hist * src)
+{
+    int k;
+    struct sg_pt_lat_hist h;
+
+    h.count = LAT_LOAD(src->count);
+    if (0 == h.count)
+        return;
+    h.sum_ns = LAT_LOAD(src->sum_ns);
+    h.min_ns = LAT_LOAD(src->min_ns);
+    h.max_ns = LAT_LOAD(src->max_ns);
+    for (k = 0; k < SCSI_PT_LAT_NUM_BUCKETS; ++k)
+        h.bucket[k] = LAT_LOAD(src->bucket[k]);
+    scsi_pt_lat_merge(dst, &h);
+}
+
+void
+scsi_pt_lat_merge(struct sg_pt_lat_hist * dst,
+                  const struct sg_pt_lat_hist * src)
+{
+    int k;
+
+    if ((NULL == src) || (0 == src->count))
+        return;
+    if ((0 == dst->count) || (src->min_ns < dst->min_ns))
+        dst->min_ns = src->min_ns;
+    if (src->max_ns > dst->max_ns)
+        dst->max_ns = src->max_ns;
+    dst->count += src->count;
+    dst->sum_ns += src->sum_ns;
+    for (k = 0; k < SCSI_PT_LAT_NUM_BUCKETS; ++k)
+        dst->bucket[k] += src->bucket[k];
+}
+
+/* Merges the histogram(s) for opcode (-1 for all) of set sp into *hp */
+static void
+lat_snapshot_set(struct pt_lat_set * sp, int opcode,
+                 struct sg_pt_lat_hist * hp)
+{
+    int k;
+    struct sg_pt_lat_hist * shp;
+
+    for (k = 0; k < LAT_NUM_HIST; ++k) {
+        if ((opcode >= 0) && (k != opcode))
+            continue;
+        shp = LAT_LOAD_PTR(sp->hist[k]);
+        if (shp)
+            lat_merge_live(hp, shp);
+    }
+}
+
+uint64_t
+scsi_pt_lat_snapshot(int opcode, struct sg_pt_lat_hist * hp)
+{
+    memset(hp, 0, sizeof(*hp));
+    if (lat_set && (opcode < LAT_NUM_HIST))
+        lat_snapshot_set(lat_set, opcode, hp);
+    return hp->count;
+}
+
+uint64_t
+scsi_pt_lat_snapshot_all(int opcode, struct sg_pt_lat_hist * hp)
+{
+    struct pt_lat_set * sp;
+
+    memset(hp, 0, sizeof(*hp));
+    if (opcode >= LAT_NUM_HIST)
+        return 0;
+    for (sp = LAT_LOAD_PTR(lat_sets); sp; sp = sp->next)
+        lat_snapshot_set(sp, opcode, hp);
+    return hp->count;
+}
+
+void
+scsi_pt_lat_reset(void)
+{
+    int j, k;
+    struct sg_pt_lat_hist * hp;
+
+    if (NULL == lat_set)
+        return;
+    for (k = 0; k < LAT_NUM_HIST; ++k) {
+        if (NULL == (hp = lat_set->hist[k]))
+            continue;
+        LAT_STORE(hp->count, 0);
+        LAT_STORE(hp->sum_ns, 0);
+        LAT_STORE(hp->min_ns, 0);
+        LAT_STORE(hp->max_ns, 0);
+        for (j = 0; j < SCSI_PT_LAT_NUM_BUCKETS; ++j)
+            LAT_STORE(hp->bucket[j], 0);
+    }
+}
+
+uint64_t
+scsi_pt_lat_percentile(const struct sg_pt_lat_hist * hp, double percent)
+{
+    int k;
+    uint64_t target, sum, val;
+
+    if ((NULL == hp) || (0 == hp->count))
+        return 0;
+    if (percent >= 100.0)
+        return hp->max_ns;
+    target = (uint64_t)((percent / 100.0) * (double)hp->count);
+    if (target < 1)
+        target = 1;
+    for (k = 0, sum = 0; k < SCSI_PT_LAT_NUM_BUCKETS; ++k) {
+        sum += hp->bucket[k];
+        if (sum >= target)
+            break;
+    }
+    val = lat_bucket_high(k < SCSI_PT_LAT_NUM_BUCKETS ? k :
+                                              SCSI_PT_LAT_NUM_BUCKETS - 1);
+    return (val > hp->max_ns) ? hp->max_ns : val;
+}
+
+int
+scsi_pt_lat_str(const struct sg_pt_lat_hist * hp, const char * leadin,
+                int b_len, char * b)
+{
+    int n;
+
+    if (b_len < 1)
+        return 0;
+    n = snprintf(b, b_len, "%scount=%" PRIu64 " p50=%.1f p99=%.1f "
+                 "p99.9=%.1f max=%.1f microseconds", (leadin ? leadin : ""),
+                 hp->count, scsi_pt_lat_percentile(hp, 50.0) / 1000.0,
+                 scsi_pt_lat_percentile(hp, 99.0) / 1000.0,
+                 scsi_pt_lat_percentile(hp, 99.9) / 1000.0,
+                 hp->max_ns / 1000.0);
+    if (n < 0)
+        n = 0;
+    else if (n >= b_len)
+        n = b_len - 1;
+    return n;
+}
+
+void
+scsi_pt_trace_enable(int num_recs)
+{
+    int k;
+
+    if (num_recs <= 0) {
+        trace_num_recs = 0;
+        return;
+    }
+    for (k = 1; k < num_recs; k <<= 1)
+        ;
+    trace_num_recs = k;
+}
+
+int
+scsi_pt_trace_enabled(void)
+{
+    return (trace_num_recs > 0);
+}
+
+void
+scsi_pt_trace_record(const struct sg_pt_trace_rec * rp)
+{
+    struct pt_trace_ring * trp = trace_ring;
+    struct sg_pt_trace_rec * recp;
+
+    if (trace_num_recs <= 0)
+        return;
+    if (NULL == trp) {
+        trp = (struct pt_trace_ring *)calloc(1, sizeof(*trp));
+        if (NULL == trp)
+            return;
+#ifdef SG_LIB_THREAD_LOCAL
+        trp->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+        while (! __atomic_compare_exchange_n(&trace_rings, &trp->next, trp,
+                                             0, __ATOMIC_RELEASE,
+                                             __ATOMIC_RELAXED))
+            ;
+#else
+        trace_rings = trp;
+#endif
+        trace_ring = trp;
+    }
+    if ((int)trp->num_recs != trace_num_recs) {
+        /* first record or ring size changed, start again */
+        free(trp->recs);
+        trp->num_recs = 0;
+        trp->head = 0;
+        trp->tail = 0;
+        trp->recs = (struct sg_pt_trace_rec *)
+                    calloc(trace_num_recs, sizeof(struct sg_pt_trace_rec));
+        if (NULL == trp->recs)
+            return;
+        trp->num_recs = trace_num_recs;
+    }
+    recp = trp->recs + (trp->head & (trp->num_recs - 1));
+    memcpy(recp, rp, sizeof(*recp));
+    recp->seq = trp->seq++;
+    ++trp->head;
+}
+
+/* Writes all len bytes at bp to fd, continuing after short writes and
+ * EINTR. Returns 0 if okay, else a negated errno. */
+static int
+trace_write(int fd, const void * bp, size_t len)
+{
+    const unsigned char * cp = (const unsigned char *)bp;
+    ssize_t res;
+
+    while (len > 0) {
+        res = write(fd, cp, len);
+        if (res < 0) {
+            if (EINTR == errno)
+                continue;
+            return -errno;
+        } else if (0 == res)
+            return -EIO;
+        cp += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static int
+trace_flush_ring(int fd, struct pt_trace_ring * trp)
+{
+    int k, n, res;
+    uint64_t first;
+    struct sg_pt_trace_hdr hdr;
+
+    if ((NULL == trp) || (trp->head == trp->tail))
+        return 0;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SCSI_PT_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.rec_size = sizeof(struct sg_pt_trace_rec);
+    hdr.ring_id = (uint64_t)(unsigned long)trp;
+    first = trp->tail;
+    if ((trp->head - first) > trp->num_recs) {
+        first = trp->head - trp->num_recs;
+        hdr.dropped = first - trp->tail;
+    }
+    n = (int)(trp->head - first);
+    hdr.num_recs = n;
+    if ((res = trace_write(fd, &hdr, sizeof(hdr))))
+        return res;
+    /* oldest records may wrap around the end of the ring; at most 2 writes */
+    while (n > 0) {
+        k = (int)(first & (trp->num_recs - 1));
+        if (k + n > (int)trp->num_recs)
+            k = (int)trp->num_recs - k;
+        else
+            k = n;
+        res = trace_write(fd, trp->recs + (first & (trp->num_recs - 1)),
+                          k * sizeof(struct sg_pt_trace_rec));
+        if (res)
+            return res;
+        first += k;
+        n -= k;
+    }
+    n = (int)hdr.num_recs;
+    trp->tail = trp->head;
+    return n;
+}
+
+int
+scsi_pt_trace_flush(int fd)
+{
+    return trace_flush_ring(fd, trace_ring);
+}
+
+int
+scsi_pt_trace_flush_all(int fd)
+{
+    int res;
+    int n = 0;
+    struct pt_trace_ring * trp;
+
+#ifdef SG_LIB_THREAD_LOCAL
+    trp = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+#else
+    trp = trace_rings;
+#endif
+    for ( ; trp; trp = trp->next) {
+        res = trace_flush_ring(fd, trp);
+        if (res < 0)
+            return res;
+        n += res;
+    }
+    return n;
+}
+
+static const char * const trace_dir_arr[] = {"none", "in", "out", "bidi"};
+
+int
+scsi_pt_trace_rec_str(const struct sg_pt_trace_rec * rp, int verbose,
+                      int b_len, char * b)
+{
+    int k, n, cdb_len;
+    unsigned char sense[18];
+    char name[80];
+    char st[40];
+
+    if (b_len < 1)
+        return 0;
+    b[0] = '\0';
+    cdb_len = (rp->cdb_len < 16) ? rp->cdb_len : 16;
+    if (cdb_len > 0)
+        sg_get_command_name(rp->cdb, 0, sizeof(name), name);
+    else
+        sg_scnpr(name, sizeof(name), "task management function");
+    n = sg_scnpr(b, b_len, "%u: %" PRIu64 ".%06u %s [%s %u", rp->seq,
+              rp->start_ns / 1000000000,
+              (unsigned int)((rp->start_ns % 1000000000) / 1000), name,
+              trace_dir_arr[rp->dir & 0x3], rp->xfer_len);
+    if (rp->resid)
+        n += sg_scnpr(b + n, b_len - n, " resid=%d", rp->resid);
+    n += sg_scnpr(b + n, b_len - n, "] %.1f us", (rp->end_ns - rp->start_ns) /
+               1000.0);
+    if (rp->os_err)
+        n += sg_scnpr(b + n, b_len - n, ", %s", safe_strerror(rp->os_err));
+    else if (SCSI_PT_RESULT_TRANSPORT_ERR == rp->result_cat)
+        n += sg_scnpr(b + n, b_len - n, ", transport error");
+    else {
+        sg_get_scsi_status_str(rp->status, sizeof(st), st);
+        n += sg_scnpr(b + n, b_len - n, ", %s", st);
+    }
+    if (rp->sense_key || rp->asc || rp->ascq) {
+        sg_get_sense_key_str(rp->sense_key, sizeof(st), st);
+        n += sg_scnpr(b + n, b_len - n, ", %s", st);
+        sg_get_asc_ascq_str(rp->asc, rp->ascq, sizeof(name), name);
+        n += sg_scnpr(b + n, b_len - n, ", %s", name);
+    }
+    if (verbose > 0) {
+        n += sg_scnpr(b + n, b_len - n, "\n    cdb:");
+        for (k = 0; k < cdb_len; ++k)
+            n += sg_scnpr(b + n, b_len - n, " %02x", rp->cdb[k]);
+        if (rp->cdb_len > 16)
+            n += sg_scnpr(b + n, b_len - n, " ...");
+    }
+    if ((verbose > 1) && (rp->sense_key || rp->asc || rp->ascq)) {
+        /* only key, asc and ascq kept so rebuild as fixed format sense */
+        memset(sense, 0, sizeof(sense));
+        sense[0] = 0x70;
+        sense[2] = rp->sense_key & 0xf;
+        sense[7] = sizeof(sense) - 8;
+        sense[12] = rp->asc;
+        sense[13] = rp->ascq;
+        n += sg_scnpr(b + n, b_len - n, "\n");
+        n += sg_get_sense_str("    ", sense, sizeof(sense), 0, b_len - n,
+                              b + n);
+        if ((n > 0) && ('\n' == b[n - 1]))
+            b[--n] = '\0';
+    }
+    return n;
+}
+
+#ifndef SG_LIB_LINUX
+/* Only the Linux implementation passes a scatter gather list to the OS.
+ * Elsewhere each element is set in turn as a plain buffer so a single
+ * element list works while setting a second one marks the object as bad
+ * (as would any other replicated set_scsi_pt_... call). */
+void
+set_scsi_pt_data_in_iov(struct sg_pt_base * objp,
+                        const struct sg_pt_iovec * iovp, int iov_count)
+{
+    int k;
+
+    for (k = 0; k < iov_count; ++k)
+        set_scsi_pt_data_in(objp, (unsigned char *)iovp[k].iov_base,
+                            (int)iovp[k].iov_len);
+}
+
+void
+set_scsi_pt_data_out_iov(struct sg_pt_base * objp,
+                         const struct sg_pt_iovec * iovp, int iov_count)
+{
+    int k;
+
+    for (k = 0; k < iov_count; ++k)
+        set_scsi_pt_data_out(objp, (const unsigned char *)iovp[k].iov_base,
+                             (int)iovp[k].iov_len);
+}
+
+/* Only the Linux implementation currently has an asynchronous interface.
+ * Elsewhere start_scsi_pt() executes the command so that it has completed
+ * when it returns; hence there is never anything left to reap. */
+int
+start_scsi_pt(struct sg_pt_base * objp, int fd, int timeout_secs,
+              int verbose)
+{
+    return do_scsi_pt(objp, fd, timeout_secs, verbose);
+}
+
+int
+poll_scsi_pt(int fd, int wait_ms, int verbose)
+{
+    if (fd || wait_ms || verbose) { ; }     /* unused, suppress warning */
+    return 0;
+}
+
+int
+reap_scsi_pt(int fd, int wait_ms, struct sg_pt_base ** objpp, int verbose)
+{
+    if (fd || wait_ms || objpp || verbose) { ; }  /* suppress warning */
+    return -EAGAIN;
+}
+
+/* Since start_scsi_pt() has already completed the command there is none
+ * outstanding to finish; as for an idle object in Linux that is an error. */
+int
+finish_scsi_pt(struct sg_pt_base * objp, int fd, int verbose)
+{
+    if (objp || fd) { ; }       /* unused, suppress warning */
+    if (verbose)
+        fprintf(sg_get_warnings_strm(), "%s: no command outstanding on "
+                "this object\n", __func__);
+    return SCSI_PT_DO_BAD_PARAMS;
+}
+
+int
+scsi_pt_uring_enable(int num_cmds, int verbose)
+{
+    if (verbose) { ; }      /* unused, suppress warning */
+    return (num_cmds > 0) ? -ENOSYS : 0;
+}
+
+int
+scsi_pt_uring_submit(int verbose)
+{
+    if (verbose) { ; }      /* unused, suppress warning */
+    return 0;
+}
+
+int
+scsi_pt_mmap_buffer(int fd, int len, unsigned char ** bufpp, int verbose)
+{
+    if (fd || len || bufpp || verbose) { ; }  /* suppress warning */
+    return -ENOSYS;
+}
+
+void
+scsi_pt_mmap_release(int fd)
+{
+    if (fd) { ; }           /* unused, suppress warning */
+}
+#endif
@@ -0,0 +1,1197 @@
+/*
+ * Copyright (c) 2016 Douglas Gilbert.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the BSD_LICENSE file.
+ */
+
+/* sg_pt_emul version 1.04 20160716 */
+
+/*
+ * Emulates a SCSI direct access block device (i.e. a disk) whose medium
+ * is a regular file, typically a sparse one (e.g. made by 'truncate -s').
+ * Commands are served synchronously in the calling thread, so with the
+ * backing file on tmpfs this is close to a zero latency device. Intended
+ * for testing and benchmarking utilities without SCSI hardware.
+ *
+ * A device name of the form "emul:<file>" selects the emulator. When the
+ * SG3_UTILS_EMUL environment variable is set, device names that are
+ * regular files are also emulated by those utilities that open their
+ * device via scsi_pt_open_device() or scsi_pt_open_flags(). The value of
+ * that variable is a comma separated list of options:
+ *     bs=<n>    logical block size in bytes (default: 512)
+ *     mmap      access the backing file via mmap() rather than pread()
+ *               and pwrite()
+ *     ro        medium is write protected
+ *     bad=<lba>[+<num>]  reads of those blocks (default: 1) fail with an
+ *               unrecovered read error; may be given up to 8 times
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef SG_LIB_LINUX
+
+#include "sg_io_linux.h"
+#include "sg_unaligned.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+#define EMUL_MAX_DEVS 64
+#define EMUL_MAX_FDS 1024       /* backing file fds must be below this */
+#define EMUL_DEF_LB_SIZE 512
+#define EMUL_MAX_XFER_BYTES (8 * 1024 * 1024)
+#define EMUL_OPT_XFER_BYTES (1024 * 1024)
+#define EMUL_PAGE_BYTES 4096    /* granularity of hole punching */
+#define EMUL_WS_BUFF_BYTES (256 * 1024)
+#define EMUL_SENSE_LEN 18
+#define EMUL_MAX_BAD 8          /* bad=<lba>[+<num>] ranges */
+
+/* SCSI commands served, anything else gets INVALID COMMAND OPERATION
+ * CODE */
+#define TUR_CMD 0x0
+#define REQUEST_SENSE_CMD 0x3
+#define READ6_CMD 0x8
+#define WRITE6_CMD 0xa
+#define INQUIRY_CMD 0x12
+#define START_STOP_CMD 0x1b
+#define READ_CAPACITY10_CMD 0x25
+#define READ10_CMD 0x28
+#define WRITE10_CMD 0x2a
+#define VERIFY10_CMD 0x2f
+#define SYNC_CACHE10_CMD 0x35
+#define WRITE_SAME10_CMD 0x41
+#define UNMAP_CMD 0x42
+#define READ16_CMD 0x88
+#define WRITE16_CMD 0x8a
+#define VERIFY16_CMD 0x8f
+#define SYNC_CACHE16_CMD 0x91
+#define WRITE_SAME16_CMD 0x93
+#define SERVICE_ACTION_IN_16_CMD 0x9e
+#define READ12_CMD 0xa8
+#define WRITE12_CMD 0xaa
+
+#define READ_CAPACITY16_SA 0x10
+#define GET_LBA_STATUS_SA 0x12
+
+struct emul_dev {
+    int fd;                     /* backing file; also the caller's handle */
+    int lb_size;
+    int read_only;
+    uint64_t num_lbs;
+    uint64_t naa_id;            /* for the Device Identification VPD page */
+    unsigned char * map;        /* non-NULL when 'mmap' option given */
+    size_t map_len;
+    uint64_t bad_lba[EMUL_MAX_BAD];     /* reads give MEDIUM ERROR */
+    uint64_t bad_num[EMUL_MAX_BAD];
+    int bad_count;
+    int refs;                   /* changed atomically */
+    pthread_mutex_t lock;       /* protects following fields */
+    struct sg_io_hdr * done_arr; /* completed via sg_emul_write() */
+    int done_num;
+    int done_max;
+};
+
+/* Emulated devices are found from their fd in emul_fds[], which each
+ * command reads without a lock. emul_fds[] entries and emul_count are
+ * only changed, by sg_emul_open() and sg_emul_close(), while holding
+ * emul_arr_lock. Each emul_dev has a reference held by emul_fds[] (until
+ * closed) and one by each command being served on it, so it is only
+ * freed after the last command using it has finished. An entry's users
+ * counts the threads between reading edp and taking a reference on it;
+ * sg_emul_close() waits for that to fall to zero before dropping the
+ * reference held by emul_fds[]. */
+struct emul_fd_ent {
+    struct emul_dev * edp;
+    int users;
+};
+
+static struct emul_fd_ent emul_fds[EMUL_MAX_FDS];
+static int emul_count = 0;
+static pthread_mutex_t emul_arr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+#if defined(__GNUC__) || defined(__clang__)
+static int pr2ws(const char * fmt, ...)
+        __attribute__ ((format (printf, 1, 2)));
+#else
+static int pr2ws(const char * fmt, ...);
+#endif
+
+
+static int
+pr2ws(const char * fmt, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
+    va_end(args);
+    return n;
+}
+
+/* Returns the emulated device whose handle is fd with a reference taken
+ * on it (release with put_dev()), else NULL. Cheap when no device is
+ * emulated, as this is called for every command, and takes no lock. */
+static struct emul_dev *
+get_dev(int fd)
+{
+    struct emul_fd_ent * ep;
+    struct emul_dev * edp;
+
+    if ((fd < 0) || (fd >= EMUL_MAX_FDS) ||
+        (0 == __atomic_load_n(&emul_count, __ATOMIC_RELAXED)))
+        return NULL;
+    ep = emul_fds + fd;
+    __atomic_add_fetch(&ep->users, 1, __ATOMIC_SEQ_CST);
+    edp = __atomic_load_n(&ep->edp, __ATOMIC_SEQ_CST);
+    if (edp)
+        __atomic_add_fetch(&edp->refs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&ep->users, 1, __ATOMIC_RELEASE);
+    return edp;
+}
+
+/* Frees edp, and closes its backing file, when it has been closed by
+ * sg_emul_close() and this was the last reference to it. Returns the
+ * result of that close(), else 0. */
+static int
+put_dev(struct emul_dev * edp)
+{
+    int fd;
+
+    if (__atomic_sub_fetch(&edp->refs, 1, __ATOMIC_ACQ_REL))
+        return 0;
+    if (edp->map)
+        munmap(edp->map, edp->map_len);
+    pthread_mutex_destroy(&edp->lock);
+    if (edp->done_arr)
+        free(edp->done_arr);
+    fd = edp->fd;
+    free(edp);
+    return close(fd);
+}
+
+/* Returns 1 if device_name will be emulated by sg_emul_open(), else 0 */
+int
+sg_emul_is_emul_name(const char * device_name)
+{
+    struct stat a_stat;
+
+    if (NULL == device_name)
+        return 0;
+    if (0 == strncmp(device_name, SG_EMUL_PREFIX,
+                     sizeof(SG_EMUL_PREFIX) - 1))
+        return 1;
+    if (NULL == getenv(SG_EMUL_ENV))
+        return 0;
+    return ((0 == stat(device_name, &a_stat)) && S_ISREG(a_stat.st_mode));
+}
+
+/* Parses the options held in the SG3_UTILS_EMUL environment variable.
+ * Returns 0 if okay, else -1 . */
+static int
+parse_opts(const char * cp, struct emul_dev * edp, int * use_mmapp,
+           int verbose)
+{
+    int n;
+    const char * ncp;
+    char * ep;
+
+    for ( ; cp && *cp; cp = ncp) {
+        ncp = strchr(cp, ',');
+        n = ncp ? (ncp++ - cp) : (int)strlen(cp);
+        if (0 == n)
+            continue;
+        if ((n > 3) && (0 == strncmp(cp, "bs=", 3))) {
+            edp->lb_size = atoi(cp + 3);
+            if ((edp->lb_size < 512) || (edp->lb_size > 65536) ||
+                (edp->lb_size & (edp->lb_size - 1))) {
+                if (verbose)
+                    pr2ws("%s: bs= expects a power of 2 between 512 and "
+                          "65536\n", __func__);
+                return -1;
+            }
+        } else if ((n > 4) && (0 == strncmp(cp, "bad=", 4))) {
+            if (edp->bad_count >= EMUL_MAX_BAD) {
+                if (verbose)
+                    pr2ws("%s: too many bad= options\n", __func__);
+                return -1;
+            }
+            edp->bad_lba[edp->bad_count] = strtoull(cp + 4, &ep, 0);
+            edp->bad_num[edp->bad_count] = 1;
+            if ('+' == *ep)
+                edp->bad_num[edp->bad_count] = strtoull(ep + 1, &ep, 0);
+            if ((ep != (cp + n)) || (0 == edp->bad_num[edp->bad_count])) {
+                if (verbose)
+                    pr2ws("%s: bad= expects <lba>[+<num>]\n", __func__);
+                return -1;
+            }
+            ++edp->bad_count;
+        } else if ((4 == n) && (0 == strncmp(cp, "mmap", 4)))
+            *use_mmapp = 1;
+        else if ((2 == n) && (0 == strncmp(cp, "ro", 2)))
+            edp->read_only = 1;
+        else if ((1 == n) && ('1' == *cp))
+            ;   /* just enables emulation */
+        else {
+            if (verbose)
+                pr2ws("%s: unrecognised option: %.*s\n", __func__, n, cp);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Opens the backing file named by device_name (less any "emul:" prefix)
+ * and registers it as an emulated device. Acts like open(): returns the
+ * file descriptor to pass to the other functions or -1 with errno set. */
+int
+sg_emul_open(const char * device_name, int flags, int verbose)
+{
+    int fd, err, use_mmap, ok;
+    const char * fnp = device_name;
+    struct emul_dev * edp;
+    struct stat a_stat;
+
+    if (0 == strncmp(fnp, SG_EMUL_PREFIX, sizeof(SG_EMUL_PREFIX) - 1))
+        fnp += sizeof(SG_EMUL_PREFIX) - 1;
+    edp = (struct emul_dev *)calloc(1, sizeof(struct emul_dev));
+    if (NULL == edp) {
+        errno = ENOMEM;
+        return -1;
+    }
+    edp->lb_size = EMUL_DEF_LB_SIZE;
+    use_mmap = 0;
+    if (parse_opts(getenv(SG_EMUL_ENV), edp, &use_mmap, verbose)) {
+        free(edp);
+        errno = EINVAL;
+        return -1;
+    }
+    flags &= ~(O_CREAT | O_TRUNC | O_APPEND);
+    if (edp->read_only)
+        flags = (flags & ~O_ACCMODE) | O_RDONLY;
+    else if (O_RDONLY == (flags & O_ACCMODE))
+        edp->read_only = 1;
+    fd = open(fnp, flags);
+    if (fd < 0)
+        goto err_out;
+    if (fstat(fd, &a_stat) < 0)
+        goto close_err_out;
+    if (! S_ISREG(a_stat.st_mode)) {
+        if (verbose)
+            pr2ws("%s: %s is not a regular file\n", __func__, fnp);
+        errno = EINVAL;
+        goto close_err_out;
+    }
+    edp->fd = fd;
+    edp->num_lbs = (uint64_t)a_stat.st_size / edp->lb_size;
+    edp->naa_id = (((uint64_t)a_stat.st_dev << 40) ^
+                   (uint64_t)a_stat.st_ino) & 0x0fffffffffffffffULL;
+    edp->naa_id |= 0x3000000000000000ULL;      /* NAA: locally assigned */
+    if (use_mmap && (edp->num_lbs > 0)) {
+        edp->map_len = edp->num_lbs * edp->lb_size;
+        edp->map = (unsigned char *)mmap(NULL, edp->map_len,
+                        PROT_READ | (edp->read_only ? 0 : PROT_WRITE),
+                        MAP_SHARED, fd, 0);
+        if (MAP_FAILED == edp->map) {
+            if (verbose)
+                pr2ws("%s: mmap() failed: %s\n", __func__, strerror(errno));
+            goto close_err_out;
+        }
+    }
+    pthread_mutex_init(&edp->lock, NULL);
+    edp->refs = 1;              /* held by emul_fds[] */
+
+    pthread_mutex_lock(&emul_arr_lock);
+    ok = (fd < EMUL_MAX_FDS) && (emul_count < EMUL_MAX_DEVS);
+    if (ok) {
+        __atomic_store_n(&emul_fds[fd].edp, edp, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&emul_count, emul_count + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&emul_arr_lock);
+    if (! ok) {
+        if (verbose)
+            pr2ws("%s: too many emulated devices (or open files)\n",
+                  __func__);
+        pthread_mutex_destroy(&edp->lock);
+        if (edp->map)
+            munmap(edp->map, edp->map_len);
+        errno = EMFILE;
+        goto close_err_out;
+    }
+    if (verbose > 1)
+        pr2ws("%s: %s has %" PRIu64 " blocks of %d bytes%s%s\n", __func__,
+              fnp, edp->num_lbs, edp->lb_size, (edp->map ? ", mmap-ed" : ""),
+              (edp->read_only ? ", write protected" : ""));
+    return fd;
+
+close_err_out:
+    err = errno;
+    close(fd);
+    errno = err;
+err_out:
+    free(edp);
+    return -1;
+}
+
+/* Returns 1 if fd was returned by sg_emul_open() and has not been closed,
+ * else 0 */
+int
+sg_emul_fd(int fd)
+{
+    if ((fd < 0) || (fd >= EMUL_MAX_FDS) ||
+        (0 == __atomic_load_n(&emul_count, __ATOMIC_RELAXED)))
+        return 0;
+    return !! __atomic_load_n(&emul_fds[fd].edp, __ATOMIC_ACQUIRE);
+}
+
+/* Acts like close() on a fd returned by sg_emul_open(). If other threads
+ * are still being served on fd, the backing file is closed when the last
+ * of them finishes. */
+int
+sg_emul_close(int fd)
+{
+    struct emul_dev * edp = NULL;
+
+    if ((fd < 0) || (fd >= EMUL_MAX_FDS)) {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&emul_arr_lock);
+    edp = emul_fds[fd].edp;
+    if (edp) {
+        __atomic_store_n(&emul_fds[fd].edp, NULL, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&emul_count, emul_count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&emul_arr_lock);
+    if (NULL == edp) {
+        errno = EBADF;
+        return -1;
+    }
+    /* a get_dev() that read edp before it was removed takes its reference
+     * before users drops; that is only a few instructions */
+    while (__atomic_load_n(&emul_fds[fd].users, __ATOMIC_SEQ_CST))
+        ;
+    return put_dev(edp);        /* drop the reference held by emul_fds[] */
+}
+
+/* Builds fixed format sense data in hp's sense buffer and sets the status
+ * fields as the sg driver would for a CHECK CONDITION. */
+static void
+set_sense(struct sg_io_hdr * hp, int sense_key, int asc, int ascq,
+          int info_valid, uint64_t info)
+{
+    int n;
+    unsigned char sb[EMUL_SENSE_LEN];
+
+    memset(sb, 0, sizeof(sb));
+    sb[0] = 0x70;
+    if (info_valid && (info <= 0xffffffffULL)) {
+        sb[0] |= 0x80;
+        sg_put_unaligned_be32((uint32_t)info, sb + 3);
+    }
+    sb[2] = sense_key;
+    sb[7] = EMUL_SENSE_LEN - 8;
+    sb[12] = asc;
+    sb[13] = ascq;
+    hp->status = SAM_STAT_CHECK_CONDITION;
+    hp->masked_status = (SAM_STAT_CHECK_CONDITION >> 1) & 0x7f;
+    hp->driver_status = DRIVER_SENSE;
+    if (hp->sbp && (hp->mx_sb_len > 0)) {
+        n = (hp->mx_sb_len < EMUL_SENSE_LEN) ? hp->mx_sb_len :
+                                               EMUL_SENSE_LEN;
+        memcpy(hp->sbp, sb, n);
+        hp->sb_len_wr = n;
+    }
+}
+
+static void
+invalid_field(struct sg_io_hdr * hp)
+{
+    set_sense(hp, SPC_SK_ILLEGAL_REQUEST, 0x24, 0, 0, 0);
+}
+
+/* Sets status if lba and num are out of range or, when xfer is set, if
+ * num blocks exceeds the maximum transfer length. Returns 0 if okay, else
+ * -1 */
+static int
+check_range(const struct emul_dev * edp, struct sg_io_hdr * hp,
+            uint64_t lba, uint64_t num, int xfer)
+{
+    if ((lba > edp->num_lbs) || (num > (edp->num_lbs - lba))) {
+        set_sense(hp, SPC_SK_ILLEGAL_REQUEST, 0x21, 0, 0, 0);
+        return -1;
+    }
+    if (xfer && (num * edp->lb_size > EMUL_MAX_XFER_BYTES)) {
+        invalid_field(hp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Copies response held in rp (of length r_len) to the data-in buffer,
+ * truncated to alloc_len. */
+static void
+resp_in(struct sg_io_hdr * hp, const unsigned char * rp, int r_len,
+        int alloc_len)
+{
+    int n = (r_len < alloc_len) ? r_len : alloc_len;
+
+    if (SG_DXFER_FROM_DEV != hp->dxfer_direction)
+        n = 0;
+    else if (n > (int)hp->dxfer_len)
+        n = hp->dxfer_len;
+    if (n > 0)
+        memcpy(hp->dxferp, rp, n);
+    hp->resid = hp->dxfer_len - n;
+}
+
+/* Reads or writes num bytes at byte offset off of the medium. Returns 0
+ * if okay, else -1 . */
+static int
+medium_io(const struct emul_dev * edp, int is_write, unsigned char * bp,
+          uint64_t off, uint64_t num)
+{
+    ssize_t res;
+
+    if (edp->map) {
+        if (is_write)
+            memcpy(edp->map + off, bp, num);
+        else
+            memcpy(bp, edp->map + off, num);
+        return 0;
+    }
+    while (num > 0) {
+        if (is_write)
+            res = pwrite(edp->fd, bp, num, (off_t)off);
+        else
+            res = pread(edp->fd, bp, num, (off_t)off);
+        if (res < 0) {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        } else if (0 == res) {
+            if (is_write)
+                return -1;
+            memset(bp, 0, num);         /* backing file has shrunk */
+            break;
+        }
+        bp += res;
+        off += res;
+        num -= res;
+    }
+    return 0;
+}
+
+/* Deallocates the given range of blocks so they read back as zeros.
+ * Returns 0 if okay, else -1 . */
+static int
+punch_hole(const struct emul_dev * edp, uint64_t lba, uint64_t num)
+{
+    if (0 == num)
+        return 0;
+    return fallocate(edp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t)(lba * edp->lb_size),
+                     (off_t)(num * edp->lb_size));
+}
+
+static void
+resp_inquiry(const struct emul_dev * edp, struct sg_io_hdr * hp)
+{
+    int alloc_len, n;
+    const unsigned char * cdbp = hp->cmdp;
+    unsigned char b[64];
+
+    alloc_len = sg_get_unaligned_be16(cdbp + 3);
+    memset(b, 0, sizeof(b));
+    if (0 == (0x1 & cdbp[1])) {         /* standard INQUIRY */
+        if (cdbp[2]) {
+            invalid_field(hp);
+            return;
+        }
+        b[2] = 6;               /* claim SPC-4 */
+        b[3] = 0x12;            /* HISUP, response data format 2 */
+        b[4] = 36 - 5;
+        b[7] = 0x2;             /* CMDQUE */
+        memcpy(b + 8, "SG3UTILS", 8);
+        memcpy(b + 16, "Emulated disk   ", 16);
+        memcpy(b + 32, "0100", 4);
+        resp_in(hp, b, 36, alloc_len);
+        return;
+    }
+    b[1] = cdbp[2];
+    switch (cdbp[2]) {
+    case 0x0:           /* Supported VPD pages */
+        b[4] = 0x0;
+        b[5] = 0x83;
+        b[6] = 0xb0;
+        b[7] = 0xb2;
+        n = 4;
+        break;
+    case 0x83:          /* Device identification: one NAA designator */
+        b[4] = 0x1;             /* code set: binary */
+        b[5] = 0x3;             /* associated with lu, designator: NAA */
+        b[7] = 8;
+        sg_put_unaligned_be64(edp->naa_id, b + 8);
+        n = 12;
+        break;
+    case 0xb0:          /* Block limits */
+        b[4] = 0x1;             /* WSNZ */
+        sg_put_unaligned_be16((EMUL_PAGE_BYTES > edp->lb_size) ?
+                              EMUL_PAGE_BYTES / edp->lb_size : 1, b + 6);
+        sg_put_unaligned_be32(EMUL_MAX_XFER_BYTES / edp->lb_size, b + 8);
+        sg_put_unaligned_be32(EMUL_OPT_XFER_BYTES / edp->lb_size, b + 12);
+        sg_put_unaligned_be32(0xffffffff, b + 20);  /* max unmap lba cnt */
+        sg_put_unaligned_be32(0xffffffff, b + 24);  /* max unmap desc cnt */
+        sg_put_unaligned_be32((EMUL_PAGE_BYTES > edp->lb_size) ?
+                              EMUL_PAGE_BYTES / edp->lb_size : 1, b + 28);
+        n = 0x3c;
+        break;
+    case 0xb2:          /* Logical block provisioning */
+        b[5] = 0xe4;            /* LBPU, LBPWS, LBPWS10, LBPRZ=1 */
+        b[6] = 0x2;             /* thin provisioned */
+        n = 4;
+        break;
+    default:
+        invalid_field(hp);
+        return;
+    }
+    sg_put_unaligned_be16(n, b + 2);
+    resp_in(hp, b, n + 4, alloc_len);
+}
+
+static void
+resp_read_capacity(const struct emul_dev * edp, struct sg_io_hdr * hp,
+                   int is_16)
+{
+    unsigned char b[32];
+
+    memset(b, 0, sizeof(b));
+    if (is_16) {
+        sg_put_unaligned_be64(edp->num_lbs ? edp->num_lbs - 1 : 0, b + 0);
+        sg_put_unaligned_be32(edp->lb_size, b + 8);
+        b[14] = 0xc0;           /* LBPME, LBPRZ */
+        resp_in(hp, b, 32, sg_get_unaligned_be32(hp->cmdp + 10));
+    } else {
+        if (edp->num_lbs > 0xffffffffULL)
+            sg_put_unaligned_be32(0xffffffff, b + 0);
+        else
+            sg_put_unaligned_be32(edp->num_lbs ? edp->num_lbs - 1 : 0,
+                                  b + 0);
+        sg_put_unaligned_be32(edp->lb_size, b + 4);
+        resp_in(hp, b, 8, 8);
+    }
+}
+
+/* READ(6, 10, 12 and 16) and WRITE(6, 10, 12 and 16) */
+static void
+resp_read_write(const struct emul_dev * edp, struct sg_io_hdr * hp,
+                int is_write, uint64_t lba, uint32_t num)
+{
+    uint64_t len;
+
+    if (check_range(edp, hp, lba, num, 1))
+        return;
+    if (is_write && edp->read_only) {
+        set_sense(hp, SPC_SK_DATA_PROTECT, 0x27, 0, 0, 0);
+        return;
+    }
+    len = (uint64_t)num * edp->lb_size;
+    if ((len > 0) && ((len > hp->dxfer_len) ||
+                      ((is_write ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV) !=
+                       hp->dxfer_direction))) {
+        invalid_field(hp);
+        return;
+    }
+    if (! is_write) {   /* stop at the first bad= block, if any */
+        int k;
+        uint64_t bad = lba + num;
+
+        for (k = 0; k < edp->bad_count; ++k) {
+            if ((edp->bad_lba[k] < bad) &&
+                ((edp->bad_lba[k] + edp->bad_num[k]) > lba))
+                bad = (edp->bad_lba[k] > lba) ? edp->bad_lba[k] : lba;
+        }
+        if (bad < (lba + num)) {
+            if ((bad > lba) &&
+                medium_io(edp, 0, (unsigned char *)hp->dxferp,
+                          lba * edp->lb_size, (bad - lba) * edp->lb_size))
+                bad = lba;
+            set_sense(hp, SPC_SK_MEDIUM_ERROR, 0x11, 0, 1, bad);
+            return;
+        }
+    }
+    if (medium_io(edp, is_write, (unsigned char *)hp->dxferp,
+                  lba * edp->lb_size, len)) {
+        if (is_write)
+            set_sense(hp, SPC_SK_MEDIUM_ERROR, 0xc, 0, 1, lba);
+        else
+            set_sense(hp, SPC_SK_MEDIUM_ERROR, 0x11, 0, 1, lba);
+        return;
+    }
+    hp->resid = hp->dxfer_len - len;
+}
+
+/* VERIFY(10 and 16). BYTCHK=0 only checks that the blocks can be read,
+ * BYTCHK=1 compares each block with the data-out buffer and BYTCHK=3
+ * compares each block with the single block in the data-out buffer. On a
+ * miscompare the information field holds the byte offset of the first
+ * difference (counted over all blocks compared for BYTCHK=3). */
+static void
+resp_verify(const struct emul_dev * edp, struct sg_io_hdr * hp,
+            uint64_t lba, uint32_t num)
+{
+    int bytchk = (hp->cmdp[1] >> 1) & 0x3;
+    int k, j, per;
+    uint32_t n;
+    uint64_t off = 0;           /* bytes compared so far */
+    unsigned char * bp;
+    const unsigned char * dp = (const unsigned char *)hp->dxferp;
+    const unsigned char * cp;
+
+    if (check_range(edp, hp, lba, num, (1 == bytchk)))
+        return;
+    if ((2 == bytchk) || (bytchk && ((SG_DXFER_TO_DEV !=
+                                      hp->dxfer_direction) ||
+         (hp->dxfer_len < (unsigned int)((1 == bytchk) ? num : 1) *
+                          edp->lb_size)))) {
+        invalid_field(hp);
+        return;
+    }
+    per = EMUL_WS_BUFF_BYTES / edp->lb_size;
+    if (per < 1)
+        per = 1;
+    bp = (unsigned char *)malloc(per * edp->lb_size);
+    if (NULL == bp) {
+        set_sense(hp, SPC_SK_HARDWARE_ERROR, 0x55, 0x3, 0, 0);
+        return;
+    }
+    for ( ; num > 0; num -= n, lba += n) {
+        n = (num < (uint32_t)per) ? num : (uint32_t)per;
+        if (medium_io(edp, 0, bp, lba * edp->lb_size,
+                      (uint64_t)n * edp->lb_size)) {
+            set_sense(hp, SPC_SK_MEDIUM_ERROR, 0x11, 0, 1, lba);
+            break;
+        }
+        if (0 == bytchk)
+            continue;
+        if (1 == bytchk) {
+            if (0 == memcmp(bp, dp, n * edp->lb_size)) {
+                dp += n * edp->lb_size;
+                off += n * edp->lb_size;
+                continue;
+            }
+            for (k = 0; k < (int)n; ++k) {     /* find first miscompare */
+                if (memcmp(bp + (k * edp->lb_size), dp + (k * edp->lb_size),
+                           edp->lb_size))
+                    break;
+            }
+            cp = dp + (k * edp->lb_size);
+        } else {
+            for (k = 0; k < (int)n; ++k) {
+                if (memcmp(bp + (k * edp->lb_size), dp, edp->lb_size))
+                    break;
+            }
+            if (k >= (int)n) {
+                off += n * edp->lb_size;
+                continue;
+            }
+            cp = dp;
+        }
+        for (j = 0; j < edp->lb_size; ++j) {
+            if (bp[(k * edp->lb_size) + j] != cp[j])
+                break;
+        }
+        off += (uint64_t)k * edp->lb_size + j;
+        set_sense(hp, SPC_SK_MISCOMPARE, 0x1d, 0, 1, off);
+        break;
+    }
+    free(bp);
+}
+
+static void
+resp_sync_cache(const struct emul_dev * edp, struct sg_io_hdr * hp)
+{
+    int res;
+
+    if (edp->map)
+        res = msync(edp->map, edp->map_len, MS_SYNC);
+    else
+        res = fdatasync(edp->fd);
+    if (res < 0)
+        set_sense(hp, SPC_SK_MEDIUM_ERROR, 0xc, 0, 0, 0);
+}
+
+/* WRITE SAME(10 and 16). With the UNMAP bit set the blocks are
+ * deallocated (and then read back as zeros since LBPRZ is set), otherwise
+ * the single block of data (or zeros if NDOB) is replicated. */
+static void
+resp_write_same(const struct emul_dev * edp, struct sg_io_hdr * hp,
+                uint64_t lba, uint32_t num, int is_16)
+{
+    int unmap = !! (0x8 & hp->cmdp[1]);
+    int ndob = is_16 && (0x1 & hp->cmdp[1]);
+    int k, per;
+    uint32_t n;
+    unsigned char * bp;
+
+    if (0 == num) {             /* WSNZ set in Block Limits VPD page */
+        invalid_field(hp);
+        return;
+    }
+    if ((lba > edp->num_lbs) || (num > (edp->num_lbs - lba))) {
+        set_sense(hp, SPC_SK_ILLEGAL_REQUEST, 0x21, 0, 0, 0);
+        return;
+    }
+    if (edp->read_only) {
+        set_sense(hp, SPC_SK_DATA_PROTECT, 0x27, 0, 0, 0);
+        return;
+    }
+    if ((! ndob) && ((SG_DXFER_TO_DEV != hp->dxfer_direction) ||
+                     (hp->dxfer_len < (unsigned int)edp->lb_size))) {
+        invalid_field(hp);
+        return;
+    }
+    if (unmap && (0 == punch_hole(edp, lba, num)))
+        return;
+    per = EMUL_WS_BUFF_BYTES / edp->lb_size;
+    if (per < 1)
+        per = 1;
+    bp = (unsigned char *)calloc(per, edp->lb_size);
+    if (NULL == bp) {
+        set_sense(hp, SPC_SK_HARDWARE_ERROR, 0x55, 0x3, 0, 0);
+        return;
+    }
+    if (! ndob) {
+        for (k = 0; k < per; ++k)
+            memcpy(bp + (k * edp->lb_size), hp->dxferp, edp->lb_size);
+    }
+    for ( ; num > 0; num -= n, lba += n) {
+        n = (num < (uint32_t)per) ? num : (uint32_t)per;
+        if (medium_io(edp, 1, bp, lba * edp->lb_size,
+                      (uint64_t)n * edp->lb_size)) {
+            set_sense(hp, SPC_SK_MEDIUM_ERROR, 0xc, 0, 1, lba);
+            break;
+        }
+    }
+    free(bp);
+}
+
+static void
+resp_unmap(const struct emul_dev * edp, struct sg_io_hdr * hp)
+{
+    int k, num_desc;
+    int plen = sg_get_unaligned_be16(hp->cmdp + 7);
+    uint64_t lba;
+    uint32_t num;
+    const unsigned char * bp = (const unsigned char *)hp->dxferp;
+
+    if (0 == plen)
+        return;
+    if ((plen < 8) || (SG_DXFER_TO_DEV != hp->dxfer_direction) ||
+        ((int)hp->dxfer_len < plen)) {
+        invalid_field(hp);
+        return;
+    }
+    if (edp->read_only) {
+        set_sense(hp, SPC_SK_DATA_PROTECT, 0x27, 0, 0, 0);
+        return;
+    }
+    num_desc = sg_get_unaligned_be16(bp + 2) / 16;
+    if (8 + (num_desc * 16) > plen) {
+        set_sense(hp, SPC_SK_ILLEGAL_REQUEST, 0x26, 0, 0, 0);
+        return;
+    }
+    for (k = 0, bp += 8; k < num_desc; ++k, bp += 16) {
+        lba = sg_get_unaligned_be64(bp + 0);
+        num = sg_get_unaligned_be32(bp + 8);
+        if ((lba > edp->num_lbs) || (num > (edp->num_lbs - lba))) {
+            set_sense(hp, SPC_SK_ILLEGAL_REQUEST, 0x21, 0, 0, 0);
+            return;
+        }
+    }
+    bp = (const unsigned char *)hp->dxferp + 8;
+    for (k = 0; k < num_desc; ++k, bp += 16) {
+        lba = sg_get_unaligned_be64(bp + 0);
+        num = sg_get_unaligned_be32(bp + 8);
+        /* if hole punching is not supported then unmap is a no-op, which
+         * is allowed as LBPRZ only applies to deallocated blocks */
+        punch_hole(edp, lba, num);
+    }
+}
+
+/* GET LBA STATUS: reports mapped and deallocated extents starting at the
+ * given lba by walking the backing file with SEEK_DATA and SEEK_HOLE */
+static void
+resp_get_lba_status(const struct emul_dev * edp, struct sg_io_hdr * hp,
+                    uint64_t lba)
+{
+    int n, max_desc, deallocated;
+    int alloc_len = sg_get_unaligned_be32(hp->cmdp + 10);
+    uint64_t end_lba, num;
+    off_t off, next;
+    unsigned char * bp;
+
+    if ((alloc_len < 24) || (lba >= edp->num_lbs)) {
+        if (alloc_len < 24)
+            invalid_field(hp);
+        else
+            set_sense(hp, SPC_SK_ILLEGAL_REQUEST, 0x21, 0, 0, 0);
+        return;
+    }
+    max_desc = (alloc_len - 8) / 16;
+    if (max_desc > 256)
+        max_desc = 256;
+    bp = (unsigned char *)calloc(1, 8 + (max_desc * 16));
+    if (NULL == bp) {
+        set_sense(hp, SPC_SK_HARDWARE_ERROR, 0x55, 0x3, 0, 0);
+        return;
+    }
+    for (n = 0; (n < max_desc) && (lba < edp->num_lbs); ++n, lba = end_lba) {
+        off = (off_t)(lba * edp->lb_size);
+        next = lseek(edp->fd, off, SEEK_DATA);
+        if (next < 0) {
+            /* ENXIO: no data beyond off; else assume all mapped */
+            deallocated = (ENXIO == errno);
+            next = deallocated ? (off_t)(edp->num_lbs * edp->lb_size) : off;
+        } else
+            deallocated = (next > off);
+        if (deallocated)        /* partial block with data is mapped */
+            end_lba = (uint64_t)next / edp->lb_size;
+        else {
+            next = lseek(edp->fd, off, SEEK_HOLE);
+            if (next < 0)
+                end_lba = edp->num_lbs;
+            else
+                end_lba = ((uint64_t)next + edp->lb_size - 1) /
+                          edp->lb_size;
+        }
+        if (end_lba > edp->num_lbs)
+            end_lba = edp->num_lbs;
+        if (end_lba <= lba)
+            end_lba = lba + 1;
+        num = end_lba - lba;
+        if (num > 0xffffffffULL) {
+            num = 0xffffffffULL;
+            end_lba = lba + num;
+        }
+        sg_put_unaligned_be64(lba, bp + 8 + (n * 16));
+        sg_put_unaligned_be32((uint32_t)num, bp + 8 + (n * 16) + 8);
+        bp[8 + (n * 16) + 12] = deallocated ? 0x1 : 0x0;
+    }
+    sg_put_unaligned_be32(4 + (n * 16), bp + 0);
+    resp_in(hp, bp, 8 + (n * 16), alloc_len);
+    free(bp);
+}
+
+/* Executes the command in hp on edp, setting the status fields in hp */
+static void
+emul_exec(const struct emul_dev * edp, struct sg_io_hdr * hp)
+{
+    const unsigned char * cdbp = hp->cmdp;
+    unsigned char b[EMUL_SENSE_LEN];
+
+    hp->status = 0;
+    hp->masked_status = 0;
+    hp->msg_status = 0;
+    hp->sb_len_wr = 0;
+    hp->host_status = 0;
+    hp->driver_status = 0;
+    hp->resid = (SG_DXFER_NONE == hp->dxfer_direction) ? 0 : hp->dxfer_len;
+    hp->duration = 0;
+    switch (cdbp[0]) {
+    case TUR_CMD:
+    case START_STOP_CMD:
+        break;
+    case REQUEST_SENSE_CMD:
+        memset(b, 0, sizeof(b));
+        b[0] = 0x70;
+        b[7] = EMUL_SENSE_LEN - 8;
+        resp_in(hp, b, EMUL_SENSE_LEN, cdbp[4]);
+        break;
+    case INQUIRY_CMD:
+        resp_inquiry(edp, hp);
+        break;
+    case READ_CAPACITY10_CMD:
+        resp_read_capacity(edp, hp, 0);
+        break;
+    case READ6_CMD:
+    case WRITE6_CMD:
+        resp_read_write(edp, hp, (WRITE6_CMD == cdbp[0]),
+                        sg_get_unaligned_be24(cdbp + 1) & 0x1fffff,
+                        cdbp[4] ? cdbp[4] : 256);
+        break;
+    case READ10_CMD:
+    case WRITE10_CMD:
+        resp_read_write(edp, hp, (WRITE10_CMD == cdbp[0]),
+                        sg_get_unaligned_be32(cdbp + 2),
+                        sg_get_unaligned_be16(cdbp + 7));
+        break;
+    case READ12_CMD:
+    case WRITE12_CMD:
+        resp_read_write(edp, hp, (WRITE12_CMD == cdbp[0]),
+                        sg_get_unaligned_be32(cdbp + 2),
+                        sg_get_unaligned_be32(cdbp + 6));
+        break;
+    case READ16_CMD:
+    case WRITE16_CMD:
+        resp_read_write(edp, hp, (WRITE16_CMD == cdbp[0]),
+                        sg_get_unaligned_be64(cdbp + 2),
+                        sg_get_unaligned_be32(cdbp + 10));
+        break;
+    case VERIFY10_CMD:
+        resp_verify(edp, hp, sg_get_unaligned_be32(cdbp + 2),
+                    sg_get_unaligned_be16(cdbp + 7));
+        break;
+    case VERIFY16_CMD:
+        resp_verify(edp, hp, sg_get_unaligned_be64(cdbp + 2),
+                    sg_get_unaligned_be32(cdbp + 10));
+        break;
+    case SYNC_CACHE10_CMD:
+    case SYNC_CACHE16_CMD:
+        resp_sync_cache(edp, hp);
+        break;
+    case WRITE_SAME10_CMD:
+        resp_write_same(edp, hp, sg_get_unaligned_be32(cdbp + 2),
+                        sg_get_unaligned_be16(cdbp + 7), 0);
+        break;
+    case WRITE_SAME16_CMD:
+        resp_write_same(edp, hp, sg_get_unaligned_be64(cdbp + 2),
+                        sg_get_unaligned_be32(cdbp + 10), 1);
+        break;
+    case UNMAP_CMD:
+        resp_unmap(edp, hp);
+        break;
+    case SERVICE_ACTION_IN_16_CMD:
+        if (READ_CAPACITY16_SA == (0x1f & cdbp[1]))
+            resp_read_capacity(edp, hp, 1);
+        else if (GET_LBA_STATUS_SA == (0x1f & cdbp[1]))
+            resp_get_lba_status(edp, hp, sg_get_unaligned_be64(cdbp + 2));
+        else
+            invalid_field(hp);
+        break;
+    default:
+        set_sense(hp, SPC_SK_ILLEGAL_REQUEST, 0x20, 0, 0, 0);
+        break;
+    }
+    hp->info = (hp->status || hp->host_status || hp->driver_status) ?
+               SG_INFO_CHECK : SG_INFO_OK;
+    /* data is always moved straight to or from the user's buffer */
+    if ((SG_FLAG_DIRECT_IO & hp->flags) && (hp->dxfer_len > 0))
+        hp->info |= SG_INFO_DIRECT_IO;
+}
+
+/* Executes hp like emul_exec() but first handles a scatter gather list,
+ * if any, by way of a bounce buffer. Returns 0 if okay, else -1 with
+ * errno set. */
+static int
+exec_hdr(const struct emul_dev * edp, struct sg_io_hdr * hp)
+{
+    int k;
+    unsigned int n, len, off;
+    unsigned char * bp;
+    const struct sg_iovec * iovp = (const struct sg_iovec *)hp->dxferp;
+    struct sg_io_hdr h;
+
+    if ((0 == hp->iovec_count) || (0 == hp->dxfer_len)) {
+        emul_exec(edp, hp);
+        return 0;
+    }
+    for (k = 0, len = 0; k < hp->iovec_count; ++k)
+        len += iovp[k].iov_len;
+    if (len < hp->dxfer_len) {
+        errno = EINVAL;
+        return -1;
+    }
+    bp = (unsigned char *)malloc(hp->dxfer_len);
+    if (NULL == bp) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (SG_DXFER_TO_DEV == hp->dxfer_direction) {
+        for (k = 0, off = 0; off < hp->dxfer_len; off += n, ++k) {
+            n = hp->dxfer_len - off;
+            if (n > iovp[k].iov_len)
+                n = iovp[k].iov_len;
+            memcpy(bp + off, iovp[k].iov_base, n);
+        }
+    }
+    h = *hp;
+    h.dxferp = bp;
+    h.iovec_count = 0;
+    emul_exec(edp, &h);
+    if (SG_DXFER_FROM_DEV == hp->dxfer_direction) {
+        len = hp->dxfer_len - h.resid;
+        for (k = 0, off = 0; off < len; off += n, ++k) {
+            n = len - off;
+            if (n > iovp[k].iov_len)
+                n = iovp[k].iov_len;
+            memcpy(iovp[k].iov_base, bp + off, n);
+        }
+    }
+    free(bp);
+    h.dxferp = hp->dxferp;
+    h.iovec_count = hp->iovec_count;
+    *hp = h;
+    return 0;
+}
+
+/* Returns 0 if hp looks like a sg v3 request that can be executed, else
+ * -1 with errno set */
+static int
+check_hdr(const struct sg_io_hdr * hp)
+{
+    if ('S' != hp->interface_id) {
+        errno = ENOSYS;
+        return -1;
+    }
+    if ((NULL == hp->cmdp) || (hp->cmd_len < 6) ||
+        ((SG_DXFER_NONE != hp->dxfer_direction) && (hp->dxfer_len > 0) &&
+         (NULL == hp->dxferp))) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Acts like ioctl(fd, SG_IO, hp) on a sg device node */
+int
+sg_emul_sg_io(int fd, struct sg_io_hdr * hp)
+{
+    int res;
+    struct emul_dev * edp = get_dev(fd);
+
+    if (NULL == edp) {
+        errno = EBADF;
+        return -1;
+    }
+    res = check_hdr(hp) ? -1 : exec_hdr(edp, hp);
+    put_dev(edp);
+    return res;
+}
+
+/* Acts like write() of a sg v3 header to a sg device node. The command is
+ * executed immediately and its response is queued for sg_emul_read(). */
+int
+sg_emul_write(int fd, const struct sg_io_hdr * hp)
+{
+    int n;
+    int res = -1;
+    struct sg_io_hdr * dp;
+    struct sg_io_hdr h;
+    struct emul_dev * edp = get_dev(fd);
+
+    if (NULL == edp) {
+        errno = EBADF;
+        return -1;
+    }
+    if (check_hdr(hp))
+        goto fini;
+    h = *hp;
+    if (exec_hdr(edp, &h))
+        goto fini;
+    pthread_mutex_lock(&edp->lock);
+    if (edp->done_num >= edp->done_max) {
+        n = edp->done_max ? (2 * edp->done_max) : 16;
+        dp = (struct sg_io_hdr *)realloc(edp->done_arr, n * sizeof(*dp));
+        if (NULL == dp) {
+            pthread_mutex_unlock(&edp->lock);
+            errno = ENOMEM;
+            goto fini;
+        }
+        edp->done_arr = dp;
+        edp->done_max = n;
+    }
+    edp->done_arr[edp->done_num++] = h;
+    pthread_mutex_unlock(&edp->lock);
+    res = (int)sizeof(*hp);
+fini:
+    put_dev(edp);
+    return res;
+}
+
+/* Acts like read() of a sg v3 header from a sg device node with
+ * SG_SET_FORCE_PACK_ID active: fetches the oldest queued response with the
+ * pack_id given in hp. If hp->pack_id is -1 then the oldest queued
+ * response is fetched. When no such response is queued fails with
+ * EAGAIN. */
+int
+sg_emul_read(int fd, struct sg_io_hdr * hp)
+{
+    int k;
+    int res = -1;
+    struct emul_dev * edp = get_dev(fd);
+
+    if (NULL == edp) {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&edp->lock);
+    k = 0;
+    if (-1 != hp->pack_id) {
+        for ( ; k < edp->done_num; ++k) {
+            if (hp->pack_id == edp->done_arr[k].pack_id)
+                break;
+        }
+    }
+    if (k >= edp->done_num) {
+        errno = EAGAIN;
+        goto fini;
+    }
+    *hp = edp->done_arr[k];
+    --edp->done_num;
+    if (k < edp->done_num)
+        memmove(edp->done_arr + k, edp->done_arr + k + 1,
+                (edp->done_num - k) * sizeof(*hp));
+    res = (int)sizeof(*hp);
+fini:
+    pthread_mutex_unlock(&edp->lock);
+    put_dev(edp);
+    return res;
+}
+
+/* Returns number of responses queued on fd (like the SG_GET_NUM_WAITING
+ * ioctl) or -1 with errno set */
+int
+sg_emul_num_waiting(int fd)
+{
+    int n;
+    struct emul_dev * edp = get_dev(fd);
+
+    if (NULL == edp) {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&edp->lock);
+    n = edp->done_num;
+    pthread_mutex_unlock(&edp->lock);
+    put_dev(edp);
+    return n;
+}
+
+#endif /* SG_LIB_LINUX */
@@ -5,7 +5,7 @@
  * license that can be found in the BSD_LICENSE file.
  */
 
-/* sg_pt_linux version 1.26 20160405 */
+/* sg_pt_linux version 1.33 20160701 */
 
 
 #include <stdio.h>
@@ -16,7 +16,10 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -28,9 +31,17 @@
 #include "sg_pt.h"
 #include "sg_lib.h"
 #include "sg_linux_inc.h"
+#include "sg_io_linux.h"
+#include "sg_io_uring.h"
+#include "sg_lib_thread.h"
 
 #define DEF_TIMEOUT 60000       /* 60,000 millisecs (60 seconds) */
 
+/* States of an object used with start_scsi_pt() and friends */
+#define SG_PT_ASYNC_IDLE 0
+#define SG_PT_ASYNC_STARTED 1
+#define SG_PT_ASYNC_DONE 2
+
 static const char * linux_host_bytes[] = {
     "DID_OK", "DID_NO_CONNECT", "DID_BUS_BUSY", "DID_TIME_OUT",
     "DID_BAD_TARGET", "DID_ABORT", "DID_PARITY", "DID_ERROR",
@@ -101,11 +112,791 @@ pr2ws(const char * fmt, ...)
     int n;
 
     va_start(args, fmt);
-    n = vfprintf(sg_warnings_strm ? sg_warnings_strm : stderr, fmt, args);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
     va_end(args);
     return n;
 }
 
+/* Returns current time in nanoseconds if latency sampling or tracing is
+ * enabled, else 0 */
+static uint64_t
+sample_now(void)
+{
+    return (scsi_pt_lat_enabled() || scsi_pt_trace_enabled()) ?
+           scsi_pt_lat_now_ns() : 0;
+}
+
+/* Returns the number of bytes described by a scatter gather list */
+static unsigned int
+iov_total(const struct sg_pt_iovec * iovp, int iov_count)
+{
+    int k;
+    unsigned int n = 0;
+
+    for (k = 0; k < iov_count; ++k)
+        n += (unsigned int)iovp[k].iov_len;
+    return n;
+}
+
+/* The following wrap the ioctl(SG_IO), write() and read() of a sg v3
+ * header so that a fd opened on an emulated device (see sg_pt_emul.c) is
+ * served by the emulator. Same return conventions as the system calls. */
+static int
+sg_io_v3(int fd, struct sg_io_hdr * hp)
+{
+    return sg_emul_fd(fd) ? sg_emul_sg_io(fd, hp) : ioctl(fd, SG_IO, hp);
+}
+
+static int
+write_v3(int fd, const struct sg_io_hdr * hp)
+{
+    return sg_emul_fd(fd) ? sg_emul_write(fd, hp) :
+                            (int)write(fd, hp, sizeof(*hp));
+}
+
+static int
+read_v3(int fd, struct sg_io_hdr * hp)
+{
+    return sg_emul_fd(fd) ? sg_emul_read(fd, hp) :
+                            (int)read(fd, hp, sizeof(*hp));
+}
+
+/* What is known about a fd is kept in pt_fd_kind[], indexed by fd, so
+ * that fetching a response needs no more than the read(). It is filled by
+ * scsi_pt_open_flags() and, for fds opened elsewhere, by each
+ * start_scsi_pt(); scsi_pt_close_device() clears it. Fds too large for
+ * the table are looked at afresh each time. */
+#define PT_FD_KIND_MAX 1024
+#define PT_FD_KNOWN 1
+#define PT_FD_BSG 2             /* bsg (v4) node, else sg v3 */
+#define PT_FD_NONBLOCK 4        /* read() returns EAGAIN, never blocks */
+#define PT_FD_OPENED 8          /* by scsi_pt_open_flags() */
+
+static unsigned char pt_fd_kind[PT_FD_KIND_MAX];
+
+static int
+fd_kind_get(int fd)
+{
+    if ((fd < 0) || (fd >= PT_FD_KIND_MAX))
+        return 0;
+    return __atomic_load_n(pt_fd_kind + fd, __ATOMIC_RELAXED);
+}
+
+static void
+fd_kind_set(int fd, int kind)
+{
+    if ((fd >= 0) && (fd < PT_FD_KIND_MAX))
+        __atomic_store_n(pt_fd_kind + fd, (unsigned char)kind,
+                         __ATOMIC_RELAXED);
+}
+
+/* Returns PT_FD_NONBLOCK if a read() on fd will not block, 0 if it may,
+ * or a negated errno. The emulator never blocks. */
+static int
+fd_nonblock(int fd)
+{
+    int fl;
+
+    if (sg_emul_fd(fd))
+        return PT_FD_NONBLOCK;
+    fl = fcntl(fd, F_GETFL);
+    if (fl < 0)
+        return -errno;
+    return (fl & O_NONBLOCK) ? PT_FD_NONBLOCK : 0;
+}
+
+static int fd_probe(int fd, int verbose);
+
+/* Returns the PT_FD_* bits of fd, or a negated errno. They are found
+ * afresh when not known and, if at_start, when fd was opened elsewhere
+ * (so a fd number reused after a plain close() is not misjudged). */
+static int
+fd_kind(int fd, int at_start, int verbose)
+{
+    int kind = fd_kind_get(fd);
+
+    if ((0 == kind) || (at_start && (0 == (kind & PT_FD_OPENED)))) {
+        kind = fd_probe(fd, verbose);
+        if (kind < 0)
+            return kind;
+        fd_kind_set(fd, kind);
+    }
+    return kind;
+}
+
+/* Waits up to wait_ms milliseconds (negative: indefinitely) for fd to
+ * become readable. Returns 1 if it is, 0 on timeout, else a negated
+ * errno. */
+static int
+wait_fd(int fd, int wait_ms, int verbose)
+{
+    int res;
+    struct pollfd a_poll;
+
+    if (sg_emul_fd(fd))
+        return (sg_emul_num_waiting(fd) > 0) ? 1 : 0;
+    a_poll.fd = fd;
+    a_poll.events = POLLIN;
+    a_poll.revents = 0;
+    res = poll(&a_poll, 1, ((wait_ms < 0) ? -1 : wait_ms));
+    if (res < 0) {
+        res = errno;
+        if ((verbose > 1) && (EINTR != res))
+            pr2ws("poll() failed: %s (errno=%d)\n", strerror(res), res);
+        return -res;
+    } else if (0 == res)
+        return 0;
+    if (a_poll.revents & (POLLERR | POLLNVAL))
+        return -EIO;
+    return (a_poll.revents & POLLIN) ? 1 : 0;
+}
+
+/* Objects with a command in flight are held in a table hashed on their
+ * address. The usr_ptr handed back with a response is only used as the
+ * address of an object once it is found there, started on the same fd
+ * with the same cdb. So a response to a write() made on the fd by other
+ * code is rejected rather than followed. Each object holds its own entry
+ * (struct pt_started) so starting a command does not allocate. */
+struct pt_started {
+    struct pt_started * next;
+    const void * obj;
+    uint64_t req;       /* address of the cdb */
+    int fd;
+};
+
+#define PT_STARTED_SZ 64        /* buckets, a power of 2 */
+
+static struct pt_started * started_tbl[PT_STARTED_SZ];
+static int started_lock[PT_STARTED_SZ];   /* a spin lock per bucket */
+
+static int
+started_bucket(const void * obj)
+{
+    unsigned long u = (unsigned long)obj;
+
+    return (int)((u >> 4) ^ (u >> 10)) & (PT_STARTED_SZ - 1);
+}
+
+static void
+started_lock_bucket(int b)
+{
+    while (__atomic_exchange_n(started_lock + b, 1, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static void
+started_unlock_bucket(int b)
+{
+    __atomic_store_n(started_lock + b, 0, __ATOMIC_RELEASE);
+}
+
+/* Adds obj, whose entry is sp, to the table before its command (with cdb
+ * at req) is sent on fd */
+static void
+started_add(struct pt_started * sp, const void * obj, int fd, uint64_t req)
+{
+    int b = started_bucket(obj);
+
+    sp->obj = obj;
+    sp->fd = fd;
+    sp->req = req;
+    started_lock_bucket(b);
+    sp->next = started_tbl[b];
+    started_tbl[b] = sp;
+    started_unlock_bucket(b);
+}
+
+/* Removes obj from the table. If fd is negative any entry for obj is
+ * removed, otherwise only one started on fd with the cdb at req. obj is
+ * not dereferenced. Returns 1 if removed, 0 if not found. */
+static int
+started_take(const void * obj, int fd, uint64_t req)
+{
+    int b = started_bucket(obj);
+    struct pt_started ** spp;
+    struct pt_started * sp;
+
+    if (NULL == obj)
+        return 0;
+    started_lock_bucket(b);
+    for (spp = started_tbl + b; (sp = *spp); spp = &sp->next) {
+        if ((obj == sp->obj) &&
+            ((fd < 0) || ((fd == sp->fd) && (req == sp->req)))) {
+            *spp = sp->next;
+            sp->next = NULL;
+            break;
+        }
+    }
+    started_unlock_bucket(b);
+    return sp ? 1 : 0;
+}
+
+/* States of an io_uring slot, see below */
+#define PT_SLOT_FREE 0
+#define PT_SLOT_QUEUED 1        /* write (then read) queued or in flight */
+#define PT_SLOT_DONE 2          /* read completed or write failed */
+
+/* Each command started through the io_uring engine has a slot holding a
+ * copy of its v3 header (so the caller's header need not stay valid until
+ * the kernel gets to the write) and a header for the response read that
+ * follows the write. That read fetches any response ready on fd, which
+ * may belong to another command; usr_ptr in it tells which. */
+struct pt_uring_slot {
+    struct sg_io_hdr w_hdr;
+    struct sg_io_hdr r_hdr;
+    int fd;
+    int state;                  /* PT_SLOT_* */
+    int err;                    /* errno when the write or read failed */
+    int next;                   /* free or done list, -1 is the end */
+};
+
+struct pt_uring {
+    struct sg_uring * up;
+    int num_slots;
+    int num_used;               /* slots not PT_SLOT_FREE */
+    int free_head;
+    int done_head;              /* done list in completion order */
+    int done_tail;
+    struct pt_uring_slot * slots;
+    int fd_used[PT_FD_KIND_MAX];        /* slots in use for each fd */
+};
+
+/* Without thread local storage each thread can not have its own ring, so
+ * the io_uring engine is not offered. */
+#ifdef SG_LIB_THREAD_LOCAL
+static SG_LIB_THREAD_LOCAL struct pt_uring * pt_ur;
+#else
+static struct pt_uring * pt_ur;         /* always NULL */
+#endif
+
+/* io_uring user_data: slot index shifted left 2, ORed with one of these */
+#define PT_UD_WRITE 1
+#define PT_UD_READ 2
+
+/* Returns 1 if commands started on fd by this thread use io_uring. Fds
+ * beyond those counted in fd_used[] use write() and read(). */
+static int
+uring_use_fd(int fd)
+{
+    return pt_ur && (fd >= 0) && (fd < PT_FD_KIND_MAX) && (! sg_emul_fd(fd));
+}
+
+/* Returns 1 if this thread has any io_uring slot in use for fd */
+static int
+uring_owns_fd(int fd)
+{
+    return pt_ur && (fd >= 0) && (fd < PT_FD_KIND_MAX) &&
+           (pt_ur->fd_used[fd] > 0);
+}
+
+static void
+uring_free_slot(int idx)
+{
+    struct pt_uring_slot * sp = pt_ur->slots + idx;
+
+    sp->state = PT_SLOT_FREE;
+    sp->next = pt_ur->free_head;
+    pt_ur->free_head = idx;
+    --pt_ur->num_used;
+    --pt_ur->fd_used[sp->fd];
+}
+
+static void
+uring_slot_done(int idx, int err)
+{
+    struct pt_uring_slot * sp = pt_ur->slots + idx;
+
+    sp->state = PT_SLOT_DONE;
+    sp->err = err;
+    sp->next = -1;
+    if (pt_ur->done_head < 0)
+        pt_ur->done_head = idx;
+    else
+        pt_ur->slots[pt_ur->done_tail].next = idx;
+    pt_ur->done_tail = idx;
+}
+
+/* The response read asks for pack_id, as finish_scsi_pt() does, so when
+ * SG_SET_FORCE_PACK_ID is active on fd each slot gets its own response */
+static void
+uring_init_r_hdr(struct sg_io_hdr * hp, int pack_id)
+{
+    memset(hp, 0, sizeof(*hp));
+    hp->interface_id = 'S';
+    hp->pack_id = pack_id;
+}
+
+/* Queues the write of the v3 header hp to fd, followed by a read of any
+ * response. Nothing is passed to the kernel yet. Returns 0 if okay,
+ * -EAGAIN if this thread's slots are all in use, else a negated errno. */
+static int
+uring_start(int fd, const struct sg_io_hdr * hp, int verbose)
+{
+    int idx, res;
+    struct pt_uring_slot * sp;
+
+    idx = pt_ur->free_head;
+    if (idx < 0)
+        return -EAGAIN;
+    sp = pt_ur->slots + idx;
+    sp->w_hdr = *hp;
+    uring_init_r_hdr(&sp->r_hdr, hp->pack_id);
+    res = sg_uring_queue_write_read(pt_ur->up, fd, &sp->w_hdr, &sp->r_hdr,
+                                    sizeof(struct sg_io_hdr),
+                                    ((uint64_t)idx << 2) | PT_UD_WRITE,
+                                    ((uint64_t)idx << 2) | PT_UD_READ);
+    if (res) {
+        if (verbose > 1)
+            pr2ws("%s: unable to queue: %s\n", __func__,
+                  safe_strerror(-res));
+        return (-EBUSY == res) ? -EAGAIN : res;
+    }
+    pt_ur->free_head = sp->next;
+    ++pt_ur->num_used;
+    ++pt_ur->fd_used[fd];
+    sp->fd = fd;
+    sp->err = 0;
+    sp->state = PT_SLOT_QUEUED;
+    return 0;
+}
+
+/* Passes queued requests to the kernel then processes all completions
+ * that are ready. Returns 0 or a negated errno. */
+static int
+uring_harvest(int verbose)
+{
+    int res, idx, kind;
+    uint64_t ud;
+    struct pt_uring_slot * sp;
+
+    res = sg_uring_submit(pt_ur->up, 0);
+    if ((res < 0) && (-EINTR != res) && (-EAGAIN != res) &&
+        (-EBUSY != res))
+        return res;
+    while (sg_uring_reap(pt_ur->up, &ud, &res)) {
+        idx = (int)(ud >> 2);
+        kind = (int)(ud & 3);
+        if (idx >= pt_ur->num_slots)
+            continue;
+        sp = pt_ur->slots + idx;
+        if (PT_SLOT_QUEUED != sp->state)
+            continue;
+        if (PT_UD_WRITE == kind) {
+            /* on failure the linked read completes with -ECANCELED */
+            if (res < 0)
+                sp->err = -res;
+            else if (res != (int)sizeof(struct sg_io_hdr))
+                sp->err = EIO;
+            continue;
+        }
+        if (sp->err)                    /* write failed */
+            uring_slot_done(idx, sp->err);
+        else if (res == (int)sizeof(struct sg_io_hdr))
+            uring_slot_done(idx, 0);
+        else if ((-EAGAIN == res) || (-EINTR == res)) {
+            /* another read took the response this one was woken for */
+            uring_init_r_hdr(&sp->r_hdr, sp->w_hdr.pack_id);
+            res = sg_uring_queue_read(pt_ur->up, sp->fd, &sp->r_hdr,
+                                      sizeof(struct sg_io_hdr), ud);
+            if (res)
+                uring_slot_done(idx, -res);
+        } else {
+            if (verbose > 1)
+                pr2ws("%s: read(sg) failed: %s\n", __func__,
+                      safe_strerror((res < 0) ? -res : EIO));
+            uring_slot_done(idx, (res < 0) ? -res : EIO);
+        }
+    }
+    return 0;
+}
+
+/* Each implementation below defines this. complete_v3() places the
+ * response in rhp, or if err is non zero that errno, in ptp. */
+struct sg_pt_linux_scsi;
+static void complete_v3(struct sg_pt_linux_scsi * ptp,
+                        const struct sg_io_hdr * rhp, int err);
+
+/* Applies the io_uring slot idx, taken from the done list, to the object
+ * it belongs to, whose address is written to *ptpp. If the write or read
+ * failed that object's os_err is set. Returns 0 if okay, else -EINVAL if
+ * the response was not to a command started by this library on the fd. */
+static int
+uring_complete(int idx, struct sg_pt_linux_scsi ** ptpp, int verbose)
+{
+    struct pt_uring_slot * sp = pt_ur->slots + idx;
+    struct sg_pt_linux_scsi * ptp;
+    int err = sp->err;
+    const struct sg_io_hdr * hp = err ? &sp->w_hdr : &sp->r_hdr;
+
+    ptp = (struct sg_pt_linux_scsi *)hp->usr_ptr;
+    if (! started_take(ptp, sp->fd, (uint64_t)(long)hp->cmdp)) {
+        uring_free_slot(idx);
+        if (verbose)
+            pr2ws("%s: response has no matching object\n", __func__);
+        return -EINVAL;
+    }
+    complete_v3(ptp, &sp->r_hdr, err);
+    uring_free_slot(idx);
+    *ptpp = ptp;
+    return 0;
+}
+
+/* Returns the number of completed slots for fd */
+static int
+uring_num_done(int fd)
+{
+    int k;
+    int num = 0;
+
+    for (k = pt_ur->done_head; k >= 0; k = pt_ur->slots[k].next) {
+        if (fd == pt_ur->slots[k].fd)
+            ++num;
+    }
+    return num;
+}
+
+/* Waits up to wait_ms milliseconds (0: no wait, negative: indefinitely)
+ * for completions on the ring. Returns 0 or a negated errno. */
+static int
+uring_wait(int wait_ms, int verbose)
+{
+    int res;
+    struct pollfd a_poll;
+
+    a_poll.fd = sg_uring_fd(pt_ur->up);
+    a_poll.events = POLLIN;
+    a_poll.revents = 0;
+    res = poll(&a_poll, 1, ((wait_ms < 0) ? -1 : wait_ms));
+    if (res < 0) {
+        res = errno;
+        if ((verbose > 1) && (EINTR != res))
+            pr2ws("poll(io_uring) failed: %s\n", strerror(res));
+        return -res;
+    }
+    return 0;
+}
+
+/* Removes the oldest completed slot for fd from the done list, waiting up
+ * to wait_ms milliseconds for one. Returns its index, -EAGAIN if none,
+ * else a negated errno. */
+static int
+uring_reap_slot(int fd, int wait_ms, int verbose)
+{
+    int k, res, prev;
+
+    while (1) {
+        res = uring_harvest(verbose);
+        if (res < 0)
+            return res;
+        for (prev = -1, k = pt_ur->done_head; k >= 0;
+             prev = k, k = pt_ur->slots[k].next) {
+            if (fd != pt_ur->slots[k].fd)
+                continue;
+            if (prev < 0)
+                pt_ur->done_head = pt_ur->slots[k].next;
+            else
+                pt_ur->slots[prev].next = pt_ur->slots[k].next;
+            if (pt_ur->done_tail == k)
+                pt_ur->done_tail = prev;
+            return k;
+        }
+        if (0 == wait_ms)
+            return -EAGAIN;
+        res = uring_wait(wait_ms, verbose);
+        if (res < 0)
+            return res;
+        if (wait_ms > 0)
+            wait_ms = 0;        /* check once more, then give up */
+    }
+}
+
+/* Turns this thread's io_uring engine on with room for num_cmds commands,
+ * or off when num_cmds is 0. */
+int
+scsi_pt_uring_enable(int num_cmds, int verbose)
+{
+    int k, err;
+    struct pt_uring * urp;
+
+    if (pt_ur) {
+        if (pt_ur->num_used > 0) {
+            if (verbose)
+                pr2ws("%s: %d commands outstanding\n", __func__,
+                      pt_ur->num_used);
+            return -EBUSY;
+        }
+        sg_uring_destroy(pt_ur->up);
+        free(pt_ur->slots);
+        free(pt_ur);
+        pt_ur = NULL;
+    }
+    if (num_cmds <= 0)
+        return 0;
+#ifndef SG_LIB_THREAD_LOCAL
+    if (k || err || urp) { ; }  /* unused, suppress warning */
+    return -ENOSYS;
+#else
+    urp = (struct pt_uring *)calloc(1, sizeof(*urp));
+    if (NULL == urp)
+        return -ENOMEM;
+    urp->slots = (struct pt_uring_slot *)calloc(num_cmds,
+                                                sizeof(*urp->slots));
+    if (NULL == urp->slots) {
+        free(urp);
+        return -ENOMEM;
+    }
+    /* each command needs a write, a poll and a read entry */
+    urp->up = sg_uring_create(3 * num_cmds, verbose);
+    if (NULL == urp->up) {
+        err = errno;
+        if (verbose && (ENOSYS == err))
+            pr2ws("%s: io_uring not available, using write() and "
+                  "read()\n", __func__);
+        free(urp->slots);
+        free(urp);
+        return -err;
+    }
+    urp->num_slots = num_cmds;
+    for (k = 0; k < num_cmds; ++k)
+        urp->slots[k].next = k + 1;
+    urp->slots[num_cmds - 1].next = -1;
+    urp->free_head = 0;
+    urp->done_head = -1;
+    urp->done_tail = -1;
+    pt_ur = urp;
+    return 0;
+#endif
+}
+
+/* Passes this thread's queued commands to the kernel */
+int
+scsi_pt_uring_submit(int verbose)
+{
+    int res;
+
+    if (NULL == pt_ur)
+        return 0;
+    res = sg_uring_submit(pt_ur->up, 0);
+    if ((res < 0) && verbose)
+        pr2ws("%s: %s\n", __func__, safe_strerror(-res));
+    return res;
+}
+
+/* Waits up to wait_ms milliseconds for a response to become available on
+ * fd. Same for sg v3 and bsg (v4) device nodes. When this thread's
+ * io_uring engine has commands on fd, waits on its ring instead. Returns
+ * number of responses waiting, 0 if none, or a negated errno. */
+int
+poll_scsi_pt(int fd, int wait_ms, int verbose)
+{
+    int res, num;
+
+    if (sg_emul_fd(fd)) {       /* emulator responds before this is called */
+        num = sg_emul_num_waiting(fd);
+        return (num < 0) ? -errno : num;
+    }
+    if (uring_owns_fd(fd)) {
+        res = uring_harvest(verbose);
+        if ((0 == res) && (0 == (num = uring_num_done(fd))) && wait_ms) {
+            res = uring_wait(wait_ms, verbose);
+            if (0 == res)
+                res = uring_harvest(verbose);
+            num = uring_num_done(fd);
+        }
+        return (res < 0) ? res : num;
+    }
+    res = wait_fd(fd, wait_ms, verbose);
+    if (res <= 0)
+        return res;
+    /* sg driver can say how many; bsg can't, but there is at least one */
+    if ((ioctl(fd, SG_GET_NUM_WAITING, &num) < 0) || (num < 1))
+        num = 1;
+    return num;
+}
+
+#ifndef SG_FLAG_MMAP_IO
+#define SG_FLAG_MMAP_IO 4
+#endif
+
+#define PT_MMAP_MAX_FDS 16
+#define PT_MMAP_MIN_LEN 8192    /* smallest reserved buffer to map */
+
+/* One entry per fd that has had scsi_pt_mmap_buffer() called on it. For
+ * emulated disks there is no reserved buffer so a heap buffer stands in
+ * (the emulator copies into it like any other buffer). An entry is
+ * unused when base is NULL. pt_mm[] and pt_mm_num are only changed, and
+ * pt_mm[] only read, while holding pt_mm_lock; pt_mm_num may be read
+ * without it to skip that lock when nothing is mapped. */
+struct pt_mmap {
+    int fd;
+    int len;                    /* bytes mapped (or allocated) */
+    int heap;                   /* 1 if base came from posix_memalign() */
+    unsigned char * base;
+};
+
+static struct pt_mmap pt_mm[PT_MMAP_MAX_FDS];
+static int pt_mm_num;           /* number of entries in use */
+static pthread_mutex_t pt_mm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Call with pt_mm_lock held */
+static struct pt_mmap *
+mmap_find(int fd)
+{
+    int k;
+
+    if (pt_mm_num > 0) {
+        for (k = 0; k < PT_MMAP_MAX_FDS; ++k) {
+            if (pt_mm[k].base && (fd == pt_mm[k].fd))
+                return pt_mm + k;
+        }
+    }
+    return NULL;
+}
+
+/* Call with pt_mm_lock held */
+static void
+mmap_free(struct pt_mmap * mp)
+{
+    if (mp->heap)
+        free(mp->base);
+    else
+        munmap(mp->base, mp->len);
+    mp->base = NULL;
+    __atomic_store_n(&pt_mm_num, pt_mm_num - 1, __ATOMIC_RELAXED);
+}
+
+/* Called just before the v3 header hp is sent to fd. If the data buffer
+ * is the start of the reserved buffer mapped for fd then asks the sg
+ * driver to use mmap-ed IO (no copy between kernel and user space). Since
+ * the kernel ignores dxferp with SG_FLAG_MMAP_IO it is left as is. */
+static void
+mmap_adjust(int fd, struct sg_io_hdr * hp)
+{
+    const struct pt_mmap * mp;
+
+    hp->flags &= ~SG_FLAG_MMAP_IO;
+    if ((NULL == hp->dxferp) || hp->iovec_count ||
+        (hp->flags & SG_FLAG_DIRECT_IO) ||
+        (0 == __atomic_load_n(&pt_mm_num, __ATOMIC_RELAXED)))
+        return;
+    pthread_mutex_lock(&pt_mm_lock);
+    mp = mmap_find(fd);
+    if (mp && (! mp->heap) && (mp->base == hp->dxferp) &&
+        ((int)hp->dxfer_len <= mp->len))
+        hp->flags |= SG_FLAG_MMAP_IO;
+    pthread_mutex_unlock(&pt_mm_lock);
+}
+
+/* Call with pt_mm_lock held */
+static int
+mmap_buffer(int fd, int len, unsigned char ** bufpp, int verbose)
+{
+    int k, t, err, psz;
+    struct pt_mmap * mp;
+    void * vp;
+
+    mp = mmap_find(fd);
+    if (mp && (len <= mp->len)) {
+        *bufpp = mp->base;
+        return 0;
+    }
+    psz = sysconf(_SC_PAGESIZE);
+    if (psz <= 0)
+        psz = 4096;
+    if (len < PT_MMAP_MIN_LEN)
+        len = PT_MMAP_MIN_LEN;
+    len = ((len + psz - 1) / psz) * psz;
+    if (mp)
+        mmap_free(mp);
+    else if (pt_mm_num >= PT_MMAP_MAX_FDS)
+        return -ENFILE;
+    for (k = 0; k < PT_MMAP_MAX_FDS; ++k) {
+        if (NULL == pt_mm[k].base)
+            break;
+    }
+    mp = pt_mm + k;
+    if (sg_emul_fd(fd)) {
+        err = posix_memalign(&vp, psz, len);
+        if (err)
+            return -err;
+        memset(vp, 0, len);
+        mp->heap = 1;
+    } else {
+        t = len;
+        if (ioctl(fd, SG_SET_RESERVED_SIZE, &t) < 0) {
+            err = errno;
+            if (verbose)
+                pr2ws("SG_SET_RESERVED_SIZE error: %s\n", strerror(err));
+            return -err;
+        }
+        if (ioctl(fd, SG_GET_RESERVED_SIZE, &t) < 0) {
+            err = errno;
+            if (verbose)
+                pr2ws("SG_GET_RESERVED_SIZE error: %s\n", strerror(err));
+            return -err;
+        }
+        if (t < len) {
+            if (verbose)
+                pr2ws("%s: sg driver reserved %d bytes, wanted %d\n",
+                      __func__, t, len);
+            return -ENOMEM;
+        }
+        vp = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if ((MAP_FAILED == vp) && (EACCES == errno))  /* O_RDONLY fd */
+            vp = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == vp) {
+            err = errno;
+            if (verbose)
+                pr2ws("mmap() of reserved buffer failed: %s\n",
+                      strerror(err));
+            return -err;
+        }
+        mp->heap = 0;
+    }
+    if (verbose > 1)
+        pr2ws("%s: fd=%d, %d byte buffer at %p\n", __func__, fd, len, vp);
+    mp->fd = fd;
+    mp->len = len;
+    mp->base = (unsigned char *)vp;
+    __atomic_store_n(&pt_mm_num, pt_mm_num + 1, __ATOMIC_RELAXED);
+    *bufpp = mp->base;
+    return 0;
+}
+
+/* Sizes the sg driver's reserved buffer of fd to at least len bytes and
+ * maps it into this process. Repeated calls on the same fd return the
+ * existing mapping unless len has grown. Returns 0 and sets *bufpp if
+ * okay, else a negated errno (e.g. -ENOTTY if fd is not a sg device,
+ * -ENOMEM if the driver could not reserve len bytes). */
+int
+scsi_pt_mmap_buffer(int fd, int len, unsigned char ** bufpp, int verbose)
+{
+    int res;
+
+    if ((NULL == bufpp) || (len < 0) || (fd < 0))
+        return -EINVAL;
+    pthread_mutex_lock(&pt_mm_lock);
+    res = mmap_buffer(fd, len, bufpp, verbose);
+    pthread_mutex_unlock(&pt_mm_lock);
+    return res;
+}
+
+/* Drops the mapping made by scsi_pt_mmap_buffer() on fd, if any. Called
+ * by scsi_pt_close_device(). */
+void
+scsi_pt_mmap_release(int fd)
+{
+    struct pt_mmap * mp;
+
+    if (0 == __atomic_load_n(&pt_mm_num, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&pt_mm_lock);
+    mp = mmap_find(fd);
+    if (mp)
+        mmap_free(mp);
+    pthread_mutex_unlock(&pt_mm_lock);
+}
+
 
 // <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
 #if defined(IGNORE_LINUX_BSG) || ! defined(HAVE_LINUX_BSG_H)
@@ -121,12 +912,77 @@ struct sg_pt_linux_scsi {
     struct sg_io_hdr io_hdr;
     int in_err;
     int os_err;
+    int async_state;    /* SG_PT_ASYNC_* */
+    uint64_t start_ns;  /* when started, if latency sampling enabled */
+    struct pt_started started;  /* table entry while command in flight */
 };
 
 struct sg_pt_base {
     struct sg_pt_linux_scsi impl;
 };
 
+/* Returns opcode (first byte of cdb) or -1 if no cdb */
+static int
+cdb_opcode(const struct sg_pt_linux_scsi * ptp)
+{
+    return ptp->io_hdr.cmdp ? ptp->io_hdr.cmdp[0] : -1;
+}
+
+/* Called when the command held in ptp, which was sent at start_ns, has
+ * completed with result res (as returned by do_scsi_pt()). Adds a sample
+ * to the latency histogram and a record to the trace ring, if enabled. */
+static void
+sample_cmd(const struct sg_pt_linux_scsi * ptp, uint64_t start_ns, int res)
+{
+    int opcode = cdb_opcode(ptp);
+    uint64_t end_ns = scsi_pt_lat_now_ns();
+    struct sg_scsi_sense_hdr ssh;
+    struct sg_pt_trace_rec rec;
+
+    if (res > 0)        /* command not sent */
+        return;
+    if ((0 == res) && scsi_pt_lat_enabled())
+        scsi_pt_lat_record(((opcode >= 0) ? opcode : SCSI_PT_LAT_NO_CDB),
+                           end_ns - start_ns);
+    if (! scsi_pt_trace_enabled())
+        return;
+    memset(&rec, 0, sizeof(rec));
+    rec.start_ns = start_ns;
+    rec.end_ns = end_ns;
+    rec.cdb_len = ptp->io_hdr.cmd_len;
+    if (ptp->io_hdr.cmdp)
+        memcpy(rec.cdb, ptp->io_hdr.cmdp,
+               (rec.cdb_len < 16) ? rec.cdb_len : 16);
+    if (SG_DXFER_FROM_DEV == ptp->io_hdr.dxfer_direction)
+        rec.dir = SCSI_PT_TRACE_DIR_IN;
+    else if (SG_DXFER_TO_DEV == ptp->io_hdr.dxfer_direction)
+        rec.dir = SCSI_PT_TRACE_DIR_OUT;
+    rec.xfer_len = ptp->io_hdr.dxfer_len;
+    rec.os_err = ptp->os_err;
+    rec.result_cat = get_scsi_pt_result_category(
+                                        (const struct sg_pt_base *)ptp);
+    if (0 == res) {
+        rec.resid = ptp->io_hdr.resid;
+        rec.status = ptp->io_hdr.status;
+        if (sg_scsi_normalize_sense(ptp->io_hdr.sbp, ptp->io_hdr.sb_len_wr,
+                                    &ssh)) {
+            rec.sense_key = ssh.sense_key;
+            rec.asc = ssh.asc;
+            rec.ascq = ssh.ascq;
+        }
+    }
+    scsi_pt_trace_record(&rec);
+}
+
+/* Only sg v3 is used so all there is to know is whether fd blocks */
+static int
+fd_probe(int fd, int verbose)
+{
+    int res = fd_nonblock(fd);
+
+    if (verbose) { ; }      /* unused, suppress warning */
+    return (res < 0) ? res : (res | PT_FD_KNOWN);
+}
 
 /* Returns >= 0 if successful. If error in Unix returns negated errno. */
 int
@@ -144,14 +1000,19 @@ scsi_pt_open_device(const char * device_name, int read_only, int verbose)
 int
 scsi_pt_open_flags(const char * device_name, int flags, int verbose)
 {
-    int fd;
+    int fd, res;
 
     if (verbose > 1) {
         pr2ws("open %s with flags=0x%x\n", device_name, flags);
     }
-    fd = open(device_name, flags);
+    if (sg_emul_is_emul_name(device_name))
+        fd = sg_emul_open(device_name, flags, verbose);
+    else
+        fd = open(device_name, flags);
     if (fd < 0)
-        fd = -errno;
+        return -errno;
+    res = fd_probe(fd, verbose);
+    fd_kind_set(fd, (res < 0) ? 0 : (res | PT_FD_OPENED));
     return fd;
 }
 
@@ -161,7 +1022,12 @@ scsi_pt_close_device(int device_fd)
 {
     int res;
 
-    res = close(device_fd);
+    scsi_pt_mmap_release(device_fd);
+    fd_kind_set(device_fd, 0);
+    if (sg_emul_fd(device_fd))
+        res = sg_emul_close(device_fd);
+    else
+        res = close(device_fd);
     if (res < 0)
         res = -errno;
     return res;
@@ -193,8 +1059,11 @@ destruct_scsi_pt_obj(struct sg_pt_base * vp)
 {
     struct sg_pt_linux_scsi * ptp = &vp->impl;
 
-    if (ptp)
+    if (ptp) {
+        if (SG_PT_ASYNC_STARTED == ptp->async_state)
+            started_take(ptp, -1, 0);
         free(ptp);
+    }
 }
 
 void
@@ -203,6 +1072,8 @@ clear_scsi_pt_obj(struct sg_pt_base * vp)
     struct sg_pt_linux_scsi * ptp = &vp->impl;
 
     if (ptp) {
+        if (SG_PT_ASYNC_STARTED == ptp->async_state)
+            started_take(ptp, -1, 0);
         memset(ptp, 0, sizeof(struct sg_pt_linux_scsi));
         ptp->io_hdr.interface_id = 'S';
         ptp->io_hdr.dxfer_direction = SG_DXFER_NONE;
@@ -234,34 +1105,69 @@ set_scsi_pt_sense(struct sg_pt_base * vp, unsigned char * sense,
     ptp->io_hdr.mx_sb_len = max_sense_len;
 }
 
-/* Setup for data transfer from device */
+/* Setup for data transfer from device */
+void
+set_scsi_pt_data_in(struct sg_pt_base * vp, unsigned char * dxferp,
+                    int dxfer_len)
+{
+    struct sg_pt_linux_scsi * ptp = &vp->impl;
+
+    if (ptp->io_hdr.dxferp)
+        ++ptp->in_err;
+    if (dxfer_len > 0) {
+        ptp->io_hdr.dxferp = dxferp;
+        ptp->io_hdr.dxfer_len = dxfer_len;
+        ptp->io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+    }
+}
+
+/* Setup for data transfer toward device */
+void
+set_scsi_pt_data_out(struct sg_pt_base * vp, const unsigned char * dxferp,
+                     int dxfer_len)
+{
+    struct sg_pt_linux_scsi * ptp = &vp->impl;
+
+    if (ptp->io_hdr.dxferp)
+        ++ptp->in_err;
+    if (dxfer_len > 0) {
+        ptp->io_hdr.dxferp = (unsigned char *)dxferp;
+        ptp->io_hdr.dxfer_len = dxfer_len;
+        ptp->io_hdr.dxfer_direction = SG_DXFER_TO_DEV;
+    }
+}
+
+/* Setup for data transfer from device into a scatter gather list. The sg
+ * driver's sg_iovec_t has the same layout as struct sg_pt_iovec . */
 void
-set_scsi_pt_data_in(struct sg_pt_base * vp, unsigned char * dxferp,
-                    int dxfer_len)
+set_scsi_pt_data_in_iov(struct sg_pt_base * vp,
+                        const struct sg_pt_iovec * iovp, int iov_count)
 {
     struct sg_pt_linux_scsi * ptp = &vp->impl;
 
     if (ptp->io_hdr.dxferp)
         ++ptp->in_err;
-    if (dxfer_len > 0) {
-        ptp->io_hdr.dxferp = dxferp;
-        ptp->io_hdr.dxfer_len = dxfer_len;
+    if (iov_count > 0) {
+        ptp->io_hdr.dxferp = (void *)iovp;
+        ptp->io_hdr.iovec_count = iov_count;
+        ptp->io_hdr.dxfer_len = iov_total(iovp, iov_count);
         ptp->io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
     }
 }
 
-/* Setup for data transfer toward device */
+/* Setup for data transfer toward device from a scatter gather list */
 void
-set_scsi_pt_data_out(struct sg_pt_base * vp, const unsigned char * dxferp,
-                     int dxfer_len)
+set_scsi_pt_data_out_iov(struct sg_pt_base * vp,
+                         const struct sg_pt_iovec * iovp, int iov_count)
 {
     struct sg_pt_linux_scsi * ptp = &vp->impl;
 
     if (ptp->io_hdr.dxferp)
         ++ptp->in_err;
-    if (dxfer_len > 0) {
-        ptp->io_hdr.dxferp = (unsigned char *)dxferp;
-        ptp->io_hdr.dxfer_len = dxfer_len;
+    if (iov_count > 0) {
+        ptp->io_hdr.dxferp = (void *)iovp;
+        ptp->io_hdr.iovec_count = iov_count;
+        ptp->io_hdr.dxfer_len = iov_total(iovp, iov_count);
         ptp->io_hdr.dxfer_direction = SG_DXFER_TO_DEV;
     }
 }
@@ -329,8 +1235,8 @@ set_scsi_pt_flags(struct sg_pt_base * vp, int flags)
 /* Executes SCSI command (or at least forwards it to lower layers).
  * Clears os_err field prior to active call (whose result may set it
  * again). */
-int
-do_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
+static int
+do_scsi_pt_once(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
 {
     struct sg_pt_linux_scsi * ptp = &vp->impl;
 
@@ -350,7 +1256,8 @@ do_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
                                              DEF_TIMEOUT);
     if (ptp->io_hdr.sbp && (ptp->io_hdr.mx_sb_len > 0))
         memset(ptp->io_hdr.sbp, 0, ptp->io_hdr.mx_sb_len);
-    if (ioctl(fd, SG_IO, &ptp->io_hdr) < 0) {
+    mmap_adjust(fd, &ptp->io_hdr);
+    if (sg_io_v3(fd, &ptp->io_hdr) < 0) {
         ptp->os_err = errno;
         if (verbose > 1)
             pr2ws("ioctl(SG_IO) failed: %s (errno=%d)\n",
@@ -360,6 +1267,200 @@ do_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
     return 0;
 }
 
+/* Submits SCSI command with a write() to sg device node; the response is
+ * fetched later with a read() by reap_scsi_pt() or finish_scsi_pt(). The
+ * address of this object is placed in usr_ptr so any response can be
+ * matched back to the object it belongs to. If this thread's io_uring
+ * engine is on, the write() and read() are queued in its ring instead. */
+int
+start_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
+{
+    struct sg_pt_linux_scsi * ptp = &vp->impl;
+    int res, state;
+
+    ptp->os_err = 0;
+    if (ptp->in_err) {
+        if (verbose)
+            pr2ws("Replicated or unused set_scsi_pt... functions\n");
+        return SCSI_PT_DO_BAD_PARAMS;
+    }
+    res = fd_kind(fd, 1, verbose);
+    if (res < 0) {
+        ptp->os_err = -res;
+        return res;
+    }
+    if (NULL == ptp->io_hdr.cmdp) {
+        if (verbose)
+            pr2ws("No SCSI command (cdb) given\n");
+        return SCSI_PT_DO_BAD_PARAMS;
+    }
+    if (SG_PT_ASYNC_STARTED == ptp->async_state) {
+        if (verbose)
+            pr2ws("%s: command already outstanding on this object\n",
+                  __func__);
+        return SCSI_PT_DO_BAD_PARAMS;
+    }
+    ptp->io_hdr.timeout = ((time_secs > 0) ? (time_secs * 1000) :
+                                             DEF_TIMEOUT);
+    if (ptp->io_hdr.sbp && (ptp->io_hdr.mx_sb_len > 0))
+        memset(ptp->io_hdr.sbp, 0, ptp->io_hdr.mx_sb_len);
+    ptp->io_hdr.usr_ptr = ptp;
+    mmap_adjust(fd, &ptp->io_hdr);
+    ptp->start_ns = sample_now();
+    /* in the table before write() as another thread may reap the reply */
+    state = ptp->async_state;
+    ptp->async_state = SG_PT_ASYNC_STARTED;
+    started_add(&ptp->started, ptp, fd, (uint64_t)(long)ptp->io_hdr.cmdp);
+    if (uring_use_fd(fd))
+        res = uring_start(fd, &ptp->io_hdr, verbose);
+    else
+        res = (write_v3(fd, &ptp->io_hdr) < 0) ? -errno : 0;
+    if (res < 0) {
+        started_take(ptp, -1, 0);
+        ptp->async_state = state;
+        ptp->os_err = -res;
+        if ((verbose > 1) && (EAGAIN != ptp->os_err))
+            pr2ws("write(sg v3) failed: %s (errno=%d)\n",
+                  strerror(ptp->os_err), ptp->os_err);
+        return res;
+    }
+    return 0;
+}
+
+static void
+complete_v3(struct sg_pt_linux_scsi * ptp, const struct sg_io_hdr * rhp,
+            int err)
+{
+    if (err) {
+        ptp->os_err = err;
+        ptp->async_state = SG_PT_ASYNC_DONE;
+        if (ptp->start_ns)
+            sample_cmd(ptp, ptp->start_ns, -err);
+        return;
+    }
+    /* the sense data has already been written into ptp's sense buffer */
+    ptp->io_hdr.status = rhp->status;
+    ptp->io_hdr.masked_status = rhp->masked_status;
+    ptp->io_hdr.msg_status = rhp->msg_status;
+    ptp->io_hdr.sb_len_wr = rhp->sb_len_wr;
+    ptp->io_hdr.host_status = rhp->host_status;
+    ptp->io_hdr.driver_status = rhp->driver_status;
+    ptp->io_hdr.resid = rhp->resid;
+    ptp->io_hdr.duration = rhp->duration;
+    ptp->io_hdr.info = rhp->info;
+    ptp->async_state = SG_PT_ASYNC_DONE;
+    if (ptp->start_ns)
+        sample_cmd(ptp, ptp->start_ns, 0);
+}
+
+/* Fetches one response with read(). If pack_id is -1 any response will
+ * do, otherwise (and only if SG_SET_FORCE_PACK_ID is active on fd) the
+ * response with that pack_id is fetched. The response is placed in the
+ * object it was started with, whose address is written to *ptpp. Returns
+ * 0 if okay, else negated errno (-EAGAIN if nothing ready on a fd that
+ * does not block, -EINVAL if the response was not to a command started
+ * by this library on fd). */
+static int
+reap_one(int fd, int pack_id, struct sg_pt_linux_scsi ** ptpp, int verbose)
+{
+    struct sg_io_hdr rh;
+    struct sg_pt_linux_scsi * ptp;
+
+    memset(&rh, 0, sizeof(rh));
+    rh.interface_id = 'S';
+    rh.pack_id = pack_id;
+    if (read_v3(fd, &rh) < 0) {
+        int err = errno;
+
+        if ((verbose > 1) && (EAGAIN != err))
+            pr2ws("read(sg v3) failed: %s (errno=%d)\n", strerror(err),
+                  err);
+        return -err;
+    }
+    ptp = (struct sg_pt_linux_scsi *)rh.usr_ptr;
+    if (! started_take(ptp, fd, (uint64_t)(long)rh.cmdp)) {
+        if (verbose)
+            pr2ws("%s: response (pack_id=%d) has no matching object\n",
+                  __func__, rh.pack_id);
+        return -EINVAL;
+    }
+    complete_v3(ptp, &rh, 0);
+    *ptpp = ptp;
+    return 0;
+}
+
+/* Fetches the response of the command started on vp, waiting if
+ * necessary. Responses belonging to other objects that are fetched along
+ * the way are placed in those objects. */
+int
+finish_scsi_pt(struct sg_pt_base * vp, int fd, int verbose)
+{
+    struct sg_pt_linux_scsi * ptp = &vp->impl;
+    struct sg_pt_linux_scsi * optp;
+    int res;
+
+    if (SG_PT_ASYNC_IDLE == ptp->async_state) {
+        if (verbose)
+            pr2ws("%s: no command started on this object\n", __func__);
+        return SCSI_PT_DO_BAD_PARAMS;
+    }
+    while (SG_PT_ASYNC_STARTED == ptp->async_state) {
+        if (uring_owns_fd(fd)) {
+            res = uring_reap_slot(fd, -1, verbose);
+            if (res >= 0)
+                res = uring_complete(res, &optp, verbose);
+        } else {
+            /* blocks until a response arrives unless fd is O_NONBLOCK */
+            res = reap_one(fd, ptp->io_hdr.pack_id, &optp, verbose);
+            if (-EAGAIN == res) {
+                res = wait_fd(fd, -1, verbose);
+                if (res < 0)
+                    return res;
+                continue;
+            }
+        }
+        if (-EAGAIN == res)
+            continue;
+        if (res < 0) {
+            ptp->os_err = -res;
+            return res;
+        }
+    }
+    return 0;
+}
+
+int
+reap_scsi_pt(int fd, int wait_ms, struct sg_pt_base ** objpp, int verbose)
+{
+    struct sg_pt_linux_scsi * ptp;
+    int res, kind;
+
+    if (uring_owns_fd(fd)) {
+        res = uring_reap_slot(fd, wait_ms, verbose);
+        if (res < 0)
+            return res;
+        res = uring_complete(res, &ptp, verbose);
+    } else {
+        kind = fd_kind(fd, 0, verbose);
+        if (kind < 0)
+            return kind;
+        /* try the read() first; only wait when nothing is ready */
+        if ((kind & PT_FD_NONBLOCK) || (wait_ms < 0))
+            res = reap_one(fd, -1, &ptp, verbose);
+        else
+            res = -EAGAIN;      /* read() could block beyond wait_ms */
+        if ((-EAGAIN == res) && (wait_ms || (! (kind & PT_FD_NONBLOCK)))) {
+            res = wait_fd(fd, wait_ms, verbose);
+            if (res <= 0)
+                return res ? res : -EAGAIN;
+            res = reap_one(fd, -1, &ptp, verbose);
+        }
+    }
+    if ((0 == res) && objpp)
+        *objpp = (struct sg_pt_base *)ptp;
+    return res;
+}
+
 int
 get_scsi_pt_result_category(const struct sg_pt_base * vp)
 {
@@ -533,6 +1634,9 @@ struct sg_pt_linux_scsi {
     struct sg_io_v4 io_hdr;     /* use v4 header as it is more general */
     int in_err;
     int os_err;
+    int async_state;    /* SG_PT_ASYNC_* */
+    uint64_t start_ns;  /* when started, if latency sampling enabled */
+    struct pt_started started;  /* table entry while command in flight */
     unsigned char tmf_request[4];
 };
 
@@ -543,6 +1647,69 @@ struct sg_pt_base {
 static int bsg_major_checked = 0;
 static int bsg_major = 0;
 
+/* Returns opcode (first byte of cdb) or -1 if no cdb or if it is a task
+ * management function */
+static int
+cdb_opcode(const struct sg_pt_linux_scsi * ptp)
+{
+    if ((0 == ptp->io_hdr.request) || (1 == ptp->io_hdr.subprotocol))
+        return -1;
+    return *(const unsigned char *)(long)ptp->io_hdr.request;
+}
+
+/* Called when the command held in ptp, which was sent at start_ns, has
+ * completed with result res (as returned by do_scsi_pt()). Adds a sample
+ * to the latency histogram and a record to the trace ring, if enabled. */
+static void
+sample_cmd(const struct sg_pt_linux_scsi * ptp, uint64_t start_ns, int res)
+{
+    int opcode = cdb_opcode(ptp);
+    uint64_t end_ns = scsi_pt_lat_now_ns();
+    struct sg_scsi_sense_hdr ssh;
+    struct sg_pt_trace_rec rec;
+
+    if (res > 0)        /* command not sent */
+        return;
+    if ((0 == res) && scsi_pt_lat_enabled())
+        scsi_pt_lat_record(((opcode >= 0) ? opcode : SCSI_PT_LAT_NO_CDB),
+                           end_ns - start_ns);
+    if (! scsi_pt_trace_enabled())
+        return;
+    memset(&rec, 0, sizeof(rec));
+    rec.start_ns = start_ns;
+    rec.end_ns = end_ns;
+    if (opcode >= 0) {
+        rec.cdb_len = ptp->io_hdr.request_len;
+        memcpy(rec.cdb, (const void *)(long)ptp->io_hdr.request,
+               (rec.cdb_len < 16) ? rec.cdb_len : 16);
+    }
+    if (ptp->io_hdr.din_xfer_len > 0) {
+        rec.dir = (ptp->io_hdr.dout_xfer_len > 0) ? SCSI_PT_TRACE_DIR_BIDI :
+                                                    SCSI_PT_TRACE_DIR_IN;
+        rec.xfer_len = ptp->io_hdr.din_xfer_len;
+    } else if (ptp->io_hdr.dout_xfer_len > 0) {
+        rec.dir = SCSI_PT_TRACE_DIR_OUT;
+        rec.xfer_len = ptp->io_hdr.dout_xfer_len;
+    }
+    rec.os_err = ptp->os_err;
+    rec.result_cat = get_scsi_pt_result_category(
+                                        (const struct sg_pt_base *)ptp);
+    if (0 == res) {
+        rec.resid = (SCSI_PT_TRACE_DIR_OUT == rec.dir) ?
+                    ptp->io_hdr.dout_resid : ptp->io_hdr.din_resid;
+        rec.status = ptp->io_hdr.device_status;
+        if (ptp->io_hdr.response &&
+            sg_scsi_normalize_sense((const unsigned char *)(long)
+                                            ptp->io_hdr.response,
+                                    ptp->io_hdr.response_len, &ssh)) {
+            rec.sense_key = ssh.sense_key;
+            rec.asc = ssh.asc;
+            rec.ascq = ssh.ascq;
+        }
+    }
+    scsi_pt_trace_record(&rec);
+}
+
 
 
 static void
@@ -600,7 +1767,7 @@ scsi_pt_open_device(const char * device_name, int read_only, int verbose)
 int
 scsi_pt_open_flags(const char * device_name, int flags, int verbose)
 {
-    int fd;
+    int fd, res;
 
     if (! bsg_major_checked) {
         bsg_major_checked = 1;
@@ -608,9 +1775,14 @@ scsi_pt_open_flags(const char * device_name, int flags, int verbose)
     }
     if (verbose > 1)
         pr2ws("open %s with flags=0x%x\n", device_name, flags);
-    fd = open(device_name, flags);
+    if (sg_emul_is_emul_name(device_name))
+        fd = sg_emul_open(device_name, flags, verbose);
+    else
+        fd = open(device_name, flags);
     if (fd < 0)
-        fd = -errno;
+        return -errno;
+    res = fd_probe(fd, verbose);
+    fd_kind_set(fd, (res < 0) ? 0 : (res | PT_FD_OPENED));
     return fd;
 }
 
@@ -620,7 +1792,12 @@ scsi_pt_close_device(int device_fd)
 {
     int res;
 
-    res = close(device_fd);
+    scsi_pt_mmap_release(device_fd);
+    fd_kind_set(device_fd, 0);
+    if (sg_emul_fd(device_fd))
+        res = sg_emul_close(device_fd);
+    else
+        res = close(device_fd);
     if (res < 0)
         res = -errno;
     return res;
@@ -651,8 +1828,11 @@ destruct_scsi_pt_obj(struct sg_pt_base * vp)
 {
     struct sg_pt_linux_scsi * ptp = &vp->impl;
 
-    if (ptp)
+    if (ptp) {
+        if (SG_PT_ASYNC_STARTED == ptp->async_state)
+            started_take(ptp, -1, 0);
         free(ptp);
+    }
 }
 
 void
@@ -661,6 +1841,8 @@ clear_scsi_pt_obj(struct sg_pt_base * vp)
     struct sg_pt_linux_scsi * ptp = &vp->impl;
 
     if (ptp) {
+        if (SG_PT_ASYNC_STARTED == ptp->async_state)
+            started_take(ptp, -1, 0);
         memset(ptp, 0, sizeof(struct sg_pt_linux_scsi));
         ptp->io_hdr.guard = 'Q';
 #ifdef BSG_PROTOCOL_SCSI
@@ -728,6 +1910,39 @@ set_scsi_pt_data_out(struct sg_pt_base * vp, const unsigned char * dxferp,
     }
 }
 
+/* Setup for data transfer from device into a scatter gather list. bsg
+ * takes an array of struct iovec (same layout as struct sg_pt_iovec). */
+void
+set_scsi_pt_data_in_iov(struct sg_pt_base * vp,
+                        const struct sg_pt_iovec * iovp, int iov_count)
+{
+    struct sg_pt_linux_scsi * ptp = &vp->impl;
+
+    if (ptp->io_hdr.din_xferp)
+        ++ptp->in_err;
+    if (iov_count > 0) {
+        ptp->io_hdr.din_xferp = (__u64)(long)iovp;
+        ptp->io_hdr.din_iovec_count = iov_count;
+        ptp->io_hdr.din_xfer_len = iov_total(iovp, iov_count);
+    }
+}
+
+/* Setup for data transfer toward device from a scatter gather list */
+void
+set_scsi_pt_data_out_iov(struct sg_pt_base * vp,
+                         const struct sg_pt_iovec * iovp, int iov_count)
+{
+    struct sg_pt_linux_scsi * ptp = &vp->impl;
+
+    if (ptp->io_hdr.dout_xferp)
+        ++ptp->in_err;
+    if (iov_count > 0) {
+        ptp->io_hdr.dout_xferp = (__u64)(long)iovp;
+        ptp->io_hdr.dout_iovec_count = iov_count;
+        ptp->io_hdr.dout_xfer_len = iov_total(iovp, iov_count);
+    }
+}
+
 void
 set_scsi_pt_packet_id(struct sg_pt_base * vp, int pack_id)
 {
@@ -928,102 +2143,153 @@ get_scsi_pt_os_err_str(const struct sg_pt_base * vp, int max_b_len, char * b)
     return b;
 }
 
-/* Executes SCSI command using sg v3 interface */
+/* Converts v4 header held in ptp into the v3 header pointed to by hp.
+ * Returns 0 if okay, else SCSI_PT_DO_BAD_PARAMS. */
 static int
-do_scsi_pt_v3(struct sg_pt_linux_scsi * ptp, int fd, int time_secs,
-              int verbose)
+v4_to_v3_hdr(const struct sg_pt_linux_scsi * ptp, struct sg_io_hdr * hp,
+             int time_secs, int verbose)
 {
-    struct sg_io_hdr v3_hdr;
-
-    memset(&v3_hdr, 0, sizeof(v3_hdr));
-    /* convert v4 to v3 header */
-    v3_hdr.interface_id = 'S';
-    v3_hdr.dxfer_direction = SG_DXFER_NONE;
-    v3_hdr.cmdp = (unsigned char *)(long)ptp->io_hdr.request;
-    v3_hdr.cmd_len = (unsigned char)ptp->io_hdr.request_len;
+    memset(hp, 0, sizeof(*hp));
+    hp->interface_id = 'S';
+    hp->dxfer_direction = SG_DXFER_NONE;
+    hp->cmdp = (unsigned char *)(long)ptp->io_hdr.request;
+    hp->cmd_len = (unsigned char)ptp->io_hdr.request_len;
     if (ptp->io_hdr.din_xfer_len > 0) {
         if (ptp->io_hdr.dout_xfer_len > 0) {
             if (verbose)
                 pr2ws("sgv3 doesn't support bidi\n");
             return SCSI_PT_DO_BAD_PARAMS;
         }
-        v3_hdr.dxferp = (void *)(long)ptp->io_hdr.din_xferp;
-        v3_hdr.dxfer_len = (unsigned int)ptp->io_hdr.din_xfer_len;
-        v3_hdr.dxfer_direction =  SG_DXFER_FROM_DEV;
+        hp->dxferp = (void *)(long)ptp->io_hdr.din_xferp;
+        hp->dxfer_len = (unsigned int)ptp->io_hdr.din_xfer_len;
+        hp->iovec_count = (unsigned short)ptp->io_hdr.din_iovec_count;
+        hp->dxfer_direction =  SG_DXFER_FROM_DEV;
     } else if (ptp->io_hdr.dout_xfer_len > 0) {
-        v3_hdr.dxferp = (void *)(long)ptp->io_hdr.dout_xferp;
-        v3_hdr.dxfer_len = (unsigned int)ptp->io_hdr.dout_xfer_len;
-        v3_hdr.dxfer_direction =  SG_DXFER_TO_DEV;
+        hp->dxferp = (void *)(long)ptp->io_hdr.dout_xferp;
+        hp->dxfer_len = (unsigned int)ptp->io_hdr.dout_xfer_len;
+        hp->iovec_count = (unsigned short)ptp->io_hdr.dout_iovec_count;
+        hp->dxfer_direction =  SG_DXFER_TO_DEV;
     }
     if (ptp->io_hdr.response && (ptp->io_hdr.max_response_len > 0)) {
-        v3_hdr.sbp = (unsigned char *)(long)ptp->io_hdr.response;
-        v3_hdr.mx_sb_len = (unsigned char)ptp->io_hdr.max_response_len;
+        hp->sbp = (unsigned char *)(long)ptp->io_hdr.response;
+        hp->mx_sb_len = (unsigned char)ptp->io_hdr.max_response_len;
     }
-    v3_hdr.pack_id = (int)ptp->io_hdr.spare_in;
+    hp->pack_id = (int)ptp->io_hdr.spare_in;
     if (BSG_FLAG_Q_AT_HEAD & ptp->io_hdr.flags)
-        v3_hdr.flags |= SG_FLAG_Q_AT_HEAD;      /* favour AT_HEAD */
+        hp->flags |= SG_FLAG_Q_AT_HEAD;      /* favour AT_HEAD */
     else if (BSG_FLAG_Q_AT_TAIL & ptp->io_hdr.flags)
-        v3_hdr.flags |= SG_FLAG_Q_AT_TAIL;
+        hp->flags |= SG_FLAG_Q_AT_TAIL;
 
-    if (NULL == v3_hdr.cmdp) {
+    if (NULL == hp->cmdp) {
         if (verbose)
             pr2ws("No SCSI command (cdb) given\n");
         return SCSI_PT_DO_BAD_PARAMS;
     }
     /* io_hdr.timeout is in milliseconds, if greater than zero */
-    v3_hdr.timeout = ((time_secs > 0) ? (time_secs * 1000) : DEF_TIMEOUT);
+    hp->timeout = ((time_secs > 0) ? (time_secs * 1000) : DEF_TIMEOUT);
+    return 0;
+}
+
+/* Transfers the response fields of a v3 header back into ptp's v4 one */
+static void
+v3_to_v4_resp(struct sg_pt_linux_scsi * ptp, const struct sg_io_hdr * hp)
+{
+    ptp->io_hdr.device_status = (__u32)hp->status;
+    ptp->io_hdr.driver_status = (__u32)hp->driver_status;
+    ptp->io_hdr.transport_status = (__u32)hp->host_status;
+    ptp->io_hdr.response_len = (__u32)hp->sb_len_wr;
+    ptp->io_hdr.duration = (__u32)hp->duration;
+    ptp->io_hdr.din_resid = (__s32)hp->resid;
+    /* hp->info not passed back since no mapping defined (yet) */
+}
+
+/* Returns 1 if fd is a bsg device node, 0 if not (so use sg v3) or a
+ * negated errno if fstat() fails. */
+static int
+is_bsg_fd(int fd, int verbose)
+{
+    int err;
+    struct stat a_stat;
+
+    if (! bsg_major_checked) {
+        bsg_major_checked = 1;
+        find_bsg_major(verbose);
+    }
+    if (bsg_major <= 0)
+        return 0;
+    if (fstat(fd, &a_stat) < 0) {
+        err = errno;
+        if (verbose > 1)
+            pr2ws("fstat() failed: %s (errno=%d)\n", strerror(err), err);
+        return -err;
+    }
+    if (! S_ISCHR(a_stat.st_mode) ||
+        (bsg_major != (int)SG_DEV_MAJOR(a_stat.st_rdev)))
+        return 0;
+    return 1;
+}
+
+/* Finds the PT_FD_* bits of fd with fstat() and fcntl() */
+static int
+fd_probe(int fd, int verbose)
+{
+    int res, kind;
+
+    kind = fd_nonblock(fd);
+    if (kind < 0)
+        return kind;
+    res = is_bsg_fd(fd, verbose);
+    if (res < 0)
+        return res;
+    return kind | (res ? PT_FD_BSG : 0) | PT_FD_KNOWN;
+}
+
+/* Executes SCSI command using sg v3 interface */
+static int
+do_scsi_pt_v3(struct sg_pt_linux_scsi * ptp, int fd, int time_secs,
+              int verbose)
+{
+    int res;
+    struct sg_io_hdr v3_hdr;
+
+    /* convert v4 to v3 header */
+    res = v4_to_v3_hdr(ptp, &v3_hdr, time_secs, verbose);
+    if (res)
+        return res;
+    mmap_adjust(fd, &v3_hdr);
     /* Finally do the v3 SG_IO ioctl */
-    if (ioctl(fd, SG_IO, &v3_hdr) < 0) {
+    if (sg_io_v3(fd, &v3_hdr) < 0) {
         ptp->os_err = errno;
         if (verbose > 1)
             pr2ws("ioctl(SG_IO v3) failed: %s (errno=%d)\n",
                   strerror(ptp->os_err), ptp->os_err);
         return -ptp->os_err;
     }
-    ptp->io_hdr.device_status = (__u32)v3_hdr.status;
-    ptp->io_hdr.driver_status = (__u32)v3_hdr.driver_status;
-    ptp->io_hdr.transport_status = (__u32)v3_hdr.host_status;
-    ptp->io_hdr.response_len = (__u32)v3_hdr.sb_len_wr;
-    ptp->io_hdr.duration = (__u32)v3_hdr.duration;
-    ptp->io_hdr.din_resid = (__s32)v3_hdr.resid;
-    /* v3_hdr.info not passed back since no mapping defined (yet) */
+    v3_to_v4_resp(ptp, &v3_hdr);
     return 0;
 }
 
 /* Executes SCSI command (or at least forwards it to lower layers).
  * Clears os_err field prior to active call (whose result may set it
  * again). */
-int
-do_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
+static int
+do_scsi_pt_once(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
 {
     struct sg_pt_linux_scsi * ptp = &vp->impl;
+    int res;
 
-    if (! bsg_major_checked) {
-        bsg_major_checked = 1;
-        find_bsg_major(verbose);
-    }
     ptp->os_err = 0;
     if (ptp->in_err) {
         if (verbose)
             pr2ws("Replicated or unused set_scsi_pt... functions\n");
         return SCSI_PT_DO_BAD_PARAMS;
     }
-    if (bsg_major <= 0)
+    res = fd_kind(fd, 1, verbose);
+    if (res < 0) {
+        ptp->os_err = -res;
+        return res;
+    } else if (0 == (res & PT_FD_BSG))
         return do_scsi_pt_v3(ptp, fd, time_secs, verbose);
-    else {
-        struct stat a_stat;
-
-        if (fstat(fd, &a_stat) < 0) {
-            ptp->os_err = errno;
-            if (verbose > 1)
-                pr2ws("fstat() failed: %s (errno=%d)\n",
-                      strerror(ptp->os_err), ptp->os_err);
-            return -ptp->os_err;
-        }
-        if (! S_ISCHR(a_stat.st_mode) ||
-            (bsg_major != (int)SG_DEV_MAJOR(a_stat.st_rdev)))
-            return do_scsi_pt_v3(ptp, fd, time_secs, verbose);
-    }
 
     if (! ptp->io_hdr.request) {
         if (verbose)
@@ -1052,5 +2318,254 @@ do_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
     return 0;
 }
 
+/* Submits SCSI command with a write(): of a v4 header to a bsg device
+ * node, otherwise of a v3 header (e.g. to a sg device node). The response
+ * is fetched later with a read() by reap_scsi_pt() or finish_scsi_pt().
+ * The address of this object is placed in usr_ptr so any response can be
+ * matched back to the object it belongs to. If this thread's io_uring
+ * engine is on, the write() and read() of v3 headers are queued in its
+ * ring instead. */
+int
+start_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
+{
+    struct sg_pt_linux_scsi * ptp = &vp->impl;
+    int res, state;
+    struct sg_io_hdr v3_hdr;
+
+    ptp->os_err = 0;
+    if (ptp->in_err) {
+        if (verbose)
+            pr2ws("Replicated or unused set_scsi_pt... functions\n");
+        return SCSI_PT_DO_BAD_PARAMS;
+    }
+    if (SG_PT_ASYNC_STARTED == ptp->async_state) {
+        if (verbose)
+            pr2ws("%s: command already outstanding on this object\n",
+                  __func__);
+        return SCSI_PT_DO_BAD_PARAMS;
+    }
+    res = fd_kind(fd, 1, verbose);
+    if (res < 0) {
+        ptp->os_err = -res;
+        return res;
+    }
+    ptp->start_ns = sample_now();
+    state = ptp->async_state;
+    if (0 == (res & PT_FD_BSG)) {
+        res = v4_to_v3_hdr(ptp, &v3_hdr, time_secs, verbose);
+        if (res)
+            return res;
+        v3_hdr.usr_ptr = ptp;
+        mmap_adjust(fd, &v3_hdr);
+        /* in the table before write() as another thread may reap it */
+        ptp->async_state = SG_PT_ASYNC_STARTED;
+        started_add(&ptp->started, ptp, fd, ptp->io_hdr.request);
+        if (uring_use_fd(fd)) {
+            res = uring_start(fd, &v3_hdr, verbose);
+            if (res < 0) {
+                started_take(ptp, -1, 0);
+                ptp->async_state = state;
+                ptp->os_err = -res;
+                return res;
+            }
+        } else
+            res = write_v3(fd, &v3_hdr);
+    } else {
+        if (! ptp->io_hdr.request) {
+            if (verbose)
+                pr2ws("No SCSI command (cdb) given (v4)\n");
+            return SCSI_PT_DO_BAD_PARAMS;
+        }
+        ptp->io_hdr.timeout = ((time_secs > 0) ? (time_secs * 1000) :
+                                                 DEF_TIMEOUT);
+        ptp->io_hdr.usr_ptr = (__u64)(long)ptp;
+        ptp->async_state = SG_PT_ASYNC_STARTED;
+        started_add(&ptp->started, ptp, fd, ptp->io_hdr.request);
+        res = write(fd, &ptp->io_hdr, sizeof(ptp->io_hdr));
+    }
+    if (res < 0) {
+        ptp->os_err = errno;
+        started_take(ptp, -1, 0);
+        ptp->async_state = state;
+        if ((verbose > 1) && (EAGAIN != ptp->os_err))
+            pr2ws("write(sg) failed: %s (errno=%d)\n",
+                  strerror(ptp->os_err), ptp->os_err);
+        return -ptp->os_err;
+    }
+    return 0;
+}
+
+/* Fetches one response with read() from fd whose PT_FD_* bits are kind.
+ * If pack_id is -1 any response will do, otherwise (and only if
+ * SG_SET_FORCE_PACK_ID is active on a sg v3 fd) the response with that
+ * pack_id is fetched. The response is placed in the object it was started
+ * with, whose address is written to *ptpp. Returns 0 if okay, else
+ * negated errno (-EAGAIN if nothing ready on a fd that does not block,
+ * -EINVAL if the response was not to a command started by this library
+ * on fd). */
+static int
+reap_one(int fd, int kind, int pack_id, struct sg_pt_linux_scsi ** ptpp,
+         int verbose)
+{
+    int res;
+    int is_bsg = !! (kind & PT_FD_BSG);
+    __u64 req;
+    struct sg_pt_linux_scsi * ptp;
+    struct sg_io_hdr v3_hdr;
+    struct sg_io_v4 v4_hdr;
+
+    if (is_bsg) {
+        memset(&v4_hdr, 0, sizeof(v4_hdr));
+        v4_hdr.guard = 'Q';
+        res = read(fd, &v4_hdr, sizeof(v4_hdr));
+    } else {
+        memset(&v3_hdr, 0, sizeof(v3_hdr));
+        v3_hdr.interface_id = 'S';
+        v3_hdr.pack_id = pack_id;
+        res = read_v3(fd, &v3_hdr);
+    }
+    if (res < 0) {
+        res = errno;
+        if ((verbose > 1) && (EAGAIN != res))
+            pr2ws("read(sg) failed: %s (errno=%d)\n", strerror(res), res);
+        return -res;
+    }
+    if (is_bsg) {
+        ptp = (struct sg_pt_linux_scsi *)(long)v4_hdr.usr_ptr;
+        req = v4_hdr.request;
+    } else {
+        ptp = (struct sg_pt_linux_scsi *)v3_hdr.usr_ptr;
+        req = (__u64)(long)v3_hdr.cmdp;
+    }
+    if (! started_take(ptp, fd, req)) {
+        if (verbose)
+            pr2ws("%s: response has no matching object\n", __func__);
+        return -EINVAL;
+    }
+    /* the sense data has already been written into ptp's sense buffer */
+    if (is_bsg) {
+        ptp->io_hdr.device_status = v4_hdr.device_status;
+        ptp->io_hdr.driver_status = v4_hdr.driver_status;
+        ptp->io_hdr.transport_status = v4_hdr.transport_status;
+        ptp->io_hdr.response_len = v4_hdr.response_len;
+        ptp->io_hdr.duration = v4_hdr.duration;
+        ptp->io_hdr.din_resid = v4_hdr.din_resid;
+        ptp->io_hdr.dout_resid = v4_hdr.dout_resid;
+        ptp->io_hdr.info = v4_hdr.info;
+    } else
+        v3_to_v4_resp(ptp, &v3_hdr);
+    ptp->async_state = SG_PT_ASYNC_DONE;
+    if (ptp->start_ns)
+        sample_cmd(ptp, ptp->start_ns, 0);
+    *ptpp = ptp;
+    return 0;
+}
+
+static void
+complete_v3(struct sg_pt_linux_scsi * ptp, const struct sg_io_hdr * rhp,
+            int err)
+{
+    if (err)
+        ptp->os_err = err;
+    else
+        v3_to_v4_resp(ptp, rhp);
+    ptp->async_state = SG_PT_ASYNC_DONE;
+    if (ptp->start_ns)
+        sample_cmd(ptp, ptp->start_ns, -err);
+}
+
+/* Fetches the response of the command started on vp, waiting if
+ * necessary. Responses belonging to other objects that are fetched along
+ * the way are placed in those objects. */
+int
+finish_scsi_pt(struct sg_pt_base * vp, int fd, int verbose)
+{
+    struct sg_pt_linux_scsi * ptp = &vp->impl;
+    struct sg_pt_linux_scsi * optp;
+    int res, kind;
+
+    if (SG_PT_ASYNC_IDLE == ptp->async_state) {
+        if (verbose)
+            pr2ws("%s: no command started on this object\n", __func__);
+        return SCSI_PT_DO_BAD_PARAMS;
+    }
+    kind = fd_kind(fd, 0, verbose);
+    if (kind < 0)
+        return kind;
+    while (SG_PT_ASYNC_STARTED == ptp->async_state) {
+        if (uring_owns_fd(fd)) {
+            res = uring_reap_slot(fd, -1, verbose);
+            if (res >= 0)
+                res = uring_complete(res, &optp, verbose);
+        } else {
+            /* blocks until a response arrives unless fd is O_NONBLOCK */
+            res = reap_one(fd, kind, (int)ptp->io_hdr.spare_in, &optp,
+                           verbose);
+            if (-EAGAIN == res) {
+                res = wait_fd(fd, -1, verbose);
+                if (res < 0)
+                    return res;
+                continue;
+            }
+        }
+        if (-EAGAIN == res)
+            continue;
+        if (res < 0) {
+            ptp->os_err = -res;
+            return res;
+        }
+    }
+    return 0;
+}
+
+int
+reap_scsi_pt(int fd, int wait_ms, struct sg_pt_base ** objpp, int verbose)
+{
+    struct sg_pt_linux_scsi * ptp;
+    int res, kind;
+
+    if (uring_owns_fd(fd)) {
+        res = uring_reap_slot(fd, wait_ms, verbose);
+        if (res < 0)
+            return res;
+        res = uring_complete(res, &ptp, verbose);
+    } else {
+        kind = fd_kind(fd, 0, verbose);
+        if (kind < 0)
+            return kind;
+        /* try the read() first; only wait when nothing is ready */
+        if ((kind & PT_FD_NONBLOCK) || (wait_ms < 0))
+            res = reap_one(fd, kind, -1, &ptp, verbose);
+        else
+            res = -EAGAIN;      /* read() could block beyond wait_ms */
+        if ((-EAGAIN == res) && (wait_ms || (! (kind & PT_FD_NONBLOCK)))) {
+            res = wait_fd(fd, wait_ms, verbose);
+            if (res <= 0)
+                return res ? res : -EAGAIN;
+            res = reap_one(fd, kind, -1, &ptp, verbose);
+        }
+    }
+    if ((0 == res) && objpp)
+        *objpp = (struct sg_pt_base *)ptp;
+    return res;
+}
+
 #endif
 // <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+/* Executes SCSI command (or at least forwards it to lower layers). When
+ * latency sampling is enabled the time taken is added to this thread's
+ * histogram for the command's opcode; when tracing is enabled a record of
+ * the command is added to this thread's trace ring. */
+int
+do_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
+{
+    int res;
+    uint64_t t;
+
+    t = sample_now();
+    res = do_scsi_pt_once(vp, fd, time_secs, verbose);
+    if (t)
+        sample_cmd(&vp->impl, t, res);
+    return res;
+}
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2016 Douglas Gilbert.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the BSD_LICENSE file.
+ */
+
+/* A completion reactor built on the asynchronous sg_pt functions
+ * (start_scsi_pt() and reap_scsi_pt()). Any number of device file
+ * descriptors are registered with one reactor; in Linux they are placed
+ * in one epoll set so a single thread can wait on all of them. Each
+ * command is submitted with its own callback which is invoked, from
+ * scsi_pt_reactor_run(), when its response has been fetched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef SG_LIB_LINUX
+#include <fcntl.h>
+#include <sys/epoll.h>
+#endif
+
+#include "sg_pt.h"
+#include "sg_lib.h"
+
+
+/* Maximum number of epoll events fetched by one epoll_wait() call */
+#define REACTOR_MAX_EVENTS 64
+/* Initial number of hash buckets; doubled as needed, always a power of 2 */
+#define REACTOR_INIT_HASH 64
+
+struct reactor_cmd {
+    struct sg_pt_base * objp;
+    int fd;
+    sg_pt_done_fn done_fn;
+    void * priv;
+    struct reactor_cmd * next;  /* in hash chain, done list or free list */
+};
+
+struct reactor_fd {
+    int fd;
+    int poll_always;            /* 1 when fd could not be added to epoll */
+};
+
+struct sg_pt_reactor {
+    int epfd;                   /* -1 when epoll is not used */
+    int verbose;
+    int num_fds;
+    int max_fds;
+    struct reactor_fd * fd_arr;
+    int num_always;             /* number of fds with poll_always set */
+    int outstanding;            /* commands started, callback not yet run */
+    unsigned int hash_mask;     /* number of buckets less 1 */
+    struct reactor_cmd ** hash; /* outstanding commands, keyed by objp */
+    struct reactor_cmd * free_list;
+    struct reactor_cmd * done_head;     /* completed at submission */
+    struct reactor_cmd ** done_tailp;
+};
+
+
+#if defined(__GNUC__) || defined(__clang__)
+static int pr2ws(const char * fmt, ...)
+        __attribute__ ((format (printf, 1, 2)));
+#else
+static int pr2ws(const char * fmt, ...);
+#endif
+
+static int
+pr2ws(const char * fmt, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vfprintf(sg_get_warnings_strm(), fmt, args);
+    va_end(args);
+    return n;
+}
+
+static unsigned int
+hash_objp(const struct sg_pt_reactor * rp, const struct sg_pt_base * objp)
+{
+    uint64_t u = (uint64_t)(uintptr_t)objp;
+
+    u = (u >> 4) * 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(u >> 32) & rp->hash_mask;
+}
+
+#ifdef SG_LIB_LINUX
+/* Doubles the number of hash buckets. Returns 0 if okay, else -ENOMEM
+ * (in which case the chains just get longer). */
+static int
+grow_hash(struct sg_pt_reactor * rp)
+{
+    unsigned int k, old_sz, new_sz;
+    struct reactor_cmd ** old_hash = rp->hash;
+    struct reactor_cmd ** new_hash;
+    struct reactor_cmd * cp;
+    struct reactor_cmd * nextp;
+
+    old_sz = rp->hash_mask + 1;
+    new_sz = old_sz * 2;
+    new_hash = (struct reactor_cmd **)calloc(new_sz, sizeof(*new_hash));
+    if (NULL == new_hash)
+        return -ENOMEM;
+    rp->hash = new_hash;
+    rp->hash_mask = new_sz - 1;
+    for (k = 0; k < old_sz; ++k) {
+        for (cp = old_hash[k]; cp; cp = nextp) {
+            unsigned int h = hash_objp(rp, cp->objp);
+
+            nextp = cp->next;
+            cp->next = new_hash[h];
+            new_hash[h] = cp;
+        }
+    }
+    free(old_hash);
+    return 0;
+}
+#endif
+
+/* Removes and returns the outstanding command for objp, NULL if none */
+static struct reactor_cmd *
+unlink_cmd(struct sg_pt_reactor * rp, const struct sg_pt_base * objp)
+{
+    struct reactor_cmd ** cpp = &rp->hash[hash_objp(rp, objp)];
+    struct reactor_cmd * cp;
+
+    for ( ; (cp = *cpp); cpp = &cp->next) {
+        if (cp->objp == objp) {
+            *cpp = cp->next;
+            --rp->outstanding;
+            return cp;
+        }
+    }
+    return NULL;
+}
+
+/* Places cp on the free list then calls its callback. The callback may
+ * submit more commands (which might reuse cp). */
+static void
+dispatch(struct sg_pt_reactor * rp, struct reactor_cmd * cp, int res)
+{
+    struct sg_pt_base * objp = cp->objp;
+    sg_pt_done_fn done_fn = cp->done_fn;
+    void * priv = cp->priv;
+    int fd = cp->fd;
+
+    cp->next = rp->free_list;
+    rp->free_list = cp;
+    if (done_fn)
+        done_fn(objp, fd, res, priv);
+}
+
+static struct reactor_fd *
+find_fd(struct sg_pt_reactor * rp, int fd)
+{
+    int k;
+
+    for (k = 0; k < rp->num_fds; ++k) {
+        if (fd == rp->fd_arr[k].fd)
+            return rp->fd_arr + k;
+    }
+    return NULL;
+}
+
+#ifdef SG_LIB_LINUX
+/* Fetches all responses ready on fd and calls their callbacks. When fd
+ * does not block, responses are read until there are no more (-EAGAIN),
+ * one read() each. Otherwise the number waiting is fetched once and that
+ * many are read, none of which can block. Returns the number of callbacks
+ * made. */
+static int
+reap_fd(struct sg_pt_reactor * rp, int fd, int nonblock)
+{
+    int res;
+    int num = 0;
+    int avail = -1;             /* responses known to be ready, -1: n/a */
+    struct sg_pt_base * objp;
+    struct reactor_cmd * cp;
+
+    if (! nonblock) {
+        avail = poll_scsi_pt(fd, 0, rp->verbose);
+        if (avail <= 0)
+            return 0;
+    }
+    while ((rp->outstanding > 0) && (0 != avail)) {
+        objp = NULL;
+        /* wait_ms of -1 reads at once, avail says it will not block */
+        res = reap_scsi_pt(fd, ((avail > 0) ? -1 : 0), &objp, rp->verbose);
+        if (avail > 0)
+            --avail;
+        if (-EAGAIN == res)
+            break;
+        else if (res < 0) {
+            if (rp->verbose)
+                pr2ws("%s: fd=%d: %s\n", __func__, fd, safe_strerror(-res));
+            if (NULL == objp)
+                break;
+        }
+        cp = unlink_cmd(rp, objp);
+        if (NULL == cp) {
+            if (rp->verbose)
+                pr2ws("%s: fd=%d: response for unknown object %p\n",
+                      __func__, fd, (void *)objp);
+            continue;
+        }
+        dispatch(rp, cp, (res < 0) ? res : 0);
+        ++num;
+    }
+    return num;
+}
+#endif
+
+/* Calls the callback, with res, of every command outstanding on fd.
+ * Returns the number of callbacks made. */
+static int
+fail_fd(struct sg_pt_reactor * rp, int fd, int res)
+{
+    unsigned int k;
+    int num = 0;
+    struct reactor_cmd ** cpp;
+    struct reactor_cmd * cp;
+    struct reactor_cmd * failp = NULL;
+
+    /* collect first since callbacks may change the hash table */
+    for (k = 0; k <= rp->hash_mask; ++k) {
+        for (cpp = &rp->hash[k]; (cp = *cpp); ) {
+            if (fd == cp->fd) {
+                *cpp = cp->next;
+                --rp->outstanding;
+                cp->next = failp;
+                failp = cp;
+            } else
+                cpp = &cp->next;
+        }
+    }
+    /* and those that completed at submission (not Linux) */
+    for (cpp = &rp->done_head; (cp = *cpp); ) {
+        if (fd == cp->fd) {
+            *cpp = cp->next;
+            --rp->outstanding;
+            cp->next = failp;
+            failp = cp;
+        } else
+            cpp = &cp->next;
+    }
+    rp->done_tailp = cpp;
+    while ((cp = failp)) {
+        failp = cp->next;
+        dispatch(rp, cp, res);
+        ++num;
+    }
+    return num;
+}
+
+struct sg_pt_reactor *
+construct_scsi_pt_reactor(int verbose)
+{
+    struct sg_pt_reactor * rp;
+
+    rp = (struct sg_pt_reactor *)calloc(1, sizeof(*rp));
+    if (NULL == rp)
+        return NULL;
+    rp->verbose = verbose;
+    rp->done_tailp = &rp->done_head;
+    rp->hash_mask = REACTOR_INIT_HASH - 1;
+    rp->hash = (struct reactor_cmd **)calloc(REACTOR_INIT_HASH,
+                                             sizeof(*rp->hash));
+    if (NULL == rp->hash) {
+        free(rp);
+        return NULL;
+    }
+#ifdef SG_LIB_LINUX
+    rp->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (rp->epfd < 0) {
+        if (verbose)
+            pr2ws("%s: epoll_create1: %s\n", __func__,
+                  safe_strerror(errno));
+        free(rp->hash);
+        free(rp);
+        return NULL;
+    }
+#else
+    rp->epfd = -1;
+#endif
+    return rp;
+}
+
+void
+destruct_scsi_pt_reactor(struct sg_pt_reactor * rp)
+{
+    unsigned int k;
+    struct reactor_cmd * cp;
+    struct reactor_cmd * nextp;
+
+    if (NULL == rp)
+        return;
+    if (rp->epfd >= 0)
+        close(rp->epfd);
+    for (k = 0; k <= rp->hash_mask; ++k) {
+        for (cp = rp->hash[k]; cp; cp = nextp) {
+            nextp = cp->next;
+            free(cp);
+        }
+    }
+    for (cp = rp->done_head; cp; cp = nextp) {
+        nextp = cp->next;
+        free(cp);
+    }
+    for (cp = rp->free_list; cp; cp = nextp) {
+        nextp = cp->next;
+        free(cp);
+    }
+    free(rp->hash);
+    free(rp->fd_arr);
+    free(rp);
+}
+
+int
+scsi_pt_reactor_add_fd(struct sg_pt_reactor * rp, int fd)
+{
+    struct reactor_fd * rfp;
+
+    if ((NULL == rp) || (fd < 0))
+        return -EINVAL;
+    if (find_fd(rp, fd))
+        return -EEXIST;
+    if (rp->num_fds >= rp->max_fds) {
+        int new_max = rp->max_fds ? (2 * rp->max_fds) : 16;
+
+        rfp = (struct reactor_fd *)realloc(rp->fd_arr,
+                                           new_max * sizeof(*rfp));
+        if (NULL == rfp)
+            return -ENOMEM;
+        rp->fd_arr = rfp;
+        rp->max_fds = new_max;
+    }
+    rfp = rp->fd_arr + rp->num_fds;
+    rfp->fd = fd;
+    rfp->poll_always = 1;
+#ifdef SG_LIB_LINUX
+    {
+        struct epoll_event ev;
+        int flags = fcntl(fd, F_GETFL);
+
+        /* fd in the low 32 bits, whether it blocks in the upper ones */
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint32_t)fd;
+        if ((flags >= 0) && (flags & O_NONBLOCK))
+            ev.data.u64 |= (uint64_t)1 << 32;
+        if (0 == epoll_ctl(rp->epfd, EPOLL_CTL_ADD, fd, &ev))
+            rfp->poll_always = 0;
+        else if (EPERM != errno) {
+            /* EPERM: fd does not support polling (e.g. an emulated disk
+             * backed by a regular file); its responses are always ready */
+            int err = errno;
+
+            if (rp->verbose)
+                pr2ws("%s: epoll_ctl(fd=%d): %s\n", __func__, fd,
+                      safe_strerror(err));
+            return -err;
+        }
+    }
+#endif
+    if (rfp->poll_always)
+        ++rp->num_always;
+    ++rp->num_fds;
+    return 0;
+}
+
+int
+scsi_pt_reactor_del_fd(struct sg_pt_reactor * rp, int fd)
+{
+    struct reactor_fd * rfp;
+
+    if (NULL == rp)
+        return -EINVAL;
+    rfp = find_fd(rp, fd);
+    if (NULL == rfp)
+        return -ENOENT;
+    if (rfp->poll_always)
+        --rp->num_always;
+#ifdef SG_LIB_LINUX
+    else
+        epoll_ctl(rp->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+    *rfp = rp->fd_arr[--rp->num_fds];
+    fail_fd(rp, fd, -ECANCELED);
+    return 0;
+}
+
+int
+scsi_pt_reactor_submit(struct sg_pt_reactor * rp, struct sg_pt_base * objp,
+                       int fd, int timeout_secs, sg_pt_done_fn done_fn,
+                       void * priv)
+{
+    int res;
+    struct reactor_cmd * cp;
+
+    if ((NULL == rp) || (NULL == objp))
+        return -EINVAL;
+    if (NULL == find_fd(rp, fd))
+        return -EBADF;
+    if (rp->free_list) {
+        cp = rp->free_list;
+        rp->free_list = cp->next;
+    } else {
+        cp = (struct reactor_cmd *)malloc(sizeof(*cp));
+        if (NULL == cp)
+            return -ENOMEM;
+    }
+    cp->objp = objp;
+    cp->fd = fd;
+    cp->done_fn = done_fn;
+    cp->priv = priv;
+    res = start_scsi_pt(objp, fd, timeout_secs, rp->verbose);
+    if (res) {
+        cp->next = rp->free_list;
+        rp->free_list = cp;
+        return res;
+    }
+#ifdef SG_LIB_LINUX
+    {
+        unsigned int h;
+
+        if ((unsigned int)rp->outstanding > rp->hash_mask)
+            grow_hash(rp);
+        h = hash_objp(rp, objp);
+        cp->next = rp->hash[h];
+        rp->hash[h] = cp;
+    }
+    ++rp->outstanding;
+#else
+    /* start_scsi_pt() has executed the command, callback on next run */
+    cp->next = NULL;
+    *rp->done_tailp = cp;
+    rp->done_tailp = &cp->next;
+    ++rp->outstanding;
+#endif
+    return 0;
+}
+
+int
+scsi_pt_reactor_outstanding(const struct sg_pt_reactor * rp)
+{
+    return rp ? rp->outstanding : 0;
+}
+
+int
+scsi_pt_reactor_run(struct sg_pt_reactor * rp, int wait_ms)
+{
+    int k = 0;
+    int num = 0;
+    struct reactor_cmd * cp;
+
+    if (NULL == rp)
+        return -EINVAL;
+    if (0 == rp->outstanding)
+        return 0;
+    /* commands that completed when submitted, oldest first */
+    while ((cp = rp->done_head)) {
+        rp->done_head = cp->next;
+        if (NULL == rp->done_head)
+            rp->done_tailp = &rp->done_head;
+        --rp->outstanding;
+        dispatch(rp, cp, 0);
+        ++num;
+    }
+#ifdef SG_LIB_LINUX
+    for (k = 0; (rp->num_always > 0) && (k < rp->num_fds); ++k) {
+        if (rp->fd_arr[k].poll_always)
+            num += reap_fd(rp, rp->fd_arr[k].fd, 1);    /* never block */
+    }
+    if (rp->num_fds > rp->num_always) {
+        int n, fd;
+        struct epoll_event evs[REACTOR_MAX_EVENTS];
+
+        n = epoll_wait(rp->epfd, evs, REACTOR_MAX_EVENTS,
+                       ((num > 0) || (0 == rp->outstanding)) ? 0 : wait_ms);
+        if (n < 0) {
+            int err = errno;
+
+            if (num > 0)
+                return num;
+            if ((EINTR != err) && rp->verbose)
+                pr2ws("%s: epoll_wait: %s\n", __func__, safe_strerror(err));
+            return -err;
+        }
+        for (k = 0; k < n; ++k) {
+            fd = (int)(uint32_t)evs[k].data.u64;
+            if (evs[k].events & EPOLLIN)
+                num += reap_fd(rp, fd, (int)(evs[k].data.u64 >> 32));
+            if (evs[k].events & (EPOLLERR | EPOLLHUP)) {
+                if (rp->verbose)
+                    pr2ws("%s: error or hangup on fd=%d\n", __func__, fd);
+                num += fail_fd(rp, fd, -EIO);
+            }
+        }
+    }
+#else
+    if (wait_ms || k) { ; }     /* unused, suppress warning */
+#endif
+    return num;
+}
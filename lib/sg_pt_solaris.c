@@ -65,7 +65,7 @@ scsi_pt_open_flags(const char * device_name, int flags_arg, int verbose)
 
     flags_arg = flags_arg;  /* ignore flags argument, suppress warning */
     if (verbose > 1) {
-        fprintf(sg_warnings_strm ? sg_warnings_strm : stderr,
+        fprintf(sg_get_warnings_strm(),
                 "open %s with flags=0x%x\n", device_name, oflags);
     }
     fd = open(device_name, oflags);
@@ -238,13 +238,13 @@ do_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
     ptp->os_err = 0;
     if (ptp->in_err) {
         if (verbose)
-            fprintf(sg_warnings_strm ? sg_warnings_strm : stderr,
+            fprintf(sg_get_warnings_strm(),
                     "Replicated or unused set_scsi_pt... functions\n");
         return SCSI_PT_DO_BAD_PARAMS;
     }
     if (NULL == ptp->uscsi.uscsi_cdb) {
         if (verbose)
-            fprintf(sg_warnings_strm ? sg_warnings_strm : stderr,
+            fprintf(sg_get_warnings_strm(),
                     "No SCSI command (cdb) given\n");
         return SCSI_PT_DO_BAD_PARAMS;
     }
@@ -258,7 +258,7 @@ do_scsi_pt(struct sg_pt_base * vp, int fd, int time_secs, int verbose)
             return 0;
         }
         if (verbose)
-            fprintf(sg_warnings_strm ? sg_warnings_strm : stderr,
+            fprintf(sg_get_warnings_strm(),
                     "ioctl(USCSICMD) failed with os_err (errno) = %d\n",
                     ptp->os_err);
         return -ptp->os_err;
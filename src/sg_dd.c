@@ -39,6 +39,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 #define __STDC_FORMAT_MACROS 1
 #include <inttypes.h>
 #include <sys/ioctl.h>
@@ -47,6 +48,7 @@
 #include <sys/sysmacros.h>
 #include <sys/time.h>
 #include <sys/file.h>
+#include <poll.h>
 #include <linux/major.h>
 #include <linux/fs.h>   /* <sys/mount.h> */
 
@@ -57,10 +59,12 @@
 #include "sg_cmds_basic.h"
 #include "sg_cmds_extra.h"
 #include "sg_io_linux.h"
+#include "sg_pt.h"
 #include "sg_unaligned.h"
 #include "sg_pr2serr.h"
+#include "sg_dd_common.h"
 
-static const char * version_str = "5.86 20151219";
+static const char * version_str = "5.95 20160712";
 
 
 #define ME "sg_dd: "
@@ -91,6 +95,13 @@ static const char * version_str = "5.86 20151219";
 #define READ_LONG_DEF_BLK_INC 8
 
 #define DEF_TIMEOUT 60000       /* 60,000 millisecs == 60 seconds */
+#define MAX_QUEUE_DEPTH 128     /* upper limit of qd=N */
+#define DEF_HASH_CHUNK_MIB 64   /* hash_chunk=MIB default */
+#define DEF_JOURNAL_INTERVAL 5  /* jinterval=SECS default */
+
+#ifndef SG_FLAG_MMAP_IO
+#define SG_FLAG_MMAP_IO 4
+#endif
 
 #ifndef RAW_MAJOR
 #define RAW_MAJOR 255   /*unlikey value */
@@ -129,6 +140,7 @@ static int in_partial = 0;
 static int64_t out_full = 0;
 static int out_partial = 0;
 static int64_t out_sparse = 0;
+static int64_t out_zeroed = 0;
 static int recovered_errs = 0;
 static int unrecovered_errs = 0;
 static int read_longs = 0;
@@ -160,10 +172,12 @@ struct flags_t {
     int excl;
     int fua;
     int flock;
+    int mmap;
     int nocache;
     int sgio;
     int pdt;
     int sparse;
+    int unmap;
     int retries;
 };
 
@@ -199,6 +213,9 @@ print_stats(const char * str)
             out_partial);
     if (oflag.sparse)
         pr2serr("%s%" PRId64 " bypassed records out\n", str, out_sparse);
+    if (oflag.unmap)
+        pr2serr("%s%" PRId64 " records out zeroed by WRITE SAME or UNMAP\n",
+                str, out_zeroed);
     if (recovered_errs > 0)
         pr2serr("%s%d recovered errors\n", str, recovered_errs);
     if (num_retries > 0)
@@ -289,6 +306,8 @@ dd_filetype(const char * filename)
 
     if ((1 == len) && ('.' == filename[0]))
         return FT_DEV_NULL;
+    if (0 == strncmp(filename, SG_EMUL_PREFIX, sizeof(SG_EMUL_PREFIX) - 1))
+        return FT_SG;   /* emulated disk, see sg_pt_emul.c */
     if (stat(filename, &st) < 0)
         return FT_ERROR;
     if (S_ISCHR(st.st_mode)) {
@@ -316,6 +335,40 @@ dd_filetype(const char * filename)
 }
 
 
+/* Opens a sg device node, or an emulated disk when the name starts with
+ * "emul:". Acts like open(). */
+static int
+sg_open(const char * filename, int flags)
+{
+    return sg_emul_is_emul_name(filename) ?
+           sg_emul_open(filename, flags, verbose) : open(filename, flags);
+}
+
+static void
+sg_close(int fd)
+{
+    scsi_pt_mmap_release(fd);
+    if (sg_emul_fd(fd))
+        sg_emul_close(fd);
+    else
+        close(fd);
+}
+
+/* SG_IO ioctl, or its equivalent when fd is an emulated disk. With
+ * time=1 its latency is added to the sg_pt library's histograms. */
+static int
+sg_io_ioctl(int fd, struct sg_io_hdr * hp)
+{
+    int res;
+    uint64_t t = scsi_pt_lat_enabled() ? scsi_pt_lat_now_ns() : 0;
+
+    res = sg_emul_fd(fd) ? sg_emul_sg_io(fd, hp) : ioctl(fd, SG_IO, hp);
+    if (t && (res >= 0))
+        scsi_pt_lat_record(hp->cmdp[0], scsi_pt_lat_now_ns() - t);
+    return res;
+}
+
+
 static char *
 dd_filetype_str(int ft, char * buff)
 {
@@ -351,14 +404,20 @@ usage()
             "              [--help] [--version]\n\n"
             "              [blk_sgio=0|1] [bpt=BPT] [cdbsz=6|10|12|16] "
             "[coe=0|1|2|3]\n"
-            "              [coe_limit=CL] [dio=0|1] [odir=0|1] "
-            "[of2=OFILE2] [retries=RETR]\n"
-            "              [sync=0|1] [time=0|1] [verbose=VERB]\n"
+            "              [coe_limit=CL] [dio=0|1] [hash_chunk=MIB] "
+            "[ihash=MFILE]\n"
+            "              [jinterval=SECS] [journal=JFILE] [odir=0|1] "
+            "[of2=OFILE2]\n"
+            "              [ohash=MFILE] [qd=QD] [rescue=MFILE] [retries=RETR] "
+            "[sync=0|1]\n"
+            "              [time=0|1] [verbose=VERB]\n"
             "  where:\n"
             "    blk_sgio    0->block device use normal I/O(def), 1->use "
             "SG_IO\n"
             "    bpt         is blocks_per_transfer (default is 128 or 32 "
-            "when BS>=2048)\n"
+            "when BS>=2048),\n"
+            "                'auto' -> tune from Block Limits VPD page and "
+            "throughput\n"
             "    bs          block size (default is 512)\n");
     pr2serr("    cdbsz       size of SCSI READ or WRITE cdb (default is "
             "10)\n"
@@ -372,12 +431,21 @@ usage()
             "                when COE>1 (default: 0 which is no limit)\n"
             "    count       number of blocks to copy (def: device size)\n"
             "    dio         for direct IO, 1->attempt, 0->indirect IO (def)\n"
+            "    hash_chunk  CRC32C each MIB mebibytes for ihash and ohash "
+            "(def: 64)\n"
             "    ibs         input block size (if given must be same as "
             "'bs=')\n"
             "    if          file or device to read from (def: stdin)\n"
             "    iflag       comma separated list from: [coe,dio,direct,"
             "dpo,dsync,excl,\n"
-            "                flock,fua,nocache,null,sgio]\n"
+            "                flock,fua,mmap,nocache,null,sgio]\n"
+            "    ihash       CRC32C of data read, digests to manifest MFILE "
+            "('.' for\n"
+            "                none)\n"
+            "    jinterval   seconds between journal or rescue map "
+            "checkpoints (def: 5)\n"
+            "    journal     record progress in JFILE, resume from it if "
+            "it exists\n"
             "    obs         output block size (if given must be same as "
             "'bs=')\n"
             "    odir        1->use O_DIRECT when opening block dev, "
@@ -388,10 +456,19 @@ usage()
             "    of2         additional output file (def: /dev/null), "
             "OFILE2 should be\n"
             "                normal file or pipe\n"
+            "    ohash       CRC32C of data written, digests to manifest "
+            "MFILE\n"
             "    oflag       comma separated list from: [append,coe,dio,"
             "direct,dpo,\n"
-            "                dsync,excl,flock,fua,nocache,null,sgio,"
-            "sparse]\n"
+            "                dsync,excl,flock,fua,mmap,nocache,null,"
+            "sgio,sparse,unmap]\n"
+            "    qd          queue depth: QD READs and QD WRITEs outstanding "
+            "on sg\n"
+            "                devices (def: 1)\n"
+            "    rescue      skip then bisect unreadable regions of IFILE, "
+            "recording\n"
+            "                progress in map MFILE, resume from it if it "
+            "exists\n"
             "    retries     retry sgio errors RETR times (def: 0)\n"
             "    seek        block position to start writing to OFILE\n"
             "    skip        block position to start reading from IFILE\n"
@@ -577,9 +654,9 @@ sg_read_low(int sg_fd, unsigned char * buff, int blocks, int64_t from_block,
 {
     unsigned char rdCmd[MAX_SCSI_CDBSZ];
     unsigned char senseBuff[SENSE_BUFF_LEN];
-    const unsigned char * sbp;
     struct sg_io_hdr io_hdr;
-    int res, k, info_valid, slen;
+    struct sg_sense_info si;
+    int res, k;
 
     if (sg_build_scsi_cdb(rdCmd, ifp->cdbsz, blocks, from_block, 0,
                           ifp->fua, ifp->dpo)) {
@@ -599,7 +676,9 @@ sg_read_low(int sg_fd, unsigned char * buff, int blocks, int64_t from_block,
     io_hdr.sbp = senseBuff;
     io_hdr.timeout = DEF_TIMEOUT;
     io_hdr.pack_id = (int)from_block;
-    if (diop && *diop)
+    if (ifp->mmap)
+        io_hdr.flags |= SG_FLAG_MMAP_IO;
+    else if (diop && *diop)
         io_hdr.flags |= SG_FLAG_DIRECT_IO;
 
     if (verbose > 2) {
@@ -608,7 +687,7 @@ sg_read_low(int sg_fd, unsigned char * buff, int blocks, int64_t from_block,
             pr2serr("%02x ", rdCmd[k]);
         pr2serr("\n");
     }
-    while (((res = ioctl(sg_fd, SG_IO, &io_hdr)) < 0) &&
+    while (((res = sg_io_ioctl(sg_fd, &io_hdr)) < 0) &&
            ((EINTR == errno) || (EAGAIN == errno)))
         ;
     if (res < 0) {
@@ -619,16 +698,15 @@ sg_read_low(int sg_fd, unsigned char * buff, int blocks, int64_t from_block,
     }
     if (verbose > 2)
         pr2serr("      duration=%u ms\n", io_hdr.duration);
-    res = sg_err_category3(&io_hdr);
-    sbp = io_hdr.sbp;
-    slen = io_hdr.sb_len_wr;
+    /* sense data decoded once, no text unless something is reported */
+    res = sg_err_category3_si(&io_hdr, &si);
+    *io_addrp = si.info;
     switch (res) {
     case SG_LIB_CAT_CLEAN:
         break;
     case SG_LIB_CAT_RECOVERED:
         ++recovered_errs;
-        info_valid = sg_get_sense_info_fld(sbp, slen, io_addrp);
-        if (info_valid) {
+        if (si.info_valid) {
             pr2serr("    lba of last recovered error in this READ=0x%" PRIx64
                     "\n", *io_addrp);
             if (verbose > 1)
@@ -647,9 +725,8 @@ sg_read_low(int sg_fd, unsigned char * buff, int blocks, int64_t from_block,
         if (verbose > 1)
             sg_chk_n_print3("reading", &io_hdr, verbose > 1);
         ++unrecovered_errs;
-        info_valid = sg_get_sense_info_fld(sbp, slen, io_addrp);
         /* MMC devices don't necessarily set VALID bit */
-        if ((info_valid) || ((5 == ifp->pdt) && (*io_addrp > 0)))
+        if ((si.info_valid) || ((5 == ifp->pdt) && (*io_addrp > 0)))
             return SG_LIB_CAT_MEDIUM_HARD_WITH_INFO;
         else {
             pr2serr("Medium, hardware or blank check error but no lba of "
@@ -664,16 +741,10 @@ sg_read_low(int sg_fd, unsigned char * buff, int blocks, int64_t from_block,
         return res;
     case SG_LIB_CAT_ILLEGAL_REQ:
         if (5 == ifp->pdt) {    /* MMC READs can go down this path */
-            struct sg_scsi_sense_hdr ssh;
-            int ili;
-
             if (verbose > 1)
                 sg_chk_n_print3("reading", &io_hdr, verbose > 1);
-            if (sg_scsi_normalize_sense(sbp, slen, &ssh) &&
-                (0x64 == ssh.asc) && (0x0 == ssh.ascq)) {
-                if (sg_get_sense_filemark_eom_ili(sbp, slen, NULL, NULL,
-                                                  &ili) && ili) {
-                    sg_get_sense_info_fld(sbp, slen, io_addrp);
+            if ((0x64 == si.asc) && (0x0 == si.ascq)) {
+                if (si.ili) {
                     if (*io_addrp > 0) {
                         ++unrecovered_errs;
                         return SG_LIB_CAT_MEDIUM_HARD_WITH_INFO;
@@ -968,8 +1039,8 @@ sg_write(int sg_fd, unsigned char * buff, int blocks, int64_t to_block,
     unsigned char wrCmd[MAX_SCSI_CDBSZ];
     unsigned char senseBuff[SENSE_BUFF_LEN];
     struct sg_io_hdr io_hdr;
-    int res, k, info_valid;
-    uint64_t io_addr = 0;
+    struct sg_sense_info si;
+    int res, k;
 
     if (sg_build_scsi_cdb(wrCmd, ofp->cdbsz, blocks, to_block, 1, ofp->fua,
                           ofp->dpo)) {
@@ -989,7 +1060,9 @@ sg_write(int sg_fd, unsigned char * buff, int blocks, int64_t to_block,
     io_hdr.sbp = senseBuff;
     io_hdr.timeout = DEF_TIMEOUT;
     io_hdr.pack_id = (int)to_block;
-    if (diop && *diop)
+    if (ofp->mmap)
+        io_hdr.flags |= SG_FLAG_MMAP_IO;
+    else if (diop && *diop)
         io_hdr.flags |= SG_FLAG_DIRECT_IO;
 
     if (verbose > 2) {
@@ -998,7 +1071,7 @@ sg_write(int sg_fd, unsigned char * buff, int blocks, int64_t to_block,
             pr2serr("%02x ", wrCmd[k]);
         pr2serr("\n");
     }
-    while (((res = ioctl(sg_fd, SG_IO, &io_hdr)) < 0) &&
+    while (((res = sg_io_ioctl(sg_fd, &io_hdr)) < 0) &&
            ((EINTR == errno) || (EAGAIN == errno)))
         ;
     if (res < 0) {
@@ -1010,17 +1083,15 @@ sg_write(int sg_fd, unsigned char * buff, int blocks, int64_t to_block,
 
     if (verbose > 2)
         pr2serr("      duration=%u ms\n", io_hdr.duration);
-    res = sg_err_category3(&io_hdr);
+    res = sg_err_category3_si(&io_hdr, &si);
     switch (res) {
     case SG_LIB_CAT_CLEAN:
         break;
     case SG_LIB_CAT_RECOVERED:
         ++recovered_errs;
-        info_valid = sg_get_sense_info_fld(io_hdr.sbp, io_hdr.sb_len_wr,
-                                           &io_addr);
-        if (info_valid) {
+        if (si.info_valid) {
             pr2serr("    lba of last recovered error in this WRITE=0x%" PRIx64
-                    "\n", io_addr);
+                    "\n", si.info);
             if (verbose > 1)
                 sg_chk_n_print3("writing", &io_hdr, 1);
         } else {
@@ -1055,6 +1126,163 @@ sg_write(int sg_fd, unsigned char * buff, int blocks, int64_t to_block,
 }
 
 
+/* Calls sg_write(), repeating it after a unit attention, an aborted
+ * command or (up to 'retries=' times) some other error. If ENOMEM is
+ * reported and blocks_perp is non-NULL then the transfer is reduced to
+ * what the reserved buffer holds and *blocksp, *blocks_perp adjusted.
+ * Returns as sg_write(). */
+static int
+sg_write_retry(int sg_fd, unsigned char * buff, int * blocksp,
+               int64_t to_block, int * blocks_perp, int * diop)
+{
+    int ret, buf_sz, blocks_per;
+    int retries_tmp = oflag.retries;
+    int first = 1;
+
+    while (1) {
+        ret = sg_write(sg_fd, buff, *blocksp, to_block, blk_sz, &oflag, diop);
+        if (0 == ret)
+            break;
+        if ((SG_LIB_CAT_NOT_READY == ret) ||
+            (SG_LIB_SYNTAX_ERROR == ret))
+            break;
+        else if ((-2 == ret) && first && blocks_perp) {
+            /* ENOMEM: find what's available and try that */
+            if (ioctl(sg_fd, SG_GET_RESERVED_SIZE, &buf_sz) < 0) {
+                perror("RESERVED_SIZE ioctls failed");
+                break;
+            }
+            if (buf_sz < MIN_RESERVED_SIZE)
+                buf_sz = MIN_RESERVED_SIZE;
+            blocks_per = (buf_sz + blk_sz - 1) / blk_sz;
+            *blocks_perp = blocks_per;
+            if (blocks_per < *blocksp) {
+                *blocksp = blocks_per;
+                pr2serr("Reducing write to %d blocks per loop\n",
+                        blocks_per);
+            } else
+                break;
+        } else if ((SG_LIB_CAT_UNIT_ATTENTION == ret) && first) {
+            if (--max_uas > 0)
+                pr2serr("Unit attention, continuing (w)\n");
+            else {
+                pr2serr("Unit attention, too many (w)\n");
+                break;
+            }
+        } else if ((SG_LIB_CAT_ABORTED_COMMAND == ret) && first) {
+            if (--max_aborted > 0)
+                pr2serr("Aborted command, continuing (w)\n");
+            else {
+                pr2serr("Aborted command, too many (w)\n");
+                break;
+            }
+        } else if (ret < 0)
+            break;
+        else if (retries_tmp > 0) {
+            pr2serr(">>> retrying a sgio write, lba=0x%" PRIx64 "\n",
+                    (uint64_t)to_block);
+            --retries_tmp;
+            ++num_retries;
+            if (unrecovered_errs > 0)
+                --unrecovered_errs;
+        } else
+            break;
+        first = 0;
+    }
+    return ret;
+}
+
+/* oflag=unmap state, see sg_dd_common.h . Adjacent zero runs, including
+ * those spanning transfers, are coalesced and sent once the run ends. */
+static struct zero_ofl zo;
+
+/* zo_wr_zeros_fn for zo_zero_run(): writes 'num' blocks of zeros at 'lba'
+ * the ordinary way */
+static int
+zo_write_zeros(void * arg, int64_t lba, int64_t num)
+{
+    int ret, blocks, dio_tmp;
+    int fd = *(int *)arg;
+
+    for ( ; num > 0; num -= blocks, lba += blocks) {
+        blocks = (num > zo.bpt) ? zo.bpt : num;
+        dio_tmp = 0;
+        ret = sg_write_retry(fd, zo.zeros, &blocks, lba, NULL, &dio_tmp);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* Sends the pending run of zeroed blocks, if any. If the device rejects
+ * the method, later runs are written. Returns 0 on success. */
+static int
+zo_flush(int fd)
+{
+    int ret;
+    int64_t zeroed = 0;
+
+    if (zo.run_num <= 0)
+        return 0;
+    ret = zo_zero_run(&zo, fd, blk_sz, zo.run_lba, zo.run_num, &zeroed,
+                      zo_write_zeros, &fd, verbose);
+    out_zeroed += zeroed;
+    if (0 == ret) {
+        out_full += zo.run_num;
+        zo.run_num = 0;
+    }
+    return ret;
+}
+
+/* Returns the number of leading blocks to write: up to the start of a
+ * zero run of at least min_run blocks, or of one reaching the end. */
+static int
+zo_data_blocks(const unsigned char * bp, int blocks)
+{
+    int k;
+    int zrun = 0;
+
+    for (k = 0; k < blocks; ++k, bp += blk_sz) {
+        if (sg_all_zeros(bp, blk_sz)) {
+            if (++zrun >= zo.min_run)
+                return k + 1 - zrun;
+        } else
+            zrun = 0;
+    }
+    return blocks - zrun;
+}
+
+/* Used instead of sg_write_retry() for oflag=unmap. Writes the blocks
+ * that are not in zero runs and adds zero runs to the pending run. */
+static int
+zo_write(int fd, unsigned char * bp, int blocks, int64_t lba, int * diop)
+{
+    int k, n, ret;
+
+    for (k = 0; k < blocks; k += n) {
+        n = zo_zero_blocks(bp + (k * blk_sz), blocks - k, blk_sz, 0);
+        if ((n > 0) && ((n >= zo.min_run) || ((k + n) == blocks) ||
+                        ((0 == k) && (zo.run_num > 0)))) {
+            if ((zo.run_num > 0) && ((zo.run_lba + zo.run_num) != lba + k))
+                if ((ret = zo_flush(fd)))
+                    return ret;
+            if (0 == zo.run_num)
+                zo.run_lba = lba + k;
+            zo.run_num += n;
+            continue;
+        }
+        if ((ret = zo_flush(fd)))
+            return ret;
+        n = zo_data_blocks(bp + (k * blk_sz), blocks - k);
+        ret = sg_write_retry(fd, bp + (k * blk_sz), &n, lba + k, NULL, diop);
+        if (ret)
+            return ret;
+        out_full += n;
+    }
+    return 0;
+}
+
+
 static void
 calc_duration_throughput(int contin)
 {
@@ -1084,6 +1312,522 @@ calc_duration_throughput(int contin)
     }
 }
 
+/* With time=1 prints a latency summary for each opcode sent during the
+ * copy (READs, WRITEs and any VERIFYs) */
+static void
+print_latency(void)
+{
+    int k;
+    static struct sg_pt_lat_hist hist;
+    char name[64];
+    char leadin[80];
+    char b[192];
+
+    for (k = 0; k < 256; ++k) {
+        if (0 == scsi_pt_lat_snapshot(k, &hist))
+            continue;
+        sg_get_opcode_name((unsigned char)k, 0, sizeof(name), name);
+        snprintf(leadin, sizeof(leadin), "%s latency: ", name);
+        scsi_pt_lat_str(&hist, leadin, sizeof(b), b);
+        pr2serr("%s\n", b);
+    }
+}
+
+/* bpt=auto state, see sg_dd_common.h */
+static struct bpt_auto bauto;
+
+static struct hash_strm ihash;
+static struct hash_strm ohash;
+
+static struct journal_t jrnl;
+
+/* Bad region map for rescue=MFILE . The blocks to copy (numbered from
+ * skip and seek) are held as a sorted list of extents, each with a
+ * status: '?' not tried, '*' failed within a larger transfer (to be
+ * bisected), '-' unreadable on its own or '+' copied. The map is
+ * rewritten (to a temporary file then renamed) at checkpoints, after the
+ * output has been synchronized, so it never claims more than is on
+ * OFILE. */
+#define RSC_UNTRIED '?'
+#define RSC_SKIPPED '*'
+#define RSC_BAD '-'
+#define RSC_COPIED '+'
+
+struct rescue_ext {
+    int64_t start;      /* block offset from skip and seek */
+    int64_t num;
+    char st;            /* RSC_* status */
+};
+
+struct rescue_t {
+    int interval;       /* seconds between checkpoints */
+    int no_sync_cache;  /* OFILE does not support SYNCHRONIZE CACHE */
+    int is_new;
+    int tsz;            /* blocks per read in the next bisect pass */
+    int dirty;          /* map changed since last written */
+    int num;            /* extents in use */
+    int max;            /* extents allocated */
+    int64_t skip;       /* skip, seek and count as first given */
+    int64_t seek;
+    int64_t count;
+    time_t last;        /* time of last checkpoint */
+    const char * fname;
+    struct rescue_ext * arr;
+};
+
+static struct rescue_t rsc = {DEF_JOURNAL_INTERVAL, 0, 0, 0, 0, 0, 0, 0,
+                              0, 0, 0, NULL, NULL};
+
+/* Returns the index of the extent holding block offset 'off' */
+static int
+rescue_find(int64_t off)
+{
+    int lo = 0;
+    int hi = rsc.num - 1;
+    int mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (rsc.arr[mid].start > off)
+            hi = mid - 1;
+        else
+            lo = mid;
+    }
+    return lo;
+}
+
+/* Appends an extent, merging it with the last one if they have the same
+ * status. Returns 0, or 1 if out of memory. */
+static int
+rescue_append(int64_t start, int64_t num, char st)
+{
+    struct rescue_ext * ep;
+
+    if (num <= 0)
+        return 0;
+    if ((rsc.num > 0) && (st == rsc.arr[rsc.num - 1].st)) {
+        rsc.arr[rsc.num - 1].num += num;
+        return 0;
+    }
+    if (rsc.num >= rsc.max) {
+        ep = (struct rescue_ext *)realloc(rsc.arr, (rsc.max + 256) *
+                                          sizeof(struct rescue_ext));
+        if (NULL == ep)
+            return 1;
+        rsc.arr = ep;
+        rsc.max += 256;
+    }
+    ep = rsc.arr + rsc.num++;
+    ep->start = start;
+    ep->num = num;
+    ep->st = st;
+    return 0;
+}
+
+/* Sets the status of 'num' blocks at 'off', which must lie within one
+ * extent, splitting that extent and merging with its neighbours as
+ * needed. Returns 0, or 1 if out of memory. */
+static int
+rescue_set(int64_t off, int64_t num, char st)
+{
+    int k, lo, hi, np;
+    struct rescue_ext e;
+    struct rescue_ext piece[3];
+    struct rescue_ext * ep;
+
+    if (num <= 0)
+        return 0;
+    k = rescue_find(off);
+    e = rsc.arr[k];
+    if (st == e.st)
+        return 0;
+    rsc.dirty = 1;
+    np = 0;
+    if (off > e.start) {
+        piece[np].start = e.start;
+        piece[np].num = off - e.start;
+        piece[np++].st = e.st;
+    }
+    piece[np].start = off;
+    piece[np].num = num;
+    piece[np++].st = st;
+    if ((off + num) < (e.start + e.num)) {
+        piece[np].start = off + num;
+        piece[np].num = e.start + e.num - (off + num);
+        piece[np++].st = e.st;
+    }
+    lo = k;             /* pieces replace extents lo to hi-1 */
+    hi = k + 1;
+    if ((lo > 0) && (piece[0].st == rsc.arr[lo - 1].st)) {
+        --lo;
+        piece[0].start = rsc.arr[lo].start;
+        piece[0].num += rsc.arr[lo].num;
+    }
+    if ((hi < rsc.num) && (piece[np - 1].st == rsc.arr[hi].st)) {
+        piece[np - 1].num += rsc.arr[hi].num;
+        ++hi;
+    }
+    if ((rsc.num + np - (hi - lo)) > rsc.max) {
+        ep = (struct rescue_ext *)realloc(rsc.arr, (rsc.max + 256) *
+                                          sizeof(struct rescue_ext));
+        if (NULL == ep)
+            return 1;
+        rsc.arr = ep;
+        rsc.max += 256;
+    }
+    memmove(rsc.arr + lo + np, rsc.arr + hi,
+            (rsc.num - hi) * sizeof(struct rescue_ext));
+    memcpy(rsc.arr + lo, piece, np * sizeof(struct rescue_ext));
+    rsc.num += np - (hi - lo);
+    return 0;
+}
+
+/* Returns the number of blocks with status 'st' */
+static int64_t
+rescue_count(char st)
+{
+    int k;
+    int64_t n = 0;
+
+    for (k = 0; k < rsc.num; ++k) {
+        if (st == rsc.arr[k].st)
+            n += rsc.arr[k].num;
+    }
+    return n;
+}
+
+/* Loads the map if it exists. If it is for the same IFILE, OFILE, bs,
+ * skip and seek (and count, if given) then *countp is set to its count.
+ * Returns 0 on success, else SG_LIB_FILE_ERROR or SG_LIB_SYNTAX_ERROR . */
+static int
+rescue_open(const char * mfile, const char * inf, const char * outf,
+            int64_t skip, int64_t seek, int64_t * countp)
+{
+    int bad = 0;
+    int other = 0;
+    int64_t jbs = -1;
+    int64_t jskip = -1;
+    int64_t jseek = -1;
+    int64_t jcount = -1;
+    int64_t start, num;
+    char st;
+    char * cp;
+    FILE * fp;
+    char b[INOUTF_SZ + 16];
+    char ebuff[EBUFF_SZ];
+
+    rsc.fname = mfile;
+    rsc.skip = skip;
+    rsc.seek = seek;
+    if (NULL == (fp = fopen(mfile, "r"))) {
+        if (ENOENT == errno) {
+            rsc.is_new = 1;     /* set up by rescue_start() */
+            return 0;
+        }
+        snprintf(ebuff, EBUFF_SZ, ME "could not open rescue map %s", mfile);
+        perror(ebuff);
+        return SG_LIB_FILE_ERROR;
+    }
+    while (fgets(b, sizeof(b), fp)) {
+        if ((cp = strchr(b, '\n')))
+            *cp = '\0';
+        if ('#' == b[0])
+            continue;
+        else if (0 == strncmp(b, "if=", 3))
+            other |= !! strcmp(b + 3, inf);
+        else if (0 == strncmp(b, "of=", 3))
+            other |= !! strcmp(b + 3, outf);
+        else if (0 == strncmp(b, "bs=", 3))
+            jbs = sg_get_llnum(b + 3);
+        else if (0 == strncmp(b, "skip=", 5))
+            jskip = sg_get_llnum(b + 5);
+        else if (0 == strncmp(b, "seek=", 5))
+            jseek = sg_get_llnum(b + 5);
+        else if (0 == strncmp(b, "count=", 6))
+            jcount = sg_get_llnum(b + 6);
+        else if (0 == strncmp(b, "tsz=", 4))
+            rsc.tsz = sg_get_num(b + 4);
+        else if ((3 == sscanf(b, "%" SCNd64 " %" SCNd64 " %c", &start,
+                              &num, &st)) && (num > 0) &&
+                 strchr("?*-+", st) &&
+                 (start == ((rsc.num > 0) ? rsc.arr[rsc.num - 1].start +
+                                            rsc.arr[rsc.num - 1].num : 0))) {
+            if (rescue_append(start, num, st)) {
+                fclose(fp);
+                pr2serr(ME "out of memory reading rescue map\n");
+                return SG_LIB_CAT_OTHER;
+            }
+        } else if (b[0])
+            bad = 1;
+    }
+    fclose(fp);
+    if (other || (jbs != blk_sz) || (jskip != skip) || (jseek != seek) ||
+        ((*countp >= 0) && (*countp != jcount))) {
+        pr2serr(ME "rescue map %s is for a different copy (if, of, bs, "
+                "skip, seek or count)\n", mfile);
+        return SG_LIB_SYNTAX_ERROR;
+    }
+    if (bad || (jcount < 1) || (rsc.num < 1) || (rsc.tsz < 1) ||
+        ((rsc.arr[rsc.num - 1].start + rsc.arr[rsc.num - 1].num) !=
+         jcount)) {
+        pr2serr(ME "rescue map %s is not valid, remove it to start again\n",
+                mfile);
+        return SG_LIB_FILE_ERROR;
+    }
+    rsc.count = jcount;
+    *countp = jcount;
+    pr2serr("Resuming from rescue map %s: %" PRId64 " of %" PRId64 " blocks "
+            "copied, %" PRId64 " unreadable\n", mfile,
+            rescue_count(RSC_COPIED), jcount, rescue_count(RSC_BAD));
+    return 0;
+}
+
+/* Writes the whole map to MFILE.tmp then renames it to MFILE. Returns 0
+ * on success, else SG_LIB_FILE_ERROR . */
+static int
+rescue_write_map(const char * inf, const char * outf)
+{
+    int k, ok;
+    FILE * fp;
+    char tname[INOUTF_SZ + 8];
+
+    snprintf(tname, sizeof(tname), "%s.tmp", rsc.fname);
+    if (NULL == (fp = fopen(tname, "w"))) {
+        perror(ME "could not create rescue map");
+        return SG_LIB_FILE_ERROR;
+    }
+    fprintf(fp, "# sg_dd %s rescue map\nif=%s\nof=%s\nbs=%d\nskip=%" PRId64
+            "\nseek=%" PRId64 "\ncount=%" PRId64 "\ntsz=%d\n# start num "
+            "status: ? not tried, * to bisect, - unreadable, + copied\n",
+            version_str, inf, outf, blk_sz, rsc.skip, rsc.seek, rsc.count,
+            rsc.tsz);
+    for (k = 0; k < rsc.num; ++k)
+        fprintf(fp, "%" PRId64 " %" PRId64 " %c\n", rsc.arr[k].start,
+                rsc.arr[k].num, rsc.arr[k].st);
+    ok = (0 == fflush(fp)) && (0 == fdatasync(fileno(fp)));
+    if ((0 != fclose(fp)) || (! ok) || (rename(tname, rsc.fname) < 0)) {
+        perror(ME "writing rescue map");
+        return SG_LIB_FILE_ERROR;
+    }
+    rsc.dirty = 0;
+    return 0;
+}
+
+/* Sets up the map for a new rescue of 'count' blocks and writes it.
+ * Returns 0 on success, else SG_LIB_FILE_ERROR or SG_LIB_CAT_OTHER . */
+static int
+rescue_start(const char * inf, const char * outf, int64_t count, int bpt)
+{
+    rsc.last = time(NULL);
+    if (! rsc.is_new)
+        return 0;
+    rsc.count = count;
+    rsc.tsz = (bpt > 1) ? (bpt / 2) : 1;
+    if (rescue_append(0, count, RSC_UNTRIED)) {
+        pr2serr(ME "out of memory for rescue map\n");
+        return SG_LIB_CAT_OTHER;
+    }
+    return rescue_write_map(inf, outf);
+}
+
+/* When 'force' is set or at least the interval has passed since the last
+ * checkpoint: synchronizes OFILE then writes the map, if it has changed.
+ * Returns 0 on success. */
+static int
+rescue_checkpoint(const char * inf, const char * outf, int outfd,
+                  int out_type, int force)
+{
+    int res;
+    time_t now;
+
+    if (! rsc.dirty)
+        return 0;
+    now = time(NULL);
+    if ((! force) && ((now - rsc.last) < rsc.interval))
+        return 0;
+    rsc.last = now;
+    if (FT_SG & out_type) {
+        if (! rsc.no_sync_cache) {
+            res = sg_ll_sync_cache_10(outfd, 0, 0, 0, 0, 0, 0,
+                                      (verbose > 1) ? verbose - 1 : 0);
+            if (SG_LIB_CAT_INVALID_OP == res)
+                rsc.no_sync_cache = 1;
+            else if (res) {
+                pr2serr("rescue: SYNCHRONIZE CACHE failed, map not "
+                        "updated\n");
+                return res;
+            }
+        }
+    } else if (! (FT_DEV_NULL & out_type)) {
+        if (fdatasync(outfd) < 0) {
+            perror("rescue: fdatasync on output, map not updated");
+            return SG_LIB_FILE_ERROR;
+        }
+    }
+    return rescue_write_map(inf, outf);
+}
+
+/* Writes 'blocks' blocks from bp to block offset 'off'. Returns 0 on
+ * success. */
+static int
+rescue_write(int outfd, int out_type, unsigned char * bp, int blocks,
+             int64_t off)
+{
+    int res, dio_tmp;
+    int64_t n;
+    char ebuff[EBUFF_SZ];
+
+    if (FT_SG & out_type) {
+        dio_tmp = oflag.dio;
+        res = sg_write_retry(outfd, bp, &blocks, rsc.seek + off, NULL,
+                             &dio_tmp);
+        if (res) {
+            pr2serr("sg_write failed, seek=%" PRId64 "\n", rsc.seek + off);
+            return res;
+        }
+    } else if (! (FT_DEV_NULL & out_type)) {
+        for (n = 0; n < ((int64_t)blocks * blk_sz); n += res) {
+            res = pwrite(outfd, bp + n, ((int64_t)blocks * blk_sz) - n,
+                         ((rsc.seek + off) * blk_sz) + n);
+            if (res < 0) {
+                if ((EINTR == errno) || (EAGAIN == errno)) {
+                    res = 0;
+                    continue;
+                }
+                snprintf(ebuff, EBUFF_SZ, ME "writing, seek=%" PRId64 " ",
+                         rsc.seek + off);
+                perror(ebuff);
+                return -1;
+            } else if (0 == res) {
+                pr2serr("output file probably full, seek=%" PRId64 "\n",
+                        rsc.seek + off);
+                return -1;
+            }
+        }
+    }
+    out_full += blocks;
+    return 0;
+}
+
+/* One pass over the extents with status 'want', reading up to 'tsz'
+ * blocks at a time. Blocks read are written and marked copied. The
+ * remainder of a read that fails is marked for bisection in a later
+ * pass, or as unreadable when it is a single block. When 'skip_ahead' is
+ * set, a failure also sets aside the following blocks (doubling with
+ * each consecutive failure) so that healthy areas are copied before
+ * time is spent in bad ones. Returns 0, or the error that stopped the
+ * pass. */
+static int
+rescue_pass(int infd, int outfd, int out_type, const char * inf,
+            const char * outf, unsigned char * wrkPos, char want, int tsz,
+            int bpt, int skip_ahead)
+{
+    int res, n, got, dio_tmp;
+    int64_t off, end, jump;
+    int64_t max_jump = rsc.count / 100;
+    struct flags_t rflag = iflag;
+    struct rescue_ext * ep;
+
+    rflag.coe = 0;      /* failures are recorded in the map instead */
+    if (tsz > 1)
+        rflag.retries = 0;
+    if (max_jump < bpt)
+        max_jump = bpt;
+    jump = bpt;
+    for (off = 0; off < rsc.count; ) {
+        ep = rsc.arr + rescue_find(off);
+        end = ep->start + ep->num;
+        if (want != ep->st) {
+            off = end;
+            continue;
+        }
+        n = ((end - off) > tsz) ? tsz : (int)(end - off);
+        got = 0;
+        dio_tmp = iflag.dio;
+        res = sg_read(infd, wrkPos, n, rsc.skip + off, blk_sz, &rflag,
+                      &dio_tmp, &got);
+        if ((0 == res) && (got < n)) {
+            pr2serr("rescue: short read at lba=%" PRId64 "\n",
+                    rsc.skip + off + got);
+            res = SG_LIB_CAT_OTHER;
+        } else if ((0 != res) && (SG_LIB_CAT_MEDIUM_HARD != res)) {
+            pr2serr("rescue: read failed at lba=%" PRId64 "%s\n",
+                    rsc.skip + off, ((-2 == res) ? ", try reducing bpt" :
+                                                   ""));
+            return res;
+        }
+        if ((got < 0) || (got > n))
+            got = 0;
+        if (got > 0) {
+            in_full += got;
+            if ((res = rescue_write(outfd, out_type, wrkPos, got, off)) ||
+                rescue_set(off, got, RSC_COPIED))
+                return res ? res : SG_LIB_CAT_OTHER;
+        }
+        if (got == n) {
+            jump = bpt;
+            off += n;
+        } else {
+            off += got;
+            n -= got;
+            if (verbose)
+                pr2serr("rescue: read of %d blocks at lba=%" PRId64 " "
+                        "failed\n", n, rsc.skip + off);
+            if (rescue_set(off, n, (1 == n) ? RSC_BAD : RSC_SKIPPED))
+                return SG_LIB_CAT_OTHER;
+            off += n;
+            if (skip_ahead && (off < end)) {
+                n = ((end - off) > jump) ? jump : (int)(end - off);
+                if (rescue_set(off, n, RSC_SKIPPED))
+                    return SG_LIB_CAT_OTHER;
+                off += n;
+                jump = ((2 * jump) > max_jump) ? max_jump : (2 * jump);
+            }
+        }
+        if ((res = rescue_checkpoint(inf, outf, outfd, out_type, 0)))
+            return res;
+    }
+    return 0;
+}
+
+/* Copies with rescue=MFILE : a first pass over blocks not yet tried with
+ * full transfers, then passes that bisect the failed regions with the
+ * transfer size halving each time until single blocks are read. Returns
+ * 0 when everything was copied, SG_LIB_CAT_MEDIUM_HARD if some blocks
+ * are unreadable, else the error that stopped the copy. */
+static int
+rescue_copy(int infd, int outfd, int out_type, const char * inf,
+            const char * outf, unsigned char * wrkPos, int bpt)
+{
+    int ret, res;
+
+    if (rsc.tsz > bpt)
+        rsc.tsz = bpt;
+    ret = rescue_pass(infd, outfd, out_type, inf, outf, wrkPos,
+                      RSC_UNTRIED, bpt, bpt, 1);
+    while ((0 == ret) && (rescue_count(RSC_SKIPPED) > 0)) {
+        if (verbose)
+            pr2serr("rescue: bisect pass with %d blocks per read\n",
+                    rsc.tsz);
+        ret = rescue_pass(infd, outfd, out_type, inf, outf, wrkPos,
+                          RSC_SKIPPED, rsc.tsz, bpt, 0);
+        if ((0 == ret) && (rsc.tsz > 1)) {
+            rsc.tsz /= 2;
+            rsc.dirty = 1;
+        }
+    }
+    res = rescue_checkpoint(inf, outf, outfd, out_type, 1);
+    if (0 == ret)
+        ret = res;
+    pr2serr("rescue: %" PRId64 " blocks copied, %" PRId64 " unreadable, %"
+            PRId64 " not tried (map: %s)\n", rescue_count(RSC_COPIED),
+            rescue_count(RSC_BAD), rescue_count(RSC_UNTRIED) +
+            rescue_count(RSC_SKIPPED), rsc.fname);
+    if ((0 == ret) && (rescue_count(RSC_BAD) > 0))
+        ret = SG_LIB_CAT_MEDIUM_HARD;
+    return ret;
+}
+
 /* Process arguments given to 'iflag=" or 'oflag=" options. Returns 0
  * on success, 1 on error. */
 static int
@@ -1120,6 +1864,8 @@ process_flags(const char * arg, struct flags_t * fp)
             fp->excl = 1;
         else if (0 == strcmp(cp, "fua"))
             ++fp->fua;
+        else if (0 == strcmp(cp, "mmap"))
+            ++fp->mmap;
         else if (0 == strcmp(cp, "nocache"))
             ++fp->nocache;
         else if (0 == strcmp(cp, "null"))
@@ -1128,6 +1874,8 @@ process_flags(const char * arg, struct flags_t * fp)
             fp->sgio = 1;
         else if (0 == strcmp(cp, "sparse"))
             ++fp->sparse;
+        else if (0 == strcmp(cp, "unmap"))
+            ++fp->unmap;
         else if (0 == strcmp(cp, "flock"))
             ++fp->flock;
         else {
@@ -1227,9 +1975,9 @@ open_if(const char * inf, int64_t skip, int bpt, struct flags_t * ifp,
         if (ifp->dsync)
             flags |= O_SYNC;
         fl = O_RDWR;
-        if ((infd = open(inf, fl | flags)) < 0) {
+        if ((infd = sg_open(inf, fl | flags)) < 0) {
             fl = O_RDONLY;
-            if ((infd = open(inf, fl | flags)) < 0) {
+            if ((infd = sg_open(inf, fl | flags)) < 0) {
                 snprintf(ebuff, EBUFF_SZ,
                          ME "could not open %s for sg reading", inf);
                 perror(ebuff);
@@ -1246,7 +1994,7 @@ open_if(const char * inf, int64_t skip, int bpt, struct flags_t * ifp,
         if (verbose)
             pr2serr("    %s: %.8s  %.16s  %.4s  [pdt=%d]\n", inf, sir.vendor,
                     sir.product, sir.revision, ifp->pdt);
-        if (! (FT_BLOCK & *in_typep)) {
+        if (! ((FT_BLOCK & *in_typep) || sg_emul_fd(infd))) {
             t = blk_sz * bpt;
             res = ioctl(infd, SG_SET_RESERVED_SIZE, &t);
             if (res < 0)
@@ -1306,7 +2054,7 @@ open_if(const char * inf, int64_t skip, int bpt, struct flags_t * ifp,
     if (ifp->flock) {
         res = flock(infd, LOCK_EX | LOCK_NB);
         if (res < 0) {
-            close(infd);
+            sg_close(infd);
             snprintf(ebuff, EBUFF_SZ, ME "flock(LOCK_EX | LOCK_NB) on %s "
                      "failed", inf);
             perror(ebuff);
@@ -1353,7 +2101,7 @@ open_of(const char * outf, int64_t seek, int bpt, struct flags_t * ofp,
             flags |= O_EXCL;
         if (ofp->dsync)
             flags |= O_SYNC;
-        if ((outfd = open(outf, flags)) < 0) {
+        if ((outfd = sg_open(outf, flags)) < 0) {
             snprintf(ebuff, EBUFF_SZ,
                      ME "could not open %s for sg writing", outf);
             perror(ebuff);
@@ -1369,7 +2117,7 @@ open_of(const char * outf, int64_t seek, int bpt, struct flags_t * ofp,
         if (verbose)
             pr2serr("    %s: %.8s  %.16s  %.4s  [pdt=%d]\n", outf, sir.vendor,
                     sir.product, sir.revision, ofp->pdt);
-        if (! (FT_BLOCK & *out_typep)) {
+        if (! ((FT_BLOCK & *out_typep) || sg_emul_fd(outfd))) {
             t = blk_sz * bpt;
             res = ioctl(outfd, SG_SET_RESERVED_SIZE, &t);
             if (res < 0)
@@ -1435,7 +2183,7 @@ open_of(const char * outf, int64_t seek, int bpt, struct flags_t * ofp,
     if (ofp->flock) {
         res = flock(outfd, LOCK_EX | LOCK_NB);
         if (res < 0) {
-            close(outfd);
+            sg_close(outfd);
             snprintf(ebuff, EBUFF_SZ, ME "flock(LOCK_EX | LOCK_NB) on %s "
                      "failed", outf);
             perror(ebuff);
@@ -1450,6 +2198,569 @@ other_err:
     return -SG_LIB_CAT_OTHER;
 }
 
+/* Submits (write()s) an sg v3 header to a sg device node or an emulated
+ * disk. Acts like write(). */
+static int
+sg_submit(int fd, const struct sg_io_hdr * hp)
+{
+    return sg_emul_fd(fd) ? sg_emul_write(fd, hp) :
+                            write(fd, hp, sizeof(*hp));
+}
+
+/* Fetches (read()s) a completed sg v3 header. Acts like read(). */
+static int
+sg_receive(int fd, struct sg_io_hdr * hp)
+{
+    return sg_emul_fd(fd) ? sg_emul_read(fd, hp) : read(fd, hp, sizeof(*hp));
+}
+
+/* Returns 1 if commands can be queued on fd with the asynchronous sg v3
+ * interface: a sg device node or emulated disk opened read-write. A
+ * block device (blk_sgio=1) only supports the SG_IO ioctl. */
+static int
+sg_async_capable(int fd, int ftype)
+{
+    int fl;
+
+    if ((! (FT_SG & ftype)) || (FT_BLOCK & ftype))
+        return 0;
+    fl = fcntl(fd, F_GETFL);
+    return ((fl >= 0) && (O_RDONLY != (fl & O_ACCMODE)));
+}
+
+/* The qd=N copy engine keeps up to N READs and N WRITEs outstanding on
+ * sg devices by using the asynchronous (write()/read()) sg v3 interface.
+ * A ring of 2*N slots holds consecutive chunks of BPT blocks. Each slot
+ * moves through the following states, the data is passed to the output
+ * side in LBA order and slots are retired in LBA order. */
+#define QD_FREE 0
+#define QD_RD_BUSY 1    /* READ submitted, awaiting completion */
+#define QD_RD_SYNC 2    /* read to be done synchronously (or again) */
+#define QD_RD_DONE 3    /* data in buffer */
+#define QD_WR_PEND 4    /* WRITE to be submitted */
+#define QD_WR_BUSY 5    /* WRITE submitted, awaiting completion */
+#define QD_WR_SYNC 6    /* write to be done synchronously (again) */
+#define QD_WR_DONE 7    /* written, sparse bypassed or to /dev/null */
+
+struct qd_slot {
+    int state;
+    int blocks;
+    int rd_bytes;       /* less than blocks * bs after a partial read() */
+    int dio;            /* cleared when dio requested but not done */
+    int sparse;         /* output bypassed due to oflag=sparse */
+    int64_t blk_off;    /* offset of this chunk from skip and seek */
+    uint64_t start_ns;  /* when submitted, if time=1 */
+    unsigned char * bp;
+    unsigned char cdb[MAX_SCSI_CDBSZ];
+    unsigned char sense[SENSE_BUFF_LEN];
+};
+
+/* Submits a READ (write_true=0) or WRITE for slot 'k' at 'lba'. Returns
+ * 0 on success, else the errno value; EAGAIN, EDOM and ENOMEM can mean
+ * that the sg driver's queue is full. */
+static int
+qd_submit(int sg_fd, struct qd_slot * sp, int k, int64_t lba, int write_true,
+          const struct flags_t * fp)
+{
+    struct sg_io_hdr io_hdr;
+    int res, j;
+
+    if (sg_build_scsi_cdb(sp->cdb, fp->cdbsz, sp->blocks, lba, write_true,
+                          fp->fua, fp->dpo)) {
+        pr2serr(ME "bad %s cdb build, lba=%" PRId64 ", blocks=%d\n",
+                (write_true ? "wr" : "rd"), lba, sp->blocks);
+        return EINVAL;
+    }
+    memset(&io_hdr, 0, sizeof(struct sg_io_hdr));
+    io_hdr.interface_id = 'S';
+    io_hdr.cmd_len = fp->cdbsz;
+    io_hdr.cmdp = sp->cdb;
+    io_hdr.dxfer_direction = write_true ? SG_DXFER_TO_DEV :
+                                          SG_DXFER_FROM_DEV;
+    io_hdr.dxfer_len = blk_sz * sp->blocks;
+    io_hdr.dxferp = sp->bp;
+    io_hdr.mx_sb_len = SENSE_BUFF_LEN;
+    io_hdr.sbp = sp->sense;
+    io_hdr.timeout = DEF_TIMEOUT;
+    io_hdr.pack_id = k;
+    if (sp->dio)
+        io_hdr.flags |= SG_FLAG_DIRECT_IO;
+    if (verbose > 2) {
+        pr2serr("    %s cdb: ", (write_true ? "write" : "read"));
+        for (j = 0; j < fp->cdbsz; ++j)
+            pr2serr("%02x ", sp->cdb[j]);
+        pr2serr("\n");
+    }
+    sp->start_ns = scsi_pt_lat_enabled() ? scsi_pt_lat_now_ns() : 0;
+    while (((res = sg_submit(sg_fd, &io_hdr)) < 0) && (EINTR == errno))
+        ;
+    return (res < 0) ? errno : 0;
+}
+
+/* Fetches all completions currently available on sg_fd. Clean and
+ * recovered commands move their slot to QD_RD_DONE or QD_WR_DONE, others
+ * to QD_RD_SYNC or QD_WR_SYNC so they are redone with sg_read() or
+ * sg_write() which do the error processing (e.g. coe and retries).
+ * Returns number of completions fetched or -1 on error. */
+static int
+qd_reap(int sg_fd, struct qd_slot * slot_arr, int nslots,
+        int * outstandingp)
+{
+    int res, k, is_rd;
+    int num = 0;
+    struct sg_io_hdr io_hdr;
+    struct sg_sense_info si;
+    struct qd_slot * sp;
+
+    while (*outstandingp > 0) {
+        memset(&io_hdr, 0, sizeof(struct sg_io_hdr));
+        io_hdr.interface_id = 'S';
+        io_hdr.pack_id = -1;
+        res = sg_receive(sg_fd, &io_hdr);
+        if (res < 0) {
+            if (EINTR == errno)
+                continue;
+            if (EAGAIN == errno)
+                break;
+            perror(ME "fetching sg response, error");
+            return -1;
+        }
+        k = io_hdr.pack_id;
+        if ((k < 0) || (k >= nslots)) {
+            pr2serr(ME "unexpected pack_id=%d\n", k);
+            return -1;
+        }
+        --*outstandingp;
+        ++num;
+        sp = slot_arr + k;
+        if (sp->start_ns)
+            scsi_pt_lat_record(sp->cdb[0], scsi_pt_lat_now_ns() -
+                                           sp->start_ns);
+        is_rd = (QD_RD_BUSY == sp->state);
+        if (verbose > 2)
+            pr2serr("      lba offset=%" PRId64 " duration=%u ms\n",
+                    sp->blk_off, io_hdr.duration);
+        res = sg_err_category3_si(&io_hdr, &si);
+        switch (res) {
+        case SG_LIB_CAT_RECOVERED:
+            ++recovered_errs;
+            if (si.info_valid)
+                pr2serr("    lba of last recovered error in this %s=0x%"
+                        PRIx64 "\n", (is_rd ? "READ" : "WRITE"), si.info);
+            else
+                sg_chk_n_print3((is_rd ? "reading" : "writing"), &io_hdr,
+                                verbose > 1);
+            /* fall through */
+        case SG_LIB_CAT_CLEAN:
+            if (sp->dio && ((io_hdr.info & SG_INFO_DIRECT_IO_MASK) !=
+                            SG_INFO_DIRECT_IO))
+                sp->dio = 0;    /* flag that dio not done (completely) */
+            if (is_rd)
+                sum_of_resids += io_hdr.resid;
+            sp->state = is_rd ? QD_RD_DONE : QD_WR_DONE;
+            break;
+        default:
+            if (verbose > 1) {
+                sg_chk_n_print3((is_rd ? "reading" : "writing"), &io_hdr,
+                                verbose > 2);
+                pr2serr("    will redo synchronously\n");
+            }
+            sp->state = is_rd ? QD_RD_SYNC : QD_WR_SYNC;
+            break;
+        }
+    }
+    return num;
+}
+
+/* Waits until an outstanding command on either side may have completed.
+ * Emulated disks complete commands as they are submitted so there is
+ * no waiting for them. */
+static void
+qd_wait(int infd, int in_outstanding, int outfd, int out_outstanding)
+{
+    int n = 0;
+    struct pollfd pfd[2];
+
+    if (in_outstanding > 0) {
+        if (sg_emul_fd(infd))
+            return;
+        pfd[n].fd = infd;
+        pfd[n++].events = POLLIN;
+    }
+    if (out_outstanding > 0) {
+        if (sg_emul_fd(outfd))
+            return;
+        pfd[n].fd = outfd;
+        pfd[n++].events = POLLIN;
+    }
+    if (n > 0) {
+        while ((poll(pfd, n, -1) < 0) && (EINTR == errno))
+            ;
+    }
+}
+
+/* Reads the chunk in slot 'sp' synchronously; with sg_read() when the
+ * input is a sg device (or block device with blk_sgio=1), otherwise with
+ * read(). Sets *eofp when fewer blocks than requested are read. Returns
+ * 0 on success, else as sg_read() or -1 . */
+static int
+qd_read_sync(int infd, int in_type, struct qd_slot * sp, int64_t skip,
+             int * eofp)
+{
+    int res, blks_read;
+    char ebuff[EBUFF_SZ];
+
+    if (FT_SG & in_type) {
+        res = sg_read(infd, sp->bp, sp->blocks, skip + sp->blk_off, blk_sz,
+                      &iflag, &sp->dio, &blks_read);
+        if (res) {
+            pr2serr("sg_read failed,%s at or after lba=%" PRId64 " [0x%"
+                    PRIx64 "]\n", ((-2 == res) ? " try reducing bpt," : ""),
+                    skip + sp->blk_off, skip + sp->blk_off);
+            return res;
+        }
+        if (blks_read < sp->blocks) {
+            sp->blocks = blks_read;
+            sp->rd_bytes = blks_read * blk_sz;
+            *eofp = 1;
+        }
+        return 0;
+    }
+    while (((res = read(infd, sp->bp, sp->blocks * blk_sz)) < 0) &&
+           ((EINTR == errno) || (EAGAIN == errno)))
+        ;
+    if (verbose > 2)
+        pr2serr("read(unix): count=%d, res=%d\n", sp->blocks * blk_sz, res);
+    if (res < 0) {
+        snprintf(ebuff, EBUFF_SZ, ME "reading, skip=%" PRId64 " ",
+                 skip + sp->blk_off);
+        perror(ebuff);
+        return -1;
+    } else if (res < sp->blocks * blk_sz) {
+        *eofp = 1;
+        sp->rd_bytes = res;
+        sp->blocks = res / blk_sz;
+        if ((res % blk_sz) > 0) {
+            sp->blocks++;
+            in_partial++;
+        }
+    }
+    return 0;
+}
+
+/* Passes the chunk in slot 'sp' (whose data has been read) to of2 and
+ * prepares it for the output side: checks for oflag=sparse, does
+ * write()s to normal files and leaves sg WRITEs pending. Returns 0 on
+ * success, else -1 or SG_LIB_FILE_ERROR . */
+static int
+qd_prepare_write(struct qd_slot * sp, int out_async, int outfd,
+                 int out_type, int out2fd, int64_t seek, int64_t total)
+{
+    int res;
+    int nbytes = sp->blocks * blk_sz;
+    char ebuff[EBUFF_SZ];
+
+    if (out2fd >= 0) {
+        while (((res = write(out2fd, sp->bp, nbytes)) < 0) &&
+               ((EINTR == errno) || (EAGAIN == errno)))
+            ;
+        if (verbose > 2)
+            pr2serr("write to of2: count=%d, res=%d\n", nbytes, res);
+        if (res < 0) {
+            snprintf(ebuff, EBUFF_SZ, ME "writing to of2, seek=%" PRId64
+                     " ", seek + sp->blk_off);
+            perror(ebuff);
+            return -1;
+        }
+    }
+    sp->sparse = 0;
+    /* as with qd=1, the last block(s) are always written */
+    if ((oflag.sparse) && ((total - sp->blk_off) > sp->blocks) &&
+        (! (FT_DEV_NULL & out_type))) {
+        if (sg_all_zeros(sp->bp, nbytes))
+            sp->sparse = 1;
+    }
+    sp->state = QD_WR_DONE;
+    if (sp->sparse) {
+        out_sparse += sp->blocks;
+        if (FT_SG & out_type) {
+            if (verbose > 2)
+                pr2serr("sparse bypassing sg_write: seek blk=%" PRId64
+                        ", offset blks=%d\n", seek + sp->blk_off,
+                        sp->blocks);
+        } else {
+            if (verbose > 2)
+                pr2serr("sparse bypassing write: seek=%" PRId64 ", rel "
+                        "offset=%d\n", (seek + sp->blk_off) * blk_sz,
+                        nbytes);
+            if (lseek64(outfd, nbytes, SEEK_CUR) < 0) {
+                perror("lseek64 on output");
+                return SG_LIB_FILE_ERROR;
+            }
+        }
+    } else if (out_async)
+        sp->state = QD_WR_PEND;
+    else if (FT_SG & out_type)
+        sp->state = QD_WR_SYNC;
+    else if (FT_DEV_NULL & out_type)
+        ;
+    else {
+        while (((res = write(outfd, sp->bp, nbytes)) < 0) &&
+               ((EINTR == errno) || (EAGAIN == errno)))
+            ;
+        if (verbose > 2)
+            pr2serr("write(unix): count=%d, res=%d\n", nbytes, res);
+        if (res < 0) {
+            snprintf(ebuff, EBUFF_SZ, ME "writing, seek=%" PRId64 " ",
+                     seek + sp->blk_off);
+            perror(ebuff);
+            return -1;
+        } else if (res < nbytes) {
+            pr2serr("output file probably full, seek=%" PRId64 " ",
+                    seek + sp->blk_off);
+            out_full += res / blk_sz;
+            if ((res % blk_sz) > 0)
+                out_partial++;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Copies dd_count blocks from IFILE (starting at skip) to OFILE
+ * (starting at seek) with up to qd READs and qd WRITEs outstanding on
+ * the sides that are sg devices. At least one side is expected to be a
+ * sg device node (or emulated disk) opened read-write. Input that is
+ * not a sg device is read, and output that is not a sg device is
+ * written, in LBA order in the same thread. Errors stop the copy at the
+ * chunk concerned; commands already submitted are still fetched. On
+ * return *sparse_blocksp is the size of the last chunk retired if it
+ * was bypassed due to oflag=sparse, else 0. Returns 0 on success. */
+static int
+qd_copy(int infd, int in_type, int outfd, int out_type, int out2fd,
+        int64_t skip, int64_t seek, int bpt, int qd, int * dio_incompletep,
+        int * sparse_blocksp)
+{
+    int k, res, progress, nslots, slot_sz;
+    int in_async, out_async;
+    int in_outstanding = 0;
+    int out_outstanding = 0;
+    int eof = 0;
+    int ret = 0;
+    int64_t total, stop, head, next_wr, next_rd, c;
+    size_t psz;
+    unsigned char * buffs = NULL;
+    struct qd_slot * slot_arr;
+    struct qd_slot * sp;
+
+    in_async = sg_async_capable(infd, in_type);
+    out_async = sg_async_capable(outfd, out_type);
+    nslots = 2 * qd;
+#if defined(HAVE_SYSCONF) && defined(_SC_PAGESIZE)
+    psz = sysconf(_SC_PAGESIZE); /* POSIX.1 (was getpagesize()) */
+#else
+    psz = 4096;     /* give up, pick likely figure */
+#endif
+    /* each slot's buffer is page aligned in case dio or O_DIRECT used */
+    slot_sz = ((blk_sz * bpt) + psz - 1) & (~(psz - 1));
+    slot_arr = (struct qd_slot *)calloc(nslots, sizeof(struct qd_slot));
+#ifdef HAVE_POSIX_MEMALIGN
+    if (posix_memalign((void **)&buffs, psz, (size_t)nslots * slot_sz))
+        buffs = NULL;
+#else
+    buffs = (unsigned char *)malloc((size_t)nslots * slot_sz);
+#endif
+    if ((NULL == slot_arr) || (NULL == buffs)) {
+        pr2serr("Not enough user memory for qd=%d, try reducing bpt\n", qd);
+        ret = SG_LIB_CAT_OTHER;
+        goto fini;
+    }
+    for (k = 0; k < nslots; ++k)
+        slot_arr[k].bp = buffs + ((size_t)k * slot_sz);
+    if (oflag.sparse && (NULL == zeros_buff)) {
+        zeros_buff = (unsigned char *)calloc(bpt, blk_sz);
+        if (NULL == zeros_buff) {
+            pr2serr("zeros_buff malloc failed\n");
+            ret = -1;
+            goto fini;
+        }
+    }
+    if (verbose)
+        pr2serr("qd=%d: %s READs, %s WRITEs\n", qd,
+                (in_async ? "queued" : "synchronous"),
+                (out_async ? "queued" : "synchronous"));
+
+    total = dd_count;
+    stop = (total + bpt - 1) / bpt;     /* number of chunks */
+    head = 0;           /* oldest chunk not yet retired */
+    next_wr = 0;        /* next chunk to pass to output side */
+    next_rd = 0;        /* next chunk to read */
+    *sparse_blocksp = 0;
+
+    while ((head < stop) || (in_outstanding > 0) || (out_outstanding > 0)) {
+        progress = 0;
+
+        /* start reads while there are free slots */
+        while ((next_rd < stop) && ((next_rd - head) < nslots) &&
+               (in_outstanding < qd)) {
+            k = next_rd % nslots;
+            sp = slot_arr + k;
+            sp->blk_off = next_rd * bpt;
+            sp->blocks = ((total - sp->blk_off) > bpt) ? bpt :
+                         (int)(total - sp->blk_off);
+            sp->rd_bytes = sp->blocks * blk_sz;
+            sp->dio = iflag.dio;
+            sp->state = QD_RD_SYNC;
+            if (in_async) {
+                res = qd_submit(infd, sp, k, skip + sp->blk_off, 0, &iflag);
+                if (res) {
+                    if (((EAGAIN == res) || (EDOM == res) ||
+                         (ENOMEM == res)) && (in_outstanding > 0))
+                        break;  /* queue full, try again later */
+                    pr2serr(ME "submitting READ at lba=%" PRId64 ": %s\n",
+                            skip + sp->blk_off, safe_strerror(res));
+                    ret = (ENOMEM == res) ? -2 : -1;
+                    stop = next_rd;
+                    break;
+                }
+                sp->state = QD_RD_BUSY;
+                ++in_outstanding;
+            }
+            ++next_rd;
+            progress = 1;
+        }
+
+        /* pass data read to the output side, in LBA order */
+        while ((next_wr < stop) && (next_wr < next_rd)) {
+            sp = slot_arr + (next_wr % nslots);
+            if (QD_RD_BUSY == sp->state)
+                break;
+            if (QD_RD_SYNC == sp->state) {
+                res = qd_read_sync(infd, in_type, sp, skip, &eof);
+                if (res) {
+                    ret = res;
+                    stop = next_wr;
+                    break;
+                }
+                if (eof)
+                    stop = next_wr + 1;
+            }
+            if (0 == sp->blocks) {
+                stop = next_wr;     /* nothing read */
+                break;
+            }
+            in_full += sp->blocks;
+            if (ihash.active)
+                hash_update(&ihash, sp->bp, sp->rd_bytes);
+            if ((FT_SG & in_type) && iflag.dio && (0 == sp->dio))
+                ++*dio_incompletep;
+            sp->dio = oflag.dio;
+            res = qd_prepare_write(sp, out_async, outfd, out_type, out2fd,
+                                   seek, total);
+            if (res) {
+                ret = res;
+                stop = next_wr;
+                break;
+            }
+            ++next_wr;
+            progress = 1;
+        }
+
+        /* submit pending writes */
+        for (c = head; (c < next_wr) && (c < stop) && (out_outstanding < qd);
+             ++c) {
+            k = c % nslots;
+            sp = slot_arr + k;
+            if (QD_WR_PEND != sp->state)
+                continue;
+            res = qd_submit(outfd, sp, k, seek + sp->blk_off, 1, &oflag);
+            if (res) {
+                if (((EAGAIN == res) || (EDOM == res) || (ENOMEM == res)) &&
+                    (out_outstanding > 0))
+                    break;      /* queue full, try again later */
+                pr2serr(ME "submitting WRITE at lba=%" PRId64 ": %s\n",
+                        seek + sp->blk_off, safe_strerror(res));
+                ret = (ENOMEM == res) ? -2 : -1;
+                if (c < stop)
+                    stop = c;
+                break;
+            }
+            sp->state = QD_WR_BUSY;
+            ++out_outstanding;
+            progress = 1;
+        }
+
+        /* retire written chunks, in LBA order */
+        while ((head < next_wr) && (head < stop)) {
+            sp = slot_arr + (head % nslots);
+            if (QD_WR_SYNC == sp->state) {
+                res = sg_write_retry(outfd, sp->bp, &sp->blocks,
+                                     seek + sp->blk_off, NULL, &sp->dio);
+                if (res) {
+                    pr2serr("sg_write failed,%s seek=%" PRId64 "\n",
+                            ((-2 == res) ? " try reducing bpt," : ""),
+                            seek + sp->blk_off);
+                    ret = res;
+                    stop = head;
+                    break;
+                }
+                sp->state = QD_WR_DONE;
+            }
+            if (QD_WR_DONE != sp->state)
+                break;
+            if (ohash.active)
+                hash_update(&ohash, sp->bp, sp->blocks * blk_sz);
+            if (! sp->sparse) {
+                out_full += sp->blocks;
+                if ((FT_SG & out_type) && oflag.dio && (0 == sp->dio))
+                    ++*dio_incompletep;
+            }
+            *sparse_blocksp = sp->sparse ? sp->blocks : 0;
+            dd_count -= sp->blocks;
+            sp->state = QD_FREE;
+            ++head;
+            progress = 1;
+        }
+        journal_checkpoint(&jrnl, total - dd_count, 0);
+
+        /* fetch completions, wait for some if nothing else to do */
+        if (in_outstanding > 0) {
+            res = qd_reap(infd, slot_arr, nslots, &in_outstanding);
+            if (res < 0) {
+                ret = -1;
+                break;
+            } else if (res > 0)
+                progress = 1;
+        }
+        if (out_outstanding > 0) {
+            res = qd_reap(outfd, slot_arr, nslots, &out_outstanding);
+            if (res < 0) {
+                ret = -1;
+                break;
+            } else if (res > 0)
+                progress = 1;
+        }
+        if (! progress) {
+            if ((0 == in_outstanding) && (0 == out_outstanding)) {
+                pr2serr(ME "qd copy stalled at lba offset=%" PRId64 "\n",
+                        head * bpt);
+                if (0 == ret)
+                    ret = SG_LIB_CAT_OTHER;
+                break;
+            }
+            qd_wait(infd, in_outstanding, outfd, out_outstanding);
+        }
+    }
+    if (eof && (0 == ret))
+        dd_count = 0;
+fini:
+    if (buffs)
+        free(buffs);
+    if (slot_arr)
+        free(slot_arr);
+    return ret;
+}
+
 
 int
 main(int argc, char * argv[])
@@ -1461,6 +2772,9 @@ main(int argc, char * argv[])
     int obs = 0;
     int bpt = DEF_BLOCKS_PER_TRANSFER;
     int bpt_given = 0;
+    int bpt_auto = 0;
+    int qd = 1;
+    int hash_chunk = DEF_HASH_CHUNK_MIB;
     char str[STR_SZ];
     char * key;
     char * buf;
@@ -1468,14 +2782,18 @@ main(int argc, char * argv[])
     int in_type = FT_OTHER;
     char outf[INOUTF_SZ];
     char out2f[INOUTF_SZ];
+    char ihashf[INOUTF_SZ];
+    char ohashf[INOUTF_SZ];
+    char jfile[INOUTF_SZ];
+    char rfile[INOUTF_SZ];
     int out_type = FT_OTHER;
     int out2_type = FT_OTHER;
     int dio_incomplete = 0;
     int cdbsz_given = 0;
     int do_sync = 0;
     int blocks = 0;
-    int res, k, t, buf_sz, dio_tmp, first, blocks_per;
-    int infd, outfd, out2fd, retries_tmp, blks_read;
+    int res, k, t, buf_sz, dio_tmp, blocks_per;
+    int infd, outfd, out2fd, blks_read;
     int bytes_read, bytes_of2, bytes_of;
     unsigned char * wrkBuff;
     unsigned char * wrkPos;
@@ -1491,6 +2809,11 @@ main(int argc, char * argv[])
     inf[0] = '\0';
     outf[0] = '\0';
     out2f[0] = '\0';
+    ihashf[0] = '\0';
+    ohashf[0] = '\0';
+    jfile[0] = '\0';
+    rfile[0] = '\0';
+    journal_init(&jrnl, "sg_dd", DEF_JOURNAL_INTERVAL);
     iflag.cdbsz = DEF_SCSI_CDBSZ;
     oflag.cdbsz = DEF_SCSI_CDBSZ;
     if (argc < 2) {
@@ -1516,7 +2839,11 @@ main(int argc, char * argv[])
             iflag.sgio = sg_get_num(buf);
             oflag.sgio = iflag.sgio;
         } else if (0 == strcmp(key, "bpt")) {
-            bpt = sg_get_num(buf);
+            if (0 == strcmp(buf, "auto")) {
+                bpt_auto = 1;
+                bpt = DEF_BLOCKS_PER_TRANSFER;
+            } else
+                bpt = sg_get_num(buf);
             if (-1 == bpt) {
                 pr2serr(ME "bad argument to 'bpt='\n");
                 return SG_LIB_SYNTAX_ERROR;
@@ -1561,6 +2888,12 @@ main(int argc, char * argv[])
             t = sg_get_num(buf);
             oflag.fua = (t & 1) ? 1 : 0;
             iflag.fua = (t & 2) ? 1 : 0;
+        } else if (0 == strcmp(key, "hash_chunk")) {
+            hash_chunk = sg_get_num(buf);
+            if (hash_chunk < 0) {
+                pr2serr(ME "bad argument to 'hash_chunk='\n");
+                return SG_LIB_SYNTAX_ERROR;
+            }
         } else if (0 == strcmp(key, "ibs"))
             ibs = sg_get_num(buf);
         else if (strcmp(key, "if") == 0) {
@@ -1574,11 +2907,45 @@ main(int argc, char * argv[])
                 pr2serr(ME "bad argument to 'iflag='\n");
                 return SG_LIB_SYNTAX_ERROR;
             }
+        } else if (0 == strcmp(key, "ihash")) {
+            if ('\0' != ihashf[0]) {
+                pr2serr("Second ihash argument??\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else if (strlen(buf) >= INOUTF_SZ) {
+                pr2serr(ME "argument to 'ihash=' too long\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else
+                strcpy(ihashf, buf);
+        } else if (0 == strcmp(key, "jinterval")) {
+            jrnl.interval = sg_get_num(buf);
+            if (jrnl.interval < 0) {
+                pr2serr(ME "bad argument to 'jinterval='\n");
+                return SG_LIB_SYNTAX_ERROR;
+            }
+            rsc.interval = jrnl.interval;
+        } else if (0 == strcmp(key, "journal")) {
+            if ('\0' != jfile[0]) {
+                pr2serr("Second journal argument??\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else if (strlen(buf) >= INOUTF_SZ) {
+                pr2serr(ME "argument to 'journal=' too long\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else
+                strcpy(jfile, buf);
         } else if (0 == strcmp(key, "obs"))
             obs = sg_get_num(buf);
         else if (0 == strcmp(key, "odir")) {
             iflag.direct = sg_get_num(buf);
             oflag.direct = iflag.direct;
+        } else if (0 == strcmp(key, "ohash")) {
+            if ('\0' != ohashf[0]) {
+                pr2serr("Second ohash argument??\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else if (strlen(buf) >= INOUTF_SZ) {
+                pr2serr(ME "argument to 'ohash=' too long\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else
+                strcpy(ohashf, buf);
         } else if (strcmp(key, "of") == 0) {
             if ('\0' != outf[0]) {
                 pr2serr("Second OFILE argument??\n");
@@ -1596,6 +2963,22 @@ main(int argc, char * argv[])
                 pr2serr(ME "bad argument to 'oflag='\n");
                 return SG_LIB_SYNTAX_ERROR;
             }
+        } else if (0 == strcmp(key, "qd")) {
+            qd = sg_get_num(buf);
+            if ((qd < 1) || (qd > MAX_QUEUE_DEPTH)) {
+                pr2serr(ME "bad argument to 'qd=', expect 1 to %d\n",
+                        MAX_QUEUE_DEPTH);
+                return SG_LIB_SYNTAX_ERROR;
+            }
+        } else if (0 == strcmp(key, "rescue")) {
+            if ('\0' != rfile[0]) {
+                pr2serr("Second rescue argument??\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else if (strlen(buf) >= INOUTF_SZ) {
+                pr2serr(ME "argument to 'rescue=' too long\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else
+                strcpy(rfile, buf);
         } else if (0 == strcmp(key, "retries")) {
             iflag.retries = sg_get_num(buf);
             oflag.retries = iflag.retries;
@@ -1659,16 +3042,66 @@ main(int argc, char * argv[])
     }
     if (iflag.sparse)
         pr2serr("sparse flag ignored for iflag\n");
+    if (iflag.unmap)
+        pr2serr("unmap flag ignored for iflag\n");
+    if (oflag.sparse && oflag.unmap) {
+        pr2serr("cannot select both sparse and unmap\n");
+        return SG_LIB_SYNTAX_ERROR;
+    }
+    if (oflag.mmap && oflag.unmap) {
+        pr2serr("cannot select both mmap and unmap on output\n");
+        return SG_LIB_SYNTAX_ERROR;
+    }
+    if ((iflag.mmap && iflag.dio) || (oflag.mmap && oflag.dio)) {
+        pr2serr("cannot select both dio and mmap\n");
+        return SG_LIB_SYNTAX_ERROR;
+    }
 
     /* defaulting transfer size to 128*2048 for CD/DVDs is too large
        for the block layer in lk 2.6 and results in an EIO on the
        SG_IO ioctl. So reduce it in that case. */
     if ((blk_sz >= 2048) && (0 == bpt_given))
         bpt = DEF_BLOCKS_PER_2048TRANSFER;
+    /* with bpt=auto sg reserved buffers are sized for the largest */
+    if (bpt_auto && (AUTO_MAX_XFER_BYTES >= blk_sz))
+        bpt = AUTO_MAX_XFER_BYTES / blk_sz;
 #ifdef SG_DEBUG
     pr2serr(ME "if=%s skip=%" PRId64 " of=%s seek=%" PRId64 " count=%" PRId64
             "\n", inf, skip, outf, seek, dd_count);
 #endif
+    if (jfile[0]) {
+        if (('\0' == inf[0]) || ('-' == inf[0]) || ('\0' == outf[0]) ||
+            ('-' == outf[0])) {
+            pr2serr("journal= needs both IFILE and OFILE to be named\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if (oflag.append > 0) {
+            pr2serr("Can't use both append and journal= options\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if ((res = journal_open(&jrnl, jfile, inf, outf, blk_sz, &skip,
+                                &seek, &dd_count, verbose)))
+            return res;
+    }
+    if (rfile[0]) {
+        if (('\0' == inf[0]) || ('-' == inf[0]) || ('\0' == outf[0]) ||
+            ('-' == outf[0])) {
+            pr2serr("rescue= needs both IFILE and OFILE to be named\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if (jfile[0] || (oflag.append > 0)) {
+            pr2serr("Can't use rescue= with journal= or append\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if (ihashf[0] || ohashf[0] || out2f[0] || oflag.sparse ||
+            oflag.unmap) {
+            pr2serr("rescue= writes out of order so can't be used with "
+                    "ihash=, ohash=,\nof2=, oflag=sparse or oflag=unmap\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if ((res = rescue_open(rfile, inf, outf, skip, seek, &dd_count)))
+            return res;
+    }
     install_handler(SIGINT, interrupt_handler);
     install_handler(SIGQUIT, interrupt_handler);
     install_handler(SIGPIPE, interrupt_handler);
@@ -1713,6 +3146,59 @@ main(int argc, char * argv[])
             return SG_LIB_SYNTAX_ERROR;
         }
     }
+    if ((iflag.mmap && (! (FT_SG & in_type))) ||
+        (oflag.mmap && (! (FT_SG & out_type)))) {
+        pr2serr("mmap flag only supported on sg devices\n");
+        return SG_LIB_SYNTAX_ERROR;
+    }
+    if (oflag.unmap) {
+        if (! (FT_SG & out_type)) {
+            pr2serr("oflag=unmap ignored, OFILE is not a sg device\n");
+            oflag.unmap = 0;
+        } else if (qd > 1) {
+            pr2serr("qd=%d ignored, oflag=unmap needs qd=1\n", qd);
+            qd = 1;
+        }
+    }
+    if (rsc.fname) {
+        if (! (FT_SG & in_type)) {
+            pr2serr("rescue= needs IFILE to be a sg device\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if ((FT_FIFO | FT_ST) & out_type) {
+            pr2serr("rescue= needs OFILE to be seekable\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if (qd > 1) {
+            pr2serr("qd=%d ignored, rescue= needs qd=1\n", qd);
+            qd = 1;
+        }
+    }
+    if (qd > 1) {
+        if (iflag.mmap || oflag.mmap) {
+            pr2serr("mmap flag cannot be used with qd=%d (only one "
+                    "reserved buffer)\n", qd);
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if (! (sg_async_capable(infd, in_type) ||
+               sg_async_capable(outfd, out_type))) {
+            pr2serr("qd=%d ignored, needs IFILE or OFILE to be a sg device "
+                    "opened read-write\n", qd);
+            qd = 1;
+        }
+    }
+    if (bpt_auto) {
+        bpt_auto_init(&bauto, infd, !! (FT_SG & in_type), outfd,
+                      !! (FT_SG & out_type), blk_sz,
+                      (blk_sz >= 2048) ? DEF_BLOCKS_PER_2048TRANSFER :
+                                         DEF_BLOCKS_PER_TRANSFER, verbose);
+        bpt = bauto.max;
+        if ((qd > 1) || rsc.fname) {
+            /* sizes only timed by the normal copy loop */
+            bpt = bauto.cur;
+            bauto.active = 0;
+        }
+    }
 
     if ((dd_count < 0) || ((verbose > 0) && (0 == dd_count))) {
         in_num_sect = -1;
@@ -1805,6 +3291,14 @@ main(int argc, char * argv[])
         pr2serr("Couldn't calculate count, please give one\n");
         return SG_LIB_CAT_OTHER;
     }
+    if (jrnl.fname &&
+        (res = journal_start(&jrnl, version_str, inf, outf, blk_sz,
+                             dd_count, outfd, (FT_SG & out_type) ?
+                             JRNL_OUT_SG : ((FT_DEV_NULL & out_type) ?
+                             JRNL_OUT_NULL : JRNL_OUT_FILE))))
+        return res;
+    if (rsc.fname && (res = rescue_start(inf, outf, dd_count, bpt)))
+        return res;
     if (! cdbsz_given) {
         if ((FT_SG & in_type) && (MAX_SCSI_CDBSZ != iflag.cdbsz) &&
             (((dd_count + skip) > UINT_MAX) || (bpt > USHRT_MAX))) {
@@ -1820,8 +3314,25 @@ main(int argc, char * argv[])
         }
     }
 
-    if (iflag.dio || iflag.direct || oflag.direct || (FT_RAW & in_type) ||
-        (FT_RAW & out_type)) {
+    if (iflag.mmap || oflag.mmap) {
+        /* the sg driver's reserved buffer of one side is mapped and used
+         * as the work buffer; the other side does normal IO from it */
+        int mfd = iflag.mmap ? infd : outfd;
+
+        if (iflag.mmap && oflag.mmap) {
+            pr2serr("Note: only the 'if' side can use mmap-ed IO, "
+                    "ignoring oflag=mmap\n");
+            oflag.mmap = 0;
+        }
+        res = scsi_pt_mmap_buffer(mfd, blk_sz * bpt, &wrkPos, verbose);
+        if (res) {
+            pr2serr("unable to mmap reserved buffer of %s: %s\n",
+                    (iflag.mmap ? inf : outf), safe_strerror(-res));
+            return SG_LIB_FILE_ERROR;
+        }
+        wrkBuff = NULL;
+    } else if (iflag.dio || iflag.direct || oflag.direct ||
+               (FT_RAW & in_type) || (FT_RAW & out_type)) {
         size_t psz;
 
 #if defined(HAVE_SYSCONF) && defined(_SC_PAGESIZE)
@@ -1859,7 +3370,21 @@ main(int argc, char * argv[])
         wrkPos = wrkBuff;
     }
 
-    blocks_per = bpt;
+    if (oflag.unmap && zo_init(&zo, outfd, blk_sz, bpt, verbose)) {
+        pr2serr("out of memory for oflag=unmap\n");
+        return SG_LIB_CAT_OTHER;
+    }
+    if (ihashf[0] && (res = hash_open(&ihash, "sg_dd", version_str,
+                                      "ihash", ihashf, (inf[0] ? inf : "-"),
+                                      skip, blk_sz, hash_chunk, verbose)))
+        return res;
+    if (ohashf[0] && (res = hash_open(&ohash, "sg_dd", version_str,
+                                      "ohash", ohashf,
+                                      (outf[0] ? outf : "-"), seek, blk_sz,
+                                      hash_chunk, verbose)))
+        return res;
+
+    blocks_per = bpt_auto ? bauto.cur : bpt;
 #ifdef SG_DEBUG
     pr2serr("Start of loop, count=%" PRId64 ", blocks_per=%d\n", dd_count,
             blocks_per);
@@ -1869,11 +3394,21 @@ main(int argc, char * argv[])
         start_tm.tv_usec = 0;
         gettimeofday(&start_tm, NULL);
         start_tm_valid = 1;
+        scsi_pt_lat_enable(1);
     }
     req_count = dd_count;
 
+    if (qd > 1) {
+        ret = qd_copy(infd, in_type, outfd, out_type, out2fd, skip, seek,
+                      bpt, qd, &dio_incomplete, &penult_blocks);
+        penult_sparse_skip = (penult_blocks > 0);
+    } else if (rsc.fname) {
+        ret = rescue_copy(infd, outfd, out_type, inf, outf, wrkPos, bpt);
+        dd_count = rsc.count - rescue_count(RSC_COPIED);
+    }
+
     /* <<< main loop that does the copy >>> */
-    while (dd_count > 0) {
+    while ((1 == qd) && (NULL == rsc.fname) && (dd_count > 0)) {
         bytes_read = 0;
         bytes_of = 0;
         bytes_of2 = 0;
@@ -1944,6 +3479,9 @@ main(int argc, char * argv[])
 
         if (0 == blocks)
             break;      /* nothing read so leave loop */
+        if (ihash.active)
+            hash_update(&ihash, wrkPos, (FT_SG & in_type) ?
+                        (blocks * blk_sz) : bytes_read);
 
         if (out2f[0]) {
             while (((res = write(out2fd, wrkPos, blocks * blk_sz)) < 0) &&
@@ -1966,15 +3504,15 @@ main(int argc, char * argv[])
         if ((oflag.sparse) && (dd_count > blocks) &&
             (! (FT_DEV_NULL & out_type))) {
             if (NULL == zeros_buff) {
-                zeros_buff = (unsigned char *)malloc(blocks * blk_sz);
+                zeros_buff = (unsigned char *)malloc(bpt * blk_sz);
                 if (NULL == zeros_buff) {
                     pr2serr("zeros_buff malloc failed\n");
                     ret = -1;
                     break;
                 }
-                memset(zeros_buff, 0, blocks * blk_sz);
+                memset(zeros_buff, 0, bpt * blk_sz);
             }
-            if (0 == memcmp(wrkPos, zeros_buff, blocks * blk_sz))
+            if (sg_all_zeros(wrkPos, blocks * blk_sz))
                 sparse_skip = 1;
         }
         if (sparse_skip) {
@@ -2006,60 +3544,18 @@ main(int argc, char * argv[])
                             (int64_t)off_res);
                 out_sparse += blocks;
             }
+        } else if ((FT_SG & out_type) && oflag.unmap) {
+            dio_tmp = oflag.dio;
+            ret = zo_write(outfd, wrkPos, blocks, seek, &dio_tmp);
+            if (0 != ret) {
+                pr2serr("sg_write failed, seek=%" PRId64 "\n", seek);
+                break;
+            } else if (oflag.dio && (0 == dio_tmp))
+                dio_incomplete++;
         } else if (FT_SG & out_type) {
             dio_tmp = oflag.dio;
-            retries_tmp = oflag.retries;
-            first = 1;
-            while (1) {
-                ret = sg_write(outfd, wrkPos, blocks, seek, blk_sz,
-                               &oflag, &dio_tmp);
-                if (0 == ret)
-                    break;
-                if ((SG_LIB_CAT_NOT_READY == ret) ||
-                    (SG_LIB_SYNTAX_ERROR == ret))
-                    break;
-                else if ((-2 == ret) && first) {
-                    /* ENOMEM: find what's available and try that */
-                    if (ioctl(outfd, SG_GET_RESERVED_SIZE, &buf_sz) < 0) {
-                        perror("RESERVED_SIZE ioctls failed");
-                        break;
-                    }
-                    if (buf_sz < MIN_RESERVED_SIZE)
-                        buf_sz = MIN_RESERVED_SIZE;
-                    blocks_per = (buf_sz + blk_sz - 1) / blk_sz;
-                    if (blocks_per < blocks) {
-                        blocks = blocks_per;
-                        pr2serr("Reducing write to %d blocks per loop\n",
-                                blocks);
-                    } else
-                        break;
-                } else if ((SG_LIB_CAT_UNIT_ATTENTION == ret) && first) {
-                    if (--max_uas > 0)
-                        pr2serr("Unit attention, continuing (w)\n");
-                    else {
-                        pr2serr("Unit attention, too many (w)\n");
-                        break;
-                    }
-                } else if ((SG_LIB_CAT_ABORTED_COMMAND == ret) && first) {
-                    if (--max_aborted > 0)
-                        pr2serr("Aborted command, continuing (w)\n");
-                    else {
-                        pr2serr("Aborted command, too many (w)\n");
-                        break;
-                    }
-                } else if (ret < 0)
-                    break;
-                else if (retries_tmp > 0) {
-                    pr2serr(">>> retrying a sgio write, lba=0x%" PRIx64 "\n",
-                            (uint64_t)seek);
-                    --retries_tmp;
-                    ++num_retries;
-                    if (unrecovered_errs > 0)
-                        --unrecovered_errs;
-                } else
-                    break;
-                first = 0;
-            }
+            ret = sg_write_retry(outfd, wrkPos, &blocks, seek, &blocks_per,
+                                 &dio_tmp);
             if (0 != ret) {
                 pr2serr("sg_write failed,%s seek=%" PRId64 "\n",
                         ((-2 == ret) ? " try reducing bpt," : ""), seek);
@@ -2097,6 +3593,8 @@ main(int argc, char * argv[])
                 bytes_of = res;
             }
         }
+        if (ohash.active)
+            hash_update(&ohash, wrkPos, blocks * blk_sz);
 #ifdef HAVE_POSIX_FADVISE
         {
             int rt, in_valid, out2_valid, out_valid;
@@ -2132,7 +3630,21 @@ main(int argc, char * argv[])
             dd_count -= blocks;
         skip += blocks;
         seek += blocks;
+        if (bauto.active) {
+            if (blocks_per != bauto.cur)
+                bauto.active = 0;       /* reduced after ENOMEM */
+            else
+                blocks_per = bpt_auto_next(&bauto, blocks, blk_sz, verbose);
+        }
+        /* blocks in a pending zero run are not yet on OFILE */
+        journal_checkpoint(&jrnl, req_count - dd_count - zo.run_num, 0);
     } /* end of main loop that does the copy ... */
+    if (oflag.unmap && (res = zo_flush(outfd))) {
+        pr2serr("writing zero run failed, seek=%" PRId64 "\n", zo.run_lba);
+        dd_count += zo.run_num;
+        if (0 == ret)
+            ret = res;
+    }
     if (ret && penult_sparse_skip && (penult_blocks > 0)) {
         /* if error and skipped last output due to sparse ... */
         if ((FT_SG & out_type) || (FT_DEV_NULL & out_type))
@@ -2153,8 +3665,11 @@ main(int argc, char * argv[])
         }
     }
 
-    if (do_time)
+    if (do_time) {
+        scsi_pt_lat_enable(0);
         calc_duration_throughput(0);
+        print_latency();
+    }
 
     if (do_sync) {
         if (FT_SG & out_type) {
@@ -2168,19 +3683,31 @@ main(int argc, char * argv[])
                 pr2serr("Unable to synchronize cache\n");
         }
     }
-    free(wrkBuff);
+    journal_close(&jrnl, req_count - dd_count,
+                  (0 == ret) && (0 == dd_count));
+    if (wrkBuff)
+        free(wrkBuff);
     if (zeros_buff)
         free(zeros_buff);
+    zo_free(&zo);
+    if (rsc.arr)
+        free(rsc.arr);
     if (STDIN_FILENO != infd)
-        close(infd);
+        sg_close(infd);
     if (! ((STDOUT_FILENO == outfd) || (FT_DEV_NULL & out_type)))
-        close(outfd);
+        sg_close(outfd);
     if (0 != dd_count) {
         pr2serr("Some error occurred,");
         if (0 == ret)
             ret = SG_LIB_CAT_OTHER;
     }
     print_stats("");
+    res = hash_close(&ihash, 0 == ret);
+    if (0 == ret)
+        ret = res;
+    res = hash_close(&ohash, 0 == ret);
+    if (0 == ret)
+        ret = res;
     if (dio_incomplete) {
         int fd;
         char c;
@@ -0,0 +1,785 @@
+/*
+ * Copyright (C) 2016 D. Gilbert
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+
+   This is an auxiliary file holding code common to the sg_dd and sgp_dd
+   utilities.
+
+*/
+
+#define _XOPEN_SOURCE 600
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "sg_lib.h"
+#include "sg_cmds_basic.h"
+#include "sg_cmds_extra.h"
+#include "sg_pt.h"
+#include "sg_unaligned.h"
+#include "sg_pr2serr.h"
+#include "sg_dd_common.h"
+
+#define EBUFF_SZ 512
+#define JRNL_PEND_INIT 32       /* pending ranges first allocated */
+#define SENSE_BUFF_LEN 64       /* Arbitrary, could be larger */
+#define DEF_TIMEOUT 60000       /* 60,000 millisecs == 60 seconds */
+#define WRITE16_OPCODE 0x8a
+#define WRITE_SAME16_OPCODE 0x93
+
+
+int
+hash_open(struct hash_strm * hsp, const char * prog,
+          const char * version_str, const char * name, const char * mfile,
+          const char * fname, int64_t start_blk, int bs, int chunk_mib,
+          int verbose)
+{
+    char ebuff[EBUFF_SZ];
+
+    memset(hsp, 0, sizeof(*hsp));
+    hsp->prog = prog;
+    hsp->name = name;
+    hsp->chunk_sz = (int64_t)chunk_mib * 1048576;
+    if (strcmp(mfile, ".")) {
+        if (NULL == (hsp->mfp = fopen(mfile, "w"))) {
+            snprintf(ebuff, EBUFF_SZ, "%s: could not open %s for writing",
+                     prog, mfile);
+            perror(ebuff);
+            return SG_LIB_FILE_ERROR;
+        }
+        fprintf(hsp->mfp, "# %s %s %s manifest\nalgorithm=crc32c\n"
+                "file=%s\nstart_block=%" PRId64 "\nblock_size=%d\n"
+                "chunk_bytes=%" PRId64 "\n# chunk <num> <byte_offset> "
+                "<length> <crc32c>\n", prog, version_str, name, fname,
+                start_blk, bs, hsp->chunk_sz);
+    }
+    if (verbose)
+        pr2serr("%s: crc32c using %s\n", name, sg_crc32c_impl());
+    hsp->active = 1;
+    return 0;
+}
+
+static void
+hash_chunk_end(struct hash_strm * hsp)
+{
+    if (0 == hsp->chunk_len)
+        return;
+    if (hsp->mfp)
+        fprintf(hsp->mfp, "chunk %d %" PRId64 " %" PRId64 " 0x%08x\n",
+                hsp->chunk_num, hsp->total_len, hsp->chunk_len,
+                hsp->chunk_crc);
+    hsp->total_crc = sg_crc32c_combine(hsp->total_crc, hsp->chunk_crc,
+                                       hsp->chunk_len);
+    hsp->total_len += hsp->chunk_len;
+    hsp->chunk_len = 0;
+    hsp->chunk_crc = 0;
+    ++hsp->chunk_num;
+}
+
+void
+hash_update(struct hash_strm * hsp, const unsigned char * bp, int len)
+{
+    int n;
+
+    while (len > 0) {
+        n = len;
+        if ((hsp->chunk_sz > 0) && ((hsp->chunk_len + n) > hsp->chunk_sz))
+            n = (int)(hsp->chunk_sz - hsp->chunk_len);
+        hsp->chunk_crc = sg_crc32c(hsp->chunk_crc, bp, n);
+        hsp->chunk_len += n;
+        bp += n;
+        len -= n;
+        if (hsp->chunk_len == hsp->chunk_sz)
+            hash_chunk_end(hsp);
+    }
+}
+
+int
+hash_close(struct hash_strm * hsp, int complete)
+{
+    int res = 0;
+    char ebuff[EBUFF_SZ];
+
+    if (! hsp->active)
+        return 0;
+    hash_chunk_end(hsp);
+    pr2serr("%s: crc32c=0x%08x over %" PRId64 " bytes%s\n", hsp->name,
+            hsp->total_crc, hsp->total_len,
+            (complete ? "" : " (copy incomplete)"));
+    if (hsp->mfp) {
+        fprintf(hsp->mfp, "total %" PRId64 " 0x%08x\nstatus=%s\n",
+                hsp->total_len, hsp->total_crc,
+                (complete ? "complete" : "incomplete"));
+        if (fclose(hsp->mfp)) {
+            snprintf(ebuff, EBUFF_SZ, "%s: closing hash manifest",
+                     hsp->prog);
+            perror(ebuff);
+            res = SG_LIB_FILE_ERROR;
+        }
+        hsp->mfp = NULL;
+    }
+    hsp->active = 0;
+    return res;
+}
+
+
+void
+journal_init(struct journal_t * jp, const char * prog, int interval)
+{
+    memset(jp, 0, sizeof(*jp));
+    jp->fd = -1;
+    jp->outfd = -1;
+    jp->interval = interval;
+    jp->prog = prog;
+}
+
+int
+journal_open(struct journal_t * jp, const char * jfile, const char * inf,
+             const char * outf, int bs, int64_t * skipp, int64_t * seekp,
+             int64_t * countp, int verbose)
+{
+    int n;
+    int64_t done = -1;
+    int64_t jbs = -1;
+    int64_t jskip = -1;
+    int64_t jseek = -1;
+    int64_t jcount = -1;
+    char * cp;
+    char * np;
+    char b[JRNL_MAX_LEN];
+    char ebuff[EBUFF_SZ];
+
+    jp->fname = jfile;
+    jp->verbose = verbose;
+    jp->skip = *skipp;
+    jp->seek = *seekp;
+    if ((jp->fd = open(jfile, O_RDWR)) < 0) {
+        if (ENOENT == errno) {
+            jp->is_new = 1;     /* created by journal_start() */
+            return 0;
+        }
+        snprintf(ebuff, EBUFF_SZ, "%s: could not open journal %s",
+                 jp->prog, jfile);
+        perror(ebuff);
+        return SG_LIB_FILE_ERROR;
+    }
+    n = read(jp->fd, b, sizeof(b) - 1);
+    if (n < 0) {
+        snprintf(ebuff, EBUFF_SZ, "%s: reading journal", jp->prog);
+        perror(ebuff);
+        return SG_LIB_FILE_ERROR;
+    }
+    b[n] = '\0';
+    for (cp = b; cp && *cp; cp = np) {
+        np = strchr(cp, '\n');
+        if (np)
+            *np++ = '\0';
+        if (0 == strncmp(cp, "done=", 5))
+            done = sg_get_llnum(cp + 5);
+        else if (0 == strncmp(cp, "if=", 3)) {
+            if (strcmp(cp + 3, inf))
+                goto mismatch;
+        } else if (0 == strncmp(cp, "of=", 3)) {
+            if (strcmp(cp + 3, outf))
+                goto mismatch;
+        } else if (0 == strncmp(cp, "bs=", 3))
+            jbs = sg_get_llnum(cp + 3);
+        else if (0 == strncmp(cp, "skip=", 5))
+            jskip = sg_get_llnum(cp + 5);
+        else if (0 == strncmp(cp, "seek=", 5))
+            jseek = sg_get_llnum(cp + 5);
+        else if (0 == strncmp(cp, "count=", 6))
+            jcount = sg_get_llnum(cp + 6);
+    }
+    if ((done < 0) || (jcount < 0) || (done > jcount)) {
+        pr2serr("%s: journal %s is not valid, remove it to start again\n",
+                jp->prog, jfile);
+        return SG_LIB_FILE_ERROR;
+    }
+    if ((jbs != bs) || (jskip != *skipp) || (jseek != *seekp) ||
+        ((*countp >= 0) && (*countp != jcount)))
+        goto mismatch;
+    jp->count = jcount;
+    jp->base = done;
+    jp->done = done;
+    *skipp += done;
+    *seekp += done;
+    *countp = jcount - done;
+    pr2serr("Resuming from journal %s: %" PRId64 " of %" PRId64 " blocks "
+            "already copied\n", jfile, done, jcount);
+    return 0;
+
+mismatch:
+    pr2serr("%s: journal %s is for a different copy (if, of, bs, skip, "
+            "seek or count)\n", jp->prog, jfile);
+    return SG_LIB_SYNTAX_ERROR;
+}
+
+int
+journal_start(struct journal_t * jp, const char * version_str,
+              const char * inf, const char * outf, int bs, int64_t count,
+              int outfd, int out_kind)
+{
+    int n;
+    char b[JRNL_MAX_LEN];
+
+    jp->outfd = outfd;
+    jp->out_kind = out_kind;
+    jp->last = time(NULL);
+    if (! jp->is_new)
+        return 0;
+    if ((jp->fd = open(jp->fname, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+        snprintf(b, sizeof(b), "%s: could not create journal %s", jp->prog,
+                 jp->fname);
+        perror(b);
+        return SG_LIB_FILE_ERROR;
+    }
+    jp->count = count;
+    n = snprintf(b, sizeof(b), "done=%020" PRId64 "\n# %s %s restart "
+                 "journal\nif=%s\nof=%s\nbs=%d\nskip=%" PRId64 "\nseek=%"
+                 PRId64 "\ncount=%" PRId64 "\n", (int64_t)0, jp->prog,
+                 version_str, inf, outf, bs, jp->skip, jp->seek, count);
+    if ((n >= (int)sizeof(b)) || (pwrite(jp->fd, b, n, 0) != n) ||
+        fdatasync(jp->fd)) {
+        snprintf(b, sizeof(b), "%s: writing journal", jp->prog);
+        perror(b);
+        return SG_LIB_FILE_ERROR;
+    }
+    return 0;
+}
+
+/* Ranges written beyond the watermark are kept sorted with adjacent ones
+ * merged, so the list holds one entry per gap still being written. It
+ * grows as needed since completions can run well ahead of the oldest
+ * outstanding write. Only if that allocation fails is a range dropped:
+ * then the watermark stalls, and a restart repeats some blocks, but
+ * journal_close() is told by the caller whether the copy completed. */
+void
+journal_mark(struct journal_t * jp, int64_t blk, int64_t num)
+{
+    int k, n;
+    int64_t end;
+    struct jrnl_range * rp;
+
+    if ((jp->fd < 0) || (num <= 0))
+        return;
+    blk -= jp->seek + jp->base;         /* from first block of this run */
+    end = blk + num;
+    if (end <= jp->wmark)
+        return;
+    if (blk < jp->wmark)
+        blk = jp->wmark;
+    n = jp->num_pend;
+    rp = jp->pend;
+    for (k = 0; (k < n) && (rp[k].blk < blk); ++k)
+        ;
+    if ((k > 0) && ((rp[k - 1].blk + rp[k - 1].num) >= blk)) {
+        --k;                            /* extend previous range */
+        if (end > (rp[k].blk + rp[k].num))
+            rp[k].num = end - rp[k].blk;
+    } else if ((k < n) && (end >= rp[k].blk)) {
+        if (end < (rp[k].blk + rp[k].num))  /* extend next range back */
+            end = rp[k].blk + rp[k].num;
+        rp[k].blk = blk;
+        rp[k].num = end - blk;
+    } else {                            /* insert new range at k */
+        if (n >= jp->max_pend) {
+            int sz = jp->max_pend ? (2 * jp->max_pend) : JRNL_PEND_INIT;
+
+            rp = (struct jrnl_range *)realloc(jp->pend, sz * sizeof(*rp));
+            if (NULL == rp) {
+                pr2serr("%s: journal out of memory, checkpoints stall\n",
+                        jp->prog);
+                return;
+            }
+            jp->pend = rp;
+            jp->max_pend = sz;
+        }
+        memmove(rp + k + 1, rp + k, (n - k) * sizeof(*rp));
+        rp[k].blk = blk;
+        rp[k].num = end - blk;
+        ++jp->num_pend;
+        ++n;
+    }
+    /* range k may now reach the one after it */
+    while (((k + 1) < n) && ((rp[k].blk + rp[k].num) >= rp[k + 1].blk)) {
+        end = rp[k + 1].blk + rp[k + 1].num;
+        if (end > (rp[k].blk + rp[k].num))
+            rp[k].num = end - rp[k].blk;
+        memmove(rp + k + 1, rp + k + 2, (n - k - 2) * sizeof(*rp));
+        --jp->num_pend;
+        --n;
+    }
+    if ((n > 0) && (rp[0].blk <= jp->wmark)) {
+        jp->wmark = rp[0].blk + rp[0].num;
+        memmove(rp, rp + 1, (n - 1) * sizeof(*rp));
+        --jp->num_pend;
+    }
+}
+
+void
+journal_checkpoint(struct journal_t * jp, int64_t copied, int force)
+{
+    int res;
+    int vb = jp->verbose;
+    time_t now;
+    char b[EBUFF_SZ];
+
+    if ((jp->fd < 0) || ((jp->base + copied) == jp->done))
+        return;
+    now = time(NULL);
+    if ((! force) && ((now - jp->last) < jp->interval))
+        return;
+    jp->last = now;
+    if (JRNL_OUT_SG == jp->out_kind) {
+        if (! jp->no_sync_cache) {
+            res = sg_ll_sync_cache_10(jp->outfd, 0, 0, 0, 0, 0, 0,
+                                      (vb > 1) ? vb - 1 : 0);
+            if (SG_LIB_CAT_INVALID_OP == res)
+                jp->no_sync_cache = 1;
+            else if (res) {
+                pr2serr("journal: SYNCHRONIZE CACHE failed, checkpoint "
+                        "skipped\n");
+                return;
+            }
+        }
+    } else if (JRNL_OUT_FILE == jp->out_kind) {
+        if (fdatasync(jp->outfd) < 0) {
+            perror("journal: fdatasync on output, checkpoint skipped");
+            return;
+        }
+    }
+    snprintf(b, sizeof(b), "done=%020" PRId64 "\n", jp->base + copied);
+    if ((pwrite(jp->fd, b, JRNL_DONE_LEN, 0) != JRNL_DONE_LEN) ||
+        fdatasync(jp->fd)) {
+        snprintf(b, sizeof(b), "%s: writing journal", jp->prog);
+        perror(b);
+        return;
+    }
+    jp->done = jp->base + copied;
+    if (vb > 1)
+        pr2serr("journal: checkpoint at %" PRId64 " blocks\n", jp->done);
+}
+
+void
+journal_close(struct journal_t * jp, int64_t copied, int complete)
+{
+    char ebuff[EBUFF_SZ];
+
+    if (jp->fd < 0)
+        return;
+    if (complete) {
+        close(jp->fd);
+        if (unlink(jp->fname) < 0) {
+            snprintf(ebuff, EBUFF_SZ, "%s: removing journal", jp->prog);
+            perror(ebuff);
+        } else if (jp->verbose)
+            pr2serr("Copy complete, journal %s removed\n", jp->fname);
+    } else {
+        journal_checkpoint(jp, copied, 1);
+        close(jp->fd);
+        pr2serr("Journal %s records %" PRId64 " of %" PRId64 " blocks "
+                "copied, repeat the command to resume\n", jp->fname,
+                jp->done, jp->count);
+    }
+    jp->fd = -1;
+    free(jp->pend);
+    jp->pend = NULL;
+    jp->num_pend = 0;
+    jp->max_pend = 0;
+}
+
+int
+zo_init(struct zero_ofl * zp, int fd, int blk_sz, int bpt, int verbose)
+{
+    int len, lbpu, lbpws, lbprz;
+    int vb = (verbose > 1) ? verbose - 1 : 0;
+    unsigned char b[64];
+
+    memset(zp, 0, sizeof(*zp));
+    zp->bpt = bpt;
+    zp->zeros = (unsigned char *)calloc(bpt, blk_sz);
+    if (NULL == zp->zeros)
+        return 1;
+    zp->method = ZO_WS16;
+    zp->max_ws = ZO_DEF_MAX_WS;
+    zp->gran = 1;
+    if ((0 == sg_ll_vpd_fetch(fd, 0xb2, b, sizeof(b), &len, 0, vb)) &&
+        (len >= 8)) {
+        lbpu = !! (0x80 & b[5]);
+        lbpws = !! (0x40 & b[5]);
+        lbprz = (1 == (0x7 & (b[5] >> 2)));
+        zp->ws_unmap = lbpws;
+        if (lbpu && (! lbpws) && lbprz)
+            zp->method = ZO_UNMAP;
+    }
+    if ((0 == sg_ll_vpd_fetch(fd, 0xb0, b, sizeof(b), &len, 0, vb)) &&
+        (len >= 44)) {
+        zp->max_lba = sg_get_unaligned_be32(b + 20);
+        zp->max_desc = sg_get_unaligned_be32(b + 24);
+        if (sg_get_unaligned_be32(b + 28) > 1)
+            zp->gran = sg_get_unaligned_be32(b + 28);
+        if (0x80 & b[32])
+            zp->align = sg_get_unaligned_be32(b + 32) & 0x7fffffff;
+        if ((sg_get_unaligned_be64(b + 36) > 0) &&
+            (sg_get_unaligned_be64(b + 36) < ZO_DEF_MAX_WS))
+            zp->max_ws = (uint32_t)sg_get_unaligned_be64(b + 36);
+    } else if (ZO_UNMAP == zp->method)
+        zp->method = ZO_WS16;   /* need UNMAP limits */
+    if ((ZO_UNMAP == zp->method) && ((0 == zp->max_lba) ||
+                                     (0 == zp->max_desc)))
+        zp->method = ZO_WS16;
+    if (zp->max_desc > ZO_MAX_DESC)
+        zp->max_desc = ZO_MAX_DESC;
+    zp->min_run = ZO_MIN_RUN_BYTES / blk_sz;
+    if ((ZO_UNMAP == zp->method) && ((uint32_t)zp->min_run < zp->gran))
+        zp->min_run = zp->gran;
+    if (zp->min_run < 1)
+        zp->min_run = 1;
+    if (verbose)
+        pr2serr("oflag=unmap: zero runs of %d or more blocks sent as %s\n",
+                zp->min_run, (ZO_UNMAP == zp->method) ? "UNMAP" :
+                (zp->ws_unmap ? "WRITE SAME(16) with UNMAP bit" :
+                                "WRITE SAME(16)"));
+    return 0;
+}
+
+void
+zo_free(struct zero_ofl * zp)
+{
+    free(zp->zeros);
+    zp->zeros = NULL;
+}
+
+/* Sends a WRITE SAME(16) or WRITE(16) cdb built by the caller. Returns 0
+ * on success, else a SG_LIB_CAT_* value or -1 . */
+static int
+zo_pt_cmd(int fd, unsigned char * cdbp, const char * name,
+          unsigned char * doutp, int dout_len, int verbose)
+{
+    int k, res, ret, sense_cat;
+    unsigned char sense_b[SENSE_BUFF_LEN];
+    struct sg_pt_base * ptvp;
+
+    if (verbose > 2) {
+        pr2serr("    %s cdb: ", name);
+        for (k = 0; k < 16; ++k)
+            pr2serr("%02x ", cdbp[k]);
+        pr2serr("\n");
+    }
+    ptvp = acquire_scsi_pt_obj();
+    if (NULL == ptvp) {
+        pr2serr("%s: out of memory\n", name);
+        return -1;
+    }
+    set_scsi_pt_cdb(ptvp, cdbp, 16);
+    set_scsi_pt_sense(ptvp, sense_b, sizeof(sense_b));
+    set_scsi_pt_data_out(ptvp, doutp, dout_len);
+    res = do_scsi_pt(ptvp, fd, DEF_TIMEOUT / 1000, verbose);
+    ret = sg_cmds_process_resp(ptvp, name, res, 0, sense_b,
+                               (verbose > 0), verbose, &sense_cat);
+    if (-2 == ret)
+        ret = ((SG_LIB_CAT_RECOVERED == sense_cat) ||
+               (SG_LIB_CAT_NO_SENSE == sense_cat)) ? 0 : sense_cat;
+    else if (ret > 0)
+        ret = 0;
+    release_scsi_pt_obj(ptvp);
+    return ret;
+}
+
+/* WRITE SAME(16) of one block of zeros to 'num' blocks at 'lba' */
+static int
+zo_write_same16(const struct zero_ofl * zp, int fd, int blk_sz, int64_t lba,
+                uint32_t num, int verbose)
+{
+    unsigned char cdb[16];
+
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = WRITE_SAME16_OPCODE;
+    if (zp->ws_unmap)
+        cdb[1] = 0x8;
+    sg_put_unaligned_be64((uint64_t)lba, cdb + 2);
+    sg_put_unaligned_be32(num, cdb + 10);
+    return zo_pt_cmd(fd, cdb, "write same(16)", zp->zeros, blk_sz, verbose);
+}
+
+/* Writes 'num' blocks of zeros at 'lba' with wr_fn or, if that is NULL,
+ * with WRITE(16) commands */
+static int
+zo_write_zeros(const struct zero_ofl * zp, int fd, int blk_sz, int64_t lba,
+               int64_t num, zo_wr_zeros_fn wr_fn, void * wr_arg, int verbose)
+{
+    int ret, blocks;
+    unsigned char cdb[16];
+
+    if (num <= 0)
+        return 0;
+    if (wr_fn)
+        return wr_fn(wr_arg, lba, num);
+    for ( ; num > 0; num -= blocks, lba += blocks) {
+        blocks = (num > zp->bpt) ? zp->bpt : num;
+        memset(cdb, 0, sizeof(cdb));
+        cdb[0] = WRITE16_OPCODE;
+        sg_put_unaligned_be64((uint64_t)lba, cdb + 2);
+        sg_put_unaligned_be32((uint32_t)blocks, cdb + 10);
+        if ((ret = zo_pt_cmd(fd, cdb, "write(16)", zp->zeros,
+                             blocks * blk_sz, verbose)))
+            return ret;
+    }
+    return 0;
+}
+
+/* UNMAPs 'num' blocks at 'lba' (aligned to the unmap granularity) then
+ * uses GET LBA STATUS to find any the device left mapped, which are
+ * zeroed with ordinary writes. */
+static int
+zo_unmap(const struct zero_ofl * zp, int fd, int blk_sz, int64_t lba,
+         int64_t num, int64_t * zeroedp, zo_wr_zeros_fn wr_fn,
+         void * wr_arg, int verbose)
+{
+    int k, n, st, res, len;
+    int vb = (verbose > 1) ? verbose - 1 : 0;
+    int64_t a_lba, a_num, end, d_lba, d_num, prev;
+    unsigned char b[8 + (16 * ZO_MAX_DESC)];
+
+    end = lba + num;
+    a_lba = lba;
+    if (zp->gran > 1) {
+        k = (int)((lba - zp->align) % zp->gran);
+        if (k < 0)
+            k += zp->gran;
+        if (k > 0)
+            a_lba += zp->gran - k;
+    }
+    a_num = end - a_lba;
+    if (zp->gran > 1)
+        a_num -= (a_num > 0) ? (a_num % zp->gran) : a_num;
+    if (a_num <= 0)
+        return zo_write_zeros(zp, fd, blk_sz, lba, num, wr_fn, wr_arg,
+                              verbose);
+    if ((res = zo_write_zeros(zp, fd, blk_sz, lba, a_lba - lba, wr_fn,
+                              wr_arg, verbose)))
+        return res;
+    if ((res = zo_write_zeros(zp, fd, blk_sz, a_lba + a_num,
+                              end - (a_lba + a_num), wr_fn, wr_arg,
+                              verbose)))
+        return res;
+    for (d_lba = a_lba, d_num = a_num; d_num > 0; ) {
+        for (n = 0; (n < (int)zp->max_desc) && (d_num > 0); ++n) {
+            prev = (d_num > zp->max_lba) ? (int64_t)zp->max_lba : d_num;
+            sg_put_unaligned_be64((uint64_t)d_lba, b + 8 + (16 * n));
+            sg_put_unaligned_be32((uint32_t)prev, b + 16 + (16 * n));
+            sg_put_unaligned_be32(0, b + 20 + (16 * n));
+            d_lba += prev;
+            d_num -= prev;
+        }
+        len = 8 + (16 * n);
+        sg_put_unaligned_be16(len - 2, b + 0);
+        sg_put_unaligned_be16(len - 8, b + 2);
+        sg_put_unaligned_be32(0, b + 4);
+        if ((res = sg_ll_unmap_v2(fd, 0, 0, DEF_TIMEOUT / 1000, b, len,
+                                  (verbose > 0), vb)))
+            return res;
+    }
+    *zeroedp += a_num;
+    /* deallocated blocks read as zeros (LBPRZ), zero any still mapped */
+    for (d_lba = a_lba; d_lba < (a_lba + a_num); ) {
+        prev = d_lba;
+        if (sg_ll_get_lba_status(fd, d_lba, b, sizeof(b), (verbose > 0),
+                                 vb))
+            break;
+        n = (sg_get_unaligned_be32(b + 0) - 4) / 16;
+        for (k = 0; (k < n) && (k < ZO_MAX_DESC) &&
+                    (d_lba < (a_lba + a_num)); ++k) {
+            const unsigned char * dp = b + 8 + (16 * k);
+
+            d_num = sg_get_unaligned_be32(dp + 8);
+            if ((int64_t)sg_get_unaligned_be64(dp) > d_lba)
+                break;          /* not the next extent, ask again */
+            d_num -= d_lba - (int64_t)sg_get_unaligned_be64(dp);
+            if (d_num <= 0)
+                continue;
+            if ((d_lba + d_num) > (a_lba + a_num))
+                d_num = a_lba + a_num - d_lba;
+            st = 0xf & dp[12];  /* 0: mapped, 3: unknown */
+            if (((0 == st) || (3 == st)) &&
+                (res = zo_write_zeros(zp, fd, blk_sz, d_lba, d_num, wr_fn,
+                                      wr_arg, verbose)))
+                return res;
+            d_lba += d_num;
+        }
+        if (d_lba == prev)
+            break;              /* no progress, zero the rest */
+    }
+    return zo_write_zeros(zp, fd, blk_sz, d_lba, a_lba + a_num - d_lba,
+                          wr_fn, wr_arg, verbose);
+}
+
+int
+zo_zero_run(struct zero_ofl * zp, int fd, int blk_sz, int64_t lba,
+            int64_t num, int64_t * zeroedp, zo_wr_zeros_fn wr_fn,
+            void * wr_arg, int verbose)
+{
+    int ret = 0;
+    uint32_t n;
+
+    if (num <= 0)
+        return 0;
+    if ((num < zp->min_run) || (ZO_WRITE == zp->method))
+        ret = zo_write_zeros(zp, fd, blk_sz, lba, num, wr_fn, wr_arg,
+                             verbose);
+    else if (ZO_UNMAP == zp->method)
+        ret = zo_unmap(zp, fd, blk_sz, lba, num, zeroedp, wr_fn, wr_arg,
+                       verbose);
+    else {
+        for ( ; num > 0; num -= n, lba += n) {
+            n = (num > zp->max_ws) ? zp->max_ws : (uint32_t)num;
+            if ((ret = zo_write_same16(zp, fd, blk_sz, lba, n, verbose)))
+                break;
+            *zeroedp += n;
+        }
+    }
+    if ((SG_LIB_CAT_INVALID_OP == ret) || (SG_LIB_CAT_ILLEGAL_REQ == ret)) {
+        pr2serr("oflag=unmap: %s rejected, writing zeros instead\n",
+                (ZO_UNMAP == zp->method) ? "UNMAP" : "WRITE SAME(16)");
+        zp->method = ZO_WRITE;
+        ret = zo_write_zeros(zp, fd, blk_sz, lba, num, wr_fn, wr_arg,
+                             verbose);
+    }
+    return ret;
+}
+
+int
+zo_zero_blocks(const unsigned char * bp, int blocks, int bs, int from_end)
+{
+    int k;
+
+    for (k = 0; k < blocks; ++k) {
+        if (! sg_all_zeros(bp + (bs * (from_end ? blocks - 1 - k : k)), bs))
+            break;
+    }
+    return k;
+}
+
+/* Reduces *maxp to the Maximum transfer length and sets *optp and *granp
+ * from the Optimal transfer length (and its granularity) of the Block
+ * Limits VPD page of sg device fd, when given */
+static void
+bpt_auto_limits(int fd, int vb, int * maxp, int * optp, int * granp)
+{
+    int len, n;
+    unsigned char b[64];
+
+    if (sg_ll_vpd_fetch(fd, 0xb0, b, sizeof(b), &len, 0, vb) || (len < 16))
+        return;
+    n = sg_get_unaligned_be16(b + 6);
+    if ((n > *granp) && (n <= *maxp))
+        *granp = n;
+    n = (int)sg_get_unaligned_be32(b + 8);
+    if ((n > 0) && (n < *maxp))
+        *maxp = n;
+    n = (int)sg_get_unaligned_be32(b + 12);
+    if ((n > 0) && ((0 == *optp) || (n < *optp)))
+        *optp = n;
+}
+
+void
+bpt_auto_init(struct bpt_auto * bap, int infd, int in_sg, int outfd,
+              int out_sg, int bs, int def_bpt, int verbose)
+{
+    int opt = 0;
+    int vb = (verbose > 1) ? verbose - 1 : 0;
+
+    memset(bap, 0, sizeof(struct bpt_auto));
+    bap->max = AUTO_MAX_XFER_BYTES / bs;
+    if (bap->max < 1)
+        bap->max = 1;
+    bap->gran = 1;
+    if (in_sg)
+        bpt_auto_limits(infd, vb, &bap->max, &opt, &bap->gran);
+    if (out_sg)
+        bpt_auto_limits(outfd, vb, &bap->max, &opt, &bap->gran);
+    if (bap->gran > bap->max)
+        bap->gran = 1;
+    bap->cur = opt ? opt : def_bpt;
+    if (bap->cur > bap->max)
+        bap->cur = bap->max;
+    if (bap->cur >= bap->gran)
+        bap->cur -= bap->cur % bap->gran;
+    bap->first = bap->cur;
+    bap->best = bap->cur;
+    bap->dir = 1;
+    bap->active = (bap->max > 1);
+    if (verbose)
+        pr2serr("bpt=auto: start at %d blocks per transfer, maximum %d\n",
+                bap->cur, bap->max);
+}
+
+int
+bpt_auto_next(struct bpt_auto * bap, int blocks, int bs, int verbose)
+{
+    int next, gain;
+    double secs, rate;
+    struct timeval now;
+
+    if (! bap->active)
+        return bap->cur;
+    gettimeofday(&now, NULL);
+    if (0 == bap->xfers++) {    /* first transfer at a size not timed */
+        bap->start = now;
+        return bap->cur;
+    }
+    bap->blks += blocks;
+    secs = (now.tv_sec - bap->start.tv_sec) +
+           (0.000001 * (now.tv_usec - bap->start.tv_usec));
+    if ((bap->xfers <= AUTO_MIN_XFERS) || (secs < (0.001 * AUTO_WINDOW_MS)))
+        return bap->cur;
+    rate = bap->blks / secs;
+    if (verbose > 1)
+        pr2serr("bpt=auto: %d blocks per transfer gave %.2f MB/sec\n",
+                bap->cur, (rate * bs) / 1000000.0);
+    gain = (rate > (bap->best_rate * (100 + AUTO_MIN_GAIN_PC) / 100));
+    if (rate > bap->best_rate) {
+        bap->best_rate = rate;
+        bap->best = bap->cur;
+    }
+    next = 0;
+    if (bap->dir > 0) {
+        if (gain && (bap->cur < bap->max))
+            next = ((2 * bap->cur) > bap->max) ? bap->max : (2 * bap->cur);
+        else if (bap->best == bap->first) {
+            bap->dir = -1;      /* doubling no faster (or too big), halve */
+            next = bap->first / 2;
+        }
+    } else if (gain)
+        next = bap->cur / 2;
+    if ((next >= bap->gran) && (next > 1))
+        next -= next % bap->gran;
+    if ((next < 1) || (next == bap->cur) ||
+        ((bap->dir < 0) && (next < bap->gran))) {
+        bap->active = 0;
+        next = bap->best;
+        if (verbose)
+            pr2serr("bpt=auto: settled on %d blocks per transfer\n", next);
+    }
+    bap->cur = next;
+    bap->xfers = 0;
+    bap->blks = 0;
+    return next;
+}
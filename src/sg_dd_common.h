@@ -0,0 +1,219 @@
+#ifndef SG_DD_COMMON_H
+#define SG_DD_COMMON_H
+
+/*
+ * Copyright (C) 2016 D. Gilbert
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ */
+
+/* Code shared by sg_dd and sgp_dd, not part of libsgutils2. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+/* Running CRC32C of the data copied, for ihash= and ohash= . The digest
+ * of each chunk of 'hash_chunk=' MiB is written to the manifest file as
+ * that chunk completes; the whole copy's digest is combined from them. */
+struct hash_strm {
+    int active;
+    int chunk_num;
+    const char * prog;          /* "sg_dd" or "sgp_dd" */
+    const char * name;          /* "ihash" or "ohash" */
+    FILE * mfp;                 /* manifest, NULL when MFILE is "." */
+    int64_t chunk_sz;           /* in bytes, 0 -> one chunk */
+    int64_t chunk_len;          /* bytes in current chunk */
+    int64_t total_len;          /* bytes in completed chunks */
+    uint32_t chunk_crc;
+    uint32_t total_crc;
+};
+
+/* Starts a hash of the data copied to or from fname, starting at block
+ * start_blk of bs bytes. The manifest is written to mfile unless it is
+ * ".". Returns 0 if successful, else SG_LIB_FILE_ERROR */
+int hash_open(struct hash_strm * hsp, const char * prog,
+              const char * version_str, const char * name,
+              const char * mfile, const char * fname, int64_t start_blk,
+              int bs, int chunk_mib, int verbose);
+
+/* Data must be given in order, starting at skip (ihash) or seek */
+void hash_update(struct hash_strm * hsp, const unsigned char * bp, int len);
+
+/* Reports the digest of the whole copy (to stderr and the manifest) and
+ * closes the manifest. Returns 0 if successful, else SG_LIB_FILE_ERROR */
+int hash_close(struct hash_strm * hsp, int complete);
+
+/* Restart journal for journal=JFILE . Its first line "done=<20 digits>"
+ * is the number of blocks, from skip and seek, known to be copied. It is
+ * rewritten in place (a single small write) at each checkpoint, after
+ * OFILE has been synchronized. The other lines record the copy's
+ * parameters so a restart can check it is resuming the same copy. */
+#define JRNL_DONE_LEN 26        /* strlen("done=") + 20 digits + '\n' */
+#define JRNL_MAX_LEN 4096
+
+/* How OFILE is synchronized before a checkpoint */
+#define JRNL_OUT_FILE 0         /* fdatasync() */
+#define JRNL_OUT_SG 1           /* SYNCHRONIZE CACHE(10) */
+#define JRNL_OUT_NULL 2         /* nothing to synchronize */
+
+struct jrnl_range {
+    int64_t blk;        /* from the first block written by this run */
+    int64_t num;
+};
+
+struct journal_t {
+    int fd;             /* -1 when journal= not given */
+    int interval;       /* seconds between checkpoints */
+    int no_sync_cache;  /* OFILE does not support SYNCHRONIZE CACHE */
+    int is_new;
+    int verbose;
+    int outfd;
+    int out_kind;       /* one of JRNL_OUT_* */
+    int busy;           /* sgp_dd: a thread is taking a checkpoint */
+    int num_pend;
+    int max_pend;       /* allocated size of pend */
+    int64_t wmark;      /* blocks from seek all written by this run */
+    struct jrnl_range * pend;   /* written beyond wmark, sorted, disjoint */
+    int64_t base;       /* blocks already done when this run started */
+    int64_t done;       /* last value written to the journal */
+    int64_t skip;       /* skip, seek and count as first given */
+    int64_t seek;
+    int64_t count;
+    time_t last;        /* time of last checkpoint */
+    const char * prog;
+    const char * fname;
+};
+
+/* Called before the command line is parsed, journal= may then follow */
+void journal_init(struct journal_t * jp, const char * prog, int interval);
+
+/* Opens the journal if it exists. If it holds a previous copy with the
+ * same IFILE, OFILE, bs, skip and seek (and count, if given) then
+ * *skipp, *seekp and *countp are moved on past the blocks already
+ * copied. Returns 0 on success, else SG_LIB_FILE_ERROR or
+ * SG_LIB_SYNTAX_ERROR . */
+int journal_open(struct journal_t * jp, const char * jfile, const char * inf,
+                 const char * outf, int bs, int64_t * skipp, int64_t * seekp,
+                 int64_t * countp, int verbose);
+
+/* Called once OFILE is open. Writes the whole journal for a new copy of
+ * 'count' blocks. Returns 0 on success, else SG_LIB_FILE_ERROR . */
+int journal_start(struct journal_t * jp, const char * version_str,
+                  const char * inf, const char * outf, int bs,
+                  int64_t count, int outfd, int out_kind);
+
+/* For when writes complete out of order: records that 'num' blocks at
+ * OFILE block 'blk' have been written and moves jp->wmark on when they
+ * (and any pending ranges) are next after it. Not thread safe. */
+void journal_mark(struct journal_t * jp, int64_t blk, int64_t num);
+
+/* Called with the number of blocks copied (in order, from skip and seek)
+ * by this run. When 'force' is set or at least the interval has passed
+ * since the last checkpoint: synchronizes OFILE then records them in the
+ * journal. Not thread safe. */
+void journal_checkpoint(struct journal_t * jp, int64_t copied, int force);
+
+/* When the copy is complete the journal is removed, otherwise a final
+ * checkpoint is taken so a restart resumes from there. */
+void journal_close(struct journal_t * jp, int64_t copied, int complete);
+
+/* oflag=unmap: runs of zeroed blocks bound for a sg device are not
+ * transferred. Instead the device is asked to zero them with WRITE
+ * SAME(16) (with the UNMAP bit when thin provisioned) or, when only
+ * UNMAP is available and deallocated blocks read back as zeros, with
+ * UNMAP. Each tool decides how runs are gathered (run_lba and run_num)
+ * and when they are sent. */
+#define ZO_WRITE 0              /* no offload, write zeros */
+#define ZO_WS16 1               /* WRITE SAME(16), maybe with UNMAP bit */
+#define ZO_UNMAP 2              /* UNMAP then check with GET LBA STATUS */
+#define ZO_MIN_RUN_BYTES (64 * 1024)    /* shorter runs are written */
+#define ZO_DEF_MAX_WS (1024 * 1024)     /* if no Maximum write same len */
+#define ZO_MAX_DESC 64          /* UNMAP block descriptors per command */
+
+struct zero_ofl {
+    int method;         /* ZO_WRITE, ZO_WS16 or ZO_UNMAP */
+    int ws_unmap;       /* set UNMAP bit in WRITE SAME(16) */
+    int min_run;        /* shortest zero run offloaded, in blocks */
+    uint32_t max_ws;    /* most blocks per WRITE SAME(16) */
+    uint32_t max_lba;   /* most blocks per UNMAP descriptor */
+    uint32_t max_desc;  /* most descriptors per UNMAP */
+    uint32_t gran;      /* unmap granularity, in blocks */
+    uint32_t align;     /* unmap granularity alignment */
+    int bpt;            /* zeros holds this many blocks */
+    unsigned char * zeros;
+    int64_t run_lba;    /* run of zeroed blocks not yet sent */
+    int64_t run_num;
+};
+
+/* Writes 'num' blocks of zeros (from zero_ofl::zeros, at most bpt at a
+ * time) at 'lba' of OFILE the tool's ordinary way. Returns 0 on success,
+ * else a SG_LIB_CAT_* value or -1 . */
+typedef int (*zo_wr_zeros_fn)(void * arg, int64_t lba, int64_t num);
+
+/* Allocates a buffer of bpt zeroed blocks then picks the method from the
+ * Logical Block Provisioning and Block Limits VPD pages of fd (OFILE).
+ * Returns 0, or 1 if out of memory. */
+int zo_init(struct zero_ofl * zp, int fd, int blk_sz, int bpt, int verbose);
+
+void zo_free(struct zero_ofl * zp);
+
+/* Zeros 'num' blocks at 'lba' with the chosen method, writing runs that
+ * are short or that the device will not offload with wr_fn (or with
+ * WRITE(16) commands when wr_fn is NULL). If the device rejects the
+ * method, it and later runs are written instead. Blocks zeroed without
+ * being written are added to *zeroedp. Does not touch run_lba or
+ * run_num, so may be called without a lock when the tool's threads
+ * detach runs from them. Returns 0 on success, else a SG_LIB_CAT_*
+ * value or -1 . */
+int zo_zero_run(struct zero_ofl * zp, int fd, int blk_sz, int64_t lba,
+                int64_t num, int64_t * zeroedp, zo_wr_zeros_fn wr_fn,
+                void * wr_arg, int verbose);
+
+/* Returns the number of zeroed blocks, of bs bytes, at the start (or,
+ * when 'from_end' is set, at the end) of the 'blocks' blocks at bp */
+int zo_zero_blocks(const unsigned char * bp, int blocks, int bs,
+                   int from_end);
+
+/* bpt=auto: the transfer size starts at the Optimal transfer length of
+ * the Block Limits VPD page of IFILE and/or OFILE (when sg devices),
+ * else at the default, and is limited by their Maximum transfer length.
+ * During the first seconds of the copy the throughput at each size is
+ * timed; the size is doubled (or, if the first doubling is no faster,
+ * halved) while that gains at least AUTO_MIN_GAIN_PC percent, then the
+ * fastest size is kept. */
+#define AUTO_MAX_XFER_BYTES (1024 * 1024)       /* upper limit */
+#define AUTO_WINDOW_MS 250      /* minimum time to time each size */
+#define AUTO_MIN_XFERS 4        /* minimum transfers at each size */
+#define AUTO_MIN_GAIN_PC 5
+
+struct bpt_auto {
+    int active;         /* still timing sizes */
+    int max;            /* most blocks per transfer */
+    int gran;           /* sizes are multiples of this, when possible */
+    int first;          /* size timed first */
+    int cur;            /* size being timed */
+    int best;           /* fastest size so far */
+    int dir;            /* 1 -> doubling, -1 -> halving */
+    int xfers;          /* transfers at cur size */
+    int64_t blks;       /* blocks timed at cur size */
+    double best_rate;   /* blocks per second at best size */
+    struct timeval start;
+};
+
+/* Sets up bpt=auto once IFILE and OFILE are open. infd and outfd are
+ * only asked for their limits when in_sg and out_sg are set. Afterwards
+ * bap->cur is the size to start with and bap->max the largest that may
+ * be chosen, which buffers should be sized for. */
+void bpt_auto_init(struct bpt_auto * bap, int infd, int in_sg, int outfd,
+                   int out_sg, int bs, int def_bpt, int verbose);
+
+/* Called after each transfer of 'blocks' blocks (of bs bytes) at size
+ * bap->cur while bap->active is set. Returns the size to use next. Not
+ * thread safe. */
+int bpt_auto_next(struct bpt_auto * bap, int blocks, int bs, int verbose);
+
+#endif
@@ -23,23 +23,37 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#ifdef SG_LIB_LINUX
+#include <pthread.h>
+#endif
 #include "sg_lib.h"
 #include "sg_pr2serr.h"
 #include "sg_unaligned.h"
 
 
-static const char * version_str = "1.11 20160418";
+static const char * version_str = "1.12 20160705";
 
 #define MAX_SENSE_LEN 1024 /* max descriptor format actually: 256+8 */
 
+/* For --batch: records are read and decoded in blocks */
+#define BATCH_BLK_RECS 1024
+#define BATCH_POOL_LEN (1024 * 1024)   /* holds a block's input */
+#define BATCH_LINE_LEN 4096     /* longest ASCII hex line (record) */
+#define BATCH_OUT_LEN 2048      /* decoded output per record */
+#define MAX_BATCH_THREADS 64
+#define BATCH_COUNT_SZ (16 * 256 * 256)   /* sense key, asc, ascq */
+
 static struct option long_options[] = {
+    {"batch", no_argument, 0, 'B'},
     {"binary", required_argument, 0, 'b'},
     {"cdb", no_argument, 0, 'c'},
+    {"count", no_argument, 0, 'C'},
     {"file", required_argument, 0, 'f'},
     {"help", no_argument, 0, 'h'},
     {"hex", no_argument, 0, 'H'},
     {"nospace", no_argument, 0, 'n'},
     {"status", required_argument, 0, 's'},
+    {"threads", required_argument, 0, 't'},
     {"verbose", no_argument, 0, 'v'},
     {"version", no_argument, 0, 'V'},
     {"write", required_argument, 0, 'w'},
@@ -47,15 +61,18 @@ static struct option long_options[] = {
 };
 
 struct opts_t {
+    bool do_batch;
     int do_binary;
     const char * fname;
     bool do_cdb;
+    int do_count;
     int do_file;
     int do_help;
     int do_hex;
     bool no_space;
     int do_status;
     int sstatus;
+    int num_threads;
     int do_verbose;
     int do_version;
     const char * wfname;
@@ -64,24 +81,56 @@ struct opts_t {
     int sense_len;
 };
 
+/* One record (sense buffer or cdb) of a --batch block */
+struct batch_rec_t {
+    const unsigned char * ip;   /* in pool: ASCII hex line or binary */
+    int in_len;
+    int num;            /* line number (ASCII hex) else record number */
+    bool bad;           /* out[] holds error message */
+    bool is_sense;      /* following 3 fields valid */
+    unsigned char sense_key;
+    unsigned char asc;
+    unsigned char ascq;
+    char out[BATCH_OUT_LEN];
+};
+
+struct batch_thr_t {
+    const struct opts_t * op;
+    struct batch_rec_t * recs;
+    int num_recs;
+};
+
 static char concat_buff[1024];
 
 
 static void
 usage()
 {
-  pr2serr("Usage: sg_decode_sense [--binary=FN] [--cdb] [--file=FN] "
-          "[--help] [--hex]\n"
-          "                       [--nospace] [--status=SS] [--verbose] "
-          "[--version]\n"
-          "                       [--write=WFN] H1 H2 H3 ...\n"
+  pr2serr("Usage: sg_decode_sense [--batch] [--binary=FN] [--cdb] "
+          "[--count]\n"
+          "                       [--file=FN] [--help] [--hex] [--nospace] "
+          "[--status=SS]\n"
+          "                       [--threads=NT] [--verbose] [--version] "
+          "[--write=WFN]\n"
+          "                       H1 H2 H3 ...\n"
           "  where:\n"
+          "    --batch|-B            FN (from --binary= or --file=) holds "
+          "many records:\n"
+          "                          one sense buffer per line in ASCII hex, "
+          "or in\n"
+          "                          binary each preceded by a 2 byte (big "
+          "endian)\n"
+          "                          length. Each is decoded in turn\n"
           "    --binary=FN|-b FN     FN is a file name to read sense "
           "data in\n"
           "                          binary from. If FN is '-' then read "
           "from stdin\n"
           "    --cdb|-c              decode given hex as cdb rather than "
           "sense data\n"
+          "    --count|-C            with --batch: count records by sense "
+          "key, asc\n"
+          "                          and ascq, output at end. Twice: only "
+          "output counts\n"
           "    --file=FN|-f FN       FN is a file name from which to read "
           "sense data\n"
           "                          in ASCII hexadecimal. Interpret '-' "
@@ -95,6 +144,8 @@ usage()
           "pairs of\n"
           "                          hex digits (e.g. '3132330A')\n"
           "    --status=SS |-s SS    SCSI status value in hex\n"
+          "    --threads=NT|-t NT    with --batch: decode with NT threads "
+          "(def: 1)\n"
           "    --verbose|-v          increase verbosity\n"
           "    --version|-V          print version string then exit\n"
           "    --write=WFN |-w WFN    write sense data in binary to WFN, "
@@ -119,7 +170,8 @@ process_cl(struct opts_t *op, int argc, char *argv[])
     char *endptr;
 
     while (1) {
-        c = getopt_long(argc, argv, "b:cf:hHns:vVw:", long_options, NULL);
+        c = getopt_long(argc, argv, "b:BcCf:hHns:t:vVw:", long_options,
+                        NULL);
         if (c == -1)
             break;
 
@@ -133,9 +185,15 @@ process_cl(struct opts_t *op, int argc, char *argv[])
             ++op->do_binary;
             op->fname = optarg;
             break;
+        case 'B':
+            op->do_batch = true;
+            break;
         case 'c':
             op->do_cdb = true;
             break;
+        case 'C':
+            ++op->do_count;
+            break;
         case 'f':
             if (op->fname) {
                 pr2serr("expect only one '--binary=FN' or '--file=FN' "
@@ -167,6 +225,15 @@ process_cl(struct opts_t *op, int argc, char *argv[])
             ++op->do_status;
             op->sstatus = ui;
             break;
+        case 't':
+            op->num_threads = sg_get_num(optarg);
+            if ((op->num_threads < 1) ||
+                (op->num_threads > MAX_BATCH_THREADS)) {
+                pr2serr("'--threads=NT' expects a value from 1 to %d\n",
+                        MAX_BATCH_THREADS);
+                return SG_LIB_SYNTAX_ERROR;
+            }
+            break;
         case 'v':
             ++op->do_verbose;
             break;
@@ -400,6 +467,345 @@ write2wfn(FILE * fp, struct opts_t * op)
     }
 }
 
+/* Decodes 'arr' of 'len' bytes as sense data or, if --cdb given, as a cdb
+ * placing the output in 'b' */
+static void
+decode_arr(const struct opts_t * op, const unsigned char * arr, int len,
+           int blen, char * b)
+{
+    int sa, opcode;
+
+    if (op->do_cdb) {
+        opcode = arr[0];
+        sa = 0;
+        if ((0x75 == opcode) || (0x7e == opcode) || (len > 16)) {
+            /* service action in bytes 8 and 9, if the cdb is that long */
+            if (len > 9)
+                sa = sg_get_unaligned_be16(arr + 8);
+        } else if (len > 1)
+            sa = arr[1] & 0x1f;
+        sg_get_opcode_sa_name(opcode, sa, 0, blen, b);
+    } else
+        sg_get_sense_str(NULL, arr, len, op->do_verbose, blen - 1, b);
+}
+
+static int
+hex_val(int c)
+{
+    if ((c >= '0') && (c <= '9'))
+        return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Decodes one line of ASCII hex bytes into 'arr', the same syntax as
+ * f2hex_arr() but without continuation onto the next line. Returns the
+ * number of bytes decoded (0 for nothing but space or comment) or -1
+ * with an error message in 'eb'. */
+static int
+hex_line2arr(const char * line, bool no_space, unsigned char * arr,
+             int max_arr_len, int eb_len, char * eb)
+{
+    int n, h, l;
+    const char * lcp = line;
+
+    for (n = 0; ; ++n) {
+        lcp += strspn(lcp, " ,\t");
+        if (('\0' == *lcp) || ('#' == *lcp) || ('\r' == *lcp) ||
+            ('\n' == *lcp))
+            break;
+        h = hex_val(*lcp);
+        if (h < 0)
+            goto syntax;
+        if (n >= max_arr_len) {
+            snprintf(eb, eb_len, "array length exceeded");
+            return -1;
+        }
+        l = hex_val(lcp[1]);
+        if (l < 0) {
+            if (no_space) {
+                snprintf(eb, eb_len, "odd number of hex digits at pos %d",
+                         (int)(lcp - line + 1));
+                return -1;
+            }
+            arr[n] = h;
+            ++lcp;
+        } else {
+            if ((! no_space) && (hex_val(lcp[2]) >= 0)) {
+                snprintf(eb, eb_len, "hex number larger than 0xff at "
+                         "pos %d", (int)(lcp - line + 1));
+                return -1;
+            }
+            arr[n] = (h << 4) | l;
+            lcp += 2;
+        }
+        if ((! no_space) && ('\0' != *lcp) &&
+            (NULL == strchr(" ,\t#\r\n", *lcp)))
+            goto syntax;
+    }
+    return n;
+syntax:
+    snprintf(eb, eb_len, "syntax error at pos %d", (int)(lcp - line + 1));
+    return -1;
+}
+
+/* Decodes the records it is given, called directly or as a thread */
+static void *
+batch_worker(void * vp)
+{
+    int k, n;
+    struct batch_thr_t * btp = (struct batch_thr_t *)vp;
+    const struct opts_t * op = btp->op;
+    struct batch_rec_t * rp;
+    const unsigned char * bp;
+    struct sg_sense_info si;
+    unsigned char arr[MAX_SENSE_LEN];
+
+    for (k = 0, rp = btp->recs; k < btp->num_recs; ++k, ++rp) {
+        if (rp->bad)            /* found when reading */
+            continue;
+        rp->out[0] = '\0';
+        if (op->do_binary) {
+            bp = rp->ip;
+            n = rp->in_len;
+        } else {
+            n = hex_line2arr((const char *)rp->ip, op->no_space, arr,
+                             MAX_SENSE_LEN, sizeof(rp->out), rp->out);
+            if (n < 0) {
+                rp->bad = true;
+                continue;
+            }
+            bp = arr;
+        }
+        rp->in_len = n;
+        if (n < 1)
+            continue;
+        if (op->do_count && (! op->do_cdb) && sg_get_sense_info(bp, n, &si)) {
+            rp->is_sense = true;
+            rp->sense_key = si.sense_key;
+            rp->asc = si.asc;
+            rp->ascq = si.ascq;
+        }
+        if (op->do_count < 2)
+            decode_arr(op, bp, n, sizeof(rp->out), rp->out);
+    }
+    return NULL;
+}
+
+/* Reads up to BATCH_BLK_RECS records from 'fp' into 'recs', their input
+ * being placed in 'pool'. Returns number of records read (0 at end of
+ * input) or -1 if the (binary) input is malformed. */
+static int
+batch_read_blk(const struct opts_t * op, FILE * fp, unsigned char * pool,
+               struct batch_rec_t * recs, int * nump)
+{
+    int k, c, len;
+    int off = 0;
+    struct batch_rec_t * rp;
+    char * cp;
+    unsigned char lb[2];
+
+    for (k = 0; (k < BATCH_BLK_RECS) &&
+                ((off + BATCH_LINE_LEN) <= BATCH_POOL_LEN); ) {
+        rp = recs + k;
+        rp->bad = false;
+        rp->is_sense = false;
+        rp->ip = pool + off;
+        if (op->do_binary) {
+            len = fread(lb, 1, 2, fp);
+            if (0 == len)
+                break;
+            rp->num = ++*nump;
+            if (2 == len) {
+                len = sg_get_unaligned_be16(lb);
+                if (len > MAX_SENSE_LEN) {
+                    pr2serr("record %d: length %d exceeds %d\n", *nump,
+                            len, MAX_SENSE_LEN);
+                    return -1;
+                }
+                if ((int)fread(pool + off, 1, len, fp) == len) {
+                    rp->in_len = len;
+                    off += len;
+                    ++k;
+                    continue;
+                }
+            }
+            pr2serr("record %d: truncated\n", *nump);
+            return -1;
+        }
+        cp = (char *)pool + off;
+        if (NULL == fgets(cp, BATCH_LINE_LEN, fp))
+            break;
+        rp->num = ++*nump;
+        len = strlen(cp);
+        if ((len > 0) && ('\n' != cp[len - 1]) && (! feof(fp))) {
+            while (((c = getc(fp)) != EOF) && ('\n' != c))
+                ;
+            rp->bad = true;
+            snprintf(rp->out, sizeof(rp->out), "line longer than %d "
+                     "characters", BATCH_LINE_LEN - 2);
+            ++k;
+            continue;
+        }
+        /* skip blank and comment lines here rather than in workers */
+        cp += strspn(cp, " \t");
+        if (('\0' == *cp) || ('#' == *cp) || ('\n' == *cp) || ('\r' == *cp))
+            continue;
+        rp->in_len = len;
+        off += len + 1;
+        ++k;
+    }
+    return k;
+}
+
+/* Decodes 'num_recs' records in 'recs' splitting them between threads */
+static void
+batch_decode_blk(const struct opts_t * op, struct batch_rec_t * recs,
+                 int num_recs)
+{
+    int k, nt, per;
+    struct batch_thr_t bt[MAX_BATCH_THREADS];
+#ifdef SG_LIB_LINUX
+    bool started[MAX_BATCH_THREADS];
+    pthread_t tids[MAX_BATCH_THREADS];
+#endif
+
+    nt = (op->num_threads > 1) ? op->num_threads : 1;
+    if (nt > num_recs)
+        nt = num_recs;
+    per = (num_recs + nt - 1) / nt;
+    for (k = 0; k < nt; ++k) {
+        bt[k].op = op;
+        bt[k].recs = recs + (k * per);
+        bt[k].num_recs = ((k + 1) * per <= num_recs) ? per :
+                                                       (num_recs - k * per);
+    }
+#ifdef SG_LIB_LINUX
+    /* decode first slice in this thread; if a thread can't be created,
+     * decode its slice here too */
+    for (k = 1; k < nt; ++k)
+        started[k] = (0 == pthread_create(tids + k, NULL, batch_worker,
+                                          bt + k));
+    batch_worker(bt + 0);
+    for (k = 1; k < nt; ++k) {
+        if (started[k])
+            pthread_join(tids[k], NULL);
+        else
+            batch_worker(bt + k);
+    }
+#else
+    for (k = 0; k < nt; ++k)
+        batch_worker(bt + k);
+#endif
+}
+
+static void
+batch_counts_out(const uint64_t * counts, uint64_t not_sense)
+{
+    int k;
+    uint64_t total = 0;
+    char b[80];
+    char d[160];
+
+    printf("Counts by sense key, asc and ascq:\n");
+    for (k = 0; k < BATCH_COUNT_SZ; ++k) {
+        if (0 == counts[k])
+            continue;
+        total += counts[k];
+        sg_get_sense_key_str((k >> 16) & 0xf, sizeof(b), b);
+        sg_get_asc_ascq_str((k >> 8) & 0xff, k & 0xff, sizeof(d), d);
+        printf("  %10" PRIu64 "  %s [0x%x], asc=0x%x, ascq=0x%x: %s\n",
+               counts[k], b, (k >> 16) & 0xf, (k >> 8) & 0xff, k & 0xff, d);
+    }
+    printf("  %10" PRIu64 "  total sense data\n", total);
+    if (not_sense)
+        printf("  %10" PRIu64 "  not recognized as sense data\n",
+               not_sense);
+}
+
+/* Processes --batch: reads records from FN in blocks, decodes each block
+ * (using threads if requested) then outputs the results in input order */
+static int
+do_batch(const struct opts_t * op)
+{
+    int k, n;
+    int num = 0;
+    int num_bad = 0;
+    int ret = 0;
+    uint64_t not_sense = 0;
+    FILE * fp;
+    unsigned char * pool = NULL;
+    struct batch_rec_t * recs = NULL;
+    struct batch_rec_t * rp;
+    uint64_t * counts = NULL;
+
+    if ((1 == strlen(op->fname)) && ('-' == op->fname[0]))
+        fp = stdin;
+    else {
+        fp = fopen(op->fname, "r");
+        if (NULL == fp) {
+            pr2serr("unable to open file: %s\n", op->fname);
+            return SG_LIB_FILE_ERROR;
+        }
+    }
+    pool = (unsigned char *)malloc(BATCH_POOL_LEN);
+    recs = (struct batch_rec_t *)calloc(BATCH_BLK_RECS, sizeof(*recs));
+    if (op->do_count)
+        counts = (uint64_t *)calloc(BATCH_COUNT_SZ, sizeof(*counts));
+    if ((NULL == pool) || (NULL == recs) || (op->do_count && (! counts))) {
+        pr2serr("out of memory\n");
+        ret = SG_LIB_CAT_OTHER;
+        goto fini;
+    }
+    while ((n = batch_read_blk(op, fp, pool, recs, &num)) > 0) {
+        batch_decode_blk(op, recs, n);
+        for (k = 0, rp = recs; k < n; ++k, ++rp) {
+            if (rp->bad) {
+                pr2serr("%s %d: %s\n", (op->do_binary ? "record" : "line"),
+                        rp->num, rp->out);
+                ++num_bad;
+                continue;
+            }
+            if (rp->in_len < 1)
+                continue;
+            if (op->do_count) {
+                if (rp->is_sense)
+                    ++counts[(rp->sense_key << 16) | (rp->asc << 8) |
+                             rp->ascq];
+                else
+                    ++not_sense;
+            }
+            if (op->do_count < 2)
+                printf("%s %d:\n%s\n", (op->do_binary ? "record" : "line"),
+                       rp->num, rp->out);
+        }
+    }
+    if (n < 0)
+        ret = SG_LIB_SYNTAX_ERROR;
+    else if (ferror(fp)) {
+        perror("read");
+        ret = SG_LIB_FILE_ERROR;
+    }
+    if (op->do_count)
+        batch_counts_out(counts, not_sense);
+    if (num_bad) {
+        pr2serr("%d %s could not be decoded\n", num_bad,
+                (op->do_binary ? "records" : "lines"));
+        if (0 == ret)
+            ret = SG_LIB_SYNTAX_ERROR;
+    }
+fini:
+    if (stdin != fp)
+        fclose(fp);
+    free(pool);
+    free(recs);
+    free(counts);
+    return ret;
+}
+
 
 int
 main(int argc, char *argv[])
@@ -465,6 +871,26 @@ main(int argc, char *argv[])
                 "both\n\n");
         return SG_LIB_SYNTAX_ERROR;
     }
+    if (op->do_batch) {
+        if (! op->fname) {
+            pr2serr(">> --batch needs --binary=FN or --file=FN\n\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if (op->wfname) {
+            pr2serr(">> --write=WFN cannot be used with --batch\n\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if (op->do_count && op->do_cdb) {
+            pr2serr(">> --count only applies to sense data, not with "
+                    "--cdb\n\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        return do_batch(op);
+    }
+    if (op->do_count || op->num_threads) {
+        pr2serr(">> --count and --threads=NT need --batch\n\n");
+        return SG_LIB_SYNTAX_ERROR;
+    }
 
     if (op->do_binary) {
         fp = fopen(op->fname, "r");
@@ -498,20 +924,7 @@ main(int argc, char *argv[])
                 pr2serr("trying to write to %s\n", op->wfname);
             }
         }
-        if (op->do_cdb) {
-            int sa, opcode;
-
-            opcode = op->sense[0];
-            if ((0x75 == opcode) || (0x7e == opcode) || (op->sense_len > 16))
-                sa = sg_get_unaligned_be16(op->sense + 8);
-            else if (op->sense_len > 1)
-                sa = op->sense[1] & 0x1f;
-            else
-                sa = 0;
-            sg_get_opcode_sa_name(opcode, sa, 0, sizeof(b), b);
-        } else
-            sg_get_sense_str(NULL, op->sense, op->sense_len,
-                             op->do_verbose, sizeof(b) - 1, b);
+        decode_arr(op, op->sense, op->sense_len, sizeof(b), b);
         printf("%s\n", b);
     }
 
@@ -31,7 +31,7 @@
 #include "sg_unaligned.h"
 #include "sg_pr2serr.h"
 
-static const char * version_str = "1.46 20160531";    /* spc5r10 + sbc4r10 */
+static const char * version_str = "1.47 20160707";    /* spc5r10 + sbc4r10 */
 
 #define MX_ALLOC_LEN (0xfffc)
 #define SHORT_RESP_LEN 128
@@ -98,8 +98,6 @@ static const char * version_str = "1.46 20160531";    /* spc5r10 + sbc4r10 */
 
 #define PCB_STR_LEN 128
 
-#define LOG_SENSE_PROBE_ALLOC_LEN 4
-
 static uint8_t rsp_buff[MX_ALLOC_LEN + 4];
 
 static struct option long_options[] = {
@@ -1485,13 +1483,14 @@ bad:
 }
 
 
-/* Call LOG SENSE twice: the first time ask for 4 byte response to determine
-   actual length of response; then a second time requesting the
-   min(actual_len, mx_resp_len) bytes. If the calculated length for the
-   second fetch is odd then it is incremented (perhaps should be made modulo
-   4 in the future for SAS). Returns 0 if ok, SG_LIB_CAT_INVALID_OP for
-   log_sense not supported, SG_LIB_CAT_ILLEGAL_REQ for bad field in log sense
-   command, SG_LIB_CAT_NOT_READY, SG_LIB_CAT_UNIT_ATTENTION,
+/* Fetch a log page with sg_ll_log_sense_fetch() which sends LOG SENSE
+   once with a generous (or previously seen) allocation length and again
+   only if the response was truncated, asking for min(actual_len,
+   mx_resp_len) bytes (incremented if odd). With --maxlen=LEN (LEN > 1)
+   LOG SENSE is sent once asking for mx_resp_len bytes. Returns 0 if ok,
+   SG_LIB_CAT_INVALID_OP for log_sense not supported,
+   SG_LIB_CAT_ILLEGAL_REQ for bad field in log sense command,
+   SG_LIB_CAT_NOT_READY, SG_LIB_CAT_UNIT_ATTENTION,
    SG_LIB_CAT_ABORTED_COMMAND and -1 for other errors. */
 static int
 do_logs(int sg_fd, uint8_t * resp, int mx_resp_len,
@@ -1518,43 +1517,30 @@ do_logs(int sg_fd, uint8_t * resp, int mx_resp_len,
 #endif
     memset(resp, 0, mx_resp_len);
     vb = op->verbose;
-    if (op->maxlen > 1)
+    if (op->maxlen > 1) {
         actual_len = mx_resp_len;
-    else {
         if ((res = sg_ll_log_sense(sg_fd, op->do_ppc, op->do_sp,
                                    op->page_control, op->pg_code,
                                    op->subpg_code, op->paramp,
-                                   resp, LOG_SENSE_PROBE_ALLOC_LEN,
-                                   1 /* noisy */, vb)))
+                                   resp, actual_len, 1 /* noisy */, vb)))
             return res;
-        actual_len = sg_get_unaligned_be16(resp + 2) + 4;
-        if ((0 == op->do_raw) && (vb > 1)) {
-            pr2serr("  Log sense (find length) response:\n");
-            dStrHexErr((const char *)resp, LOG_SENSE_PROBE_ALLOC_LEN, 1);
-            pr2serr("  hence calculated response length=%d\n", actual_len);
-        }
-        if (op->pg_code != (0x3f & resp[0])) {
+    } else {
+        /* one command unless the (remembered) length was too short */
+        if ((res = sg_ll_log_sense_fetch(sg_fd, op->do_ppc, op->do_sp,
+                                         op->page_control, op->pg_code,
+                                         op->subpg_code, op->paramp,
+                                         resp, mx_resp_len, &actual_len,
+                                         1 /* noisy */, vb)))
+            return res;
+        if ((op->pg_code != (0x3f & resp[0])) && (actual_len > 0x40)) {
+            actual_len = 0x40;
             if (vb)
                 pr2serr("Page code does not appear in first byte of "
-                        "response so it's suspect\n");
-            if (actual_len > 0x40) {
-                actual_len = 0x40;
-                if (vb)
-                    pr2serr("Trim response length to 64 bytes due to "
-                            "suspect response format\n");
-            }
+                        "response so trim response length to 64 bytes\n");
         }
-        /* Some HBAs don't like odd transfer lengths */
-        if (actual_len % 2)
-            actual_len += 1;
         if (actual_len > mx_resp_len)
             actual_len = mx_resp_len;
     }
-    if ((res = sg_ll_log_sense(sg_fd, op->do_ppc, op->do_sp,
-                               op->page_control, op->pg_code,
-                               op->subpg_code, op->paramp,
-                               resp, actual_len, 1 /* noisy */, vb)))
-        return res;
     if ((0 == op->do_raw) && (vb > 1)) {
         pr2serr("  Log sense response:\n");
         dStrHexErr((const char *)resp, actual_len, 1);
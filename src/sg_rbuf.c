@@ -28,7 +28,6 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <sys/time.h>
 
 #ifdef HAVE_CONFIG_H
@@ -36,6 +35,7 @@
 #endif
 #include "sg_lib.h"
 #include "sg_io_linux.h"
+#include "sg_pt.h"
 #include "sg_unaligned.h"
 #include "sg_pr2serr.h"
 
@@ -55,7 +55,7 @@
 #endif
 
 
-static const char * version_str = "4.97 20160528";
+static const char * version_str = "4.98 20160701";
 
 static struct option long_options[] = {
         {"buffer", required_argument, 0, 'b'},
@@ -482,20 +482,17 @@ main(int argc, char * argv[])
         rawp = NULL;
     }
 
-    if (! op->do_dio) {
+    if (! (op->do_dio || op->do_mmap)) {
         k = buf_size;
-        if (op->do_mmap && (0 != (k % psz)))
-            k = ((k / psz) + 1) * psz;  /* round up to page size */
         res = ioctl(sg_fd, SG_SET_RESERVED_SIZE, &k);
         if (res < 0)
             perror("SG_SET_RESERVED_SIZE error");
     }
 
     if (op->do_mmap) {
-        rbBuff = (unsigned char *)mmap(NULL, buf_size, PROT_READ, MAP_SHARED,
-                                       sg_fd, 0);
-        if (MAP_FAILED == rbBuff) {
-            if (ENOMEM == errno) {
+        res = scsi_pt_mmap_buffer(sg_fd, buf_size, &rbBuff, op->do_verbose);
+        if (res) {
+            if (-ENOMEM == res) {
                 pr2serr("mmap() out of memory, try a smaller buffer size "
                         "than %d bytes\n", buf_size);
                 if (op->opt_new)
@@ -504,7 +501,7 @@ main(int argc, char * argv[])
                 else
                     pr2serr("    [with '-b=EACH' where EACH is in KiB]\n");
             } else
-                perror("error using mmap()");
+                pr2serr("error using mmap(): %s\n", safe_strerror(-res));
             return SG_LIB_CAT_OTHER;
         }
     }
@@ -641,6 +638,8 @@ main(int argc, char * argv[])
            (int64_t)num * buf_size, buf_size / 1024, buf_size);
 
     if (rawp) free(rawp);
+    if (op->do_mmap)
+        scsi_pt_mmap_release(sg_fd);
     res = close(sg_fd);
     if (res < 0) {
         perror("close error");
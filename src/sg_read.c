@@ -37,7 +37,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
-#include <sys/mman.h>
 #include <sys/time.h>
 #include <linux/major.h>
 
@@ -46,11 +45,12 @@
 #endif
 #include "sg_lib.h"
 #include "sg_io_linux.h"
+#include "sg_pt.h"
 #include "sg_unaligned.h"
 #include "sg_pr2serr.h"
 
 
-static const char * version_str = "1.26 20160218";
+static const char * version_str = "1.27 20160701";
 
 #define DEF_BLOCK_SIZE 512
 #define DEF_BLOCKS_PER_TRANSFER 128
@@ -567,8 +567,6 @@ int main(int argc, char * argv[])
                     pr2serr("  SG_GET_RESERVED_SIZE yields: %d\n", t);
             }
             t = bs * bpt;
-            if ((do_mmap) && (0 != (t % psz)))
-                t = ((t / psz) + 1) * psz;    /* round up to next pagesize */
             res = ioctl(infd, SG_SET_RESERVED_SIZE, &t);
             if (res < 0)
                 perror(ME "SG_SET_RESERVED_SIZE error");
@@ -630,10 +628,11 @@ int main(int argc, char * argv[])
             wrkPos = (unsigned char *)(((uintptr_t)wrkBuff + psz - 1) &
                                        (~(psz - 1)));
         } else if (do_mmap) {
-            wrkPos = (unsigned char *)mmap(NULL, bs * bpt,
-                        PROT_READ | PROT_WRITE, MAP_SHARED, infd, 0);
-            if (MAP_FAILED == wrkPos) {
-                perror(ME "error from mmap()");
+            /* sizes the reserved buffer (rounded up to a page size
+             * multiple) then maps it */
+            res = scsi_pt_mmap_buffer(infd, bs * bpt, &wrkPos, verbose);
+            if (res) {
+                pr2serr(ME "error from mmap(): %s\n", safe_strerror(-res));
                 return SG_LIB_CAT_OTHER;
             }
         } else {
@@ -808,6 +807,8 @@ int main(int argc, char * argv[])
     if (wrkBuff)
         free(wrkBuff);
 
+    if (do_mmap)
+        scsi_pt_mmap_release(infd);
     close(infd);
     if (0 != dd_count) {
         pr2serr("Some error occurred,");
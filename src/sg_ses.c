@@ -31,7 +31,7 @@
  * commands tailored for SES (enclosure) devices.
  */
 
-static const char * version_str = "2.17 20160525";    /* ses3r13 */
+static const char * version_str = "2.18 20160707";    /* ses3r13 */
 
 #define MX_ALLOC_LEN ((64 * 1024) - 4)  /* max allowable for big enclosures */
 #define MX_ELEM_HDR 1024
@@ -1618,7 +1618,7 @@ static int
 do_rec_diag(int sg_fd, int page_code, uint8_t * rsp_buff,
             int rsp_buff_size, const struct opts_t * op, int * rsp_lenp)
 {
-    int rsp_len, res;
+    int rsp_len, res, k;
     const char * cp;
     char b[80];
 
@@ -1633,16 +1633,20 @@ do_rec_diag(int sg_fd, int page_code, uint8_t * rsp_buff,
             pr2serr("    Receive diagnostic results cmd for page 0x%x\n",
                     page_code);
     }
-    res = sg_ll_receive_diag(sg_fd, 1 /* pcv */, page_code, rsp_buff,
-                             rsp_buff_size, 1, op->verbose);
+    /* usually one command; sent again only if the length used (generous
+     * or that seen earlier for this page) was too short */
+    res = sg_ll_receive_diag_fetch(sg_fd, 1 /* pcv */, page_code, rsp_buff,
+                                   rsp_buff_size, &rsp_len, 1, op->verbose);
     if (0 == res) {
-        rsp_len = sg_get_unaligned_be16(rsp_buff + 2) + 4;
-        if (rsp_len > rsp_buff_size) {
-            if (rsp_buff_size > 8) /* tried to get more than header */
-                pr2serr("<<< warning response buffer too small [%d but need "
-                        "%d]>>>\n", rsp_buff_size, rsp_len);
-            rsp_len = rsp_buff_size;
+        if (rsp_len < 4) {
+            pr2serr("Receive diagnostic results response too short "
+                    "(len=%d)\n", rsp_len);
+            return SG_LIB_CAT_MALFORMED;
         }
+        k = sg_get_unaligned_be16(rsp_buff + 2) + 4;
+        if ((k > rsp_len) && (rsp_buff_size > 8)) /* more than header */
+            pr2serr("<<< warning response buffer too small [%d but need "
+                    "%d]>>>\n", rsp_buff_size, k);
         if (rsp_lenp)
             *rsp_lenp = rsp_len;
         if (page_code != rsp_buff[0]) {
@@ -29,10 +29,11 @@
 
 #include "sg_lib.h"
 #include "sg_cmds_basic.h"
+#include "sg_pt.h"
 #include "sg_pr2serr.h"
 
 
-static const char * version_str = "3.33 20160525";
+static const char * version_str = "3.34 20160619";
 
 #if defined(MSC_VER) || defined(__MINGW32__)
 #define HAVE_MS_SLEEP
@@ -335,6 +336,8 @@ int main(int argc, char * argv[])
             gettimeofday(&start_tm, NULL);
         }
 #endif
+        if (op->do_time)
+            scsi_pt_lat_enable(1);
         for (k = 0; k < op->do_number; ++k) {
             /* Might get Unit Attention on first invocation */
             res = sg_ll_test_unit_ready(sg_fd, k, (0 == k), op->do_verbose);
@@ -377,6 +380,15 @@ int main(int argc, char * argv[])
                 printf("\n");
         }
 #endif
+        if (op->do_time) {
+            static struct sg_pt_lat_hist lat_hist;
+            char lb[160];
+
+            if (scsi_pt_lat_snapshot(-1, &lat_hist) > 0) {
+                scsi_pt_lat_str(&lat_hist, "latency: ", sizeof(lb), lb);
+                printf("%s\n", lb);
+            }
+        }
 
         if (((op->do_number > 1) || (num_errs > 0)) && (! reported))
             printf("Completed %d Test Unit Ready commands with %d errors\n",
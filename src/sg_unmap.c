@@ -32,7 +32,7 @@
  * logical blocks.
  */
 
-static const char * version_str = "1.10 20160201";
+static const char * version_str = "1.11 20160706";
 
 
 #define DEF_TIMEOUT_SECS 60
@@ -354,7 +354,7 @@ bad_exit:
 int
 main(int argc, char * argv[])
 {
-    int sg_fd, res, c, num, k, j;
+    int sg_fd, res, c, num, k;
     int grpnum = 0;
     const char * lba_op = NULL;
     const char * num_op = NULL;
@@ -493,13 +493,9 @@ main(int argc, char * argv[])
     }
     param_len = 8 + (16 * addr_arr_len);
     memset(param_arr, 0, param_len);
-    k = 8;
-    for (j = 0; j < addr_arr_len; ++j) {
-        sg_put_unaligned_be64(addr_arr[j], param_arr + k);
-        k += 8;
-        sg_put_unaligned_be32(num_arr[j], param_arr + k);
-        k += 4 + 4;
-    }
+    /* UNMAP block descriptors are 16 bytes long, starting at offset 8 */
+    sg_put_unaligned_be64_arr(addr_arr, addr_arr_len, param_arr + 8, 16);
+    sg_put_unaligned_be32_arr(num_arr, addr_arr_len, param_arr + 8 + 8, 16);
     k = 0;
     num = param_len - 2;
     sg_put_unaligned_be16((uint16_t)num, param_arr + k);
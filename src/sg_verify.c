@@ -20,6 +20,7 @@
 #include "sg_lib.h"
 #include "sg_cmds_basic.h"
 #include "sg_cmds_extra.h"
+#include "sg_pt.h"
 #include "sg_pr2serr.h"
 
 /* A utility program for the Linux OS SCSI subsystem.
@@ -34,11 +35,15 @@
  * the possibility of protection data (DIF).
  */
 
-static const char * version_str = "1.21 20140516";    /* sbc4r01 */
+static const char * version_str = "1.23 20160702";    /* sbc4r01 */
 
 #define ME "sg_verify: "
 
 #define EBUFF_SZ 256
+#define NO_INFO 0xffffffff      /* info not written by sg_ll_verify10() */
+#define NO_INFO64 0xffffffffffffffffULL
+#define VERIFY10_CMD 0x2f
+#define VERIFY16_CMD 0x8f
 
 
 static struct option long_options[] = {
@@ -52,9 +57,11 @@ static struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
         {"in", required_argument, 0, 'i'},
         {"lba", required_argument, 0, 'l'},
-        {"nbo", required_argument, 0, 'n'},
+        {"mmap", no_argument, 0, 'm'},
+        {"ndo", required_argument, 0, 'n'},
         {"quiet", no_argument, 0, 'q'},
         {"readonly", no_argument, 0, 'r'},
+        {"time", no_argument, 0, 'T'},
         {"verbose", no_argument, 0, 'v'},
         {"version", no_argument, 0, 'V'},
         {"vrprotect", required_argument, 0, 'P'},
@@ -67,10 +74,10 @@ usage()
     pr2serr("Usage: sg_verify [--16] [--bpc=BPC] [--count=COUNT] [--dpo] "
             "[--ebytchk=BCH]\n"
             "                 [--group=GN] [--help] [--in=IF] "
-            "[--lba=LBA] [--ndo=NDO]\n"
-            "                 [--quiet] [--readonly] [--verbose] "
-            "[--version]\n"
-            "                 [--vrprotect=VRP] DEVICE\n"
+            "[--lba=LBA] [--mmap]\n"
+            "                 [--ndo=NDO] [--quiet] [--readonly] "
+            "[--time] [--verbose]\n"
+            "                 [--version] [--vrprotect=VRP] DEVICE\n"
             "  where:\n"
             "    --16|-S             use VERIFY(16) (def: use "
             "VERIFY(10) )\n"
@@ -97,6 +104,10 @@ usage()
             "                        only active if --bytchk=N given\n"
             "    --lba=LBA|-l LBA    logical block address to start "
             "verify (def: 0)\n"
+            "    --mmap|-m           read IF into the sg driver's reserved "
+            "buffer and\n"
+            "                        use mmap-ed IO for the data-out "
+            "buffer\n"
             "    --ndo=NDO|-n NDO    NDO is number of bytes placed in "
             "data-out buffer.\n"
             "                        These are fetched from IF (or "
@@ -110,6 +121,8 @@ usage()
             "                        causes an exit status of 14\n"
             "    --readonly|-r       open DEVICE read-only (def: open it "
             "read-write)\n"
+            "    --time|-T           report latency of the VERIFY "
+            "commands sent\n"
             "    --verbose|-v        increase verbosity\n"
             "    --version|-V        print version string and exit\n"
             "    --vrprotect=VRP|-P VRP    set vrprotect field to VRP "
@@ -126,6 +139,7 @@ main(int argc, char * argv[])
     int64_t ll;
     int dpo = 0;
     int bytchk = 0;
+    int do_mmap = 0;
     int ndo = 0;
     char *ref_data = NULL;
     int vrprotect = 0;
@@ -141,19 +155,20 @@ main(int argc, char * argv[])
     int readonly = 0;
     int verbose = 0;
     int verify16 = 0;
+    int do_time = 0;
     const char * device_name = NULL;
     const char * file_name = NULL;
     const char * vc;
     int ret = 0;
-    unsigned int info = 0;
-    uint64_t info64 = 0;
+    unsigned int info = NO_INFO;
+    uint64_t info64 = NO_INFO64;
     char ebuff[EBUFF_SZ];
 
     while (1) {
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "b:B:c:dE:g:hi:l:n:P:qrSvV", long_options,
-                        &option_index);
+        c = getopt_long(argc, argv, "b:B:c:dE:g:hi:l:mn:P:qrSTvV",
+                        long_options, &option_index);
         if (c == -1)
             break;
 
@@ -205,6 +220,9 @@ main(int argc, char * argv[])
             }
             lba = (uint64_t)ll;
             break;
+        case 'm':
+            ++do_mmap;
+            break;
         case 'n':
         case 'B':       /* undocumented, old --bytchk=NDO option */
             ndo = sg_get_num(optarg);
@@ -234,6 +252,9 @@ main(int argc, char * argv[])
         case 'S':
             ++verify16;
             break;
+        case 'T':
+            ++do_time;
+            break;
         case 'v':
             ++verbose;
             break;
@@ -292,14 +313,45 @@ main(int argc, char * argv[])
         pr2serr("group number ignored with VERIFY(10) command, use the --16 "
                 "option\n");
 
+    if (do_mmap && readonly) {
+        pr2serr("--mmap needs DEVICE opened read-write\n");
+        return SG_LIB_SYNTAX_ERROR;
+    }
+    if (do_mmap && (0 == ndo))
+        pr2serr("--mmap ignored without --ndo=NDO\n");
     orig_count = count;
     orig_lba = lba;
 
+    if (NULL == device_name) {
+        pr2serr("missing device name!\n");
+        usage();
+        return SG_LIB_SYNTAX_ERROR;
+    }
+    sg_fd = sg_cmds_open_device(device_name, readonly, verbose);
+    if (sg_fd < 0) {
+        pr2serr(ME "open error: %s: %s\n", device_name, safe_strerror(-sg_fd));
+        return SG_LIB_FILE_ERROR;
+    }
+
     if (ndo > 0) {
-        ref_data = (char *)malloc(ndo);
-        if (NULL == ref_data) {
-            pr2serr("failed to allocate %d byte buffer\n", ndo);
-            return SG_LIB_FILE_ERROR;
+        if (do_mmap) {
+            /* IF is read straight into the mapped reserved buffer */
+            res = scsi_pt_mmap_buffer(sg_fd, ndo,
+                                      (unsigned char **)&ref_data, verbose);
+            if (res) {
+                pr2serr("unable to mmap %d byte buffer: %s\n", ndo,
+                        safe_strerror(-res));
+                ref_data = NULL;
+                ret = SG_LIB_FILE_ERROR;
+                goto err_out;
+            }
+        } else {
+            ref_data = (char *)malloc(ndo);
+            if (NULL == ref_data) {
+                pr2serr("failed to allocate %d byte buffer\n", ndo);
+                ret = SG_LIB_FILE_ERROR;
+                goto err_out;
+            }
         }
         if ((NULL == file_name) || (0 == strcmp(file_name, "-"))) {
             ++got_stdin;
@@ -331,20 +383,9 @@ main(int argc, char * argv[])
             close(infd);
     }
 
-    if (NULL == device_name) {
-        pr2serr("missing device name!\n");
-        usage();
-        ret = SG_LIB_SYNTAX_ERROR;
-        goto err_out;
-    }
-    sg_fd = sg_cmds_open_device(device_name, readonly, verbose);
-    if (sg_fd < 0) {
-        pr2serr(ME "open error: %s: %s\n", device_name, safe_strerror(-sg_fd));
-        ret = SG_LIB_FILE_ERROR;
-        goto err_out;
-    }
-
     vc = verify16 ? "VERIFY(16)" : "VERIFY(10)";
+    if (do_time)
+        scsi_pt_lat_enable(1);
     for (; count > 0; count -= bpc, lba += bpc) {
         num = (count > bpc) ? bpc : count;
         if (verify16)
@@ -377,8 +418,15 @@ main(int argc, char * argv[])
                             vc, info);
                 break;
             case SG_LIB_CAT_MISCOMPARE:
-                if ((0 == quiet) || verbose)
-                    pr2serr("%s reported MISCOMPARE\n", vc);
+                if ((0 == quiet) || verbose) {
+                    /* info fields only written when VALID is set */
+                    if (verify16 ? (NO_INFO64 != info64) : (NO_INFO != info))
+                        pr2serr("%s reported MISCOMPARE at byte offset "
+                                "%" PRIu64 "\n", vc,
+                                (verify16 ? info64 : (uint64_t)info));
+                    else
+                        pr2serr("%s reported MISCOMPARE\n", vc);
+                }
                 break;
             default:
                 sg_get_category_sense_str(res, sizeof(b), b, verbose);
@@ -395,16 +443,26 @@ main(int argc, char * argv[])
         pr2serr("Verified %" PRId64 " [0x%" PRIx64 "] blocks from lba %" PRIu64
                 " [0x%" PRIx64 "]\n    without error\n", orig_count,
                 (uint64_t)orig_count, orig_lba, orig_lba);
+    if (do_time) {
+        static struct sg_pt_lat_hist lat_hist;
+        char lb[160];
 
+        scsi_pt_lat_enable(0);
+        if (scsi_pt_lat_snapshot(verify16 ? VERIFY16_CMD : VERIFY10_CMD,
+                                 &lat_hist) > 0) {
+            scsi_pt_lat_str(&lat_hist, "latency: ", sizeof(lb), lb);
+            pr2serr("%s %s\n", vc, lb);
+        }
+    }
+
+ err_out:
+    if (ref_data && (! do_mmap))
+        free(ref_data);
     res = sg_cmds_close_device(sg_fd);
     if (res < 0) {
         pr2serr("close error: %s\n", safe_strerror(-res));
         if (0 == ret)
             ret = SG_LIB_FILE_ERROR;
     }
-
- err_out:
-    if (ref_data)
-        free(ref_data);
     return (ret >= 0) ? ret : SG_LIB_CAT_OTHER;
 }
@@ -37,7 +37,7 @@
 
 */
 
-static const char * version_str = "1.24 20160531";  /* spc5r10 + sbc4r10 */
+static const char * version_str = "1.25 20160707";  /* spc5r10 + sbc4r10 */
 
 
 /* These structures are duplicates of those of the same name in
@@ -570,11 +570,21 @@ vpd_fetch_page_from_dev(int sg_fd, unsigned char * rp, int page,
         pr2serr("--maxlen=LEN too long: %d > %d\n", mxlen, MX_ALLOC_LEN);
         return SG_LIB_SYNTAX_ERROR;
     }
-    n = (mxlen > 0) ? mxlen : DEF_ALLOC_LEN;
-    res = pt_inquiry(sg_fd, 1, page, rp, n, &resid, 1, vb);
-    if (res)
-        return res;
-    rlen = n - resid;
+    if (0 == mxlen) {
+        /* one INQUIRY unless the page is longer than DEF_ALLOC_LEN (or
+         * the length seen for this page earlier) */
+        res = sg_ll_vpd_fetch(sg_fd, page, rp, MX_ALLOC_LEN, &rlen, 1, vb);
+        if (res)
+            return res;
+        if (rlen > MX_ALLOC_LEN)
+            rlen = MX_ALLOC_LEN;
+    } else {
+        n = (mxlen > 0) ? mxlen : DEF_ALLOC_LEN;
+        res = pt_inquiry(sg_fd, 1, page, rp, n, &resid, 1, vb);
+        if (res)
+            return res;
+        rlen = n - resid;
+    }
     if (rlen < 4) {
         pr2serr("VPD response too short (len=%d)\n", rlen);
         return SG_LIB_CAT_MALFORMED;
@@ -36,6 +36,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 #include <pthread.h>
 #include <signal.h>
 #define __STDC_FORMAT_MACROS 1
@@ -53,12 +54,15 @@
 #endif
 #include "sg_lib.h"
 #include "sg_cmds_basic.h"
+#include "sg_cmds_extra.h"
 #include "sg_io_linux.h"
+#include "sg_pt.h"
 #include "sg_unaligned.h"
 #include "sg_pr2serr.h"
+#include "sg_dd_common.h"
 
 
-static const char * version_str = "5.53 20160518";
+static const char * version_str = "5.59 20160712";
 
 #define DEF_BLOCK_SIZE 512
 #define DEF_BLOCKS_PER_TRANSFER 128
@@ -79,6 +83,8 @@ static const char * version_str = "5.53 20160518";
 #define SGP_READ10 0x28
 #define SGP_WRITE10 0x2a
 #define DEF_NUM_THREADS 4
+#define DEF_HASH_CHUNK_MIB 64   /* hash_chunk=MIB default */
+#define DEF_JOURNAL_INTERVAL 5  /* jinterval=SECS default */
 #define MAX_NUM_THREADS SG_MAX_QUEUE
 
 #ifndef RAW_MAJOR
@@ -106,8 +112,18 @@ struct flags_t {
     int dsync;
     int excl;
     int fua;
+    int unmap;
 };
 
+/* bpt=auto state is a struct bpt_auto (see sg_dd_common.h), tuned from
+ * the rate at which the worker threads take blocks during the first
+ * seconds of the copy. */
+
+/* oflag=unmap state is a struct zero_ofl (see sg_dd_common.h). Zeroed
+ * blocks at either end of each transfer are coalesced, in LBA order, into
+ * a pending run (run_lba and run_num, protected by out_mutex) which is
+ * sent once data follows it. */
+
 typedef struct request_collection
 {       /* one instance visible to all threads */
     int infd;
@@ -120,6 +136,8 @@ typedef struct request_collection
     int64_t in_rem_count;           /*  | count of remaining in blocks */
     int in_partial;                   /*  | */
     int in_stop;                      /*  | */
+    int in_dio_incomplete;            /*  | */
+    int in_sum_of_resids;             /*  | */
     pthread_mutex_t in_mutex;         /* -/ */
     int outfd;
     int64_t seek;
@@ -131,13 +149,18 @@ typedef struct request_collection
     int64_t out_rem_count;          /*  | count of remaining out blocks */
     int out_partial;                  /*  | */
     int out_stop;                     /*  | */
+    int out_dio_incomplete;           /*  | */
+    int out_sum_of_resids;            /*  | */
     pthread_mutex_t out_mutex;        /*  | */
     pthread_cond_t out_sync_cv;       /* -/ hold writes until "in order" */
+    struct hash_strm ihash;     /* ihash= and ohash= state, updated in */
+    struct hash_strm ohash;     /* order while holding out_mutex */
+    struct journal_t jrnl;      /* watermark protected by out_mutex */
+    struct zero_ofl zo;         /* oflag=unmap state */
+    struct bpt_auto bauto;      /* bpt=auto state, under in_mutex */
+    int64_t out_zeroed;         /* protected by out_mutex */
     int bs;
     int bpt;
-    int dio_incomplete;         /* -\ */
-    int sum_of_resids;          /*  | */
-    pthread_mutex_t aux_mutex;  /* -/ (also serializes some printf()s */
     int debug;
 } Rq_coll;
 
@@ -153,6 +176,7 @@ typedef struct request_element
     struct sg_io_hdr io_hdr;
     unsigned char cmd[MAX_SCSI_CDBSZ];
     unsigned char sb[SENSE_BUFF_LEN];
+    struct sg_sense_info si;    /* sense data of last command decoded */
     int bs;
     int dio_incomplete;
     int resid;
@@ -161,6 +185,11 @@ typedef struct request_element
     struct flags_t in_flags;
     struct flags_t out_flags;
     int debug;
+    int zlead;          /* oflag=unmap: zeroed blocks at start of buffp */
+    int ztrail;         /* oflag=unmap: zeroed blocks at end of buffp */
+    int64_t zlba;       /* oflag=unmap: zero run detached by zo_trim() */
+    int64_t znum;
+    uint64_t start_ns;  /* when submitted, if time=1 */
 } Rq_elem;
 
 static sigset_t signal_set;
@@ -173,7 +202,7 @@ static void sg_out_operation(Rq_coll * clp, Rq_elem * rep);
 static int normal_in_operation(Rq_coll * clp, Rq_elem * rep, int blocks);
 static void normal_out_operation(Rq_coll * clp, Rq_elem * rep, int blocks);
 static int sg_start_io(Rq_elem * rep);
-static int sg_finish_io(int wr, Rq_elem * rep, pthread_mutex_t * a_mutp);
+static int sg_finish_io(int wr, Rq_elem * rep);
 
 #define STRERR_BUFF_LEN 128
 
@@ -228,6 +257,22 @@ print_stats(const char * str)
     outfull = dd_count - rcoll.out_rem_count;
     pr2serr("%s%" PRId64 "+%d records out\n", str,
             outfull - rcoll.out_partial, rcoll.out_partial);
+    if (rcoll.out_flags.unmap)
+        pr2serr("%s%" PRId64 " records out zeroed by WRITE SAME or UNMAP\n",
+                str, rcoll.out_zeroed);
+}
+
+/* Called holding out_mutex when rep's blocks are next in LBA order. The
+ * ohash covers the data passed on for writing. */
+static void
+hash_blocks(Rq_coll * clp, const Rq_elem * rep)
+{
+    int len = rep->num_blks * clp->bs;
+
+    if (clp->ihash.active)
+        hash_update(&clp->ihash, rep->buffp, len);
+    if (clp->ohash.active)
+        hash_update(&clp->ohash, rep->buffp, len);
 }
 
 static void
@@ -297,6 +342,120 @@ tsafe_strerror(int code, char * ebp)
     } while (0)
 
 
+/* Called without holding out_mutex. When 'force' is set or at least the
+ * interval has passed since the last checkpoint: synchronizes OFILE then
+ * records the watermark in the journal. Only one thread at a time takes
+ * a checkpoint. */
+static void
+journal_checkpoint_mt(Rq_coll * clp, int force)
+{
+    int status;
+    int64_t wmark;
+    time_t now;
+    struct journal_t * jp = &clp->jrnl;
+
+    if (jp->fd < 0)
+        return;
+    now = time(NULL);
+    status = pthread_mutex_lock(&clp->out_mutex);
+    if (0 != status) err_exit(status, "lock out_mutex");
+    wmark = jp->wmark;
+    if (jp->busy || ((jp->base + wmark) == jp->done) ||
+        ((! force) && ((now - jp->last) < jp->interval)))
+        wmark = -1;
+    else
+        jp->busy = 1;
+    status = pthread_mutex_unlock(&clp->out_mutex);
+    if (0 != status) err_exit(status, "unlock out_mutex");
+    if (wmark < 0)
+        return;
+
+    journal_checkpoint(jp, wmark, 1);   /* sets last and done */
+    status = pthread_mutex_lock(&clp->out_mutex);
+    if (0 != status) err_exit(status, "lock out_mutex");
+    jp->busy = 0;
+    status = pthread_mutex_unlock(&clp->out_mutex);
+    if (0 != status) err_exit(status, "unlock out_mutex");
+}
+
+/* Zeros a run of blocks detached from the pending run, then accounts for
+ * them (as written in order) holding out_mutex. If the device rejects
+ * the method, later runs are written. Called without holding out_mutex;
+ * returns 0 on success. */
+static int
+zo_send(Rq_coll * clp, int64_t lba, int64_t num)
+{
+    int ret, status;
+    int64_t zeroed = 0;
+
+    if (num <= 0)
+        return 0;
+    ret = zo_zero_run(&clp->zo, clp->outfd, clp->bs, lba, num, &zeroed,
+                      NULL, NULL, clp->debug);
+    if (ret) {
+        pr2serr("error zeroing out blk=%" PRId64 " for %" PRId64
+                " blocks\n", lba, num);
+        return ret;
+    }
+    status = pthread_mutex_lock(&clp->out_mutex);
+    if (0 != status) err_exit(status, "lock out_mutex");
+    clp->out_rem_count -= num;
+    clp->out_zeroed += zeroed;
+    journal_mark(&clp->jrnl, lba, num);
+    status = pthread_mutex_unlock(&clp->out_mutex);
+    if (0 != status) err_exit(status, "unlock out_mutex");
+    return 0;
+}
+
+/* Called holding out_mutex when rep's blocks are next in LBA order. The
+ * zeroed blocks at each end of them (rep->zlead and rep->ztrail) join the
+ * pending zero run (if long enough) and rep is trimmed to the blocks
+ * left to write. When the pending run ends (or becomes large) it is
+ * detached into rep->zlba and rep->znum for the caller to send. */
+static void
+zo_trim(Rq_coll * clp, Rq_elem * rep)
+{
+    int lead = rep->zlead;
+    int trail = rep->ztrail;
+    int64_t * zlbap = &rep->zlba;
+    int64_t * znump = &rep->znum;
+    struct zero_ofl * zp = &clp->zo;
+
+    *znump = 0;
+    if ((zp->run_num > 0) && ((zp->run_lba + zp->run_num) != rep->blk)) {
+        *zlbap = zp->run_lba;   /* not adjacent (should not happen) */
+        *znump = zp->run_num;
+        zp->run_num = 0;
+    }
+    if (lead == rep->num_blks)
+        trail = 0;
+    else {
+        if ((lead < zp->min_run) && (0 == zp->run_num))
+            lead = 0;
+        if (trail < zp->min_run)
+            trail = 0;
+    }
+    if (lead > 0) {
+        if (0 == zp->run_num)
+            zp->run_lba = rep->blk;
+        zp->run_num += lead;
+        rep->blk += lead;
+        rep->buffp += lead * rep->bs;
+        rep->num_blks -= lead;
+    }
+    if (((rep->num_blks > 0) || (zp->run_num >= ZO_DEF_MAX_WS)) &&
+        (0 == *znump)) {
+        *zlbap = zp->run_lba;   /* data follows, so the run has ended */
+        *znump = zp->run_num;
+        zp->run_num = 0;
+    }
+    if (trail > 0) {
+        rep->num_blks -= trail;
+        zp->run_lba = rep->blk + rep->num_blks;
+        zp->run_num = trail;
+    }
+}
+
 static int
 dd_filetype(const char * filename)
 {
@@ -305,6 +464,8 @@ dd_filetype(const char * filename)
 
     if ((1 == len) && ('.' == filename[0]))
         return FT_DEV_NULL;
+    if (0 == strncmp(filename, SG_EMUL_PREFIX, sizeof(SG_EMUL_PREFIX) - 1))
+        return FT_SG;   /* emulated disk, see sg_pt_emul.c */
     if (stat(filename, &st) < 0)
         return FT_ERROR;
     if (S_ISCHR(st.st_mode)) {
@@ -322,6 +483,24 @@ dd_filetype(const char * filename)
     return FT_OTHER;
 }
 
+/* Opens a sg device node, or an emulated disk when the name starts with
+ * "emul:". Acts like open(). */
+static int
+sg_open(const char * filename, int flags, int verbose)
+{
+    return sg_emul_is_emul_name(filename) ?
+           sg_emul_open(filename, flags, verbose) : open(filename, flags);
+}
+
+static void
+sg_close(int fd)
+{
+    if (sg_emul_fd(fd))
+        sg_emul_close(fd);
+    else
+        close(fd);
+}
+
 static void
 usage()
 {
@@ -332,10 +511,15 @@ usage()
             "               [--help] [--version]\n\n");
     pr2serr("               [bpt=BPT] [cdbsz=6|10|12|16] [coe=0|1] "
             "[deb=VERB] [dio=0|1]\n"
-            "               [fua=0|1|2|3] [sync=0|1] [thr=THR] "
-            "[time=0|1] [verbose=VERB]\n"
+            "               [fua=0|1|2|3] [hash_chunk=MIB] [ihash=MFILE] "
+            "[jinterval=SECS]\n"
+            "               [journal=JFILE] [ohash=MFILE] [sync=0|1] "
+            "[thr=THR] [time=0|1]\n"
+            "               [verbose=VERB]\n"
             "  where:\n"
-            "    bpt         is blocks_per_transfer (default is 128)\n"
+            "    bpt         is blocks_per_transfer (default is 128), "
+            "'auto' -> tune\n"
+            "                from Block Limits VPD page and throughput\n"
             "    bs          must be device block size (default 512)\n"
             "    cdbsz       size of SCSI READ or WRITE cdb (default is 10)\n"
             "    coe         continue on error, 0->exit (def), "
@@ -347,16 +531,26 @@ usage()
             "    fua         force unit access: 0->don't(def), 1->OFILE, "
             "2->IFILE,\n"
             "                3->OFILE+IFILE\n"
+            "    hash_chunk  CRC32C each MIB mebibytes for ihash and ohash "
+            "(def: 64)\n"
             "    if          file or device to read from (def: stdin)\n"
             "    iflag       comma separated list from: [coe,dio,direct,dpo,"
             "dsync,excl,\n"
             "                fua, null]\n"
+            "    ihash       CRC32C of data read, digests to manifest MFILE "
+            "('.' for\n"
+            "                none)\n"
+            "    jinterval   seconds between journal checkpoints (def: 5)\n"
+            "    journal     record progress in JFILE, resume from it if "
+            "it exists\n"
             "    of          file or device to write to (def: stdout), "
             "OFILE of '.'\n"
             "                treated as /dev/null\n"
+            "    ohash       CRC32C of data written, digests to manifest "
+            "MFILE\n"
             "    oflag       comma separated list from: [append,coe,dio,"
             "direct,dpo,dsync,\n"
-            "                excl,fua,null]\n"
+            "                excl,fua,null,unmap]\n"
             "    seek        block position to start writing to OFILE\n"
             "    skip        block position to start reading from IFILE\n"
             "    sync        0->no sync(def), 1->SYNCHRONIZE CACHE on OFILE "
@@ -511,9 +705,12 @@ read_write_thread(void * v_clp)
     volatile int stop_after_write = 0;
     int64_t seek_skip;
     int blocks, status;
+    unsigned char * bp;
 
     clp = (Rq_coll *)v_clp;
-    sz = clp->bpt * clp->bs;
+    /* with bpt=auto, clp->bpt may grow to clp->bauto.max */
+    sz = ((clp->bauto.max > clp->bpt) ? clp->bauto.max : clp->bpt) *
+         clp->bs;
     seek_skip =  clp->seek - clp->skip;
     memset(rep, 0, sizeof(Rq_elem));
 #if defined(HAVE_SYSCONF) && defined(_SC_PAGESIZE)
@@ -545,6 +742,9 @@ read_write_thread(void * v_clp)
             break;
         }
         blocks = (clp->in_count > clp->bpt) ? clp->bpt : clp->in_count;
+        if (clp->bauto.active)
+            clp->bpt = bpt_auto_next(&clp->bauto, blocks, clp->bs,
+                                     clp->debug);
         rep->wr = 0;
         rep->blk = clp->in_blk;
         rep->num_blks = blocks;
@@ -561,9 +761,16 @@ read_write_thread(void * v_clp)
         }
         pthread_cleanup_pop(0);
 
+        if (clp->out_flags.unmap && (rep->num_blks > 0)) {
+            rep->zlead = zo_zero_blocks(rep->buffp, rep->num_blks, rep->bs,
+                                        0);
+            rep->ztrail = (rep->zlead < rep->num_blks) ?
+                zo_zero_blocks(rep->buffp, rep->num_blks, rep->bs, 1) : 0;
+        }
         status = pthread_mutex_lock(&clp->out_mutex);
         if (0 != status) err_exit(status, "lock out_mutex");
-        if (FT_DEV_NULL != clp->out_type) {
+        if ((FT_DEV_NULL != clp->out_type) || clp->ihash.active ||
+            clp->ohash.active) {
             while ((! clp->out_stop) &&
                    ((rep->blk + seek_skip) != clp->out_blk)) {
                 /* if write would be out of sequence then wait */
@@ -596,12 +803,22 @@ read_write_thread(void * v_clp)
             break;      /* read nothing so leave loop */
         }
 
+        bp = rep->buffp;
         pthread_cleanup_push(cleanup_out, (void *)clp);
-        if (FT_SG == clp->out_type)
+        if (clp->ihash.active || clp->ohash.active)
+            hash_blocks(clp, rep);
+        if (clp->out_flags.unmap)
+            zo_trim(clp, rep);
+        if (clp->out_flags.unmap && (0 == rep->num_blks)) {
+            /* all zeros, held in the pending run */
+            status = pthread_mutex_unlock(&clp->out_mutex);
+            if (0 != status) err_exit(status, "unlock out_mutex");
+        } else if (FT_SG == clp->out_type)
             sg_out_operation(clp, rep); /* releases out_mutex mid operation */
         else if (FT_DEV_NULL == clp->out_type) {
             /* skip actual write operation */
             clp->out_rem_count -= blocks;
+            journal_mark(&clp->jrnl, rep->blk, blocks);
             status = pthread_mutex_unlock(&clp->out_mutex);
             if (0 != status) err_exit(status, "unlock out_mutex");
         }
@@ -611,10 +828,18 @@ read_write_thread(void * v_clp)
             if (0 != status) err_exit(status, "unlock out_mutex");
         }
         pthread_cleanup_pop(0);
+        rep->buffp = bp;
+        if ((rep->znum > 0) && zo_send(clp, rep->zlba, rep->znum)) {
+            if (exit_status <= 0)
+                exit_status = SG_LIB_CAT_OTHER;
+            guarded_stop_both(clp);
+        }
+        rep->znum = 0;
 
         if (stop_after_write)
             break;
         pthread_cond_broadcast(&clp->out_sync_cv);
+        journal_checkpoint_mt(clp, 0);
     } /* end of while loop */
     if (rep->alloc_bp) free(rep->alloc_bp);
     status = pthread_mutex_lock(&clp->in_mutex);
@@ -699,6 +924,7 @@ normal_out_operation(Rq_coll * clp, Rq_elem * rep, int blocks)
             return;
         }
     }
+    journal_mark(&clp->jrnl, rep->blk, res / clp->bs);
     if (res < blocks * clp->bs) {
         blocks = res / clp->bs;
         if ((res % clp->bs) > 0) {
@@ -802,7 +1028,7 @@ sg_in_operation(Rq_coll * clp, Rq_elem * rep)
         status = pthread_mutex_unlock(&clp->in_mutex);
         if (0 != status) err_exit(status, "unlock in_mutex");
 
-        res = sg_finish_io(rep->wr, rep, &clp->aux_mutex);
+        res = sg_finish_io(rep->wr, rep);
         switch (res) {
         case SG_LIB_CAT_ABORTED_COMMAND:
         case SG_LIB_CAT_UNIT_ATTENTION:
@@ -821,21 +1047,21 @@ sg_in_operation(Rq_coll * clp, Rq_elem * rep)
                 return;
             } else {
                 memset(rep->buffp, 0, rep->num_blks * rep->bs);
-                pr2serr(">> substituted zeros for in blk=%" PRId64 " for %d "
-                        "bytes\n", rep->blk, rep->num_blks * rep->bs);
+                if (rep->si.info_valid)
+                    pr2serr(">> substituted zeros for in blk=%" PRId64
+                            " for %d bytes, lba of error=0x%" PRIx64 "\n",
+                            rep->blk, rep->num_blks * rep->bs, rep->si.info);
+                else
+                    pr2serr(">> substituted zeros for in blk=%" PRId64
+                            " for %d bytes\n", rep->blk,
+                            rep->num_blks * rep->bs);
             }
             /* fall through */
         case 0:
-            if (rep->dio_incomplete || rep->resid) {
-                status = pthread_mutex_lock(&clp->aux_mutex);
-                if (0 != status) err_exit(status, "lock aux_mutex");
-                clp->dio_incomplete += rep->dio_incomplete;
-                clp->sum_of_resids += rep->resid;
-                status = pthread_mutex_unlock(&clp->aux_mutex);
-                if (0 != status) err_exit(status, "unlock aux_mutex");
-            }
             status = pthread_mutex_lock(&clp->in_mutex);
             if (0 != status) err_exit(status, "lock in_mutex");
+            clp->in_dio_incomplete += rep->dio_incomplete;
+            clp->in_sum_of_resids += rep->resid;
             clp->in_rem_count -= rep->num_blks;
             status = pthread_mutex_unlock(&clp->in_mutex);
             if (0 != status) err_exit(status, "unlock in_mutex");
@@ -873,7 +1099,7 @@ sg_out_operation(Rq_coll * clp, Rq_elem * rep)
         status = pthread_mutex_unlock(&clp->out_mutex);
         if (0 != status) err_exit(status, "unlock out_mutex");
 
-        res = sg_finish_io(rep->wr, rep, &clp->aux_mutex);
+        res = sg_finish_io(rep->wr, rep);
         switch (res) {
         case SG_LIB_CAT_ABORTED_COMMAND:
         case SG_LIB_CAT_UNIT_ATTENTION:
@@ -890,22 +1116,21 @@ sg_out_operation(Rq_coll * clp, Rq_elem * rep)
                     exit_status = res;
                 guarded_stop_both(clp);
                 return;
-            } else
+            } else if (rep->si.info_valid)
+                pr2serr(">> ignored error for out blk=%" PRId64 " for %d "
+                        "bytes, lba of error=0x%" PRIx64 "\n", rep->blk,
+                        rep->num_blks * rep->bs, rep->si.info);
+            else
                 pr2serr(">> ignored error for out blk=%" PRId64 " for %d "
                         "bytes\n", rep->blk, rep->num_blks * rep->bs);
             /* fall through */
         case 0:
-            if (rep->dio_incomplete || rep->resid) {
-                status = pthread_mutex_lock(&clp->aux_mutex);
-                if (0 != status) err_exit(status, "lock aux_mutex");
-                clp->dio_incomplete += rep->dio_incomplete;
-                clp->sum_of_resids += rep->resid;
-                status = pthread_mutex_unlock(&clp->aux_mutex);
-                if (0 != status) err_exit(status, "unlock aux_mutex");
-            }
             status = pthread_mutex_lock(&clp->out_mutex);
             if (0 != status) err_exit(status, "lock out_mutex");
+            clp->out_dio_incomplete += rep->dio_incomplete;
+            clp->out_sum_of_resids += rep->resid;
             clp->out_rem_count -= rep->num_blks;
+            journal_mark(&clp->jrnl, rep->blk, rep->num_blks);
             status = pthread_mutex_unlock(&clp->out_mutex);
             if (0 != status) err_exit(status, "unlock out_mutex");
             return;
@@ -927,7 +1152,7 @@ sg_start_io(Rq_elem * rep)
     int dpo = rep->wr ? rep->out_flags.dpo : rep->in_flags.dpo;
     int dio = rep->wr ? rep->out_flags.dio : rep->in_flags.dio;
     int cdbsz = rep->wr ? rep->cdbsz_out : rep->cdbsz_in;
-    int res;
+    int res, fd;
 
     if (sg_build_scsi_cdb(rep->cmd, cdbsz, rep->num_blks, rep->blk,
                           rep->wr, fua, dpo)) {
@@ -949,14 +1174,16 @@ sg_start_io(Rq_elem * rep)
     hp->pack_id = (int)rep->blk;
     if (dio)
         hp->flags |= SG_FLAG_DIRECT_IO;
+    rep->start_ns = scsi_pt_lat_enabled() ? scsi_pt_lat_now_ns() : 0;
     if (rep->debug > 8) {
         pr2serr("sg_start_io: SCSI %s, blk=%" PRId64 " num_blks=%d\n",
                rep->wr ? "WRITE" : "READ", rep->blk, rep->num_blks);
         sg_print_command(hp->cmdp);
     }
 
-    while (((res = write(rep->wr ? rep->outfd : rep->infd, hp,
-                         sizeof(struct sg_io_hdr))) < 0) &&
+    fd = rep->wr ? rep->outfd : rep->infd;
+    while (((res = (sg_emul_fd(fd) ? sg_emul_write(fd, hp) :
+                    write(fd, hp, sizeof(struct sg_io_hdr)))) < 0) &&
            ((EINTR == errno) || (EAGAIN == errno)))
         ;
     if (res < 0) {
@@ -968,13 +1195,61 @@ sg_start_io(Rq_elem * rep)
     return 0;
 }
 
+/* Reports the outcome of the command in hp as sg_chk_n_print3() does, but
+ * with one write to stderr so that reports from several threads are not
+ * interleaved. The library's diagnostics go to a memory stream belonging
+ * to this thread meanwhile. */
+static void
+chk_n_print3_whole(const char * leadin, struct sg_io_hdr * hp)
+{
+    char * bp = NULL;
+    size_t len = 0;
+    FILE * fp;
+
+    fp = open_memstream(&bp, &len);
+    if ((NULL == fp) || sg_set_thread_warnings_strm(fp)) {
+        if (fp)
+            fclose(fp);
+        free(bp);
+        sg_chk_n_print3(leadin, hp, 0);
+        return;
+    }
+    sg_chk_n_print3(leadin, hp, 0);
+    sg_set_thread_warnings_strm(NULL);
+    fclose(fp);
+    if (bp && (len > 0))
+        fwrite(bp, 1, len, stderr);
+    free(bp);
+}
+
+/* Prints the command latency histograms of all worker threads merged,
+ * one line per opcode seen. */
+static void
+print_latency(void)
+{
+    int k;
+    static struct sg_pt_lat_hist hist;
+    char name[64];
+    char leadin[80];
+    char b[192];
+
+    for (k = 0; k < 256; ++k) {
+        if (0 == scsi_pt_lat_snapshot_all(k, &hist))
+            continue;
+        sg_get_opcode_name((unsigned char)k, 0, sizeof(name), name);
+        snprintf(leadin, sizeof(leadin), "%s latency: ", name);
+        scsi_pt_lat_str(&hist, leadin, sizeof(b), b);
+        pr2serr("%s\n", b);
+    }
+}
+
 /* 0 -> successful, SG_LIB_CAT_UNIT_ATTENTION or SG_LIB_CAT_ABORTED_COMMAND
    -> try again, SG_LIB_CAT_NOT_READY, SG_LIB_CAT_MEDIUM_HARD,
    -1 other errors */
 static int
-sg_finish_io(int wr, Rq_elem * rep, pthread_mutex_t * a_mutp)
+sg_finish_io(int wr, Rq_elem * rep)
 {
-    int res, status;
+    int res, fd;
     struct sg_io_hdr io_hdr;
     struct sg_io_hdr * hp;
 #if 0
@@ -987,8 +1262,9 @@ sg_finish_io(int wr, Rq_elem * rep, pthread_mutex_t * a_mutp)
     io_hdr.dxfer_direction = wr ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV;
     io_hdr.pack_id = (int)rep->blk;
 
-    while (((res = read(wr ? rep->outfd : rep->infd, &io_hdr,
-                        sizeof(struct sg_io_hdr))) < 0) &&
+    fd = wr ? rep->outfd : rep->infd;
+    while (((res = (sg_emul_fd(fd) ? sg_emul_read(fd, &io_hdr) :
+                    read(fd, &io_hdr, sizeof(struct sg_io_hdr)))) < 0) &&
            ((EINTR == errno) || (EAGAIN == errno)))
         ;
     if (res < 0) {
@@ -999,8 +1275,11 @@ sg_finish_io(int wr, Rq_elem * rep, pthread_mutex_t * a_mutp)
         err_exit(0, "sg_finish_io: bad usr_ptr, request-response mismatch\n");
     memcpy(&rep->io_hdr, &io_hdr, sizeof(struct sg_io_hdr));
     hp = &rep->io_hdr;
+    if (rep->start_ns)
+        scsi_pt_lat_record(rep->cmd[0], scsi_pt_lat_now_ns() -
+                                        rep->start_ns);
 
-    res = sg_err_category3(hp);
+    res = sg_err_category3_si(hp, &rep->si);
     switch (res) {
         case SG_LIB_CAT_CLEAN:
             break;
@@ -1013,6 +1292,12 @@ sg_finish_io(int wr, Rq_elem * rep, pthread_mutex_t * a_mutp)
             if (rep->debug > 8)
                 sg_chk_n_print3((wr ? "writing": "reading"), hp, 0);
             return res;
+        case SG_LIB_CAT_MEDIUM_HARD:
+            /* with coe the caller reports it briefly, from rep->si */
+            if ((wr ? rep->out_flags.coe : rep->in_flags.coe) &&
+                (rep->debug <= 8))
+                return res;
+            /* fall through */
         case SG_LIB_CAT_NOT_READY:
         default:
             {
@@ -1020,11 +1305,7 @@ sg_finish_io(int wr, Rq_elem * rep, pthread_mutex_t * a_mutp)
 
                 snprintf(ebuff, EBUFF_SZ, "%s blk=%" PRId64,
                          wr ? "writing": "reading", rep->blk);
-                status = pthread_mutex_lock(a_mutp);
-                if (0 != status) err_exit(status, "lock aux_mutex");
-                sg_chk_n_print3(ebuff, hp, 0);
-                status = pthread_mutex_unlock(a_mutp);
-                if (0 != status) err_exit(status, "unlock aux_mutex");
+                chk_n_print3_whole(ebuff, hp);
                 return res;
             }
     }
@@ -1047,6 +1328,8 @@ sg_prepare(int fd, int bs, int bpt)
 {
     int res, t;
 
+    if (sg_emul_fd(fd))
+        return 0;       /* emulator needs none of the following */
     res = ioctl(fd, SG_GET_VERSION_NUM, &t);
     if ((res < 0) || (t < 30000)) {
         pr2serr(ME "sg driver prior to 3.x.y\n");
@@ -1099,6 +1382,8 @@ process_flags(const char * arg, struct flags_t * fp)
             fp->fua = 1;
         else if (0 == strcmp(cp, "null"))
             ;
+        else if (0 == strcmp(cp, "unmap"))
+            fp->unmap = 1;
         else {
             pr2serr("unrecognised flag: %s\n", cp);
             return 1;
@@ -1121,12 +1406,17 @@ main(int argc, char * argv[])
     int ibs = 0;
     int obs = 0;
     int bpt_given = 0;
+    int bpt_auto = 0;
     int cdbsz_given = 0;
+    int hash_chunk = DEF_HASH_CHUNK_MIB;
     char str[STR_SZ];
     char * key;
     char * buf;
     char inf[INOUTF_SZ];
     char outf[INOUTF_SZ];
+    char ihashf[INOUTF_SZ];
+    char ohashf[INOUTF_SZ];
+    char jfile[INOUTF_SZ];
     int res, k;
     int64_t in_num_sect = 0;
     int64_t out_num_sect = 0;
@@ -1143,6 +1433,10 @@ main(int argc, char * argv[])
     rcoll.cdbsz_out = DEF_SCSI_CDBSZ;
     inf[0] = '\0';
     outf[0] = '\0';
+    ihashf[0] = '\0';
+    ohashf[0] = '\0';
+    jfile[0] = '\0';
+    journal_init(&rcoll.jrnl, "sgp_dd", DEF_JOURNAL_INTERVAL);
 
     for (k = 1; k < argc; k++) {
         if (argv[k]) {
@@ -1156,7 +1450,11 @@ main(int argc, char * argv[])
         if (*buf)
             *buf++ = '\0';
         if (0 == strcmp(key,"bpt")) {
-            rcoll.bpt = sg_get_num(buf);
+            if (0 == strcmp(buf, "auto")) {
+                bpt_auto = 1;
+                rcoll.bpt = DEF_BLOCKS_PER_TRANSFER;
+            } else
+                rcoll.bpt = sg_get_num(buf);
             if (-1 == rcoll.bpt) {
                 pr2serr(ME "bad argument to 'bpt='\n");
                 return SG_LIB_SYNTAX_ERROR;
@@ -1195,6 +1493,12 @@ main(int argc, char * argv[])
                 rcoll.out_flags.fua = 1;
             if (n & 2)
                 rcoll.in_flags.fua = 1;
+        } else if (0 == strcmp(key,"hash_chunk")) {
+            hash_chunk = sg_get_num(buf);
+            if (hash_chunk < 0) {
+                pr2serr(ME "bad argument to 'hash_chunk='\n");
+                return SG_LIB_SYNTAX_ERROR;
+            }
         } else if (0 == strcmp(key,"ibs")) {
             ibs = sg_get_num(buf);
             if (-1 == ibs) {
@@ -1212,12 +1516,45 @@ main(int argc, char * argv[])
                 pr2serr(ME "bad argument to 'iflag='\n");
                 return SG_LIB_SYNTAX_ERROR;
             }
+        } else if (0 == strcmp(key,"ihash")) {
+            if ('\0' != ihashf[0]) {
+                pr2serr("Second 'ihash=' argument??\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else if (strlen(buf) >= INOUTF_SZ) {
+                pr2serr(ME "argument to 'ihash=' too long\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else
+                strcpy(ihashf, buf);
+        } else if (0 == strcmp(key,"jinterval")) {
+            rcoll.jrnl.interval = sg_get_num(buf);
+            if (rcoll.jrnl.interval < 0) {
+                pr2serr(ME "bad argument to 'jinterval='\n");
+                return SG_LIB_SYNTAX_ERROR;
+            }
+        } else if (0 == strcmp(key,"journal")) {
+            if ('\0' != jfile[0]) {
+                pr2serr("Second 'journal=' argument??\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else if (strlen(buf) >= INOUTF_SZ) {
+                pr2serr(ME "argument to 'journal=' too long\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else
+                strcpy(jfile, buf);
         } else if (0 == strcmp(key,"obs")) {
             obs = sg_get_num(buf);
             if (-1 == obs) {
                 pr2serr(ME "bad argument to 'obs='\n");
                 return SG_LIB_SYNTAX_ERROR;
             }
+        } else if (0 == strcmp(key,"ohash")) {
+            if ('\0' != ohashf[0]) {
+                pr2serr("Second 'ohash=' argument??\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else if (strlen(buf) >= INOUTF_SZ) {
+                pr2serr(ME "argument to 'ohash=' too long\n");
+                return SG_LIB_SYNTAX_ERROR;
+            } else
+                strcpy(ohashf, buf);
         } else if (strcmp(key,"of") == 0) {
             if ('\0' != outf[0]) {
                 pr2serr("Second 'of=' argument??\n");
@@ -1289,6 +1626,9 @@ main(int argc, char * argv[])
        SG_IO ioctl. So reduce it in that case. */
     if ((rcoll.bs >= 2048) && (0 == bpt_given))
         rcoll.bpt = DEF_BLOCKS_PER_2048TRANSFER;
+    /* with bpt=auto sg reserved buffers are sized for the largest */
+    if (bpt_auto && (AUTO_MAX_XFER_BYTES >= rcoll.bs))
+        rcoll.bpt = AUTO_MAX_XFER_BYTES / rcoll.bs;
     if ((num_threads < 1) || (num_threads > MAX_NUM_THREADS)) {
         pr2serr("too few or too many threads requested\n");
         usage();
@@ -1297,6 +1637,20 @@ main(int argc, char * argv[])
     if (rcoll.debug)
         pr2serr(ME "if=%s skip=%" PRId64 " of=%s seek=%" PRId64 " count=%"
                 PRId64 "\n", inf, skip, outf, seek, dd_count);
+    if (jfile[0]) {
+        if (('\0' == inf[0]) || ('-' == inf[0]) || ('\0' == outf[0]) ||
+            ('-' == outf[0])) {
+            pr2serr("journal= needs both IFILE and OFILE to be named\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if (rcoll.out_flags.append > 0) {
+            pr2serr("Can't use both append and journal= options\n");
+            return SG_LIB_SYNTAX_ERROR;
+        }
+        if ((res = journal_open(&rcoll.jrnl, jfile, inf, outf, rcoll.bs,
+                                &skip, &seek, &dd_count, rcoll.debug)))
+            return res;
+    }
 
     install_handler(SIGINT, interrupt_handler);
     install_handler(SIGQUIT, interrupt_handler);
@@ -1323,7 +1677,7 @@ main(int argc, char * argv[])
             if (rcoll.in_flags.dsync)
                 flags |= O_SYNC;
 
-            if ((rcoll.infd = open(inf, flags)) < 0) {
+            if ((rcoll.infd = sg_open(inf, flags, rcoll.debug)) < 0) {
                 snprintf(ebuff, EBUFF_SZ,
                          ME "could not open %s for sg reading", inf);
                 perror(ebuff);
@@ -1376,7 +1730,7 @@ main(int argc, char * argv[])
             if (rcoll.out_flags.dsync)
                 flags |= O_SYNC;
 
-            if ((rcoll.outfd = open(outf, flags)) < 0) {
+            if ((rcoll.outfd = sg_open(outf, flags, rcoll.debug)) < 0) {
                 snprintf(ebuff,  EBUFF_SZ,
                          ME "could not open %s for sg writing", outf);
                 perror(ebuff);
@@ -1516,6 +1870,12 @@ main(int argc, char * argv[])
         pr2serr("Couldn't calculate count, please give one\n");
         return SG_LIB_CAT_OTHER;
     }
+    if (jfile[0] &&
+        (res = journal_start(&rcoll.jrnl, version_str, inf, outf, rcoll.bs,
+                             dd_count, rcoll.outfd, (FT_SG == rcoll.out_type) ?
+                             JRNL_OUT_SG : ((FT_DEV_NULL == rcoll.out_type) ?
+                             JRNL_OUT_NULL : JRNL_OUT_FILE))))
+        return res;
     if (! cdbsz_given) {
         if ((FT_SG == rcoll.in_type) && (MAX_SCSI_CDBSZ != rcoll.cdbsz_in) &&
             (((dd_count + skip) > UINT_MAX) || (rcoll.bpt > USHRT_MAX))) {
@@ -1531,6 +1891,40 @@ main(int argc, char * argv[])
         }
     }
 
+    if (bpt_auto) {
+        bpt_auto_init(&rcoll.bauto, rcoll.infd, (FT_SG == rcoll.in_type),
+                      rcoll.outfd, (FT_SG == rcoll.out_type), rcoll.bs,
+                      (rcoll.bs >= 2048) ? DEF_BLOCKS_PER_2048TRANSFER :
+                                           DEF_BLOCKS_PER_TRANSFER,
+                      rcoll.debug);
+        rcoll.bpt = rcoll.bauto.cur;
+    }
+    if (rcoll.in_flags.unmap) {
+        pr2serr("Note: iflag=unmap ignored\n");
+        rcoll.in_flags.unmap = 0;
+    }
+    if (rcoll.out_flags.unmap) {
+        if (FT_SG != rcoll.out_type) {
+            pr2serr("Note: oflag=unmap ignored as OFILE is not a sg "
+                    "device\n");
+            rcoll.out_flags.unmap = 0;
+        } else if (zo_init(&rcoll.zo, rcoll.outfd, rcoll.bs, rcoll.bpt,
+                           rcoll.debug)) {
+            pr2serr("out of memory for oflag=unmap\n");
+            return SG_LIB_CAT_OTHER;
+        }
+    }
+    if (ihashf[0] && (res = hash_open(&rcoll.ihash, "sgp_dd", version_str,
+                                      "ihash", ihashf, (inf[0] ? inf : "-"),
+                                      skip, rcoll.bs, hash_chunk,
+                                      rcoll.debug)))
+        return res;
+    if (ohashf[0] && (res = hash_open(&rcoll.ohash, "sgp_dd", version_str,
+                                      "ohash", ohashf,
+                                      (outf[0] ? outf : "-"), seek, rcoll.bs,
+                                      hash_chunk, rcoll.debug)))
+        return res;
+
     rcoll.in_count = dd_count;
     rcoll.in_rem_count = dd_count;
     rcoll.skip = skip;
@@ -1543,8 +1937,6 @@ main(int argc, char * argv[])
     if (0 != status) err_exit(status, "init in_mutex");
     status = pthread_mutex_init(&rcoll.out_mutex, NULL);
     if (0 != status) err_exit(status, "init out_mutex");
-    status = pthread_mutex_init(&rcoll.aux_mutex, NULL);
-    if (0 != status) err_exit(status, "init aux_mutex");
     status = pthread_cond_init(&rcoll.out_sync_cv, NULL);
     if (0 != status) err_exit(status, "init out_sync_cv");
 
@@ -1560,6 +1952,7 @@ main(int argc, char * argv[])
         start_tm.tv_sec = 0;
         start_tm.tv_usec = 0;
         gettimeofday(&start_tm, NULL);
+        scsi_pt_lat_enable(1);
     }
 
 /* vvvvvvvvvvv  Start worker threads  vvvvvvvvvvvvvvvvvvvvvvvv */
@@ -1598,9 +1991,17 @@ main(int argc, char * argv[])
                 pr2serr("Worker thread k=%d terminated\n", k);
         }
     }
+    if (rcoll.out_flags.unmap && (rcoll.zo.run_num > 0) &&
+        zo_send(&rcoll, rcoll.zo.run_lba, rcoll.zo.run_num)) {
+        if (exit_status <= 0)
+            exit_status = SG_LIB_CAT_OTHER;
+    }
 
-    if ((do_time) && (start_tm.tv_sec || start_tm.tv_usec))
+    if ((do_time) && (start_tm.tv_sec || start_tm.tv_usec)) {
+        scsi_pt_lat_enable(0);
         calc_duration_throughput(0);
+        print_latency();
+    }
 
     if (do_sync) {
         if (FT_SG == rcoll.out_type) {
@@ -1615,12 +2016,16 @@ main(int argc, char * argv[])
         }
     }
 
+    /* every block written, including zero runs sent by zo_send() */
+    journal_close(&rcoll.jrnl, rcoll.jrnl.wmark,
+                  rcoll.jrnl.wmark == dd_count);
     status = pthread_cancel(sig_listen_thread_id);
     if (0 != status) err_exit(status, "pthread_cancel");
     if (STDIN_FILENO != rcoll.infd)
-        close(rcoll.infd);
+        sg_close(rcoll.infd);
     if ((STDOUT_FILENO != rcoll.outfd) && (FT_DEV_NULL != rcoll.out_type))
-        close(rcoll.outfd);
+        sg_close(rcoll.outfd);
+    zo_free(&rcoll.zo);
     res = exit_status;
     if (0 != rcoll.out_count) {
         pr2serr(">>>> Some error occurred, remaining blocks=%" PRId64 "\n",
@@ -1629,12 +2034,18 @@ main(int argc, char * argv[])
             res = SG_LIB_CAT_OTHER;
     }
     print_stats("");
-    if (rcoll.dio_incomplete) {
+    k = hash_close(&rcoll.ihash, 0 == res);
+    if (0 == res)
+        res = k;
+    k = hash_close(&rcoll.ohash, 0 == res);
+    if (0 == res)
+        res = k;
+    if (rcoll.in_dio_incomplete + rcoll.out_dio_incomplete) {
         int fd;
         char c;
 
         pr2serr(">> Direct IO requested but incomplete %d times\n",
-                rcoll.dio_incomplete);
+                rcoll.in_dio_incomplete + rcoll.out_dio_incomplete);
         if ((fd = open(proc_allow_dio, O_RDONLY)) >= 0) {
             if (1 == read(fd, &c, 1)) {
                 if ('0' == c)
@@ -1644,8 +2055,8 @@ main(int argc, char * argv[])
             close(fd);
         }
     }
-    if (rcoll.sum_of_resids)
+    if (rcoll.in_sum_of_resids + rcoll.out_sum_of_resids)
         pr2serr(">> Non-zero sum of residual counts=%d\n",
-               rcoll.sum_of_resids);
+               rcoll.in_sum_of_resids + rcoll.out_sum_of_resids);
     return (res >= 0) ? res : SG_LIB_CAT_OTHER;
 }
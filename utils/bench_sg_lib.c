@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2016 Douglas Gilbert.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the BSD_LICENSE file.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+#include "sg_lib.h"
+#include "sg_unaligned.h"
+
+/* A micro-benchmark program for the decode (and encode) functions in
+ * sg_lib.c and sg_unaligned.h. For each function the time per operation
+ * (call) in nanoseconds and the number of heap allocations per operation
+ * are reported. Where sample data is available in the examples directory
+ * (e.g. ref_sense.txt) it is used, otherwise built in data is used.
+ *
+ * Allocations are counted by linking with the GNU ld options:
+ *     -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+ * as 'make bench' does.
+ */
+
+static const char * version_str = "1.00 20160706";
+
+#define MAX_SAMPLE_LEN 1024
+#define MAX_TIDS 32
+#define DEF_MIN_MS 200
+
+static struct option long_options[] = {
+        {"examples", required_argument, 0, 'e'},
+        {"filter", required_argument, 0, 'f'},
+        {"help", no_argument, 0, 'h'},
+        {"time", required_argument, 0, 't'},
+        {"verbose", no_argument, 0, 'v'},
+        {"version", no_argument, 0, 'V'},
+        {0, 0, 0, 0},   /* sentinel */
+};
+
+/* Fixed format: medium error, unrecovered read error at lba 0x1234 */
+static unsigned char fixed_sense[] = {
+    0xf0, 0x0, 0x3, 0x0, 0x0, 0x12, 0x34, 0xa, 0x0, 0x0, 0x0, 0x0,
+    0x11, 0x0, 0x0, 0x0, 0x0, 0x0,
+};
+
+/* Device identification VPD page (0x83) designation descriptors: logical
+ * unit NAA, T10 vendor id, relative target port, target port NAA and
+ * target device SCSI name string */
+static unsigned char dev_id_page[] = {
+    0x1, 0x3, 0x0, 0x8, 0x50, 0x0, 0xc5, 0x0, 0x12, 0x34, 0x56, 0x78,
+    0x2, 0x1, 0x0, 0x10, 'A', 'C', 'M', 'E', ' ', ' ', ' ', ' ',
+    'D', 'I', 'S', 'K', '1', '2', '3', '4',
+    0x61, 0x94, 0x0, 0x4, 0x0, 0x0, 0x0, 0x1,
+    0x61, 0x93, 0x0, 0x8, 0x50, 0x0, 0xc5, 0x0, 0x12, 0x34, 0x56, 0x79,
+    0x3, 0x28, 0x0, 0x18, 'n', 'a', 'a', '.', '5', '0', '0', '0',
+    'C', '5', '0', '0', '1', '2', '3', '4', '5', '6', '7', '8',
+    0x0, 0x0, 0x0, 0x0,
+};
+
+/* SAS TransportID */
+static unsigned char def_tid[24] = {
+    0x6, 0x0, 0x0, 0x0, 0x50, 0x6, 0x5, 0xb0, 0x0, 0x6, 0xf2, 0x60,
+};
+
+struct sample_t {
+    unsigned char b[MAX_SAMPLE_LEN];
+    int len;
+};
+
+struct opts_t {
+    const char * examples_dir;
+    const char * filter;
+    int min_ms;
+    int verbose;
+};
+
+static struct sample_t ref_sense;
+static struct sample_t fwd_sense;
+static unsigned char tids[MAX_TIDS][24];
+static int num_tids;
+static unsigned char desc_arr[256 * 16];
+static uint64_t lba_arr[256];
+static uint32_t num_arr[256];
+static char out_b[8192];
+static volatile uint64_t sink;
+
+static uint64_t num_allocs;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t nmemb, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    ++num_allocs;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    ++num_allocs;
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void * ptr, size_t size)
+{
+    ++num_allocs;
+    return __real_realloc(ptr, size);
+}
+
+
+static void
+usage()
+{
+    fprintf(stderr, "Usage: "
+            "bench_sg_lib [--examples=DIR] [--filter=STR] [--help] "
+            "[--time=MS]\n"
+            "                    [--verbose] [--version]\n"
+            "  where:\n"
+            "    --examples=DIR|-e DIR    directory holding sample data "
+            "(def:\n"
+            "                             ../examples)\n"
+            "    --filter=STR|-f STR      only run benchmarks whose name "
+            "contains STR\n"
+            "    --help|-h                print out usage message\n"
+            "    --time=MS|-t MS          minimum time to run each "
+            "benchmark (def: %d)\n"
+            "    --verbose|-v             increase verbosity\n"
+            "    --version|-V             print version string and exit\n\n"
+            "Micro-benchmarks for sg_lib decode and encode functions. "
+            "Reports time\nper operation (ns/op) and heap allocations per "
+            "operation (allocs/op).\n", DEF_MIN_MS);
+}
+
+/* Reads ASCII hex bytes from 'fname', space, comma or tab separated with
+ * everything after a '#' on a line ignored. If 'sp' is non-NULL all bytes
+ * are placed in it; otherwise each line holding bytes is taken as a
+ * TransportID. Returns 0 if ok, else -1. */
+static int
+read_hex_file(const char * dir, const char * fname, struct sample_t * sp)
+{
+    int n, h;
+    unsigned int u;
+    char * cp;
+    FILE * fp;
+    char line[512];
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, fname);
+    fp = fopen(path, "r");
+    if (NULL == fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        cp = strchr(line, '#');
+        if (cp)
+            *cp = '\0';
+        for (n = 0, cp = line; ; cp += h) {
+            cp += strspn(cp, " ,\t\r\n");
+            if ((0 == *cp) || (1 != sscanf(cp, "%x%n", &u, &h)) ||
+                (u > 0xff))
+                break;
+            if (sp) {
+                if (sp->len < MAX_SAMPLE_LEN)
+                    sp->b[sp->len++] = u;
+            } else if ((num_tids < MAX_TIDS) && (n < 24))
+                tids[num_tids][n++] = u;
+        }
+        if ((NULL == sp) && (n > 0))
+            ++num_tids;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void
+load_samples(const struct opts_t * op)
+{
+    int k;
+
+    if (read_hex_file(op->examples_dir, "ref_sense.txt", &ref_sense) ||
+        (ref_sense.len < 8)) {
+        memcpy(ref_sense.b, fixed_sense, sizeof(fixed_sense));
+        ref_sense.len = sizeof(fixed_sense);
+        if (op->verbose)
+            fprintf(stderr, "ref_sense.txt not found, using built in\n");
+    }
+    if (read_hex_file(op->examples_dir, "forwarded_sense.txt", &fwd_sense)
+        || (fwd_sense.len < 8)) {
+        memcpy(fwd_sense.b, fixed_sense, sizeof(fixed_sense));
+        fwd_sense.len = sizeof(fixed_sense);
+        if (op->verbose)
+            fprintf(stderr, "forwarded_sense.txt not found, using built "
+                    "in\n");
+    }
+    if (read_hex_file(op->examples_dir, "transport_ids.txt", NULL) ||
+        (0 == num_tids)) {
+        memcpy(tids[0], def_tid, sizeof(def_tid));
+        num_tids = 1;
+        if (op->verbose)
+            fprintf(stderr, "transport_ids.txt not found, using built "
+                    "in\n");
+    }
+    if (op->verbose)
+        fprintf(stderr, "sense samples: %d and %d bytes, %d TransportIDs\n",
+                ref_sense.len, fwd_sense.len, num_tids);
+    for (k = 0; k < 256; ++k) {
+        lba_arr[k] = 0x123456789ULL * (k + 1);
+        num_arr[k] = 0x1000 + k;
+    }
+    sg_put_unaligned_be64_arr(lba_arr, 256, desc_arr, 16);
+    sg_put_unaligned_be32_arr(num_arr, 256, desc_arr + 8, 16);
+}
+
+/* Each benchmark function does 'iters' iterations, returning the number
+ * of operations performed */
+
+static uint64_t
+b_sense_str_fixed(uint64_t iters)
+{
+    uint64_t k;
+
+    for (k = 0; k < iters; ++k)
+        sink += sg_get_sense_str(NULL, fixed_sense, sizeof(fixed_sense), 0,
+                                 sizeof(out_b), out_b);
+    return iters;
+}
+
+static uint64_t
+b_sense_str_ref(uint64_t iters)
+{
+    uint64_t k;
+
+    for (k = 0; k < iters; ++k)
+        sink += sg_get_sense_str(NULL, ref_sense.b, ref_sense.len, 0,
+                                 sizeof(out_b), out_b);
+    return iters;
+}
+
+static uint64_t
+b_sense_str_fwd(uint64_t iters)
+{
+    uint64_t k;
+
+    for (k = 0; k < iters; ++k)
+        sink += sg_get_sense_str("  ", fwd_sense.b, fwd_sense.len, 1,
+                                 sizeof(out_b), out_b);
+    return iters;
+}
+
+static uint64_t
+b_asc_ascq_str(uint64_t iters)
+{
+    uint64_t k;
+
+    for (k = 0; k < iters; ++k)
+        sink += (uintptr_t)sg_get_asc_ascq_str((k * 7) & 0x7f, k & 0x7,
+                                               sizeof(out_b), out_b);
+    return iters;
+}
+
+static uint64_t
+b_command_name(uint64_t iters)
+{
+    uint64_t k;
+    unsigned char cdb[16];
+
+    memset(cdb, 0, sizeof(cdb));
+    for (k = 0; k < iters; ++k) {
+        cdb[0] = k & 0xff;
+        cdb[1] = (k >> 8) & 0x1f;
+        cdb[9] = cdb[1];
+        sg_get_command_name(cdb, 0, sizeof(out_b), out_b);
+        sink += out_b[0];
+    }
+    return iters;
+}
+
+static uint64_t
+b_dstrhexstr(uint64_t iters)
+{
+    uint64_t k;
+
+    for (k = 0; k < iters; ++k)
+        sink += dStrHexStr((const char *)desc_arr, 256, "  ", 0,
+                           sizeof(out_b), out_b);
+    return iters;
+}
+
+static uint64_t
+b_designation_str(uint64_t iters)
+{
+    int off;
+    uint64_t k;
+    uint64_t ops = 0;
+    int len = sizeof(dev_id_page);
+
+    for (k = 0; k < iters; ++k) {
+        for (off = -1; 0 == sg_vpd_dev_id_iter(dev_id_page, len, &off, -1,
+                                               -1, -1); ++ops)
+            sink += sg_get_designation_descriptor_str(NULL,
+                        dev_id_page + off, dev_id_page[off + 3] + 4, 1, 0,
+                        sizeof(out_b), out_b);
+    }
+    return ops;
+}
+
+static uint64_t
+b_transportid_str(uint64_t iters)
+{
+    uint64_t k;
+
+    for (k = 0; k < iters; ++k) {
+        sg_decode_transportid_str(NULL, tids[k % num_tids], 24, true,
+                                  sizeof(out_b), out_b);
+        sink += out_b[0];
+    }
+    return iters;
+}
+
+static uint64_t
+b_dev_id_iter(uint64_t iters)
+{
+    int off;
+    uint64_t k;
+    int len = sizeof(dev_id_page);
+
+    for (k = 0; k < iters; ++k) {
+        off = -1;
+        /* target port NAA (association 1, designator type 3) */
+        sink += sg_vpd_dev_id_iter(dev_id_page, len, &off, 1, 3, -1);
+    }
+    return iters;
+}
+
+/* One operation is decoding the LBA and number of blocks from one 16 byte
+ * (UNMAP or LBA status like) descriptor */
+static uint64_t
+b_unaligned_get(uint64_t iters)
+{
+    int j;
+    uint64_t k;
+    uint64_t sum = 0;
+    const unsigned char * bp;
+
+    for (k = 0; k < iters; ++k) {
+        for (j = 0, bp = desc_arr; j < 256; ++j, bp += 16)
+            sum += sg_get_unaligned_be64(bp) + sg_get_unaligned_be32(bp + 8);
+    }
+    sink += sum;
+    return iters * 256;
+}
+
+static uint64_t
+b_unaligned_get_arr(uint64_t iters)
+{
+    uint64_t k;
+
+    for (k = 0; k < iters; ++k) {
+        sg_get_unaligned_be64_arr(desc_arr, 16, 256, lba_arr);
+        sg_get_unaligned_be32_arr(desc_arr + 8, 16, 256, num_arr);
+        sink += lba_arr[k & 0xff] + num_arr[k & 0xff];
+    }
+    return iters * 256;
+}
+
+static uint64_t
+b_unaligned_put(uint64_t iters)
+{
+    int j;
+    uint64_t k;
+    unsigned char * bp;
+
+    for (k = 0; k < iters; ++k) {
+        for (j = 0, bp = desc_arr; j < 256; ++j, bp += 16) {
+            sg_put_unaligned_be64(lba_arr[j] + k, bp);
+            sg_put_unaligned_be32(num_arr[j], bp + 8);
+        }
+        sink += desc_arr[k & 0xfff];
+    }
+    return iters * 256;
+}
+
+struct bench_t {
+    const char * name;
+    uint64_t (*fn)(uint64_t iters);
+};
+
+static struct bench_t bench_arr[] = {
+    {"sense_str_fixed", b_sense_str_fixed},
+    {"sense_str_ref", b_sense_str_ref},
+    {"sense_str_fwd", b_sense_str_fwd},
+    {"asc_ascq_str", b_asc_ascq_str},
+    {"command_name", b_command_name},
+    {"dStrHexStr_256", b_dstrhexstr},
+    {"designation_str", b_designation_str},
+    {"transportid_str", b_transportid_str},
+    {"vpd_dev_id_iter", b_dev_id_iter},
+    {"unaligned_get", b_unaligned_get},
+    {"unaligned_get_arr", b_unaligned_get_arr},
+    {"unaligned_put", b_unaligned_put},
+    {NULL, NULL},
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/* Doubles the number of iterations until a run takes at least 'min_ms'
+ * milliseconds, then reports on that run */
+static void
+run_bench(const struct bench_t * bp, const struct opts_t * op)
+{
+    uint64_t iters, ops, start, elapsed, allocs;
+
+    bp->fn(1);          /* warm up */
+    for (iters = 1; ; iters *= 2) {
+        num_allocs = 0;
+        start = now_ns();
+        ops = bp->fn(iters);
+        elapsed = now_ns() - start;
+        allocs = num_allocs;
+        if ((elapsed >= ((uint64_t)op->min_ms * 1000000)) ||
+            (iters >= (1ULL << 40)))
+            break;
+    }
+    printf("%-20s %12" PRIu64 " %12.1f %12.2f\n", bp->name, ops,
+           (double)elapsed / ops, (double)allocs / ops);
+}
+
+int
+main(int argc, char * argv[])
+{
+    int c;
+    const struct bench_t * bp;
+    struct opts_t opts;
+    struct opts_t * op = &opts;
+
+    memset(op, 0, sizeof(opts));
+    op->examples_dir = "../examples";
+    op->min_ms = DEF_MIN_MS;
+    while (1) {
+        int option_index = 0;
+
+        c = getopt_long(argc, argv, "e:f:ht:vV", long_options,
+                        &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'e':
+            op->examples_dir = optarg;
+            break;
+        case 'f':
+            op->filter = optarg;
+            break;
+        case 'h':
+        case '?':
+            usage();
+            return 0;
+        case 't':
+            op->min_ms = atoi(optarg);
+            if (op->min_ms < 1) {
+                fprintf(stderr, "--time= expects a positive number of "
+                        "milliseconds\n");
+                return 1;
+            }
+            break;
+        case 'v':
+            ++op->verbose;
+            break;
+        case 'V':
+            fprintf(stderr, "version: %s\n", version_str);
+            return 0;
+        default:
+            fprintf(stderr, "unrecognised switch code 0x%x ??\n", c);
+            usage();
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        for (; optind < argc; ++optind)
+            fprintf(stderr, "Unexpected extra argument: %s\n",
+                    argv[optind]);
+        usage();
+        return 1;
+    }
+    load_samples(op);
+    printf("%-20s %12s %12s %12s\n", "benchmark", "ops", "ns/op",
+           "allocs/op");
+    for (bp = bench_arr; bp->name; ++bp) {
+        if (op->filter && (NULL == strstr(bp->name, op->filter)))
+            continue;
+        run_bench(bp, op);
+    }
+    return 0;
+}
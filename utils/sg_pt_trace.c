@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2016 Douglas Gilbert.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the BSD_LICENSE file.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+#include "sg_lib.h"
+#include "sg_pt.h"
+
+/* A utility program for the Linux OS SCSI subsystem.
+ *
+ * This program decodes a binary trace file written by scsi_pt_trace_flush()
+ * in libsgutils2. That file holds one or more chunks, each a header
+ * followed by fixed length records of SCSI commands sent through the
+ * pass-through (sg_pt) interface.
+ */
+
+static const char * version_str = "1.00 20160622";
+
+
+static struct option long_options[] = {
+        {"help", 0, 0, 'h'},
+        {"verbose", 0, 0, 'v'},
+        {"version", 0, 0, 'V'},
+        {0, 0, 0, 0},
+};
+
+static void usage()
+{
+    fprintf(stderr, "Usage: "
+            "sg_pt_trace [--help] [--verbose] [--version] [TRACE_FILE]\n"
+            "  where:\n"
+            "    --help|-h          print out usage message\n"
+            "    --verbose|-v       increase verbosity (once: add cdb in "
+            "hex;\n"
+            "                       twice: also decode sense data)\n"
+            "    --version|-V       print version string and exit\n\n"
+            "Decodes a trace file written by scsi_pt_trace_flush(). If "
+            "TRACE_FILE is\nnot given then reads stdin.\n"
+           );
+}
+
+/* Reads exactly len bytes unless EOF or error. Returns number of bytes
+ * read or -1 on error. */
+static int
+read_all(int fd, void * bp, int len)
+{
+    int n, k;
+
+    for (k = 0; k < len; k += n) {
+        n = read(fd, (unsigned char *)bp + k, len - k);
+        if (n < 0) {
+            if (EINTR == errno) {
+                n = 0;
+                continue;
+            }
+            return -1;
+        } else if (0 == n)
+            break;
+    }
+    return k;
+}
+
+int main(int argc, char * argv[])
+{
+    int c, k, n, fd;
+    int verbose = 0;
+    int num_chunks = 0;
+    uint64_t num_recs = 0;
+    const char * file_name = NULL;
+    struct sg_pt_trace_hdr hdr;
+    struct sg_pt_trace_rec rec;
+    char b[2048];
+
+    while (1) {
+        int option_index = 0;
+
+        c = getopt_long(argc, argv, "hvV", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'h':
+        case '?':
+            usage();
+            return 0;
+        case 'v':
+            ++verbose;
+            break;
+        case 'V':
+            fprintf(stderr, "version: %s\n", version_str);
+            return 0;
+        default:
+            fprintf(stderr, "unrecognised switch code 0x%x ??\n", c);
+            usage();
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        file_name = argv[optind++];
+        if (optind < argc) {
+            for (; optind < argc; ++optind)
+                fprintf(stderr, "Unexpected extra argument: %s\n",
+                        argv[optind]);
+            usage();
+            return 1;
+        }
+    }
+    if (file_name) {
+        fd = open(file_name, O_RDONLY);
+        if (fd < 0) {
+            perror(file_name);
+            return 1;
+        }
+    } else
+        fd = STDIN_FILENO;
+
+    while ((n = read_all(fd, &hdr, sizeof(hdr))) > 0) {
+        if ((n < (int)sizeof(hdr)) ||
+            memcmp(hdr.magic, SCSI_PT_TRACE_MAGIC, sizeof(hdr.magic))) {
+            fprintf(stderr, "bad or truncated chunk header at chunk %d\n",
+                    num_chunks);
+            return 1;
+        }
+        if (hdr.rec_size != sizeof(rec)) {
+            fprintf(stderr, "record size %u, expected %u; different "
+                    "library version?\n", hdr.rec_size,
+                    (unsigned int)sizeof(rec));
+            return 1;
+        }
+        ++num_chunks;
+        printf("ring 0x%" PRIx64 ": %u records", hdr.ring_id, hdr.num_recs);
+        if (hdr.dropped)
+            printf(", %" PRIu64 " earlier records dropped", hdr.dropped);
+        printf("\n");
+        for (k = 0; k < (int)hdr.num_recs; ++k) {
+            if (read_all(fd, &rec, sizeof(rec)) < (int)sizeof(rec)) {
+                fprintf(stderr, "truncated record %d in chunk %d\n", k,
+                        num_chunks);
+                return 1;
+            }
+            scsi_pt_trace_rec_str(&rec, verbose, sizeof(b), b);
+            printf("  %s\n", b);
+            ++num_recs;
+        }
+    }
+    if (n < 0) {
+        perror("read");
+        return 1;
+    }
+    if (verbose)
+        fprintf(stderr, "%d chunks, %" PRIu64 " records\n", num_chunks,
+                num_recs);
+    if (file_name)
+        close(fd);
+    return 0;
+}
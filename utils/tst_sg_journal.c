@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2016 Douglas Gilbert.
+ * All rights reserved.
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the BSD_LICENSE file.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+#include "sg_lib.h"
+#include "../src/sg_dd_common.h"
+
+/* A utility program to test the restart journal shared by sg_dd and
+ * sgp_dd (see src/sg_dd_common.c). Writes are marked as complete in
+ * orders other than the one they were submitted in, as happens with
+ * sgp_dd's worker threads and with zero runs sent late by oflag=unmap,
+ * and the journal's watermark is checked against a bitmap after each.
+ *
+ */
+
+static const char * version_str = "1.00 20160712";
+
+#define DEF_NUM_BLKS 4096
+#define SEEK_BLK 1000
+
+static int verbose;
+
+static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"num", required_argument, 0, 'n'},
+        {"verbose", no_argument, 0, 'v'},
+        {"version", no_argument, 0, 'V'},
+        {0, 0, 0, 0},   /* sentinel */
+};
+
+
+static void
+usage()
+{
+    fprintf(stderr, "Usage: tst_sg_journal [--help] [--num=NUM] "
+            "[--verbose] [--version]\n"
+            "  where: --help|-h          print out usage message\n"
+            "         --num=NUM|-n NUM   blocks in each test copy (def: "
+            "%d)\n"
+            "         --verbose|-v       increase verbosity\n"
+            "         --version|-V       print version string then exit\n\n"
+            "Test the sg_dd and sgp_dd restart journal with writes that "
+            "complete out of\norder. Returns 0 when all tests pass.\n",
+            DEF_NUM_BLKS);
+}
+
+/* Small deterministic generator so failures can be repeated */
+static uint32_t rnd_state = 1;
+
+static uint32_t
+rnd_next(void)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return (rnd_state >> 8) & 0xffffff;
+}
+
+/* Splits num blocks into runs of 1 to mx_run blocks, held in blk_arr and
+ * num_arr. Returns the number of runs. */
+static int
+make_runs(int64_t * blk_arr, int64_t * num_arr, int num, int mx_run)
+{
+    int k, n;
+
+    for (k = 0, n = 0; n < num; ++k) {
+        blk_arr[k] = n;
+        num_arr[k] = 1 + (rnd_next() % mx_run);
+        if ((n + num_arr[k]) > num)
+            num_arr[k] = num - n;
+        n += num_arr[k];
+    }
+    return k;
+}
+
+static void
+swap_runs(int64_t * blk_arr, int64_t * num_arr, int a, int b)
+{
+    int64_t t;
+
+    t = blk_arr[a];
+    blk_arr[a] = blk_arr[b];
+    blk_arr[b] = t;
+    t = num_arr[a];
+    num_arr[a] = num_arr[b];
+    num_arr[b] = t;
+}
+
+/* Marks the runs in the order given, checking after each that the
+ * watermark is the number of leading blocks marked. Returns 0 if ok. */
+static int
+mark_runs(struct journal_t * jp, const char * name, const int64_t * blk_arr,
+          const int64_t * num_arr, int nruns, int num)
+{
+    int k, mx_pend;
+    int64_t j, expect;
+    unsigned char * done_arr;
+
+    done_arr = (unsigned char *)calloc(num, 1);
+    if (NULL == done_arr) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    expect = 0;
+    mx_pend = 0;
+    for (k = 0; k < nruns; ++k) {
+        journal_mark(jp, SEEK_BLK + blk_arr[k], num_arr[k]);
+        for (j = 0; j < num_arr[k]; ++j)
+            done_arr[blk_arr[k] + j] = 1;
+        while ((expect < num) && done_arr[expect])
+            ++expect;
+        if (jp->num_pend > mx_pend)
+            mx_pend = jp->num_pend;
+        if (jp->wmark != expect) {
+            fprintf(stderr, "%s: after run %d (blk=%" PRId64 ", num=%"
+                    PRId64 ") watermark is %" PRId64 ", expected %" PRId64
+                    "\n", name, k, blk_arr[k], num_arr[k], jp->wmark,
+                    expect);
+            free(done_arr);
+            return 1;
+        }
+    }
+    free(done_arr);
+    if ((jp->wmark != num) || (0 != jp->num_pend)) {
+        fprintf(stderr, "%s: finished with watermark %" PRId64 " of %d, "
+                "%d ranges pending\n", name, jp->wmark, num, jp->num_pend);
+        return 1;
+    }
+    if (verbose)
+        fprintf(stderr, "%s: %d runs, at most %d ranges pending\n", name,
+                nruns, mx_pend);
+    return 0;
+}
+
+/* Runs one copy of num blocks through a new journal, with the runs
+ * marked in the order given by 'how'. Checks the journal is removed at
+ * the end. Returns 0 if ok. */
+static int
+tst_copy(const char * jfile, const char * name, int how, int num)
+{
+    int j, k, nruns, res;
+    int64_t skip = 0;
+    int64_t seek = SEEK_BLK;
+    int64_t count = num;
+    int64_t * blk_arr;
+    int64_t * num_arr;
+    struct journal_t jrnl;
+
+    blk_arr = (int64_t *)calloc(num, sizeof(int64_t));
+    num_arr = (int64_t *)calloc(num, sizeof(int64_t));
+    if ((NULL == blk_arr) || (NULL == num_arr)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    res = 1;
+    nruns = make_runs(blk_arr, num_arr, num, 8);
+    switch (how) {
+    case 0:             /* last submitted completes first */
+        for (k = 0; k < (nruns / 2); ++k)
+            swap_runs(blk_arr, num_arr, k, nruns - 1 - k);
+        break;
+    case 1:             /* shuffled */
+        for (k = nruns - 1; k > 0; --k)
+            swap_runs(blk_arr, num_arr, k, rnd_next() % (k + 1));
+        break;
+    case 2:     /* every third run last, as zero runs marked late */
+        for (k = 0, j = 0; k < nruns; ++k) {
+            if (2 != (k % 3))
+                swap_runs(blk_arr, num_arr, j++, k);
+        }
+        break;
+    default:            /* in order */
+        break;
+    }
+    unlink(jfile);
+    journal_init(&jrnl, "tst_sg_journal", 5);
+    if (journal_open(&jrnl, jfile, "in", "out", 512, &skip, &seek, &count,
+                     verbose) ||
+        journal_start(&jrnl, version_str, "in", "out", 512, count, -1,
+                      JRNL_OUT_NULL))
+        goto fini;
+    if (mark_runs(&jrnl, name, blk_arr, num_arr, nruns, num))
+        goto fini;
+    journal_close(&jrnl, jrnl.wmark, jrnl.wmark == count);
+    if (0 == access(jfile, F_OK)) {
+        fprintf(stderr, "%s: journal not removed after complete copy\n",
+                name);
+        goto fini;
+    }
+    res = 0;
+fini:
+    free(blk_arr);
+    free(num_arr);
+    return res;
+}
+
+/* Stops a copy part way with writes still outstanding, then checks a
+ * restart resumes from the watermark. Returns 0 if ok. */
+static int
+tst_resume(const char * jfile, int num)
+{
+    static const char * name = "resume";
+    int k, res;
+    int64_t skip = 0;
+    int64_t seek = SEEK_BLK;
+    int64_t count = num;
+    struct journal_t jrnl;
+
+    unlink(jfile);
+    journal_init(&jrnl, "tst_sg_journal", 5);
+    if (journal_open(&jrnl, jfile, "in", "out", 512, &skip, &seek, &count,
+                     verbose) ||
+        journal_start(&jrnl, version_str, "in", "out", 512, count, -1,
+                      JRNL_OUT_NULL))
+        return 1;
+    /* blocks 0 to num/2 - 1 written except block 10, and then some */
+    for (k = (num / 2) - 1; k >= 0; --k) {
+        if (10 != k)
+            journal_mark(&jrnl, SEEK_BLK + k, 1);
+    }
+    journal_mark(&jrnl, SEEK_BLK + num - 4, 4);
+    journal_close(&jrnl, jrnl.wmark, 0);
+    if (10 != jrnl.done) {
+        fprintf(stderr, "%s: journal records %" PRId64 " blocks, expected "
+                "10\n", name, jrnl.done);
+        return 1;
+    }
+    journal_init(&jrnl, "tst_sg_journal", 5);
+    count = -1;
+    res = journal_open(&jrnl, jfile, "in", "out", 512, &skip, &seek,
+                       &count, verbose);
+    if (res || (10 != skip) || ((SEEK_BLK + 10) != seek) ||
+        ((num - 10) != count)) {
+        fprintf(stderr, "%s: restart gave skip=%" PRId64 ", seek=%" PRId64
+                ", count=%" PRId64 "\n", name, skip, seek, count);
+        return 1;
+    }
+    if (journal_start(&jrnl, version_str, "in", "out", 512, count, -1,
+                      JRNL_OUT_NULL))
+        return 1;
+    journal_mark(&jrnl, seek + 1, count - 1);
+    journal_mark(&jrnl, seek, 1);
+    if (jrnl.wmark != count) {
+        fprintf(stderr, "%s: watermark %" PRId64 " after restart, expected "
+                "%" PRId64 "\n", name, jrnl.wmark, count);
+        return 1;
+    }
+    journal_close(&jrnl, jrnl.wmark, 1);
+    return 0;
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    int c, k;
+    int num = DEF_NUM_BLKS;
+    int fails = 0;
+    char jfile[64];
+    static const char * names[] = {"reversed", "shuffled", "late runs",
+                                   "in order"};
+
+    while (1) {
+        int option_index = 0;
+
+        c = getopt_long(argc, argv, "hn:vV", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'h':
+        case '?':
+            usage();
+            return 0;
+        case 'n':
+            num = sg_get_num(optarg);
+            if (num < 64) {
+                fprintf(stderr, "--num= expects 64 or more\n");
+                return SG_LIB_SYNTAX_ERROR;
+            }
+            break;
+        case 'v':
+            ++verbose;
+            break;
+        case 'V':
+            fprintf(stderr, "version: %s\n", version_str);
+            return 0;
+        default:
+            fprintf(stderr, "unrecognised switch code 0x%x ??\n", c);
+            usage();
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        for (; optind < argc; ++optind)
+            fprintf(stderr, "Unexpected extra argument: %s\n",
+                    argv[optind]);
+        usage();
+        return 1;
+    }
+
+    snprintf(jfile, sizeof(jfile), "/tmp/tst_sg_journal_%d",
+             (int)getpid());
+    for (k = 0; k < 4; ++k)
+        fails += tst_copy(jfile, names[k], k, num);
+    fails += tst_resume(jfile, num);
+    unlink(jfile);
+    if (fails) {
+        fprintf(stderr, "%d test(s) failed\n", fails);
+        return 1;
+    }
+    fprintf(stderr, "All journal tests passed\n");
+    return 0;
+}